@@ -0,0 +1,217 @@
+#!/bin/bash
+# Throughput benchmark (make bench).
+#
+# Runs every program over the corpus of corpus.txt, the median of
+# several runs per input, and writes one CSV row per build variant,
+# program and input:
+#   variant,program,input,codec,rate,channels,seconds,jobs,wall_s,rtf,samples_per_s,peak_rss_kb
+# debug is the plain build in the top directory, the other variants are
+# taken from build/<variant> (make release, lto, pgo). The rtf of each
+# variant over that of debug goes to speedup.csv next to the results.
+# rtf is seconds of audio per second of wall time, samples_per_s counts
+# samples per channel. tmp30d is also run with 1, 2, 4 ... workers up to
+# the number of cores, each time on twice as many concurrent jobs as there
+# are cores, to show how it scales; so are tmp30 -S -j (tmp30-S) and
+# -X -j (tmp30-X), on one input each time.
+#
+# The results are compared with the baseline (make bench-baseline stores
+# one); any rtf more than the threshold below its baseline fails the run.
+#
+# Usage: bench.sh [-n runs] [-t threshold%] [-b baseline.csv] [-o results.csv]
+#                 [-v "debug release ..."]
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+top=$here/..
+runs=3
+threshold=10
+baseline=$here/baseline.csv
+results=$here/results.csv
+corpus=$here/corpus
+variants=debug
+
+while getopts "n:t:b:o:v:" opt; do
+    case $opt in
+    n) runs=$OPTARG ;;
+    t) threshold=$OPTARG ;;
+    b) baseline=$OPTARG ;;
+    o) results=$OPTARG ;;
+    v) variants=$OPTARG ;;
+    *) exit 1 ;;
+    esac
+done
+
+if [ ! -x /usr/bin/time ]; then
+    echo "bench: GNU time (/usr/bin/time) is needed for peak RSS" >&2
+    exit 1
+fi
+
+"$here/mkcorpus.sh" "$corpus"
+
+tmp=$(mktemp -d)
+daemon=
+trap '[ -n "$daemon" ] && kill $daemon 2>/dev/null; rm -rf "$tmp"' EXIT
+
+ext() {
+    case $1 in
+    aac)  echo m4a ;;
+    *)    echo "$1" ;;
+    esac
+}
+
+now() {
+    date +%s%N
+}
+
+# measure <command...>: run it $runs times, print "median_wall_s peak_rss_kb".
+measure() {
+    local i t0 t1 rss=0 r
+    for ((i = 0; i < runs; i++)); do
+        t0=$(now)
+        /usr/bin/time -f %M -o "$tmp/rss" "$@" >/dev/null 2>"$tmp/err" || {
+            echo "bench: failed: $*" >&2
+            cat "$tmp/err" >&2
+            return 1
+        }
+        t1=$(now)
+        echo $(((t1 - t0) / 1000)) >>"$tmp/walls"
+        r=$(tail -1 "$tmp/rss")
+        [ "$r" -gt "$rss" ] && rss=$r
+    done
+    echo "$(sort -n "$tmp/walls" | sed -n "$(((runs + 1) / 2))p" | awk '{ printf "%.6f", $1 / 1e6 }') $rss"
+    rm -f "$tmp/walls"
+}
+
+# row <program> <input> <codec> <rate> <channels> <seconds> <jobs> <inputs> <wall> <rss>
+# <inputs> is how many times the input was transcoded within <wall>.
+row() {
+    awk -v v="$variant" -v p="$1" -v f="$2" -v c="$3" -v r="$4" -v ch="$5" -v s="$6" -v j="$7" -v n="$8" -v w="$9" -v m="${10}" \
+        'BEGIN { printf "%s,%s,%s,%s,%d,%d,%g,%d,%.6f,%.3f,%.0f,%d\n", v, p, f, c, r, ch, s, j, w, n * s / w, n * s * r / w, m }' \
+        | tee -a "$results"
+}
+
+echo "variant,program,input,codec,rate,channels,seconds,jobs,wall_s,rtf,samples_per_s,peak_rss_kb" >"$results"
+
+for variant in $variants; do
+    bin=$top
+    [ "$variant" = debug ] || bin=$top/build/$variant
+    if [ ! -x "$bin/tmp30" ]; then
+        echo "bench: no $variant build in $bin (make $variant)" >&2
+        exit 1
+    fi
+
+    grep -v '^#' "$here/corpus.txt" | while read -r name secs codec rate ch signal; do
+        [ -n "$name" ] || continue
+        in=$corpus/$name.$(ext "$codec")
+        progs="tmp30:mp3 transcode_aac:m4a taac0:m4a"
+        [ "$codec" = mp2 ] && progs="decode_audio:raw decaud0:raw $progs"
+        for p in $progs; do
+            m=$(measure "$bin/${p%:*}" "$in" "$tmp/out.${p#*:}") || exit 1
+            row "${p%:*}" "$name" "$codec" "$rate" "$ch" "$secs" 1 1 $m
+        done
+    done
+
+    # Core scaling of the daemon, on one mid-sized input.
+    read -r name secs codec rate ch signal < <(grep '^mp3_44k_2_60s' "$here/corpus.txt")
+    in=$corpus/$name.$(ext "$codec")
+    ncpu=$(nproc)
+    jobs_list=
+    for ((j = 1; j < ncpu; j *= 2)); do jobs_list="$jobs_list $j"; done
+    jobs_list="$jobs_list $ncpu"
+    njobs=$((2 * ncpu))
+    for j in $jobs_list; do
+        "$bin/tmp30d" -s "$tmp/sock" -j "$j" -q "$njobs" -w mp3@$rate/mp3 2>/dev/null &
+        daemon=$!
+        while [ ! -S "$tmp/sock" ]; do
+            kill -0 $daemon || exit 1
+            sleep 0.05
+        done
+        walls=
+        for ((i = 0; i < runs; i++)); do
+            pids=
+            t0=$(now)
+            for ((k = 0; k < njobs; k++)); do
+                "$bin/tmp30c" -s "$tmp/sock" "$in" "$tmp/out$k.mp3" >/dev/null &
+                pids="$pids $!"
+            done
+            for pid in $pids; do
+                wait $pid || { echo "bench: tmp30d job failed" >&2; exit 1; }
+            done
+            t1=$(now)
+            walls="$walls $(((t1 - t0) / 1000))"
+        done
+        rss=$(awk '/^VmHWM/ { print $2 }' /proc/$daemon/status)
+        kill $daemon
+        wait $daemon 2>/dev/null || true
+        daemon=
+        wall=$(printf '%s\n' $walls | sort -n | sed -n "$(((runs + 1) / 2))p" | awk '{ printf "%.6f", $1 / 1e6 }')
+        # One row per worker count, with the audio of all jobs counted.
+        row tmp30d "$name" "$codec" "$rate" "$ch" "$secs" "$j" "$njobs" "$wall" "$rss"
+    done
+
+    # Core scaling of segmenting in worker processes (-S -j) and of
+    # splitting into tracks on the encode threads (-X -j), on the same
+    # input, cut into as many parts as the most jobs would want.
+    mkdir -p "$tmp/seg"
+    : >"$tmp/tracks.txt"
+    for ((k = 0; k < ncpu; k++)); do
+        echo "$((k * secs / ncpu)) - track$k.mp3" >>"$tmp/tracks.txt"
+    done
+    seg=$(((secs + ncpu - 1) / ncpu))
+    for j in $jobs_list; do
+        m=$(measure "$bin/tmp30" -S "$seg" -j "$j" "$in" "$tmp/seg/out.m3u8") || exit 1
+        row tmp30-S "$name" "$codec" "$rate" "$ch" "$secs" "$j" 1 $m
+        m=$(measure "$bin/tmp30" -X "$tmp/tracks.txt" -j "$j" "$in") || exit 1
+        row tmp30-X "$name" "$codec" "$rate" "$ch" "$secs" "$j" 1 $m
+    done
+done
+
+# Speedup of every variant over debug, keyed by program, input and jobs,
+# with the geometric mean per variant.
+speedup=$(dirname "$results")/speedup.csv
+awk -F, '
+    FNR == 1 { next }
+    $1 == "debug" { base[$2 "," $3 "," $8] = $10; next }
+    {
+        key = $2 "," $3 "," $8
+        if (!(key in base) || base[key] <= 0)
+            next
+        x = $10 / base[key]
+        printf "%s,%s,%.3f,%.3f,%.3f\n", $1, key, $10, base[key], x > out
+        logsum[$1] += log(x)
+        n[$1]++
+    }
+    END {
+        for (v in n)
+            printf "bench: %-8s %.3fx debug (geometric mean of %d)\n", v, exp(logsum[v] / n[v]), n[v]
+    }' out="$speedup.tmp" "$results"
+if [ -f "$speedup.tmp" ]; then
+    { echo "variant,program,input,jobs,rtf,debug_rtf,speedup"; cat "$speedup.tmp"; } >"$speedup"
+    rm -f "$speedup.tmp"
+fi
+
+if [ ! -f "$baseline" ]; then
+    echo "bench: no baseline at $baseline (make bench-baseline stores one)"
+    exit 0
+fi
+
+# Compare realtime factors, keyed by variant, program, input and jobs.
+awk -F, -v thr="$threshold" '
+    FNR == 1 { next }
+    NR == FNR { base[$1 "," $2 "," $3 "," $8] = $10; next }
+    {
+        key = $1 "," $2 "," $3 "," $8
+        if (!(key in base) || base[key] <= 0)
+            next
+        d = ($10 / base[key] - 1) * 100
+        printf "%-8s %-14s %-16s jobs %-3s rtf %10.3f  baseline %10.3f  %+6.1f%%%s\n",
+               $1, $2, $3, $8, $10, base[key], d, d < -thr ? "  REGRESSION" : ""
+        if (d < -thr)
+            bad++
+    }
+    END {
+        if (bad) {
+            printf "bench: %d regression(s) beyond %s%%\n", bad, thr
+            exit 1
+        }
+    }' "$baseline" "$results"
@@ -0,0 +1,32 @@
+#!/bin/bash
+# Generate the benchmark corpus described in corpus.txt into $1
+# (default bench/corpus) with gencorpus. Inputs that already exist are
+# kept; the content is fixed by the seed ($BENCH_SEED, default 1), so
+# reruns and other machines with the same FFmpeg build get the same files.
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+out=${1:-$here/corpus}
+seed=${BENCH_SEED:-1}
+mkdir -p "$out"
+
+if [ ! -x "$here/../gencorpus" ]; then
+    echo "mkcorpus: build gencorpus first (make gencorpus)" >&2
+    exit 1
+fi
+
+ext() {
+    case $1 in
+    aac)  echo m4a ;;
+    *)    echo "$1" ;;
+    esac
+}
+
+grep -v '^#' "$here/corpus.txt" | while read -r name secs codec rate ch signal; do
+    [ -n "$name" ] || continue
+    f=$out/$name.$(ext "$codec")
+    [ -s "$f" ] && continue
+    echo "  $f"
+    "$here/../gencorpus" -s "$seed" -S "$signal" -c "$codec" -r "$rate" -C "$ch" -d "$secs" "$f.tmp.$(ext "$codec")"
+    mv "$f.tmp.$(ext "$codec")" "$f"
+done
@@ -0,0 +1,36 @@
+#!/bin/bash
+# PGO training run (make pgo): the corpus workload of bench.sh, once,
+# through the instrumented decode_audio, tmp30 and transcode_aac in $1.
+# The profile is written next to their objects as they exit.
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+bin=$(cd "$1" && pwd)
+corpus=$here/corpus
+
+"$here/mkcorpus.sh" "$corpus"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+ext() {
+    case $1 in
+    aac)  echo m4a ;;
+    *)    echo "$1" ;;
+    esac
+}
+
+grep -v '^#' "$here/corpus.txt" | while read -r name secs codec rate ch signal; do
+    [ -n "$name" ] || continue
+    in=$corpus/$name.$(ext "$codec")
+    echo "  $name"
+    progs="tmp30:mp3 transcode_aac:m4a"
+    [ "$codec" = mp2 ] && progs="decode_audio:raw $progs"
+    for p in $progs; do
+        "$bin/${p%:*}" "$in" "$tmp/out.${p#*:}" >/dev/null 2>"$tmp/err" || {
+            echo "train: failed: ${p%:*} $in" >&2
+            cat "$tmp/err" >&2
+            exit 1
+        }
+    done
+done
@@ -0,0 +1,115 @@
+/*
+ * ckpt.c: see ckpt.h.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/error.h>
+
+#include "ckpt.h"
+
+static void ckpt_name(char *buf, size_t size, const char *output, const char *suffix)
+{
+    snprintf(buf, size, "%s.ckpt%s", output, suffix);
+}
+
+int ckpt_identify(struct ckpt *ck, const char *input)
+{
+    struct stat sb;
+
+    if (stat(input, &sb) < 0) {
+        fprintf(stderr, "Could not stat input '%s'\n", input);
+        return AVERROR(errno);
+    }
+    ck->in_size  = sb.st_size;
+    ck->in_mtime = sb.st_mtime;
+    return 0;
+}
+
+int ckpt_same_job(const struct ckpt *a, const struct ckpt *b)
+{
+    return a->in_size == b->in_size && a->in_mtime == b->in_mtime &&
+           !strcmp(a->encoder, b->encoder) && a->bit_rate == b->bit_rate &&
+           a->vbr == b->vbr && a->quality == b->quality &&
+           a->channels == b->channels && a->sample_rate == b->sample_rate;
+}
+
+int ckpt_save(const char *output, const struct ckpt *ck)
+{
+    char path[4096], tmp[4096];
+    FILE *f;
+    int error;
+
+    ckpt_name(path, sizeof(path), output, "");
+    ckpt_name(tmp, sizeof(tmp), output, ".tmp");
+    if (!(f = fopen(tmp, "w"))) {
+        error = AVERROR(errno);
+        fprintf(stderr, "Could not write checkpoint '%s' (error '%s')\n", tmp, av_err2str(error));
+        return error;
+    }
+    fprintf(f, "in_size=%" PRId64 "\nin_mtime=%" PRId64 "\n", ck->in_size, ck->in_mtime);
+    fprintf(f, "encoder=%s\nbit_rate=%" PRId64 "\nvbr=%d\nquality=%d\nchannels=%d\nsample_rate=%d\n",
+            ck->encoder, ck->bit_rate, ck->vbr, ck->quality, ck->channels, ck->sample_rate);
+    fprintf(f, "in_pts=%" PRId64 "\nout_bytes=%" PRId64 "\nout_samples=%" PRId64 "\n",
+            ck->in_pts, ck->out_bytes, ck->out_samples);
+    /* The rename has to find the contents on disk, or a crash could leave
+     * an empty checkpoint behind in place of the last good one. */
+    if (fflush(f) || fsync(fileno(f)) < 0 || fclose(f)) {
+        error = AVERROR(errno);
+        fprintf(stderr, "Could not write checkpoint '%s' (error '%s')\n", tmp, av_err2str(error));
+        unlink(tmp);
+        return error;
+    }
+    if (rename(tmp, path) < 0) {
+        error = AVERROR(errno);
+        fprintf(stderr, "Could not rename checkpoint to '%s' (error '%s')\n", path, av_err2str(error));
+        unlink(tmp);
+        return error;
+    }
+    return 0;
+}
+
+int ckpt_load(const char *output, struct ckpt *ck)
+{
+    char path[4096], line[256];
+    int fields = 0;
+    FILE *f;
+
+    ckpt_name(path, sizeof(path), output, "");
+    if (!(f = fopen(path, "r")))
+        return AVERROR(errno);
+    memset(ck, 0, sizeof(*ck));
+    while (fgets(line, sizeof(line), f)) {
+        fields +=
+            sscanf(line, "in_size=%" SCNd64, &ck->in_size) +
+            sscanf(line, "in_mtime=%" SCNd64, &ck->in_mtime) +
+            sscanf(line, "encoder=%31s", ck->encoder) +
+            sscanf(line, "bit_rate=%" SCNd64, &ck->bit_rate) +
+            sscanf(line, "vbr=%d", &ck->vbr) +
+            sscanf(line, "quality=%d", &ck->quality) +
+            sscanf(line, "channels=%d", &ck->channels) +
+            sscanf(line, "sample_rate=%d", &ck->sample_rate) +
+            sscanf(line, "in_pts=%" SCNd64, &ck->in_pts) +
+            sscanf(line, "out_bytes=%" SCNd64, &ck->out_bytes) +
+            sscanf(line, "out_samples=%" SCNd64, &ck->out_samples);
+    }
+    fclose(f);
+    if (fields != 11) {
+        fprintf(stderr, "Checkpoint '%s' is incomplete\n", path);
+        return AVERROR_INVALIDDATA;
+    }
+    return 0;
+}
+
+void ckpt_remove(const char *output)
+{
+    char path[4096];
+
+    ckpt_name(path, sizeof(path), output, "");
+    unlink(path);
+}
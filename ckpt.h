@@ -0,0 +1,60 @@
+/*
+ * ckpt.h: checkpoints of a running tmp30 transcode, to resume it after
+ * the process was killed (tmp30 -k / -K).
+ *
+ * A checkpoint is <output>.ckpt, a few key=value lines replaced
+ * atomically (written to a temporary name, synced, renamed) each time.
+ * It says how many bytes of the output are complete and up to which
+ * sample they reach, which is all a resume needs: it truncates the output
+ * there and decodes again from a little before that sample, so neither
+ * the FIFO nor the encoder state has to be saved (see tmp30.c).
+ * The input is identified by size and mtime, the encoder by its profile,
+ * and a checkpoint for anything else is refused.
+ */
+
+#ifndef CKPT_H
+#define CKPT_H
+
+#include <stdint.h>
+
+struct ckpt {
+    /* Identity of the job */
+    int64_t in_size, in_mtime;
+    char encoder[32];
+    int64_t bit_rate;
+    int vbr, quality, channels, sample_rate;
+    /* Progress */
+    int64_t in_pts;       /* pts of the last input packet read, input time base */
+    int64_t out_bytes;    /* output bytes that are complete */
+    int64_t out_samples;  /* end of the last packet in them, in samples */
+};
+
+/**
+ * Fill in the input's size and mtime.
+ * @return Error code (0 if successful)
+ */
+int ckpt_identify(struct ckpt *ck, const char *input);
+
+/**
+ * @return Nonzero if a and b are checkpoints of the same job.
+ */
+int ckpt_same_job(const struct ckpt *a, const struct ckpt *b);
+
+/**
+ * Replace the checkpoint of output with ck.
+ * @return Error code (0 if successful)
+ */
+int ckpt_save(const char *output, const struct ckpt *ck);
+
+/**
+ * Read the checkpoint of output.
+ * @return Error code (0 if successful, AVERROR(ENOENT) if there is none)
+ */
+int ckpt_load(const char *output, struct ckpt *ck);
+
+/**
+ * Remove the checkpoint of output, once the transcode has finished.
+ */
+void ckpt_remove(const char *output);
+
+#endif /* CKPT_H */
@@ -0,0 +1,289 @@
+/*
+ * editlist.c: see editlist.h.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#include <libavutil/parseutils.h>
+
+#include "editlist.h"
+
+/* Next blank-separated word of a line, terminated in place. */
+static char *next_word(char **p)
+{
+    char *w = *p + strspn(*p, " \t");
+    char *end = w + strcspn(w, " \t");
+
+    *p = *end ? end + 1 : end;
+    *end = 0;
+    return w;
+}
+
+int editlist_load(struct editlist *el, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char line[4096];
+    int lineno = 0, error = 0;
+    FILE *f;
+
+    memset(el, 0, sizeof(*el));
+    if (!(f = fopen(path, "r"))) {
+        error = AVERROR(errno);
+        fprintf(stderr, "Could not open edit list '%s' (error '%s')\n", path, av_err2str(error));
+        return error;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        struct edit e = { 0 }, *edits;
+        char *p = line, *start, *length, *file, *end;
+
+        lineno++;
+        line[strcspn(line, "\r\n")] = 0;
+        p += strspn(p, " \t");
+        if (!*p || *p == '#')
+            continue;
+        start  = next_word(&p);
+        length = next_word(&p);
+        file   = p + strspn(p, " \t");
+        for (end = file + strlen(file); end > file && (end[-1] == ' ' || end[-1] == '\t'); end--)
+            end[-1] = 0;
+        if (!*file || av_parse_time(&e.start, start, 1) < 0 || e.start < 0 ||
+            (strcmp(length, "-") && (av_parse_time(&e.length, length, 1) < 0 || e.length <= 0))) {
+            fprintf(stderr, "%s:%d: expected <start> <duration or -> <file>\n", path, lineno);
+            error = AVERROR_INVALIDDATA;
+            break;
+        }
+        /* Files are relative to the list. */
+        if (*file != '/' && slash)
+            e.file = av_asprintf("%.*s%s", (int)(slash - path + 1), path, file);
+        else
+            e.file = av_strdup(file);
+        if (!e.file || !(edits = av_realloc_array(el->edits, el->nb_edits + 1, sizeof(*edits)))) {
+            av_free(e.file);
+            error = AVERROR(ENOMEM);
+            break;
+        }
+        el->edits = edits;
+        el->edits[el->nb_edits++] = e;
+    }
+    fclose(f);
+    if (!error && !el->nb_edits) {
+        fprintf(stderr, "Edit list '%s' has no snippets\n", path);
+        error = AVERROR(EINVAL);
+    }
+    if (error < 0)
+        editlist_free(el);
+    return error;
+}
+
+void editlist_free(struct editlist *el)
+{
+    int i;
+
+    for (i = 0; i < el->nb_edits; i++)
+        av_free(el->edits[i].file);
+    av_freep(&el->edits);
+    el->nb_edits = 0;
+}
+
+static int open_source(const char *file, AVFormatContext **fcx)
+{
+    int error;
+
+    if ((error = avformat_open_input(fcx, file, NULL, NULL)) < 0 ||
+        (error = avformat_find_stream_info(*fcx, NULL)) < 0) {
+        fprintf(stderr, "Could not open input file '%s' (error '%s')\n", file, av_err2str(error));
+        avformat_close_input(fcx);
+        return error;
+    }
+    /* Like tmp30, the audio is the first stream. */
+    if ((*fcx)->nb_streams < 1 || (*fcx)->streams[0]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+        fprintf(stderr, "'%s' has no audio as its first stream\n", file);
+        avformat_close_input(fcx);
+        return AVERROR_INVALIDDATA;
+    }
+    return 0;
+}
+
+int editlist_copyable(const struct editlist *el, const AVCodec *enc, int64_t bit_rate, int channels)
+{
+    /* The first source's, which the output gets */
+    AVCodecParameters *first;
+    int rate = 0, ret = 1, error, i;
+
+    if (!(first = avcodec_parameters_alloc()))
+        return AVERROR(ENOMEM);
+    for (i = 0; i < el->nb_edits && ret == 1; i++) {
+        const struct edit *e = &el->edits[i];
+        const AVCodecParameters *par;
+        AVFormatContext *fcx = NULL;
+
+        if ((error = open_source(e->file, &fcx)) < 0) {
+            ret = error;
+            break;
+        }
+        par = fcx->streams[0]->codecpar;
+        if (!rate) {
+            rate = par->sample_rate;
+            if ((error = avcodec_parameters_copy(first, par)) < 0) {
+                avformat_close_input(&fcx);
+                ret = error;
+                break;
+            }
+        }
+        if (par->codec_id != enc->id || par->sample_rate != rate ||
+            par->ch_layout.nb_channels != channels || (bit_rate && par->bit_rate != bit_rate)) {
+            fprintf(stderr, "Re-encoding: '%s' is not in the output's codec, sample rate, channels and bit rate\n",
+                    e->file);
+            ret = 0;
+        } else if (par->profile != first->profile || par->extradata_size != first->extradata_size ||
+                   (par->extradata_size && memcmp(par->extradata, first->extradata, par->extradata_size))) {
+            /* e.g. LC and HE-AAC, or another AudioSpecificConfig: one
+             * stream has one decoder setup. */
+            fprintf(stderr, "Re-encoding: '%s' has another codec profile or setup than '%s'\n",
+                    e->file, el->edits[0].file);
+            ret = 0;
+        } else if (par->frame_size <= 0 ||
+                   av_rescale(e->start, rate, AV_TIME_BASE) % par->frame_size ||
+                   av_rescale(e->length, rate, AV_TIME_BASE) % par->frame_size) {
+            fprintf(stderr, "Re-encoding: a cut in '%s' is not on a packet boundary (every %d samples)\n",
+                    e->file, par->frame_size);
+            ret = 0;
+        }
+        avformat_close_input(&fcx);
+    }
+    avcodec_parameters_free(&first);
+    return ret;
+}
+
+/**
+ * Copy the packets of one snippet.
+ * @param         e       Snippet
+ * @param         ofcx    Output, header written
+ * @param         pkt     Packet to read into
+ * @param[in,out] out_pos End of the output so far, in samples
+ * @return Error code (0 if successful)
+ */
+static int copy_edit(const struct edit *e, AVFormatContext *ofcx, AVPacket *pkt, int64_t *out_pos)
+{
+    const AVStream *ost = ofcx->streams[0];
+    const int rate = ost->codecpar->sample_rate;
+    const AVRational tb = { 1, rate };
+    AVFormatContext *fcx = NULL;
+    const AVStream *st;
+    int64_t start, end, t0;
+    int error;
+
+    if ((error = open_source(e->file, &fcx)) < 0)
+        return error;
+    st    = fcx->streams[0];
+    t0    = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    start = av_rescale(e->start, rate, AV_TIME_BASE);
+    end   = e->length ? start + av_rescale(e->length, rate, AV_TIME_BASE) : INT64_MAX;
+    if (start &&
+        (error = av_seek_frame(fcx, 0, t0 + av_rescale_q(start, tb, st->time_base), AVSEEK_FLAG_BACKWARD)) < 0) {
+        fprintf(stderr, "Could not seek in '%s' (error '%s')\n", e->file, av_err2str(error));
+        goto cleanup;
+    }
+
+    while ((error = av_read_frame(fcx, pkt)) >= 0) {
+        int64_t pos, duration;
+
+        if (pkt->stream_index || pkt->pts == AV_NOPTS_VALUE) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        pos = av_rescale_q(pkt->pts - t0, st->time_base, tb);
+        if (pos >= end) {
+            av_packet_unref(pkt);
+            break;
+        }
+        if (pos < start) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        /* The snippet goes on where the last one ended. */
+        if (!(duration = av_rescale_q(pkt->duration, st->time_base, tb)))
+            duration = st->codecpar->frame_size;
+        pkt->pts = pkt->dts = *out_pos;
+        pkt->duration = duration;
+        pkt->pos = -1;
+        av_packet_rescale_ts(pkt, tb, ost->time_base);
+        *out_pos += duration;
+        error = av_write_frame(ofcx, pkt);
+        av_packet_unref(pkt);
+        if (error < 0) {
+            fprintf(stderr, "Could not write frame (error '%s')\n", av_err2str(error));
+            goto cleanup;
+        }
+    }
+    if (error == AVERROR_EOF)
+        error = 0;
+    else if (error < 0)
+        fprintf(stderr, "Could not read frame (error '%s')\n", av_err2str(error));
+
+cleanup:
+    avformat_close_input(&fcx);
+    return error;
+}
+
+int editlist_copy(const struct editlist *el, const char *out, const char *out_format)
+{
+    AVFormatContext *ofcx = NULL, *fcx = NULL;
+    AVPacket *pkt = NULL;
+    AVStream *ost;
+    int64_t out_pos = 0;
+    int error, i;
+
+    /* The output stream is the first source's. */
+    if ((error = open_source(el->edits[0].file, &fcx)) < 0)
+        return error;
+    if ((error = avformat_alloc_output_context2(&ofcx, NULL, out_format, out)) < 0) {
+        fprintf(stderr, "Could not find output file format\n");
+        goto cleanup;
+    }
+    if (!(ost = avformat_new_stream(ofcx, NULL))) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    if ((error = avcodec_parameters_copy(ost->codecpar, fcx->streams[0]->codecpar)) < 0)
+        goto cleanup;
+    ost->codecpar->codec_tag = 0;
+    ost->time_base = (AVRational){ 1, ost->codecpar->sample_rate };
+    avformat_close_input(&fcx);
+
+    if ((error = avio_open(&ofcx->pb, out, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open output file '%s' (error '%s')\n", out, av_err2str(error));
+        goto cleanup;
+    }
+    if ((error = avformat_write_header(ofcx, NULL)) < 0) {
+        fprintf(stderr, "Could not write output file header (error '%s')\n", av_err2str(error));
+        goto cleanup;
+    }
+    if (!(pkt = av_packet_alloc())) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    for (i = 0; i < el->nb_edits; i++)
+        if ((error = copy_edit(&el->edits[i], ofcx, pkt, &out_pos)) < 0)
+            goto cleanup;
+    if ((error = av_write_trailer(ofcx)) < 0)
+        fprintf(stderr, "Could not write output file trailer (error '%s')\n", av_err2str(error));
+    else
+        fprintf(stderr, "Edit list: %d snippets copied, %.3f s\n", el->nb_edits,
+                (double)out_pos / ost->codecpar->sample_rate);
+
+cleanup:
+    av_packet_free(&pkt);
+    avformat_close_input(&fcx);
+    if (ofcx)
+        avio_closep(&ofcx->pb);
+    avformat_free_context(ofcx);
+    return error;
+}
@@ -0,0 +1,69 @@
+/*
+ * editlist.h: edit lists for tmp30 (-E option), snippets of any number of
+ * files rendered into one output by one process.
+ *
+ * A list has one snippet per line, start and duration in av_parse_time
+ * syntax ([[hh:]mm:]ss[.xxx]) and then the file, relative to the list:
+ *     1:00 10 willie.opus
+ *     0:30.5 - other.mp3          (- for to the end)
+ * Blank lines and lines starting with # are skipped.
+ *
+ * tmp30 decodes the snippets one after the other into one encoder, whose
+ * timestamps just go on (see tmp30.c). When every source is already in
+ * the output's codec, sample rate and channels and every cut falls on a
+ * packet boundary, editlist_copy puts the packets together instead,
+ * without decoding anything.
+ *
+ * tmp30 -X reads a track list in the same format, with output files in
+ * place of sources: the tracks are cut from one input in one decode. A
+ * track without a duration (-) goes up to the start of the next line's.
+ */
+
+#ifndef EDITLIST_H
+#define EDITLIST_H
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+
+struct edit {
+    char *file;
+    int64_t start;          /* microseconds */
+    int64_t length;         /* microseconds, 0 for to the end */
+};
+
+struct editlist {
+    struct edit *edits;
+    int nb_edits;
+};
+
+/**
+ * Read an edit list.
+ * @return Error code (0 if successful)
+ */
+int editlist_load(struct editlist *el, const char *path);
+
+void editlist_free(struct editlist *el);
+
+/**
+ * Whether the snippets can be copied rather than re-encoded: all sources
+ * in the encoder's codec at one sample rate, with the given channels and,
+ * if one is given, bit rate, of one profile and decoder setup (extradata),
+ * and all cuts on packet boundaries. Says why not on stderr.
+ * @param enc      Encoder the output would otherwise be made with
+ * @param bit_rate Bit rate asked for, 0 for any
+ * @param channels Output channels
+ * @return 1 if so, 0 if not, an error code if a source can't be opened
+ */
+int editlist_copyable(const struct editlist *el, const AVCodec *enc, int64_t bit_rate, int channels);
+
+/**
+ * Write the snippets' packets into one output, with timestamps that go on
+ * from one snippet to the next.
+ * @param out        Output file name
+ * @param out_format Container, NULL to guess it from out
+ * @return Error code (0 if successful)
+ */
+int editlist_copy(const struct editlist *el, const char *out, const char *out_format);
+
+#endif /* EDITLIST_H */
@@ -0,0 +1,340 @@
+/*
+ * fastopen.c: see fastopen.h.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+
+#include "fastopen.h"
+
+/* Probe limits in fast mode; libavformat's defaults are 5 MB and 5 s. */
+#define FASTOPEN_PROBESIZE       32768
+#define FASTOPEN_ANALYZEDURATION 100000  /* microseconds */
+
+/* Past this size the cache file is started afresh. */
+#define FASTOPEN_CACHE_MAX (256 * 1024)
+
+static const char *cache_path(char *buf, size_t size)
+{
+    const char *path = getenv("FFPROGS_PROBE_CACHE");
+    const char *home = getenv("HOME");
+
+    if (path)
+        return *path ? path : NULL;
+    if (!home || snprintf(buf, size, "%s/.ffprogs_probe", home) >= size)
+        return NULL;
+    return buf;
+}
+
+/**
+ * Parse key=value fields of a cache line or sidecar into p.
+ * @return 0 if at least the container is known, -1 otherwise
+ */
+static int parse_params(const char *s, struct fastopen_params *p)
+{
+    char key[16], val[64];
+    int n;
+
+    memset(p, 0, sizeof(*p));
+    while (sscanf(s, " %15[^= \n]=%63s%n", key, val, &n) == 2) {
+        if (!strcmp(key, "format"))
+            av_strlcpy(p->format, val, sizeof(p->format));
+        else if (!strcmp(key, "codec"))
+            av_strlcpy(p->codec, val, sizeof(p->codec));
+        else if (!strcmp(key, "rate"))
+            p->sample_rate = atoi(val);
+        else if (!strcmp(key, "layout"))
+            av_strlcpy(p->layout, val, sizeof(p->layout));
+        else if (!strcmp(key, "fmt"))
+            av_strlcpy(p->sample_fmt, val, sizeof(p->sample_fmt));
+        s += n;
+    }
+    return p->format[0] ? 0 : -1;
+}
+
+/**
+ * Find the last cache line for the file identity fo->id.
+ * @return 0 if found, -1 otherwise
+ */
+static int cache_lookup(struct fastopen *fo)
+{
+    char pathbuf[4096], line[512];
+    const char *path = cache_path(pathbuf, sizeof(pathbuf));
+    size_t idlen = strlen(fo->id);
+    int found = -1;
+    FILE *f;
+
+    if (!path || !(f = fopen(path, "r")))
+        return -1;
+    while (fgets(line, sizeof(line), f))
+        if (!strncmp(line, fo->id, idlen) && line[idlen] == ' ' &&
+            !parse_params(line + idlen, &fo->hint))
+            found = 0;
+    fclose(f);
+    return found;
+}
+
+static int sidecar_lookup(struct fastopen *fo, const char *filename)
+{
+    char path[4096], line[512];
+    FILE *f;
+    int ret;
+
+    if (snprintf(path, sizeof(path), "%s.probe", filename) >= sizeof(path) ||
+        !(f = fopen(path, "r")))
+        return -1;
+    ret = fgets(line, sizeof(line), f) ? parse_params(line, &fo->hint) : -1;
+    fclose(f);
+    return ret;
+}
+
+/**
+ * Guess the container from the file extension: a demuxer named after it
+ * first (mp3, flac, wav), then any demuxer claiming it.
+ */
+static const AVInputFormat *format_from_extension(const char *filename)
+{
+    const char *ext = strrchr(filename, '.');
+    const AVInputFormat *fmt;
+    void *it = NULL;
+
+    if (!ext || strchr(ext, '/'))
+        return NULL;
+    if ((fmt = av_find_input_format(ext + 1)))
+        return fmt;
+    while ((fmt = av_demuxer_iterate(&it)))
+        if (fmt->extensions && av_match_ext(filename, fmt->extensions))
+            return fmt;
+    return NULL;
+}
+
+static int params_complete(const AVCodecParameters *par)
+{
+    return par->codec_id != AV_CODEC_ID_NONE && par->sample_rate > 0 &&
+           par->ch_layout.nb_channels > 0;
+}
+
+static double ms_since(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+void fastopen_init(struct fastopen *fo, int enabled)
+{
+    memset(fo, 0, sizeof(*fo));
+    fo->enabled = enabled;
+    fo->how     = "full probe";
+}
+
+const AVInputFormat *fastopen_begin(struct fastopen *fo, const char *filename,
+                                    AVDictionary **options)
+{
+    const AVInputFormat *iformat = NULL;
+    struct stat st;
+
+    /* A reopen after a failed fast open keeps counting from the first try. */
+    if (!fo->t0.tv_sec && !fo->t0.tv_nsec)
+        clock_gettime(CLOCK_MONOTONIC, &fo->t0);
+
+    fo->id[0] = '\0';
+    if (filename && !stat(filename, &st) && S_ISREG(st.st_mode))
+        snprintf(fo->id, sizeof(fo->id), "%llx:%llx:%lld:%lld.%09ld",
+                 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+                 (long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    if (!fo->enabled)
+        return NULL;
+
+    fo->hint_from = NULL;
+    if (fo->id[0] && !cache_lookup(fo))
+        fo->hint_from = "cache";
+    else if (filename && !sidecar_lookup(fo, filename))
+        fo->hint_from = "sidecar";
+    if (fo->hint_from)
+        iformat = av_find_input_format(fo->hint.format);
+    if (!iformat && filename)
+        iformat = format_from_extension(filename);
+
+    av_dict_set_int(options, "probesize", FASTOPEN_PROBESIZE, 0);
+    av_dict_set_int(options, "analyzeduration", FASTOPEN_ANALYZEDURATION, 0);
+    return iformat;
+}
+
+int fastopen_stream_info(struct fastopen *fo, AVFormatContext *fcx)
+{
+    AVCodecParameters *par;
+
+    if (fcx->nb_streams != 1 || fcx->streams[0]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO)
+        return FASTOPEN_FALLBACK;
+    par = fcx->streams[0]->codecpar;
+
+    if (fo->hint_from) {
+        if ((fo->hint.format[0] && strcmp(fo->hint.format, fcx->iformat->name)) ||
+            (fo->hint.codec[0] && strcmp(fo->hint.codec, avcodec_get_name(par->codec_id))))
+            return FASTOPEN_FALLBACK;
+        /* Only fill in what the header did not say. */
+        if (!par->sample_rate)
+            par->sample_rate = fo->hint.sample_rate;
+        if (!par->ch_layout.nb_channels && fo->hint.layout[0] &&
+            av_channel_layout_from_string(&par->ch_layout, fo->hint.layout) < 0)
+            return FASTOPEN_FALLBACK;
+        if (par->format < 0 && fo->hint.sample_fmt[0])
+            par->format = av_get_sample_fmt(fo->hint.sample_fmt);
+        fo->how = !strcmp(fo->hint_from, "cache") ? "fast open, cached parameters"
+                                                  : "fast open, sidecar";
+    }
+
+    if (!params_complete(par)) {
+        /* Limited by the probe options given to avformat_open_input. */
+        if (avformat_find_stream_info(fcx, NULL) < 0)
+            return FASTOPEN_FALLBACK;
+        fo->how = "fast open, short probe";
+    } else if (!fo->hint_from)
+        fo->how = "fast open, header only";
+    return params_complete(par) ? 0 : FASTOPEN_FALLBACK;
+}
+
+int fastopen_verify(struct fastopen *fo, AVFormatContext *fcx, AVCodecContext *ccx)
+{
+    const AVStream *stream = fcx->streams[0];
+    AVCodecContext *scratch;
+    AVFrame *frame = NULL;
+    AVPacket *pkt;
+    int error, ret = FASTOPEN_FALLBACK;
+
+    /* A second decoder, so that the one handed out has seen nothing yet. */
+    if (!(scratch = avcodec_alloc_context3(ccx->codec)) ||
+        !(frame = av_frame_alloc()) ||
+        avcodec_parameters_to_context(scratch, stream->codecpar) < 0)
+        goto end;
+    /* Set up like the one handed out, so that it decodes to the same
+     * sample format. */
+    scratch->request_sample_fmt = ccx->request_sample_fmt;
+    scratch->pkt_timebase       = stream->time_base;
+    if (avcodec_open2(scratch, ccx->codec, NULL) < 0)
+        goto end;
+
+    while ((error = avcodec_receive_frame(scratch, frame)) == AVERROR(EAGAIN)) {
+        if (fo->nb_queued == FASTOPEN_MAX_PACKETS || !(pkt = av_packet_alloc()))
+            goto end;
+        if (av_read_frame(fcx, pkt) < 0) {
+            av_packet_free(&pkt);
+            goto end;
+        }
+        fo->queue[fo->nb_queued++] = pkt;
+        if (avcodec_send_packet(scratch, pkt) < 0)
+            goto end;
+    }
+    if (error < 0)
+        goto end;
+
+    if (frame->sample_rate != ccx->sample_rate ||
+        frame->ch_layout.nb_channels != ccx->ch_layout.nb_channels ||
+        (ccx->sample_fmt != AV_SAMPLE_FMT_NONE && frame->format != ccx->sample_fmt)) {
+        fprintf(stderr, "Fast open: first frame is %d Hz, %d channels, %s; assumed %d Hz, %d channels, %s\n",
+                frame->sample_rate, frame->ch_layout.nb_channels,
+                av_get_sample_fmt_name(frame->format),
+                ccx->sample_rate, ccx->ch_layout.nb_channels,
+                av_get_sample_fmt_name(ccx->sample_fmt));
+        goto end;
+    }
+    if (ccx->sample_fmt == AV_SAMPLE_FMT_NONE)
+        ccx->sample_fmt = frame->format;
+    ret = 0;
+
+end:
+    if (ret < 0)
+        fprintf(stderr, "Fast open of the input failed, reopening it with a full probe\n");
+    av_frame_free(&frame);
+    avcodec_free_context(&scratch);
+    return ret;
+}
+
+void fastopen_store(struct fastopen *fo, AVFormatContext *fcx, AVCodecContext *ccx)
+{
+    char pathbuf[4096], layout[64], line[512];
+    const char *path = cache_path(pathbuf, sizeof(pathbuf));
+    const char *fmt = av_get_sample_fmt_name(ccx->sample_fmt);
+    struct stat st;
+    int fd, n;
+
+    /* A cache hit that was verified is already in there. */
+    if (!path || !fo->id[0] || (fo->hint_from && !strcmp(fo->hint_from, "cache")))
+        return;
+    if (ccx->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC)
+        snprintf(layout, sizeof(layout), "%dc", ccx->ch_layout.nb_channels);
+    else if (av_channel_layout_describe(&ccx->ch_layout, layout, sizeof(layout)) < 0 ||
+             strchr(layout, ' '))
+        return;
+    n = snprintf(line, sizeof(line), "%s format=%s codec=%s rate=%d layout=%s%s%s\n",
+                 fo->id, fcx->iformat->name, avcodec_get_name(ccx->codec_id),
+                 ccx->sample_rate, layout, fmt ? " fmt=" : "", fmt ? fmt : "");
+    if (n >= sizeof(line))
+        return;
+
+    /* One write per line with O_APPEND, so that concurrent runs do not
+     * interleave; a lost entry only costs a probe next time. */
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND |
+              (!stat(path, &st) && st.st_size > FASTOPEN_CACHE_MAX ? O_TRUNC : 0), 0644);
+    if (fd < 0)
+        return;
+    if (write(fd, line, n) != n)
+        fprintf(stderr, "Could not update probe cache '%s'\n", path);
+    close(fd);
+}
+
+void fastopen_discard(struct fastopen *fo)
+{
+    while (fo->nb_queued)
+        av_packet_free(&fo->queue[--fo->nb_queued]);
+    fo->next = 0;
+}
+
+void fastopen_fallback(struct fastopen *fo)
+{
+    fastopen_discard(fo);
+    fo->enabled   = 0;
+    fo->hint_from = NULL;
+    fo->how       = "full probe after fast open failed";
+}
+
+int fastopen_read_frame(AVFormatContext *fcx, AVPacket *pkt)
+{
+    struct fastopen *fo = fcx->opaque;
+
+    if (fo && fo->next < fo->nb_queued) {
+        av_packet_move_ref(pkt, fo->queue[fo->next]);
+        av_packet_free(&fo->queue[fo->next++]);
+        return 0;
+    }
+    return av_read_frame(fcx, pkt);
+}
+
+void fastopen_frame_decoded(AVFormatContext *fcx)
+{
+    struct fastopen *fo = fcx->opaque;
+
+    if (!fo || fo->reported)
+        return;
+    fo->reported = 1;
+    fprintf(stderr, "Open to first frame: %.2f ms (%s)\n", ms_since(&fo->t0), fo->how);
+}
+
+void fastopen_uninit(struct fastopen *fo)
+{
+    int i;
+
+    for (i = fo->next; i < fo->nb_queued; i++)
+        av_packet_free(&fo->queue[i]);
+    fo->nb_queued = fo->next = 0;
+}
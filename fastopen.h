@@ -0,0 +1,115 @@
+/*
+ * fastopen.h: quicker input opening for the transcoding programs (-F).
+ *
+ * avformat_find_stream_info may decode seconds of audio to learn what the
+ * header or an earlier run could have told us. In fast mode the container
+ * is taken from a sidecar file or the extension, the probe is limited to
+ * a few KiB, and stream parameters seen before for the same file (same
+ * device, inode, size and mtime) are reused from a cache file. The first
+ * decoded frame is checked against what was assumed; if anything
+ * disagrees the input is reopened with a full probe.
+ *
+ * The cache file is $FFPROGS_PROBE_CACHE, or ~/.ffprogs_probe. A sidecar
+ * is <input>.probe holding the same key=value fields as a cache line:
+ *     format=ogg codec=opus rate=48000 layout=stereo fmt=fltp
+ *
+ * Open-to-first-frame latency is printed in both modes.
+ */
+
+#ifndef FASTOPEN_H
+#define FASTOPEN_H
+
+#include <time.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+/* Returned when the fast path gave up and the input has to be reopened
+ * with a full probe. */
+#define FASTOPEN_FALLBACK AVERROR(EAGAIN)
+
+/* Packets read while checking the first frame, replayed afterwards. */
+#define FASTOPEN_MAX_PACKETS 64
+
+struct fastopen_params {
+    char format[32];       /* demuxer short name */
+    char codec[32];        /* decoder codec name */
+    int sample_rate;
+    char layout[64];       /* channel layout description */
+    char sample_fmt[16];
+};
+
+struct fastopen {
+    int enabled;                   /* fast mode (-F), else only timing */
+    const char *how;               /* how the input got opened, for the report */
+    struct timespec t0;            /* when opening started */
+    int reported;
+    char id[96];                   /* file identity, empty if unknown */
+    const char *hint_from;         /* "cache" or "sidecar", NULL without hint */
+    struct fastopen_params hint;
+    AVPacket *queue[FASTOPEN_MAX_PACKETS];
+    int nb_queued, next;
+};
+
+/**
+ * Set up fast-open state for one input.
+ * @param enabled Nonzero for fast mode, zero for a full probe
+ */
+void fastopen_init(struct fastopen *fo, int enabled);
+
+/**
+ * Start opening filename: note the time, identify the file and look for
+ * a hint. In fast mode, also add the small probe limits to options.
+ * @param      filename File about to be opened
+ * @param[out] options  Options for avformat_open_input
+ * @return The container to open the file as, or NULL to probe it
+ */
+const AVInputFormat *fastopen_begin(struct fastopen *fo, const char *filename,
+                                    AVDictionary **options);
+
+/**
+ * Fast-mode replacement for avformat_find_stream_info: fill in what the
+ * header left out from the hint, or probe briefly if there is none.
+ * @return 0, a negative error code, or FASTOPEN_FALLBACK
+ */
+int fastopen_stream_info(struct fastopen *fo, AVFormatContext *fcx);
+
+/**
+ * Decode the first frame with a scratch decoder and compare it with what
+ * ccx was opened for. The packets read are kept for fastopen_read_frame.
+ * @return 0 or FASTOPEN_FALLBACK
+ */
+int fastopen_verify(struct fastopen *fo, AVFormatContext *fcx, AVCodecContext *ccx);
+
+/**
+ * Remember the parameters of a successfully opened input in the cache.
+ */
+void fastopen_store(struct fastopen *fo, AVFormatContext *fcx, AVCodecContext *ccx);
+
+/**
+ * Drop the packets kept by fastopen_verify and leave fast mode, before
+ * the input is reopened with a full probe.
+ */
+void fastopen_fallback(struct fastopen *fo);
+
+/**
+ * Drop the packets kept by fastopen_verify, before a seek makes them
+ * stale; fast mode itself stays as it is.
+ */
+void fastopen_discard(struct fastopen *fo);
+
+/**
+ * av_read_frame that first hands out the packets kept by fastopen_verify.
+ * fcx->opaque is the struct fastopen, or NULL.
+ */
+int fastopen_read_frame(AVFormatContext *fcx, AVPacket *pkt);
+
+/**
+ * Print the open-to-first-frame latency the first time it is called.
+ * fcx->opaque is the struct fastopen, or NULL.
+ */
+void fastopen_frame_decoded(AVFormatContext *fcx);
+
+void fastopen_uninit(struct fastopen *fo);
+
+#endif /* FASTOPEN_H */
@@ -0,0 +1,291 @@
+/*
+ * fgraph.c: see fgraph.h.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/avstring.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "fgraph.h"
+
+/* One graph of the chain, from abuffer to abuffersink */
+struct fstage {
+    char *desc;
+    AVFilterGraph *graph;
+    AVFilterContext *src, *sink;
+    int src_done;           /* the end was put into src */
+    int64_t ns;             /* wall time in the graph */
+    uint64_t frames_in, frames_out;
+    uint64_t samples_in, samples_out;
+};
+
+struct fgraph {
+    struct fstage *stages;
+    int nb_stages;
+    AVFrame *tmp;           /* handed from one stage to the next */
+};
+
+static int64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/**
+ * Cut a description into the filters of its chain: at the commas that are
+ * not quoted or escaped. A description with pads or several chains stays
+ * in one piece.
+ * @return Number of pieces, or an error code
+ */
+static int split_chain(const char *filters, char ***pieces)
+{
+    const char *p, *start = filters;
+    char **list = NULL, **l;
+    int n = 0, quoted = 0;
+
+    *pieces = NULL;
+    if (strpbrk(filters, "[;"))
+        p = filters + strlen(filters);
+    else
+        p = filters;
+    for (;; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+            continue;
+        }
+        if (*p == '\'')
+            quoted = !quoted;
+        if (*p && (*p != ',' || quoted))
+            continue;
+        if (p > start) {
+            if ((l = av_realloc_array(list, n + 1, sizeof(*list))))
+                list = l;
+            if (!l || !(list[n] = av_strndup(start, p - start))) {
+                while (n--)
+                    av_free(list[n]);
+                av_free(list);
+                return AVERROR(ENOMEM);
+            }
+            n++;
+        }
+        if (!*p)
+            break;
+        start = p + 1;
+    }
+    *pieces = list;
+    return n;
+}
+
+/**
+ * Set up one graph of the chain.
+ * @param s      Stage, desc set
+ * @param fmt    Sample format going in
+ * @param layout Channel layout going in
+ * @param rate   Sample rate going in
+ * @param tb     Time base going in
+ * @return Error code (0 if successful)
+ */
+static int open_stage(struct fstage *s, enum AVSampleFormat fmt, const AVChannelLayout *layout, int rate, AVRational tb)
+{
+    AVFilterInOut *outputs = avfilter_inout_alloc(), *inputs = avfilter_inout_alloc();
+    char args[512], ch[128];
+    int error;
+
+    if (!outputs || !inputs || !(s->graph = avfilter_graph_alloc())) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    av_channel_layout_describe(layout, ch, sizeof(ch));
+    snprintf(args, sizeof(args), "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:channel_layout=%s",
+             tb.num, tb.den, rate, av_get_sample_fmt_name(fmt), ch);
+    if ((error = avfilter_graph_create_filter(&s->src, avfilter_get_by_name("abuffer"), "in",
+                                              args, NULL, s->graph)) < 0 ||
+        (error = avfilter_graph_create_filter(&s->sink, avfilter_get_by_name("abuffersink"), "out",
+                                              NULL, NULL, s->graph)) < 0)
+        goto cleanup;
+
+    /* The description's open input is fed by src, its open output feeds
+     * sink. */
+    outputs->name       = av_strdup("in");
+    outputs->filter_ctx = s->src;
+    inputs->name        = av_strdup("out");
+    inputs->filter_ctx  = s->sink;
+    if (!outputs->name || !inputs->name) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    if ((error = avfilter_graph_parse_ptr(s->graph, s->desc, &inputs, &outputs, NULL)) < 0 ||
+        (error = avfilter_graph_config(s->graph, NULL)) < 0)
+        goto cleanup;
+
+cleanup:
+    if (error < 0)
+        fprintf(stderr, "Could not set up filter '%s' (error '%s')\n", s->desc, av_err2str(error));
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return error;
+}
+
+int fgraph_alloc(struct fgraph **fg, const char *filters, const AVCodecContext *dec, AVRational time_base,
+                 enum AVSampleFormat out_fmt, const AVChannelLayout *out_layout, int out_rate)
+{
+    AVChannelLayout layout = { 0 };
+    enum AVSampleFormat fmt = dec->sample_fmt;
+    int rate = dec->sample_rate;
+    struct fgraph *g;
+    char **pieces, ch[128];
+    int n, error, i;
+
+    if ((n = split_chain(filters, &pieces)) < 0)
+        return n;
+    if (!n) {
+        fprintf(stderr, "No filters in '%s'\n", filters);
+        return AVERROR(EINVAL);
+    }
+    if (!(g = av_mallocz(sizeof(*g))) ||
+        !(g->stages = av_calloc(n + 1, sizeof(*g->stages))) ||
+        !(g->tmp = av_frame_alloc())) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    for (i = 0; i < n; i++)
+        g->stages[i].desc = pieces[i];
+    g->nb_stages = n;
+    av_freep(&pieces);
+    /* The conversion to what the next stage takes comes last. */
+    av_channel_layout_describe(out_layout, ch, sizeof(ch));
+    if (!(g->stages[n].desc = av_asprintf("aformat=sample_fmts=%s:sample_rates=%d:channel_layouts=%s",
+                                          av_get_sample_fmt_name(out_fmt), out_rate, ch))) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    g->nb_stages = n + 1;
+
+    /* Each graph takes what the one before it puts out. */
+    if ((error = av_channel_layout_copy(&layout, &dec->ch_layout)) < 0)
+        goto cleanup;
+    for (i = 0; i < g->nb_stages; i++) {
+        struct fstage *s = &g->stages[i];
+
+        if ((error = open_stage(s, fmt, &layout, rate, time_base)) < 0)
+            goto cleanup;
+        av_channel_layout_uninit(&layout);
+        fmt       = av_buffersink_get_format(s->sink);
+        rate      = av_buffersink_get_sample_rate(s->sink);
+        time_base = av_buffersink_get_time_base(s->sink);
+        if ((error = av_buffersink_get_ch_layout(s->sink, &layout)) < 0)
+            goto cleanup;
+    }
+    av_channel_layout_uninit(&layout);
+    *fg = g;
+    return 0;
+
+cleanup:
+    av_channel_layout_uninit(&layout);
+    if (pieces) {
+        for (i = 0; i < n; i++)
+            av_free(pieces[i]);
+        av_free(pieces);
+    }
+    fgraph_free(&g);
+    return error;
+}
+
+/* Put a frame, or the end, into a stage. */
+static int push(struct fstage *s, AVFrame *frame)
+{
+    const int64_t t = clock_ns();
+    int error;
+
+    if (frame) {
+        s->frames_in++;
+        s->samples_in += frame->nb_samples;
+    } else
+        s->src_done = 1;
+    /* Without AV_BUFFERSRC_FLAG_KEEP_REF the references move, no copy. */
+    error = av_buffersrc_add_frame_flags(s->src, frame, 0);
+    s->ns += clock_ns() - t;
+    if (error < 0)
+        fprintf(stderr, "Could not filter frame in '%s' (error '%s')\n", s->desc, av_err2str(error));
+    return error;
+}
+
+/* Take a frame out of a stage. */
+static int pull(struct fstage *s, AVFrame *frame)
+{
+    const int64_t t = clock_ns();
+    int error;
+
+    error = av_buffersink_get_frame(s->sink, frame);
+    s->ns += clock_ns() - t;
+    if (error >= 0) {
+        s->frames_out++;
+        s->samples_out += frame->nb_samples;
+    } else if (error != AVERROR(EAGAIN) && error != AVERROR_EOF)
+        fprintf(stderr, "Could not filter frame in '%s' (error '%s')\n", s->desc, av_err2str(error));
+    return error;
+}
+
+int fgraph_send(struct fgraph *fg, AVFrame *frame)
+{
+    int error, i;
+
+    if ((error = push(&fg->stages[0], frame)) < 0)
+        return error;
+    /* Hand on whatever each stage has, up to the last one's source. */
+    for (i = 0; i + 1 < fg->nb_stages; i++) {
+        struct fstage *next = &fg->stages[i + 1];
+
+        while ((error = pull(&fg->stages[i], fg->tmp)) >= 0)
+            if ((error = push(next, fg->tmp)) < 0)
+                return error;
+        if (error == AVERROR_EOF && !next->src_done && (error = push(next, NULL)) < 0)
+            return error;
+        if (error < 0 && error != AVERROR(EAGAIN) && error != AVERROR_EOF)
+            return error;
+    }
+    return 0;
+}
+
+int fgraph_receive(struct fgraph *fg, AVFrame *frame)
+{
+    return pull(&fg->stages[fg->nb_stages - 1], frame);
+}
+
+void fgraph_report(const struct fgraph *fg, FILE *f)
+{
+    int i;
+
+    for (i = 0; i < fg->nb_stages; i++) {
+        const struct fstage *s = &fg->stages[i];
+        fprintf(f, "Filter '%s': %llu frames, %llu samples in, %llu frames, %llu samples out, %.3f ms\n",
+                s->desc, (unsigned long long)s->frames_in, (unsigned long long)s->samples_in,
+                (unsigned long long)s->frames_out, (unsigned long long)s->samples_out, s->ns / 1e6);
+    }
+}
+
+void fgraph_free(struct fgraph **fg)
+{
+    struct fgraph *g = *fg;
+    int i;
+
+    if (!g)
+        return;
+    for (i = 0; g->stages && i < g->nb_stages; i++) {
+        avfilter_graph_free(&g->stages[i].graph);
+        av_free(g->stages[i].desc);
+    }
+    av_free(g->stages);
+    av_frame_free(&g->tmp);
+    av_freep(fg);
+}
@@ -0,0 +1,65 @@
+/*
+ * fgraph.h: libavfilter stage of tmp30 (-f option), e.g. atempo=0.5 or
+ * "atempo=0.5,atempo=0.5,volume=3dB".
+ *
+ * Sits between the decoder and the FIFO, in place of the resampler: the
+ * decoded frames go into the graph by reference, and what comes out is
+ * in the encoder's (or the loudness stage's) sample format, layout and
+ * rate, ready to be stored as it is.
+ *
+ * A chain of filters (commas at the top level of the string) is run as
+ * one graph per filter, frames handed on by reference from one to the
+ * next, so that the time each filter takes can be told apart; a string
+ * with labelled pads or several chains (;) is one graph. The conversion
+ * to the encoder's format is the last graph of the chain, aformat.
+ */
+
+#ifndef FGRAPH_H
+#define FGRAPH_H
+
+#include <stdio.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+
+struct fgraph;
+
+/**
+ * Set up the filters.
+ * @param[out] fg         Filter stage
+ * @param      filters    libavfilter graph description
+ * @param      dec        Decoder the frames come from
+ * @param      time_base  Time base of their timestamps
+ * @param      out_fmt    Sample format to put out
+ * @param      out_layout Channel layout to put out
+ * @param      out_rate   Sample rate to put out
+ * @return Error code (0 if successful)
+ */
+int fgraph_alloc(struct fgraph **fg, const char *filters, const AVCodecContext *dec, AVRational time_base,
+                 enum AVSampleFormat out_fmt, const AVChannelLayout *out_layout, int out_rate);
+
+/**
+ * Put a decoded frame into the graph. Its references are taken over, the
+ * frame is left blank.
+ * @param frame Frame, or NULL at the end of the input
+ * @return Error code (0 if successful)
+ */
+int fgraph_send(struct fgraph *fg, AVFrame *frame);
+
+/**
+ * Take a filtered frame out of the graph.
+ * @return 0 if there is one, AVERROR(EAGAIN) if it needs more input,
+ *         AVERROR_EOF once it has put out everything, or an error code
+ */
+int fgraph_receive(struct fgraph *fg, AVFrame *frame);
+
+/**
+ * Print frames, samples and time of each filter.
+ */
+void fgraph_report(const struct fgraph *fg, FILE *f);
+
+void fgraph_free(struct fgraph **fg);
+
+#endif /* FGRAPH_H */
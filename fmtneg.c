@@ -0,0 +1,90 @@
+/*
+ * fmtneg.c: see fmtneg.h.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fmtneg.h"
+
+static int is_float(enum AVSampleFormat fmt)
+{
+    fmt = av_get_packed_sample_fmt(fmt);
+    return fmt == AV_SAMPLE_FMT_FLT || fmt == AV_SAMPLE_FMT_DBL;
+}
+
+/* Cost of converting from one format to another: losing precision worst,
+ * then changing between integer and float, then (de)interleaving. */
+static int cost(enum AVSampleFormat from, enum AVSampleFormat to)
+{
+    return 4 * (av_get_bytes_per_sample(to) < av_get_bytes_per_sample(from)) +
+           2 * (is_float(to) != is_float(from)) +
+               (av_sample_fmt_is_planar(to) != av_sample_fmt_is_planar(from));
+}
+
+enum AVSampleFormat fmtneg_pick(const AVCodec *enc, enum AVSampleFormat in_fmt)
+{
+    const enum AVSampleFormat *f;
+    enum AVSampleFormat best;
+    int best_cost = 8;
+
+    if (!enc->sample_fmts)
+        return in_fmt != AV_SAMPLE_FMT_NONE ? in_fmt : AV_SAMPLE_FMT_S16;
+    best = enc->sample_fmts[0];
+    if (in_fmt == AV_SAMPLE_FMT_NONE)
+        return best;
+    for (f = enc->sample_fmts; *f != AV_SAMPLE_FMT_NONE; f++) {
+        int c = cost(in_fmt, *f);
+        if (c < best_cost) {
+            best      = *f;
+            best_cost = c;
+        }
+    }
+    return best;
+}
+
+void fmtneg_request(AVCodecContext *dec, const AVCodec *enc)
+{
+    const enum AVSampleFormat *e, *d;
+
+    if (!enc || !enc->sample_fmts)
+        return;
+    dec->request_sample_fmt = enc->sample_fmts[0];
+    if (!dec->codec || !dec->codec->sample_fmts)
+        return;
+    for (e = enc->sample_fmts; *e != AV_SAMPLE_FMT_NONE; e++)
+        for (d = dec->codec->sample_fmts; *d != AV_SAMPLE_FMT_NONE; d++)
+            if (*d == *e) {
+                dec->request_sample_fmt = *e;
+                return;
+            }
+}
+
+int fmtneg_passthrough(const AVCodecContext *dec, const AVChannelLayout *out_layout,
+                       enum AVSampleFormat out_fmt, int out_rate)
+{
+    return dec->sample_fmt == out_fmt && dec->sample_rate == out_rate &&
+           !av_channel_layout_compare(&dec->ch_layout, out_layout);
+}
+
+void fmtneg_describe(char *buf, size_t size, const AVCodecContext *dec,
+                     const AVChannelLayout *out_layout, enum AVSampleFormat out_fmt, int out_rate)
+{
+    const char *in_name = av_get_sample_fmt_name(dec->sample_fmt), *out_name = av_get_sample_fmt_name(out_fmt);
+    char in_layout[64], layout[64];
+    size_t n = 0;
+
+    av_channel_layout_describe(&dec->ch_layout, in_layout, sizeof(in_layout));
+    av_channel_layout_describe(out_layout, layout, sizeof(layout));
+    if (fmtneg_passthrough(dec, out_layout, out_fmt, out_rate)) {
+        snprintf(buf, size, "skipped (%s, %s, %d Hz)", out_name ? out_name : "?", layout, out_rate);
+        return;
+    }
+    *buf = 0;
+    if (dec->sample_fmt != out_fmt)
+        n += snprintf(buf + n, n < size ? size - n : 0, "%s -> %s", in_name ? in_name : "?", out_name ? out_name : "?");
+    if (av_channel_layout_compare(&dec->ch_layout, out_layout))
+        n += snprintf(buf + n, n < size ? size - n : 0, "%s%s -> %s", n ? ", " : "", in_layout, layout);
+    if (dec->sample_rate != out_rate)
+        snprintf(buf + n, n < size ? size - n : 0, "%s%d -> %d Hz", n ? ", " : "", dec->sample_rate, out_rate);
+}
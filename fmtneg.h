@@ -0,0 +1,49 @@
+/*
+ * fmtneg.h: sample format negotiation between decoder and encoder.
+ *
+ * The encoder gets the sample format it supports that is closest to what
+ * the decoder puts out, and the decoder is asked for a format the encoder
+ * takes (request_sample_fmt, which some decoders honour). When format,
+ * layout and rate then all match, the samples go from decoder to encoder
+ * without a resampler.
+ */
+
+#ifndef FMTNEG_H
+#define FMTNEG_H
+
+#include <stddef.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+
+/**
+ * Pick an encoder sample format.
+ * @param enc    Encoder
+ * @param in_fmt What the decoder puts out, AV_SAMPLE_FMT_NONE if unknown
+ * @return in_fmt if the encoder takes it, else the encoder's format that
+ *         loses least and converts cheapest, in the encoder's order of
+ *         preference on a tie
+ */
+enum AVSampleFormat fmtneg_pick(const AVCodec *enc, enum AVSampleFormat in_fmt);
+
+/**
+ * Before opening a decoder, ask it for a format the encoder takes: one
+ * the decoder lists, else the encoder's first.
+ */
+void fmtneg_request(AVCodecContext *dec, const AVCodec *enc);
+
+/**
+ * Whether samples from a decoder can go to the encoder as they are.
+ */
+int fmtneg_passthrough(const AVCodecContext *dec, const AVChannelLayout *out_layout,
+                       enum AVSampleFormat out_fmt, int out_rate);
+
+/**
+ * Describe the conversion between decoder and encoder, e.g.
+ * "s16 -> fltp" or "skipped (fltp, stereo, 44100 Hz)".
+ */
+void fmtneg_describe(char *buf, size_t size, const AVCodecContext *dec,
+                     const AVChannelLayout *out_layout, enum AVSampleFormat out_fmt, int out_rate);
+
+#endif /* FMTNEG_H */
@@ -0,0 +1,158 @@
+/*
+ * fpool.c: see fpool.h.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/buffer.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "fpool.h"
+
+struct fpool {
+    /* The threads of a frame-threaded decoder get buffers at once: lock
+     * for the pool, its size and the counters. */
+    pthread_mutex_t lock;
+    AVBufferPool *pool;
+    size_t size;                /* of the pool's buffers */
+    struct fpool_stats st;
+    /* Scratch */
+    uint8_t **scratch;
+    int scratch_channels, scratch_samples;
+    enum AVSampleFormat scratch_fmt;
+};
+
+static void free_buffer(void *opaque, uint8_t *data)
+{
+    free(data);
+}
+
+static AVBufferRef *alloc_buffer(void *opaque, size_t size)
+{
+    struct fpool *fp = opaque;
+    AVBufferRef *buf;
+    void *data;
+
+    if (posix_memalign(&data, FPOOL_ALIGN, size))
+        return NULL;
+    /* Take the page faults now, once, not on the decoder's first write. */
+    memset(data, 0, size);
+    if (!(buf = av_buffer_create(data, size, free_buffer, NULL, 0))) {
+        free(data);
+        return NULL;
+    }
+    fp->st.allocs++;
+    fp->st.bytes += size;
+    return buf;
+}
+
+static int get_buffer(AVCodecContext *avctx, AVFrame *frame, int flags)
+{
+    struct fpool *fp = avctx->opaque;
+    const int planar = av_sample_fmt_is_planar(frame->format);
+    const int planes = planar ? frame->ch_layout.nb_channels : 1;
+    int linesize, size, p, fallback;
+
+    /* Without DR1 the decoder can't take buffers it didn't ask for the
+     * size of itself. */
+    fallback = avctx->codec_type != AVMEDIA_TYPE_AUDIO || planes > AV_NUM_DATA_POINTERS ||
+               !(avctx->codec->capabilities & AV_CODEC_CAP_DR1);
+    pthread_mutex_lock(&fp->lock);
+    fp->st.gets++;
+    fp->st.fallbacks += fallback;
+    pthread_mutex_unlock(&fp->lock);
+    if (fallback)
+        return avcodec_default_get_buffer2(avctx, frame, flags);
+    if ((size = av_samples_get_buffer_size(&linesize, frame->ch_layout.nb_channels,
+                                           frame->nb_samples, frame->format, FPOOL_ALIGN)) < 0)
+        return size;
+
+    /* A bigger frame than so far: a new pool for the new size. Buffers of
+     * the old one go away as their frames are freed. alloc_buffer counts
+     * under the lock too, called from av_buffer_pool_get. */
+    pthread_mutex_lock(&fp->lock);
+    if (size > fp->size) {
+        av_buffer_pool_uninit(&fp->pool);
+        if (!(fp->pool = av_buffer_pool_init2(size, fp, alloc_buffer, NULL))) {
+            fp->size = 0;
+            pthread_mutex_unlock(&fp->lock);
+            return AVERROR(ENOMEM);
+        }
+        fp->size = size;
+    }
+    frame->buf[0] = av_buffer_pool_get(fp->pool);
+    pthread_mutex_unlock(&fp->lock);
+    if (!frame->buf[0])
+        return AVERROR(ENOMEM);
+
+    /* All planes in the one buffer. */
+    for (p = 0; p < planes; p++)
+        frame->data[p] = frame->buf[0]->data + p * linesize;
+    frame->extended_data = frame->data;
+    frame->linesize[0]   = linesize;
+    return 0;
+}
+
+int fpool_alloc(struct fpool **fp)
+{
+    if (!(*fp = av_mallocz(sizeof(**fp))))
+        return AVERROR(ENOMEM);
+    pthread_mutex_init(&(*fp)->lock, NULL);
+    return 0;
+}
+
+void fpool_attach(struct fpool *fp, AVCodecContext *dec)
+{
+    dec->opaque      = fp;
+    dec->get_buffer2 = get_buffer;
+}
+
+int fpool_scratch(struct fpool *fp, uint8_t ***data, int channels, int nb_samples,
+                  enum AVSampleFormat fmt)
+{
+    int error;
+
+    if (!fp->scratch || channels != fp->scratch_channels || fmt != fp->scratch_fmt ||
+        nb_samples > fp->scratch_samples) {
+        if (fp->scratch)
+            av_freep(&fp->scratch[0]);
+        av_freep(&fp->scratch);
+        if ((error = av_samples_alloc_array_and_samples(&fp->scratch, NULL, channels, nb_samples,
+                                                        fmt, FPOOL_ALIGN)) < 0) {
+            fprintf(stderr, "Could not allocate converted input samples (error '%s')\n", av_err2str(error));
+            return error;
+        }
+        fp->scratch_channels = channels;
+        fp->scratch_samples  = nb_samples;
+        fp->scratch_fmt      = fmt;
+        pthread_mutex_lock(&fp->lock);
+        fp->st.allocs++;
+        fp->st.bytes += av_samples_get_buffer_size(NULL, channels, nb_samples, fmt, FPOOL_ALIGN);
+        pthread_mutex_unlock(&fp->lock);
+    }
+    *data = fp->scratch;
+    return 0;
+}
+
+void fpool_stats(struct fpool *fp, struct fpool_stats *st)
+{
+    pthread_mutex_lock(&fp->lock);
+    *st = fp->st;
+    pthread_mutex_unlock(&fp->lock);
+}
+
+void fpool_free(struct fpool **fp)
+{
+    if (!*fp)
+        return;
+    av_buffer_pool_uninit(&(*fp)->pool);
+    if ((*fp)->scratch)
+        av_freep(&(*fp)->scratch[0]);
+    av_freep(&(*fp)->scratch);
+    pthread_mutex_destroy(&(*fp)->lock);
+    av_freep(fp);
+}
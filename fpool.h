@@ -0,0 +1,66 @@
+/*
+ * fpool.h: buffers of tmp30's decoded and converted samples.
+ *
+ * The decoder gets its frames from a get_buffer2 callback backed by an
+ * AVBufferPool of FPOOL_ALIGN aligned buffers. A buffer is faulted in
+ * when it is made and goes back to the pool when its frame is freed, so
+ * a run touches the same few buffers over and over instead of getting
+ * fresh pages. The resampler converts into a scratch buffer that is kept
+ * from frame to frame instead of being allocated for each one.
+ */
+
+#ifndef FPOOL_H
+#define FPOOL_H
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/samplefmt.h>
+
+/* Alignment of the buffers and of their planes: a cache line, and enough
+ * for AVX-512 */
+#define FPOOL_ALIGN 64
+
+struct fpool_stats {
+    uint64_t gets;      /* frames the decoder asked for */
+    uint64_t allocs;    /* buffers made: pool misses and scratch growth */
+    uint64_t fallbacks; /* frames left to libavcodec's allocator */
+    int64_t bytes;      /* bytes made */
+};
+
+struct fpool;
+
+/**
+ * Allocate a pool.
+ * @return Error code (0 if successful)
+ */
+int fpool_alloc(struct fpool **fp);
+
+/**
+ * Have a decoder take its frames from the pool, before avcodec_open2 so
+ * that the threads of a frame-threaded decoder do too; they may get
+ * frames at the same time, and the pool locks. Decoders without
+ * AV_CODEC_CAP_DR1 keep libavcodec's allocator. The pool must outlive
+ * the decoder.
+ */
+void fpool_attach(struct fpool *fp, AVCodecContext *dec);
+
+/**
+ * Get the scratch buffer, big enough for nb_samples.
+ * @param[out] data Planes, valid until the next call
+ * @return Error code (0 if successful)
+ */
+int fpool_scratch(struct fpool *fp, uint8_t ***data, int channels, int nb_samples,
+                  enum AVSampleFormat fmt);
+
+/**
+ * Counters so far.
+ */
+void fpool_stats(struct fpool *fp, struct fpool_stats *st);
+
+/**
+ * Free a pool. Frames still out keep their buffers until they are freed.
+ */
+void fpool_free(struct fpool **fp);
+
+#endif /* FPOOL_H */
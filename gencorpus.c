@@ -0,0 +1,548 @@
+/*
+ * gencorpus.c: deterministic synthetic audio for benchmarks and tests.
+ *
+ * Writes one file of generated audio through the same encoder and muxer
+ * setup as tmp30.c, so the corpus does not depend on an ffmpeg command
+ * line tool or on files nobody else has. The content is fixed by the
+ * seed: same seed, same samples. Encoders and muxers are put in bitexact
+ * mode, so with the same FFmpeg build the files are byte-identical too.
+ *
+ * Signals:
+ *   silence  digital silence
+ *   tone     one steady sine per channel, frequencies picked by the seed
+ *   noise    pink noise, independent per channel
+ *   speech   speech-like bursts: syllables of a pulse train through two
+ *            formant resonators, with pitch movement and pauses between
+ *
+ * Codecs: mp2, mp3, aac, opus, flac (or any encoder name), 1 to 8
+ * channels, any rate; channels and rate are brought to the nearest the
+ * encoder supports, with a note on stderr.
+ *
+ * e.g. ./gencorpus -S speech -c aac -r 48000 -C 6 -d 600 speech.m4a
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+
+#include <libavcodec/avcodec.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+
+/* Samples per frame for encoders that take any frame size. */
+#define DEFAULT_FRAME_SIZE 1024
+
+enum signal { SIG_SILENCE, SIG_TONE, SIG_NOISE, SIG_SPEECH };
+
+static const char *const signal_names[] = { "silence", "tone", "noise", "speech" };
+
+/* Short codec names and the encoders behind them, with a bit rate for
+ * stereo; other channel counts scale it (0: lossless). */
+static const struct {
+    const char *name, *encoder;
+    int64_t bit_rate;
+} codecs[] = {
+    { "mp2",  "mp2",        192000 },
+    { "mp3",  "libmp3lame", 128000 },
+    { "aac",  "aac",        128000 },
+    { "opus", "libopus",     96000 },
+    { "flac", "flac",            0 },
+};
+
+/* xorshift64*: small, fast and the same everywhere. */
+struct rng {
+    uint64_t s;
+};
+
+static void rng_seed(struct rng *r, uint64_t seed)
+{
+    /* splitmix64 step, so that small seeds give well-mixed states */
+    uint64_t z = seed + 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    r->s = (z ^ (z >> 31)) | 1;
+}
+
+static uint64_t rng_next(struct rng *r)
+{
+    r->s ^= r->s >> 12;
+    r->s ^= r->s << 25;
+    r->s ^= r->s >> 27;
+    return r->s * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform in [0, 1). */
+static double rng_u01(struct rng *r)
+{
+    return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Two-pole resonator, used as a formant filter. */
+struct reson {
+    double a1, a2, g, y1, y2;
+};
+
+static void reson_set(struct reson *f, double freq, double bw, int rate)
+{
+    double r = exp(-M_PI * bw / rate);
+
+    f->a1 = 2 * r * cos(2 * M_PI * freq / rate);
+    f->a2 = -r * r;
+    f->g  = 1 - r;
+}
+
+static double reson_run(struct reson *f, double x)
+{
+    double y = f->g * x + f->a1 * f->y1 + f->a2 * f->y2;
+
+    f->y2 = f->y1;
+    f->y1 = y;
+    return y;
+}
+
+/* Generator state for one file. */
+struct gen {
+    enum signal signal;
+    int rate, channels;
+    struct rng rng;
+    /* tone */
+    double phase[8], step[8];
+    /* noise: Paul Kellet's pink filter, per channel */
+    double pink[8][7];
+    /* speech */
+    int64_t left;               /* samples left in the current syllable or pause */
+    int voiced;
+    int64_t length;             /* of the current syllable */
+    double f0, f0_slope, pulse; /* pitch, its drift per sample, pulse phase */
+    struct reson f1, f2;
+    double gain[8];
+};
+
+static void gen_init(struct gen *g, enum signal signal, int rate, int channels, uint64_t seed)
+{
+    int ch;
+
+    memset(g, 0, sizeof(*g));
+    g->signal   = signal;
+    g->rate     = rate;
+    g->channels = channels;
+    rng_seed(&g->rng, seed);
+    for (ch = 0; ch < channels; ch++) {
+        /* Tones between A2 and A6, stepped in semitones. */
+        double freq = 110 * pow(2, (int)(rng_u01(&g->rng) * 48) / 12.0);
+        g->step[ch] = 2 * M_PI * FFMIN(freq, rate * 0.45) / rate;
+        /* Speech is one voice, a little louder in some channels. */
+        g->gain[ch] = 0.6 + 0.4 * rng_u01(&g->rng);
+    }
+}
+
+/* Start the next syllable or pause of the speech signal. */
+static void speech_next(struct gen *g)
+{
+    /* Vowel formants (F1, F2) of a, e, i, o, u. */
+    static const double formants[5][2] = {
+        { 730, 1090 }, { 530, 1840 }, { 270, 2290 }, { 570, 840 }, { 300, 870 },
+    };
+    const double *f;
+
+    g->voiced = !g->voiced;
+    if (!g->voiced) {
+        /* Mostly short gaps between syllables, now and then a sentence break. */
+        double secs = rng_u01(&g->rng) < 0.15 ? 0.4 + 0.8 * rng_u01(&g->rng)
+                                              : 0.03 + 0.12 * rng_u01(&g->rng);
+        g->left = secs * g->rate;
+        return;
+    }
+    g->length = g->left = (0.08 + 0.25 * rng_u01(&g->rng)) * g->rate;
+    g->f0 = 90 + 130 * rng_u01(&g->rng);
+    /* Falling or rising by up to a fifth over the syllable. */
+    g->f0_slope = g->f0 * (rng_u01(&g->rng) - 0.5) / g->length;
+    f = formants[(int)(rng_u01(&g->rng) * 5)];
+    reson_set(&g->f1, FFMIN(f[0], g->rate * 0.45), 80, g->rate);
+    reson_set(&g->f2, FFMIN(f[1], g->rate * 0.45), 120, g->rate);
+}
+
+/**
+ * Produce the next sample of every channel.
+ * @param out One value in [-1, 1] per channel
+ */
+static void gen_sample(struct gen *g, float *out)
+{
+    double v, white, env;
+    int ch;
+
+    switch (g->signal) {
+    case SIG_SILENCE:
+        for (ch = 0; ch < g->channels; ch++)
+            out[ch] = 0;
+        break;
+    case SIG_TONE:
+        for (ch = 0; ch < g->channels; ch++) {
+            out[ch] = 0.5 * sin(g->phase[ch]);
+            if ((g->phase[ch] += g->step[ch]) > 2 * M_PI)
+                g->phase[ch] -= 2 * M_PI;
+        }
+        break;
+    case SIG_NOISE:
+        for (ch = 0; ch < g->channels; ch++) {
+            double *b = g->pink[ch];
+            white = 2 * rng_u01(&g->rng) - 1;
+            b[0] = 0.99886 * b[0] + white * 0.0555179;
+            b[1] = 0.99332 * b[1] + white * 0.0750759;
+            b[2] = 0.96900 * b[2] + white * 0.1538520;
+            b[3] = 0.86650 * b[3] + white * 0.3104856;
+            b[4] = 0.55000 * b[4] + white * 0.5329522;
+            b[5] = -0.7616 * b[5] - white * 0.0168980;
+            v = b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] + white * 0.5362;
+            b[6] = white * 0.115926;
+            out[ch] = 0.1 * v;
+        }
+        break;
+    case SIG_SPEECH:
+        if (g->left <= 0)
+            speech_next(g);
+        g->left--;
+        v = 0;
+        if (g->voiced) {
+            /* Glottal pulses plus a little breath, shaped by the formants
+             * and a raised-cosine envelope over the syllable. */
+            g->pulse += g->f0 / g->rate;
+            g->f0    += g->f0_slope;
+            white = 2 * rng_u01(&g->rng) - 1;
+            if (g->pulse >= 1) {
+                g->pulse -= 1;
+                v = 1;
+            }
+            v += 0.05 * white;
+            v = 4 * reson_run(&g->f1, v) + 2 * reson_run(&g->f2, v);
+            env = 0.5 - 0.5 * cos(2 * M_PI * (g->length - g->left) / g->length);
+            v *= env;
+        }
+        for (ch = 0; ch < g->channels; ch++)
+            out[ch] = av_clipf(v * g->gain[ch], -1, 1);
+        break;
+    }
+}
+
+/**
+ * Store one sample into a frame in the encoder's sample format.
+ */
+static void store_sample(AVFrame *frame, int ch, int i, float v)
+{
+    int channels = frame->ch_layout.nb_channels;
+
+    switch (frame->format) {
+    case AV_SAMPLE_FMT_S16:  ((int16_t *)frame->data[0])[i * channels + ch] = lrintf(v * 32767); break;
+    case AV_SAMPLE_FMT_S16P: ((int16_t *)frame->data[ch])[i] = lrintf(v * 32767); break;
+    case AV_SAMPLE_FMT_S32:  ((int32_t *)frame->data[0])[i * channels + ch] = lrint(v * 2147483647.0); break;
+    case AV_SAMPLE_FMT_S32P: ((int32_t *)frame->data[ch])[i] = lrint(v * 2147483647.0); break;
+    case AV_SAMPLE_FMT_FLT:  ((float *)frame->data[0])[i * channels + ch] = v; break;
+    case AV_SAMPLE_FMT_FLTP: ((float *)frame->data[ch])[i] = v; break;
+    default: break;
+    }
+}
+
+/**
+ * Pick the supported sample rate closest to the requested one.
+ */
+static int pick_sample_rate(const AVCodec *codec, int rate)
+{
+    const int *p;
+    int best = 0;
+
+    if (!codec->supported_samplerates)
+        return rate;
+    for (p = codec->supported_samplerates; *p; p++)
+        if (!best || abs(*p - rate) < abs(best - rate))
+            best = *p;
+    return best;
+}
+
+/* Whether layout p suits a channel count better than best: the same
+ * count first, else the most channels below it, else the fewest above. */
+static int layout_better(const AVChannelLayout *p, const AVChannelLayout *best, int channels)
+{
+    if (!best)
+        return 1;
+    if ((p->nb_channels <= channels) != (best->nb_channels <= channels))
+        return p->nb_channels <= channels;
+    return p->nb_channels <= channels ? p->nb_channels > best->nb_channels
+                                      : p->nb_channels < best->nb_channels;
+}
+
+/**
+ * Pick the channel layout for a channel count: the default layout if the
+ * encoder takes it, else the closest one it lists.
+ */
+static void pick_layout(const AVCodec *codec, int channels, AVChannelLayout *layout)
+{
+    const AVChannelLayout *p, *best = NULL;
+
+    av_channel_layout_default(layout, channels);
+    if (!codec->ch_layouts)
+        return;
+    for (p = codec->ch_layouts; p->nb_channels; p++) {
+        if (!av_channel_layout_compare(p, layout))
+            return;
+        if (layout_better(p, best, channels))
+            best = p;
+    }
+    if (best) {
+        av_channel_layout_uninit(layout);
+        av_channel_layout_copy(layout, best);
+    }
+}
+
+/**
+ * Open the output file and its encoder (compare open_output_file in tmp30.c).
+ * @param      filename Output file; its extension picks the container
+ * @param      codec    Encoder
+ * @param      rate     Requested sample rate
+ * @param      channels Requested channel count
+ * @param      bit_rate Bit rate in bit/s, 0 for the codec's default
+ * @param[out] outfcx   Format context of the output file
+ * @param[out] outccx   Codec context of the output file
+ * @return Error code (0 if successful)
+ */
+static int open_output_file(const char *filename, const AVCodec *codec, int rate, int channels, int64_t bit_rate, AVFormatContext **outfcx, AVCodecContext **outccx)
+{
+    AVCodecContext *avctx = NULL;
+    AVIOContext *pb = NULL;
+    AVStream *stream;
+    int error;
+
+    if ((error = avio_open(&pb, filename, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open output file '%s' (error '%s')\n", filename, av_err2str(error));
+        return error;
+    }
+    if (!(*outfcx = avformat_alloc_context())) {
+        fprintf(stderr, "Could not allocate output format context\n");
+        avio_closep(&pb);
+        return AVERROR(ENOMEM);
+    }
+    (*outfcx)->pb = pb;
+    /* No library versions in the headers, so that builds compare equal. */
+    (*outfcx)->flags |= AVFMT_FLAG_BITEXACT;
+    if (!((*outfcx)->oformat = av_guess_format(NULL, filename, NULL))) {
+        fprintf(stderr, "Could not find output file format\n");
+        error = AVERROR(EINVAL);
+        goto cleanup;
+    }
+    if (!((*outfcx)->url = av_strdup(filename))) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    if (!(stream = avformat_new_stream(*outfcx, NULL))) {
+        fprintf(stderr, "Could not create new stream\n");
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+
+    if (!(avctx = avcodec_alloc_context3(codec))) {
+        fprintf(stderr, "Could not allocate an encoding context\n");
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    pick_layout(codec, channels, &avctx->ch_layout);
+    if (avctx->ch_layout.nb_channels != channels)
+        fprintf(stderr, "%s: %d channels instead of %d\n", codec->name, avctx->ch_layout.nb_channels, channels);
+    avctx->sample_rate = pick_sample_rate(codec, rate);
+    if (avctx->sample_rate != rate)
+        fprintf(stderr, "%s: %d Hz instead of %d Hz\n", codec->name, avctx->sample_rate, rate);
+    avctx->sample_fmt = codec->sample_fmts[0];
+    avctx->bit_rate   = bit_rate;
+    avctx->flags     |= AV_CODEC_FLAG_BITEXACT;
+    avctx->time_base  = (AVRational){ 1, avctx->sample_rate };
+    if ((*outfcx)->oformat->flags & AVFMT_GLOBALHEADER)
+        avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if ((error = avcodec_open2(avctx, codec, NULL)) < 0) {
+        fprintf(stderr, "Could not open output codec (error '%s')\n", av_err2str(error));
+        goto cleanup;
+    }
+
+    stream->time_base = avctx->time_base;
+    if ((error = avcodec_parameters_from_context(stream->codecpar, avctx)) < 0) {
+        fprintf(stderr, "Could not initialize stream parameters\n");
+        goto cleanup;
+    }
+
+    *outccx = avctx;
+    return 0;
+
+cleanup:
+    avcodec_free_context(&avctx);
+    avio_closep(&(*outfcx)->pb);
+    avformat_free_context(*outfcx);
+    *outfcx = NULL;
+    return error;
+}
+
+/**
+ * Encode one frame (NULL to flush) and write all packets it gives.
+ * @return Error code (0 if successful)
+ */
+static int encode_and_write(AVFrame *frame, AVFormatContext *outfcx, AVCodecContext *outccx, AVPacket *pkt)
+{
+    int error;
+
+    if ((error = avcodec_send_frame(outccx, frame)) < 0) {
+        fprintf(stderr, "Could not send frame for encoding (error '%s')\n", av_err2str(error));
+        return error;
+    }
+    while ((error = avcodec_receive_packet(outccx, pkt)) >= 0) {
+        pkt->stream_index = 0;
+        av_packet_rescale_ts(pkt, outccx->time_base, outfcx->streams[0]->time_base);
+        if ((error = av_write_frame(outfcx, pkt)) < 0) {
+            fprintf(stderr, "Could not write frame (error '%s')\n", av_err2str(error));
+            av_packet_unref(pkt);
+            return error;
+        }
+        av_packet_unref(pkt);
+    }
+    return error == AVERROR(EAGAIN) || error == AVERROR_EOF ? 0 : error;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s seed] [-S silence|tone|noise|speech] [-c codec] [-r rate] [-C channels] [-d seconds] [-b bitrate] <output file>\n", prog);
+    fprintf(stderr, "  codec: mp2 mp3 aac opus flac, or an encoder name; defaults: -s 1 -S tone -c mp3 -r 44100 -C 2 -d 10\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    AVFormatContext *outfcx = NULL;
+    AVCodecContext *outccx = NULL;
+    AVFrame *frame = NULL;
+    AVPacket *pkt = NULL;
+    const AVCodec *codec;
+    const char *codec_name = "mp3", *encoder_name;
+    enum signal signal = SIG_TONE;
+    uint64_t seed = 1;
+    int rate = 44100, channels = 2;
+    double seconds = 10;
+    int64_t bit_rate = -1, total, done;
+    struct gen g;
+    float v[8];
+    int opt, i, ch, frame_size;
+    int ret = 1;
+
+    while ((opt = getopt(argc, argv, "s:S:c:r:C:d:b:")) != -1) {
+        switch (opt) {
+        case 's': seed       = strtoull(optarg, NULL, 0); break;
+        case 'c': codec_name = optarg;                   break;
+        case 'r': rate       = atoi(optarg);             break;
+        case 'C': channels   = atoi(optarg);             break;
+        case 'd': seconds    = atof(optarg);             break;
+        case 'b': bit_rate   = atoll(optarg);            break;
+        case 'S':
+            for (i = 0; i < FF_ARRAY_ELEMS(signal_names); i++)
+                if (!strcmp(optarg, signal_names[i]))
+                    break;
+            if (i == FF_ARRAY_ELEMS(signal_names))
+                usage(argv[0]);
+            signal = i;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1 || rate < 1000 || channels < 1 || channels > 8 || seconds <= 0)
+        usage(argv[0]);
+
+    encoder_name = codec_name;
+    for (i = 0; i < FF_ARRAY_ELEMS(codecs); i++) {
+        if (!strcmp(codec_name, codecs[i].name)) {
+            encoder_name = codecs[i].encoder;
+            if (bit_rate < 0)
+                bit_rate = codecs[i].bit_rate * FFMAX(channels, 2) / 2;
+            break;
+        }
+    }
+    if (!(codec = avcodec_find_encoder_by_name(encoder_name))) {
+        fprintf(stderr, "Could not find encoder '%s'\n", encoder_name);
+        return 1;
+    }
+    if (bit_rate < 0)
+        bit_rate = 0;
+    /* MP3 tops out at 320 kbit/s and MP2 at 384 kbit/s. */
+    if (!strcmp(codec_name, "mp3"))
+        bit_rate = FFMIN(bit_rate, 320000);
+    else if (!strcmp(codec_name, "mp2"))
+        bit_rate = FFMIN(bit_rate, 384000);
+
+    if (open_output_file(argv[optind], codec, rate, channels, bit_rate, &outfcx, &outccx))
+        goto cleanup;
+    /* Generate at the rate and channel count actually encoded, so that
+     * the seed gives the same signal whatever had to be adjusted. */
+    gen_init(&g, signal, outccx->sample_rate, outccx->ch_layout.nb_channels, seed);
+
+    frame_size = outccx->frame_size ? outccx->frame_size : DEFAULT_FRAME_SIZE;
+    if (!(frame = av_frame_alloc()) || !(pkt = av_packet_alloc())) {
+        fprintf(stderr, "Could not allocate frame or packet\n");
+        goto cleanup;
+    }
+    frame->format      = outccx->sample_fmt;
+    frame->sample_rate = outccx->sample_rate;
+    frame->nb_samples  = frame_size;
+    av_channel_layout_copy(&frame->ch_layout, &outccx->ch_layout);
+    if (av_frame_get_buffer(frame, 0) < 0) {
+        fprintf(stderr, "Could not allocate frame samples\n");
+        goto cleanup;
+    }
+
+    if (avformat_write_header(outfcx, NULL) < 0) {
+        fprintf(stderr, "Could not write output file header\n");
+        goto cleanup;
+    }
+
+    total = llrint(seconds * outccx->sample_rate);
+    for (done = 0; done < total; done += frame->nb_samples) {
+        if (av_frame_make_writable(frame) < 0)
+            goto cleanup;
+        /* The last frame may be short, unless the encoder insists on
+         * full frames; then it is padded with silence. */
+        frame->nb_samples = FFMIN(frame_size, total - done);
+        if (frame->nb_samples < frame_size &&
+            !(codec->capabilities & (AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE)))
+            frame->nb_samples = frame_size;
+        for (i = 0; i < frame->nb_samples; i++) {
+            if (done + i < total)
+                gen_sample(&g, v);
+            else
+                memset(v, 0, sizeof(v));
+            for (ch = 0; ch < g.channels; ch++)
+                store_sample(frame, ch, i, v[ch]);
+        }
+        frame->pts = done;
+        if (encode_and_write(frame, outfcx, outccx, pkt) < 0)
+            goto cleanup;
+    }
+    if (encode_and_write(NULL, outfcx, outccx, pkt) < 0)
+        goto cleanup;
+
+    if (av_write_trailer(outfcx) < 0) {
+        fprintf(stderr, "Could not write output file trailer\n");
+        goto cleanup;
+    }
+    ret = 0;
+
+cleanup:
+    av_packet_free(&pkt);
+    av_frame_free(&frame);
+    avcodec_free_context(&outccx);
+    if (outfcx) {
+        avio_closep(&outfcx->pb);
+        avformat_free_context(outfcx);
+    }
+    return ret;
+}
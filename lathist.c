@@ -0,0 +1,64 @@
+/*
+ * lathist.c: see lathist.h.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "lathist.h"
+
+static int bucket(int64_t v)
+{
+    int shift;
+
+    if (v < 2 * LATHIST_SUB)
+        return v;
+    if (v >= INT64_C(1) << LATHIST_BITS)
+        return LATHIST_BUCKETS - 1;
+    /* Shift the value down into [LATHIST_SUB, 2 * LATHIST_SUB). */
+    shift = 63 - __builtin_clzll(v) - LATHIST_SUB_BITS;
+    return 2 * LATHIST_SUB + (shift - 1) * LATHIST_SUB + (int)(v >> shift) - LATHIST_SUB;
+}
+
+static int64_t bucket_top(int b)
+{
+    int shift;
+
+    if (b < 2 * LATHIST_SUB)
+        return b;
+    b    -= 2 * LATHIST_SUB;
+    shift = b / LATHIST_SUB + 1;
+    return ((int64_t)(LATHIST_SUB + b % LATHIST_SUB) << shift) + (INT64_C(1) << shift) - 1;
+}
+
+void lathist_reset(struct lathist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void lathist_record(struct lathist *h, int64_t value)
+{
+    if (value < 0)
+        value = 0;
+    h->counts[bucket(value)]++;
+    h->count++;
+    if (value > h->max)
+        h->max = value;
+}
+
+int64_t lathist_percentile(const struct lathist *h, double pct)
+{
+    uint64_t want, seen = 0;
+    int b;
+
+    if (!h->count)
+        return 0;
+    want = ceil(pct / 100 * h->count);
+    if (want < 1)
+        want = 1;
+    for (b = 0; b < LATHIST_BUCKETS; b++)
+        if ((seen += h->counts[b]) >= want)
+            break;
+    /* The last bucket also holds whatever was clamped. */
+    return b < LATHIST_BUCKETS - 1 && bucket_top(b) < h->max ? bucket_top(b) : h->max;
+}
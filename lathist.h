@@ -0,0 +1,45 @@
+/*
+ * lathist.h: latency histograms in the manner of HdrHistogram.
+ *
+ * Values below LATHIST_SUB * 2 are counted exactly; above, every power of
+ * two is split into LATHIST_SUB buckets, so a value is known to within
+ * 1/LATHIST_SUB (about two significant digits) whatever its size. That
+ * keeps p99.9 and the maximum as meaningful as the median, at a fixed
+ * size and a few instructions per value.
+ */
+
+#ifndef LATHIST_H
+#define LATHIST_H
+
+#include <stdint.h>
+
+/* Buckets per power of two */
+#define LATHIST_SUB_BITS 6
+#define LATHIST_SUB (1 << LATHIST_SUB_BITS)
+/* Values counted without clamping are below 2^LATHIST_BITS */
+#define LATHIST_BITS 32
+#define LATHIST_BUCKETS ((LATHIST_BITS - LATHIST_SUB_BITS + 1) * LATHIST_SUB)
+
+struct lathist {
+    uint32_t counts[LATHIST_BUCKETS];
+    uint64_t count;
+    int64_t max;
+};
+
+void lathist_reset(struct lathist *h);
+
+/**
+ * Count a value; negative ones count as 0, ones beyond the range as the
+ * largest bucket (max stays exact).
+ */
+void lathist_record(struct lathist *h, int64_t value);
+
+/**
+ * Value at a percentile.
+ * @param pct Percentile, 0 to 100
+ * @return The largest value in the bucket the percentile falls in, no
+ *         more than the maximum; 0 if nothing was counted
+ */
+int64_t lathist_percentile(const struct lathist *h, double pct);
+
+#endif /* LATHIST_H */
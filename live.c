@@ -0,0 +1,219 @@
+/*
+ * live.c: see live.h.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "fastopen.h"
+#include "live.h"
+
+struct live {
+    AVFormatContext *fcx;
+    int64_t budget;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* a packet came, or the reader finished */
+    /* Oldest first, with when each was demuxed */
+    AVPacket *queue[LIVE_QUEUE];
+    int64_t when[LIVE_QUEUE];
+    int head, count;
+    int done;               /* the reader thread has finished ... */
+    int error;              /* ... with this, AVERROR_EOF at the end */
+    atomic_int stop;        /* read by live_interrupt without the lock */
+    int64_t arrival;
+    struct live_stats st;
+};
+
+static void wake(int sig)
+{
+    (void)sig;
+}
+
+static void *reader(void *arg)
+{
+    struct live *lv = arg;
+    AVPacket *pkt;
+    int error;
+
+    for (;;) {
+        if (!(pkt = av_packet_alloc())) {
+            error = AVERROR(ENOMEM);
+            break;
+        }
+        if ((error = fastopen_read_frame(lv->fcx, pkt)) < 0) {
+            av_packet_free(&pkt);
+            /* Whatever a read that live_stop broke off returned */
+            if (atomic_load(&lv->stop))
+                error = AVERROR_EXIT;
+            break;
+        }
+
+        pthread_mutex_lock(&lv->lock);
+        if (atomic_load(&lv->stop)) {
+            pthread_mutex_unlock(&lv->lock);
+            av_packet_free(&pkt);
+            error = AVERROR_EXIT;
+            break;
+        }
+        if (lv->count == LIVE_QUEUE) {
+            av_packet_free(&lv->queue[lv->head]);
+            lv->head = (lv->head + 1) % LIVE_QUEUE;
+            lv->count--;
+            lv->st.overflow++;
+        }
+        lv->queue[(lv->head + lv->count) % LIVE_QUEUE] = pkt;
+        lv->when[(lv->head + lv->count) % LIVE_QUEUE]  = av_gettime_relative();
+        lv->count++;
+        lv->st.packets++;
+        pthread_cond_signal(&lv->cond);
+        pthread_mutex_unlock(&lv->lock);
+    }
+
+    pthread_mutex_lock(&lv->lock);
+    lv->error = error;
+    lv->done  = 1;
+    pthread_cond_signal(&lv->cond);
+    pthread_mutex_unlock(&lv->lock);
+    return NULL;
+}
+
+int live_interrupt(void *opaque)
+{
+    struct live *const *lv = opaque;
+
+    return *lv && atomic_load(&(*lv)->stop);
+}
+
+int live_start(struct live **lv, AVFormatContext *inpfcx, int64_t budget)
+{
+    /* No SA_RESTART: the signal makes a blocked read() fail with EINTR. */
+    const struct sigaction sa = { .sa_handler = wake };
+    pthread_condattr_t attr;
+    struct live *l;
+    int error;
+
+    if (!(l = av_mallocz(sizeof(*l))))
+        return AVERROR(ENOMEM);
+    l->fcx    = inpfcx;
+    l->budget = budget;
+    pthread_mutex_init(&l->lock, NULL);
+    /* Timeouts on the clock av_gettime_relative() uses. */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&l->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    sigaction(LIVE_SIGNAL, &sa, NULL);
+    /* Where live_interrupt looks, before the reader can call it */
+    *lv = l;
+    if ((error = pthread_create(&l->thread, NULL, reader, l))) {
+        fprintf(stderr, "Could not start the live input thread\n");
+        *lv = NULL;
+        pthread_cond_destroy(&l->cond);
+        pthread_mutex_destroy(&l->lock);
+        av_free(l);
+        return AVERROR(error);
+    }
+    return 0;
+}
+
+int live_wait(struct live *lv, int64_t timeout)
+{
+    struct timespec ts;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    timeout = FFMAX(timeout, 0) + ts.tv_nsec / 1000;
+    ts.tv_sec  += timeout / 1000000;
+    ts.tv_nsec  = timeout % 1000000 * 1000;
+
+    pthread_mutex_lock(&lv->lock);
+    while (!lv->count && !lv->done)
+        if (pthread_cond_timedwait(&lv->cond, &lv->lock, &ts) == ETIMEDOUT)
+            break;
+    ret = lv->count ? 1 : lv->done ? lv->error : 0;
+    pthread_mutex_unlock(&lv->lock);
+    return ret;
+}
+
+int live_read(struct live *lv, AVPacket *pkt)
+{
+    const int64_t now = av_gettime_relative();
+    int ret = 0;
+
+    pthread_mutex_lock(&lv->lock);
+    /* Catch up by dropping what waited too long, but keep the newest so
+     * that there is always something to go on with. */
+    while (lv->count > 1 && now - lv->when[lv->head] > lv->budget) {
+        av_packet_free(&lv->queue[lv->head]);
+        lv->head = (lv->head + 1) % LIVE_QUEUE;
+        lv->count--;
+        lv->st.late++;
+    }
+    if (lv->count) {
+        av_packet_move_ref(pkt, lv->queue[lv->head]);
+        av_packet_free(&lv->queue[lv->head]);
+        lv->arrival = lv->when[lv->head];
+        lv->head    = (lv->head + 1) % LIVE_QUEUE;
+        lv->count--;
+    } else
+        ret = lv->done ? lv->error : AVERROR(EAGAIN);
+    pthread_mutex_unlock(&lv->lock);
+    return ret;
+}
+
+int64_t live_arrival(const struct live *lv)
+{
+    return lv->arrival;
+}
+
+void live_stats(struct live *lv, struct live_stats *st)
+{
+    pthread_mutex_lock(&lv->lock);
+    *st = lv->st;
+    pthread_mutex_unlock(&lv->lock);
+}
+
+void live_stop(struct live **lv)
+{
+    struct live *l = *lv;
+
+    if (!l)
+        return;
+    atomic_store(&l->stop, 1);
+    /* A pipe read blocks until the writer sends something or goes away;
+     * don't wait for either. The signal breaks the read off, and the
+     * interrupt callback then keeps libavformat from retrying it. One
+     * that comes just before the read is lost, so send it until the
+     * reader has finished. */
+    pthread_mutex_lock(&l->lock);
+    while (!l->done) {
+        struct timespec ts;
+
+        pthread_kill(l->thread, LIVE_SIGNAL);
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_nsec += LIVE_STOP_RETRY * 1000;
+        ts.tv_sec  += ts.tv_nsec / 1000000000;
+        ts.tv_nsec %= 1000000000;
+        pthread_cond_timedwait(&l->cond, &l->lock, &ts);
+    }
+    pthread_mutex_unlock(&l->lock);
+    pthread_join(l->thread, NULL);
+
+    while (l->count) {
+        av_packet_free(&l->queue[l->head]);
+        l->head = (l->head + 1) % LIVE_QUEUE;
+        l->count--;
+    }
+    pthread_cond_destroy(&l->cond);
+    pthread_mutex_destroy(&l->lock);
+    av_freep(lv);
+}
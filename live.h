@@ -0,0 +1,88 @@
+/*
+ * live.h: live input for tmp30 (-l option).
+ *
+ * A pipe or FIFO is demuxed on a thread of its own, so that a stalled
+ * input never holds up the encoder and muxer: the transcode waits for a
+ * packet for at most its latency budget and then writes what it has,
+ * padded with silence. Packets that have waited longer than the budget
+ * by the time they are taken (the transcode fell behind) are dropped,
+ * and so are the oldest when the queue is full.
+ */
+
+#ifndef LIVE_H
+#define LIVE_H
+
+#include <signal.h>
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+/* Packets queued between the reader thread and the transcode at most */
+#define LIVE_QUEUE 64
+
+/* Sent to the reader thread to break off a blocked read, and how often,
+ * in microseconds, until it has finished */
+#define LIVE_SIGNAL     SIGUSR2
+#define LIVE_STOP_RETRY 10000
+
+struct live_stats {
+    uint64_t packets;       /* demuxed */
+    uint64_t late;          /* dropped for having waited too long */
+    uint64_t overflow;      /* dropped for a full queue */
+};
+
+struct live;
+
+/**
+ * Interrupt callback of the input (AVFormatContext.interrupt_callback),
+ * which must be set before avformat_open_input for the protocol to take
+ * it: true once live_stop has begun. Input read through xio.h (mmap,
+ * readahead) doesn't call it, but is a regular file, whose reads don't
+ * block.
+ * @param opaque Where live_start puts the state, a struct live **
+ */
+int live_interrupt(void *opaque);
+
+/**
+ * Start demuxing an opened input on a thread of its own. Nothing else
+ * may read from the input until live_stop. Installs a handler for
+ * LIVE_SIGNAL.
+ * @param inpfcx Format context of the input, with live_interrupt as its
+ *               interrupt callback, whose opaque is lv
+ * @param budget Latency budget in microseconds
+ * @return Error code (0 if successful)
+ */
+int live_start(struct live **lv, AVFormatContext *inpfcx, int64_t budget);
+
+/**
+ * Wait for a packet.
+ * @param timeout Microseconds to wait at most
+ * @return 1 if a packet can be read, 0 if none came in time, AVERROR_EOF
+ *         at the end of the input, another error code if reading failed
+ */
+int live_wait(struct live *lv, int64_t timeout);
+
+/**
+ * Take the oldest packet without waiting. Late ones are dropped.
+ * @return 0 if successful, AVERROR(EAGAIN) if there is none, AVERROR_EOF
+ *         at the end of the input, another error code if reading failed
+ */
+int live_read(struct live *lv, AVPacket *pkt);
+
+/**
+ * When the packet live_read returned last was demuxed, in
+ * av_gettime_relative() time.
+ */
+int64_t live_arrival(const struct live *lv);
+
+void live_stats(struct live *lv, struct live_stats *st);
+
+/**
+ * Stop the reader thread, breaking off a read it is blocked in with
+ * LIVE_SIGNAL and live_interrupt, wait for it, and free the queue. The
+ * input is left open.
+ */
+void live_stop(struct live **lv);
+
+#endif /* LIVE_H */
@@ -0,0 +1,538 @@
+/*
+ * loud.c: see loud.h.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include <libswresample/swresample.h>
+
+#include "loud.h"
+
+#define STEPS_M   4      /* 100 ms steps in a 400 ms block */
+#define STEPS_ST  30     /* ... in the 3 s short-term window */
+#define HIST_BINS 1000   /* 0.1 LU bins of block loudness from -70 LUFS */
+#define ABS_GATE  -70.0  /* LUFS */
+#define REL_GATE  10.0   /* LU below the ungated mean, for integrated */
+/* Dynamic mode: steps more than this below the integrated loudness so far
+ * keep the gain of the step before them, so pauses are not pulled up. */
+#define DYN_GATE  20.0
+/* Dynamic mode: largest gain, dB. */
+#define MAX_BOOST 24.0
+
+struct biquad {
+    double b0, b1, b2, a1, a2;
+};
+
+/* One 100 ms step waiting in the dynamic mode's lookahead. */
+struct step {
+    int len;
+    float peak;
+    double want;    /* gain its short-term loudness asks for, dB */
+};
+
+struct loud {
+    struct loud_opts o;
+    int channels, rate;
+    double *weight;             /* per channel; 0 leaves LFE out */
+    struct biquad shelf, hpass; /* K-weighting */
+    double (*z)[4];             /* filter state per channel */
+
+    /* Meter, in 100 ms steps */
+    int sub_len;                /* samples per step */
+    int sub_n;                  /* samples in the current step so far */
+    double sub_sum;             /* weighted sum of squares of the current step */
+    float sub_peak;
+    double sub[STEPS_ST];       /* mean square of the last steps */
+    int64_t nb_steps;           /* steps completed */
+    uint64_t hist_n[HIST_BINS]; /* 400 ms blocks by loudness */
+    double hist_e[HIST_BINS];   /* and their summed mean squares */
+    float peak;
+
+    /* Output */
+    SwrContext *swr;            /* float to the FIFO's format, NULL if fltp */
+    enum AVSampleFormat out_fmt;
+    uint8_t **conv;
+    int conv_size;
+    double gain;                /* linear, at the end of the last released step */
+    double gain_min, gain_max;  /* dB, as applied */
+
+    /* Dynamic: samples of the steps not yet released, one slot each */
+    int lookahead;              /* steps */
+    int nb_slots;
+    float **ring;
+    float **slot;               /* pointers into ring for one step */
+    struct step *steps;
+    int64_t released;
+
+    /* Two-pass */
+    FILE *spill;
+    int replay;                 /* the spill is being played back */
+    float **buf;
+    int buf_size;
+};
+
+static double energy_to_lufs(double e)
+{
+    return -0.691 + 10 * log10(e);
+}
+
+/*
+ * The two K-weighting stages of BS.1770 (high shelf, then high pass),
+ * recomputed for the sample rate from their analog prototypes, the same
+ * way as libebur128 does.
+ */
+static void init_kweighting(struct loud *ld)
+{
+    double f0 = 1681.974450955533, g = 3.999843853973347, q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / ld->rate);
+    double vh = pow(10, g / 20), vb = pow(vh, 0.4996667741545416);
+    double a0 = 1 + k / q + k * k;
+
+    ld->shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    ld->shelf.b1 = 2 * (k * k - vh) / a0;
+    ld->shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    ld->shelf.a1 = 2 * (k * k - 1) / a0;
+    ld->shelf.a2 = (1 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q  = 0.5003270373238773;
+    k  = tan(M_PI * f0 / ld->rate);
+    a0 = 1 + k / q + k * k;
+    ld->hpass.b0 = 1;
+    ld->hpass.b1 = -2;
+    ld->hpass.b2 = 1;
+    ld->hpass.a1 = 2 * (k * k - 1) / a0;
+    ld->hpass.a2 = (1 - k / q + k * k) / a0;
+}
+
+/* Channel weights of BS.1770: surrounds count 1.41, LFE not at all. */
+static double channel_weight(enum AVChannel ch)
+{
+    switch (ch) {
+    case AV_CHAN_LOW_FREQUENCY:
+    case AV_CHAN_LOW_FREQUENCY_2:
+        return 0;
+    case AV_CHAN_SIDE_LEFT:
+    case AV_CHAN_SIDE_RIGHT:
+    case AV_CHAN_BACK_LEFT:
+    case AV_CHAN_BACK_RIGHT:
+        return 1.41;
+    default:
+        return 1;
+    }
+}
+
+/* Integrated loudness of the blocks so far, -HUGE_VAL without any. */
+static double integrated(const struct loud *ld)
+{
+    double e = 0;
+    uint64_t n = 0;
+    int i, first;
+
+    for (i = 0; i < HIST_BINS; i++) {
+        n += ld->hist_n[i];
+        e += ld->hist_e[i];
+    }
+    if (!n)
+        return -HUGE_VAL;
+    first = ceil((energy_to_lufs(e / n) - REL_GATE - ABS_GATE) * 10);
+    e = n = 0;
+    for (i = FFMAX(first, 0); i < HIST_BINS; i++) {
+        n += ld->hist_n[i];
+        e += ld->hist_e[i];
+    }
+    return n ? energy_to_lufs(e / n) : -HUGE_VAL;
+}
+
+/* Filter len samples from off, add their energy and peak to the step. */
+static void meter(struct loud *ld, const float *const *data, int off, int len)
+{
+    const struct biquad *s = &ld->shelf, *h = &ld->hpass;
+    float peak = ld->sub_peak;
+    int ch, i;
+
+    for (ch = 0; ch < ld->channels; ch++) {
+        const float *x = data[ch] + off;
+        double *z = ld->z[ch], sum = 0;
+
+        /* Kept apart from the filter, whose recursion does not vectorize. */
+        for (i = 0; i < len; i++)
+            peak = FFMAX(peak, fabsf(x[i]));
+        if (!ld->weight[ch])
+            continue;
+        for (i = 0; i < len; i++) {
+            double in = x[i], y, o;
+            y    = s->b0 * in + z[0];
+            z[0] = s->b1 * in - s->a1 * y + z[1];
+            z[1] = s->b2 * in - s->a2 * y;
+            o    = h->b0 * y + z[2];
+            z[2] = h->b1 * y - h->a1 * o + z[3];
+            z[3] = h->b2 * y - h->a2 * o;
+            sum += o * o;
+        }
+        ld->sub_sum += ld->weight[ch] * sum;
+    }
+    ld->sub_peak = peak;
+}
+
+/* Close the current step: momentary block into the histogram, and in
+ * dynamic mode the step's wanted gain from the short-term loudness. */
+static void end_step(struct loud *ld)
+{
+    double e = ld->sub_sum / ld->sub_n, m = 0, st = 0;
+    int i, nb;
+
+    ld->sub[ld->nb_steps % STEPS_ST] = e;
+    ld->nb_steps++;
+
+    if (ld->nb_steps >= STEPS_M) {
+        for (i = 1; i <= STEPS_M; i++)
+            m += ld->sub[(ld->nb_steps - i) % STEPS_ST];
+        m /= STEPS_M;
+        if (m > 0 && energy_to_lufs(m) > ABS_GATE) {
+            int bin = FFMIN((int)((energy_to_lufs(m) - ABS_GATE) * 10), HIST_BINS - 1);
+            ld->hist_n[bin]++;
+            ld->hist_e[bin] += m;
+        }
+    }
+    ld->peak = FFMAX(ld->peak, ld->sub_peak);
+
+    if (!ld->o.twopass) {
+        struct step *p = &ld->steps[(ld->nb_steps - 1) % ld->nb_slots];
+        const struct step *prev = ld->nb_steps > 1 ? &ld->steps[(ld->nb_steps - 2) % ld->nb_slots] : NULL;
+        double l, gate = FFMAX(integrated(ld) - DYN_GATE, ABS_GATE);
+
+        nb = FFMIN(ld->nb_steps, STEPS_ST);
+        for (i = 1; i <= nb; i++)
+            st += ld->sub[(ld->nb_steps - i) % STEPS_ST];
+        l = st > 0 ? energy_to_lufs(st / nb) : -HUGE_VAL;
+        p->len  = ld->sub_n;
+        p->peak = ld->sub_peak;
+        if (l > gate)
+            p->want = av_clipd(ld->o.target - l, -MAX_BOOST, MAX_BOOST);
+        else
+            p->want = prev ? prev->want : 0;
+    }
+
+    ld->sub_n    = 0;
+    ld->sub_sum  = 0;
+    ld->sub_peak = 0;
+}
+
+/* Gain ramping from g0 to g1 over len samples, in place. */
+static void apply_gain(float **data, int channels, int len, double g0, double g1)
+{
+    float step = (g1 - g0) / len;
+    int ch, i;
+
+    for (ch = 0; ch < channels; ch++) {
+        float *x = data[ch];
+        for (i = 0; i < len; i++)
+            x[i] *= (float)g0 + step * i;
+    }
+}
+
+static int put_samples(struct loud *ld, AVAudioFifo *fifo, float **data, int len)
+{
+    void **out = (void **)data;
+    int error;
+
+    if (ld->swr) {
+        if (len > ld->conv_size) {
+            if (ld->conv)
+                av_freep(&ld->conv[0]);
+            av_freep(&ld->conv);
+            ld->conv_size = 0;
+            if ((error = av_samples_alloc_array_and_samples(&ld->conv, NULL, ld->channels, len, ld->out_fmt, 0)) < 0)
+                return error;
+            ld->conv_size = len;
+        }
+        if ((error = swr_convert(ld->swr, ld->conv, len, (const uint8_t **)data, len)) < 0) {
+            fprintf(stderr, "Could not convert normalized samples (error '%s')\n", av_err2str(error));
+            return error;
+        }
+        out = (void **)ld->conv;
+    }
+    if (av_audio_fifo_write(fifo, out, len) < len) {
+        fprintf(stderr, "Could not write data to FIFO\n");
+        return AVERROR_EXIT;
+    }
+    return 0;
+}
+
+static void note_gain(struct loud *ld, double g)
+{
+    double db = 20 * log10(g);
+
+    ld->gain_min = FFMIN(ld->gain_min, db);
+    ld->gain_max = FFMAX(ld->gain_max, db);
+}
+
+/*
+ * Release the oldest step of the lookahead: its gain is the mean of what
+ * the steps from it to the end of the lookahead want, lowered so that
+ * neither it nor the next step goes over the ceiling. The gain ramps
+ * linearly from the previous step's, which was already held below this
+ * step's peak, so no sample in between goes over either.
+ */
+static int release_step(struct loud *ld, AVAudioFifo *fifo)
+{
+    const int64_t k = ld->released;
+    const struct step *p = &ld->steps[k % ld->nb_slots];
+    double ceiling = pow(10, ld->o.ceiling / 20), want = 0, g, g0;
+    int64_t j, last = FFMIN(ld->nb_steps - 1, k + ld->lookahead);
+    int ch, error;
+
+    for (j = k; j <= last; j++)
+        want += ld->steps[j % ld->nb_slots].want;
+    g = pow(10, want / (last - k + 1) / 20);
+    if (p->peak > 0)
+        g = FFMIN(g, ceiling / p->peak);
+    if (k + 1 < ld->nb_steps && ld->steps[(k + 1) % ld->nb_slots].peak > 0)
+        g = FFMIN(g, ceiling / ld->steps[(k + 1) % ld->nb_slots].peak);
+    g0 = k ? ld->gain : g;
+
+    for (ch = 0; ch < ld->channels; ch++)
+        ld->slot[ch] = ld->ring[ch] + (k % ld->nb_slots) * ld->sub_len;
+    apply_gain(ld->slot, ld->channels, p->len, g0, g);
+    if ((error = put_samples(ld, fifo, ld->slot, p->len)) < 0)
+        return error;
+    ld->gain = g;
+    note_gain(ld, g);
+    ld->released++;
+    return p->len;
+}
+
+int loud_parse(const char *spec, struct loud_opts *o)
+{
+    const char *p = spec;
+    char *end;
+
+    o->target    = strtod(p, &end);
+    o->ceiling   = -1;
+    o->lookahead = 3;
+    o->twopass   = 0;
+    if (end == p)
+        goto fail;
+    for (p = end; *p == ':'; p = end) {
+        p++;
+        if (!strncmp(p, "tp", 2))
+            o->ceiling = strtod(p + 2, &end);
+        else if (!strncmp(p, "la", 2))
+            o->lookahead = strtod(p + 2, &end);
+        else if (!strncmp(p, "2pass", 5))
+            o->twopass = 1, end = (char *)p + 5;
+        else
+            goto fail;
+        if (end == p)
+            goto fail;
+    }
+    if (*p || o->target < ABS_GATE || o->target > 0 || o->ceiling > 0 ||
+        o->lookahead < 0.1 || o->lookahead > LOUD_MAX_LOOKAHEAD)
+        goto fail;
+    return 0;
+
+fail:
+    fprintf(stderr, "Invalid loudness setting '%s', expected <LUFS>[:tp<dBFS>][:la<seconds>][:2pass] "
+            "(LUFS -70..0, lookahead up to %d s)\n", spec, LOUD_MAX_LOOKAHEAD);
+    return AVERROR(EINVAL);
+}
+
+int loud_alloc(struct loud **ld, const struct loud_opts *o,
+               const AVChannelLayout *layout, int rate, enum AVSampleFormat out_fmt)
+{
+    struct loud *l;
+    int ch, error;
+
+    if (!(l = av_mallocz(sizeof(*l))))
+        return AVERROR(ENOMEM);
+    *ld = l;
+    l->o        = *o;
+    l->channels = layout->nb_channels;
+    l->rate     = rate;
+    l->sub_len  = FFMAX(rate / 10, 1);
+    l->out_fmt  = out_fmt;
+    l->gain     = 1;
+    l->gain_min = HUGE_VAL;
+    l->gain_max = -HUGE_VAL;
+    init_kweighting(l);
+
+    if (!(l->weight = av_calloc(l->channels, sizeof(*l->weight))) ||
+        !(l->z = av_calloc(l->channels, sizeof(*l->z))))
+        goto nomem;
+    for (ch = 0; ch < l->channels; ch++)
+        l->weight[ch] = channel_weight(av_channel_layout_channel_from_index(layout, ch));
+
+    if (out_fmt != AV_SAMPLE_FMT_FLTP) {
+        if ((error = swr_alloc_set_opts2(&l->swr, layout, out_fmt, rate, layout, AV_SAMPLE_FMT_FLTP, rate, 0, NULL)) < 0 ||
+            (error = swr_init(l->swr)) < 0) {
+            fprintf(stderr, "Could not open loudness output conversion\n");
+            goto fail;
+        }
+    }
+
+    if (o->twopass) {
+        if (!(l->spill = tmpfile())) {
+            error = AVERROR(errno);
+            fprintf(stderr, "Could not create loudness spill file (error '%s')\n", av_err2str(error));
+            goto fail;
+        }
+        if (!(l->buf = av_calloc(l->channels, sizeof(*l->buf))))
+            goto nomem;
+    } else {
+        l->lookahead = FFMAX(lrint(o->lookahead * 10), 1);
+        l->nb_slots  = l->lookahead + 2;
+        if (!(l->steps = av_calloc(l->nb_slots, sizeof(*l->steps))) ||
+            !(l->ring = av_calloc(l->channels, sizeof(*l->ring))) ||
+            !(l->slot = av_calloc(l->channels, sizeof(*l->slot))))
+            goto nomem;
+        for (ch = 0; ch < l->channels; ch++)
+            if (!(l->ring[ch] = av_malloc_array((size_t)l->nb_slots * l->sub_len, sizeof(float))))
+                goto nomem;
+    }
+    return 0;
+
+nomem:
+    error = AVERROR(ENOMEM);
+fail:
+    loud_free(ld);
+    return error;
+}
+
+int loud_write(struct loud *ld, const float *const *data, int nb_samples, AVAudioFifo *fifo)
+{
+    int done = 0, ch, error;
+
+    if (ld->o.twopass) {
+        if (fwrite(&nb_samples, sizeof(nb_samples), 1, ld->spill) != 1)
+            goto write_error;
+        for (ch = 0; ch < ld->channels; ch++)
+            if (fwrite(data[ch], sizeof(float), nb_samples, ld->spill) != nb_samples)
+                goto write_error;
+    }
+
+    while (done < nb_samples) {
+        int len = FFMIN(nb_samples - done, ld->sub_len - ld->sub_n);
+
+        meter(ld, data, done, len);
+        if (!ld->o.twopass) {
+            size_t at = (ld->nb_steps % ld->nb_slots) * ld->sub_len + ld->sub_n;
+            for (ch = 0; ch < ld->channels; ch++)
+                memcpy(ld->ring[ch] + at, data[ch] + done, len * sizeof(float));
+        }
+        ld->sub_n += len;
+        done      += len;
+        if (ld->sub_n == ld->sub_len) {
+            end_step(ld);
+            while (!ld->o.twopass && ld->nb_steps - ld->released > ld->lookahead)
+                if ((error = release_step(ld, fifo)) < 0)
+                    return error;
+        }
+    }
+    return 0;
+
+write_error:
+    fprintf(stderr, "Could not write loudness spill file\n");
+    return AVERROR(EIO);
+}
+
+int loud_flush(struct loud *ld, AVAudioFifo *fifo, int want)
+{
+    int moved = 0, n, ch, error;
+
+    if (ld->sub_n)
+        end_step(ld);
+
+    if (!ld->o.twopass) {
+        while (moved < want && ld->released < ld->nb_steps) {
+            if ((n = release_step(ld, fifo)) < 0)
+                return n;
+            moved += n;
+        }
+        return moved;
+    }
+
+    if (!ld->replay) {
+        double i = integrated(ld);
+
+        ld->gain = i > -HUGE_VAL ? pow(10, (ld->o.target - i) / 20) : 1;
+        if (ld->peak > 0)
+            ld->gain = FFMIN(ld->gain, pow(10, ld->o.ceiling / 20) / ld->peak);
+        note_gain(ld, ld->gain);
+        rewind(ld->spill);
+        ld->replay = 1;
+    }
+    while (moved < want) {
+        if (fread(&n, sizeof(n), 1, ld->spill) != 1) {
+            if (ferror(ld->spill))
+                goto read_error;
+            break;
+        }
+        if (n > ld->buf_size) {
+            for (ch = 0; ch < ld->channels; ch++) {
+                av_freep(&ld->buf[ch]);
+                if (!(ld->buf[ch] = av_malloc_array(n, sizeof(float))))
+                    return AVERROR(ENOMEM);
+            }
+            ld->buf_size = n;
+        }
+        for (ch = 0; ch < ld->channels; ch++)
+            if (fread(ld->buf[ch], sizeof(float), n, ld->spill) != n)
+                goto read_error;
+        apply_gain(ld->buf, ld->channels, n, ld->gain, ld->gain);
+        if ((error = put_samples(ld, fifo, ld->buf, n)) < 0)
+            return error;
+        moved += n;
+    }
+    return moved;
+
+read_error:
+    fprintf(stderr, "Could not read loudness spill file\n");
+    return AVERROR(EIO);
+}
+
+void loud_report(const struct loud *ld, FILE *f)
+{
+    fprintf(f, "Loudness: input %.1f LUFS, peak %.1f dBFS, ", integrated(ld), 20 * log10(ld->peak));
+    if (ld->o.twopass)
+        fprintf(f, "gain %.1f dB (two-pass)\n", ld->gain_max);
+    else
+        fprintf(f, "gain %.1f to %.1f dB (dynamic, %.1f s lookahead)\n",
+                ld->gain_min, ld->gain_max, ld->lookahead / 10.0);
+}
+
+void loud_free(struct loud **ld)
+{
+    struct loud *l = *ld;
+    int ch;
+
+    if (!l)
+        return;
+    for (ch = 0; ch < l->channels; ch++) {
+        if (l->ring)
+            av_freep(&l->ring[ch]);
+        if (l->buf)
+            av_freep(&l->buf[ch]);
+    }
+    av_freep(&l->ring);
+    av_freep(&l->slot);
+    av_freep(&l->buf);
+    av_freep(&l->steps);
+    av_freep(&l->weight);
+    av_freep(&l->z);
+    if (l->conv)
+        av_freep(&l->conv[0]);
+    av_freep(&l->conv);
+    swr_free(&l->swr);
+    if (l->spill)
+        fclose(l->spill);
+    av_freep(ld);
+}
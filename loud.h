@@ -0,0 +1,87 @@
+/*
+ * loud.h: EBU R128 loudness normalization stage for tmp30.
+ *
+ * Sits between the resampler and the FIFO. The resampler hands it planar
+ * float at the output rate and layout; it measures the K-weighted
+ * loudness (ITU-R BS.1770: 400 ms blocks every 100 ms, 3 s short-term,
+ * gated integrated), applies a gain and passes the samples on to the FIFO
+ * in the encoder's sample format.
+ *
+ * Two modes:
+ *  - dynamic: one pass. Samples are held back by the lookahead (at most
+ *    LOUD_MAX_LOOKAHEAD seconds); the gain of each 100 ms step follows
+ *    the short-term loudness of the lookahead window ahead of it and is
+ *    lowered early enough that no sample goes over the peak ceiling.
+ *  - two-pass: the decoded samples are measured and spilled to an
+ *    unlinked temporary file; when the input ends the integrated loudness
+ *    gives one gain for the whole file (held below the peak ceiling) and
+ *    the spill is played back through it. The input is decoded once.
+ */
+
+#ifndef LOUD_H
+#define LOUD_H
+
+#include <stdio.h>
+
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+
+/* Upper bound of the dynamic mode's lookahead, in seconds. */
+#define LOUD_MAX_LOOKAHEAD 10
+
+struct loud_opts {
+    double target;    /* integrated loudness to normalize to, LUFS */
+    double ceiling;   /* sample peak ceiling, dBFS */
+    double lookahead; /* seconds, dynamic mode */
+    int twopass;
+};
+
+struct loud;
+
+/**
+ * Parse "<target>[:tp<ceiling>][:la<seconds>][:2pass]", e.g. "-16",
+ * "-23:2pass" or "-16:tp-2:la5". The defaults are a ceiling of -1 dBFS
+ * and a lookahead of 3 seconds.
+ * @return Error code (0 if successful)
+ */
+int loud_parse(const char *spec, struct loud_opts *o);
+
+/**
+ * Set up a loudness stage.
+ * @param[out] ld      Loudness stage
+ * @param      o       Settings
+ * @param      layout  Channel layout of the samples
+ * @param      rate    Sample rate
+ * @param      out_fmt Sample format to write into the FIFO
+ * @return Error code (0 if successful)
+ */
+int loud_alloc(struct loud **ld, const struct loud_opts *o,
+               const AVChannelLayout *layout, int rate, enum AVSampleFormat out_fmt);
+
+/**
+ * Measure and take in nb_samples of planar float. In dynamic mode the
+ * steps that have left the lookahead are moved on into the FIFO.
+ * @param fifo FIFO in the output sample format
+ * @return Error code (0 if successful)
+ */
+int loud_write(struct loud *ld, const float *const *data, int nb_samples, AVAudioFifo *fifo);
+
+/**
+ * At the end of the input, move what is still held back into the FIFO,
+ * a part at a time.
+ * @param fifo FIFO in the output sample format
+ * @param want Stop once at least this many samples were moved
+ * @return Number of samples moved, 0 once everything has been,
+ *         or a negative error code
+ */
+int loud_flush(struct loud *ld, AVAudioFifo *fifo, int want);
+
+/**
+ * Print the measured loudness and the gain that was applied.
+ */
+void loud_report(const struct loud *ld, FILE *f);
+
+void loud_free(struct loud **ld);
+
+#endif /* LOUD_H */
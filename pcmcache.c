@@ -0,0 +1,292 @@
+/*
+ * pcmcache.c: see pcmcache.h.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavcodec/version.h>
+#include <libavformat/version.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+#include <libswresample/swresample.h>
+#include <libswresample/version.h>
+
+#include "pcmcache.h"
+
+/* Version 2 of the layout below */
+#define PCMCACHE_MAGIC "ffpcm\0\0\2"
+/* What the samples depend on besides the input's bytes */
+#define PCMCACHE_PARAMS "pcm flt " LIBAVFORMAT_IDENT " " LIBAVCODEC_IDENT " " LIBSWRESAMPLE_IDENT
+
+struct header {
+    char magic[8];
+    int32_t sample_rate;
+    int32_t channels;
+    int64_t nb_samples;
+    char layout[64];            /* av_channel_layout_describe */
+};
+
+struct pcmcache {
+    struct xcache xc;           /* own copy, the key is the entry's */
+    struct header h;
+    AVChannelLayout layout;
+    int64_t pos;                /* samples read or written */
+    /* Reading */
+    uint8_t *map;
+    size_t map_size;
+    /* Writing */
+    int fd;
+    char tmp[4200];
+    SwrContext *swr;            /* to interleaved float, NULL if it is already */
+    uint8_t *buf;
+    unsigned buf_size;
+};
+
+static size_t sample_size(const struct pcmcache *pc)
+{
+    return (size_t)pc->h.channels * sizeof(float);
+}
+
+/* Where a sample is in the entry */
+static size_t sample_offset(const struct pcmcache *pc, int64_t pos)
+{
+    return PCMCACHE_HEADER + pos * sample_size(pc);
+}
+
+static int write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    ssize_t n;
+
+    while (size) {
+        if ((n = write(fd, p, size)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        p    += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int alloc(struct pcmcache **pc, const struct xcache *xc, const char *input)
+{
+    int error;
+
+    if (!(*pc = av_mallocz(sizeof(**pc))))
+        return AVERROR(ENOMEM);
+    (*pc)->fd = -1;
+    (*pc)->xc = *xc;
+    if ((error = xcache_key(&(*pc)->xc, input, PCMCACHE_PARAMS)) < 0)
+        pcmcache_free(pc);
+    return error;
+}
+
+int pcmcache_open(struct pcmcache **pc, struct xcache *xc, const char *input)
+{
+    struct pcmcache *p;
+    struct stat sb;
+    int fd, error;
+
+    if ((error = alloc(pc, xc, input)) < 0)
+        return error;
+    p = *pc;
+    if ((fd = xcache_open(&p->xc)) < 0) {
+        error = fd;
+        goto fail;
+    }
+    if (fstat(fd, &sb) < 0) {
+        error = AVERROR(errno);
+        close(fd);
+        goto fail;
+    }
+    if (sb.st_size < PCMCACHE_HEADER) {
+        error = AVERROR_INVALIDDATA;
+        close(fd);
+        goto fail;
+    }
+    p->map_size = sb.st_size;
+    p->map = mmap(NULL, p->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p->map == MAP_FAILED) {
+        p->map = NULL;
+        error = AVERROR(errno);
+        goto fail;
+    }
+
+    /* Check that it is whole before trusting it. */
+    memcpy(&p->h, p->map, sizeof(p->h));
+    p->h.layout[sizeof(p->h.layout) - 1] = 0;
+    if (memcmp(p->h.magic, PCMCACHE_MAGIC, sizeof(p->h.magic)) ||
+        p->h.sample_rate <= 0 || p->h.channels <= 0 || p->h.nb_samples < 0 ||
+        (p->map_size - PCMCACHE_HEADER) / sample_size(p) < (uint64_t)p->h.nb_samples ||
+        av_channel_layout_from_string(&p->layout, p->h.layout) < 0 ||
+        p->layout.nb_channels != p->h.channels) {
+        error = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+    madvise(p->map, p->map_size, MADV_SEQUENTIAL);
+    return 0;
+
+fail:
+    if (error != AVERROR(ENOENT))
+        fprintf(stderr, "Could not read the decoded samples of '%s' from the cache (error '%s')\n", input, av_err2str(error));
+    pcmcache_free(pc);
+    return error;
+}
+
+int pcmcache_create(struct pcmcache **pc, struct xcache *xc, const char *input,
+                    const AVCodecContext *dec)
+{
+    struct pcmcache *p;
+    int error;
+
+    if ((error = alloc(pc, xc, input)) < 0)
+        return error;
+    p = *pc;
+    memcpy(p->h.magic, PCMCACHE_MAGIC, sizeof(p->h.magic));
+    p->h.sample_rate = dec->sample_rate;
+    p->h.channels    = dec->ch_layout.nb_channels;
+    if ((error = av_channel_layout_describe(&dec->ch_layout, p->h.layout, sizeof(p->h.layout))) < 0 ||
+        (error = av_channel_layout_copy(&p->layout, &dec->ch_layout)) < 0)
+        goto fail;
+
+    if (dec->sample_fmt != AV_SAMPLE_FMT_FLT &&
+        ((error = swr_alloc_set_opts2(&p->swr, &dec->ch_layout, AV_SAMPLE_FMT_FLT, dec->sample_rate,
+                                      &dec->ch_layout, dec->sample_fmt, dec->sample_rate, 0, NULL)) < 0 ||
+         (error = swr_init(p->swr)) < 0))
+        goto fail;
+
+    /* The samples go after the header, which is written when they are
+     * complete. */
+    if ((p->fd = xcache_create(&p->xc, p->tmp, sizeof(p->tmp))) < 0) {
+        error = p->fd;
+        goto fail;
+    }
+    if (lseek(p->fd, PCMCACHE_HEADER, SEEK_SET) < 0) {
+        error = AVERROR(errno);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    fprintf(stderr, "Could not start caching the decoded samples of '%s' (error '%s')\n", input, av_err2str(error));
+    pcmcache_free(pc);
+    return error;
+}
+
+int pcmcache_reading(const struct pcmcache *pc)
+{
+    return !!pc->map;
+}
+
+int pcmcache_codec_context(const struct pcmcache *pc, AVCodecContext **avctx)
+{
+    int error;
+
+    if (!(*avctx = avcodec_alloc_context3(NULL)))
+        return AVERROR(ENOMEM);
+    (*avctx)->codec_type  = AVMEDIA_TYPE_AUDIO;
+    (*avctx)->sample_fmt  = AV_SAMPLE_FMT_FLT;
+    (*avctx)->sample_rate = pc->h.sample_rate;
+    (*avctx)->time_base   = (AVRational){ 1, pc->h.sample_rate };
+    if ((error = av_channel_layout_copy(&(*avctx)->ch_layout, &pc->layout)) < 0)
+        avcodec_free_context(avctx);
+    return error;
+}
+
+int pcmcache_write(struct pcmcache *pc, const AVFrame *frame)
+{
+    const uint8_t *data = frame->extended_data[0];
+    size_t size = frame->nb_samples * sample_size(pc);
+    int error;
+
+    if (pc->swr) {
+        av_fast_malloc(&pc->buf, &pc->buf_size, size);
+        if (!pc->buf)
+            return AVERROR(ENOMEM);
+        if ((error = swr_convert(pc->swr, &pc->buf, frame->nb_samples,
+                                 (const uint8_t **)frame->extended_data, frame->nb_samples)) < 0)
+            return error;
+        data = pc->buf;
+    }
+
+    if ((error = write_all(pc->fd, data, size)) < 0) {
+        fprintf(stderr, "Could not write decoded samples to the cache (error '%s')\n", av_err2str(error));
+        return error;
+    }
+    pc->pos += frame->nb_samples;
+    return 0;
+}
+
+int pcmcache_commit(struct pcmcache *pc)
+{
+    int error;
+
+    pc->h.nb_samples = pc->pos;
+    if (pwrite(pc->fd, &pc->h, sizeof(pc->h), 0) != sizeof(pc->h)) {
+        error = AVERROR(errno);
+        goto fail;
+    }
+    error = xcache_commit(&pc->xc, pc->fd, pc->tmp);
+    pc->fd = -1;
+    if (error < 0)
+        goto fail;
+    return 0;
+
+fail:
+    fprintf(stderr, "Could not store the decoded samples in the cache (error '%s')\n", av_err2str(error));
+    return error;
+}
+
+int pcmcache_read(struct pcmcache *pc, const uint8_t **data, int nb_samples)
+{
+    int n = FFMIN(nb_samples, pc->h.nb_samples - pc->pos);
+
+    *data = pc->map + sample_offset(pc, pc->pos);
+    pc->pos += n;
+    return n;
+}
+
+int pcmcache_seek(struct pcmcache *pc, int64_t sample)
+{
+    const long page = sysconf(_SC_PAGESIZE);
+    size_t off;
+
+    if (sample < 0)
+        return AVERROR(EINVAL);
+    pc->pos = FFMIN(sample, pc->h.nb_samples);
+    /* Read ahead from there rather than from where reading stood. */
+    off = sample_offset(pc, pc->pos) / page * page;
+    madvise(pc->map + off, FFMIN(pc->map_size - off, (size_t)PCMCACHE_BLOCK * sample_size(pc) + page),
+            MADV_WILLNEED);
+    return 0;
+}
+
+int64_t pcmcache_position(const struct pcmcache *pc)
+{
+    return pc->pos;
+}
+
+void pcmcache_free(struct pcmcache **pc)
+{
+    if (!*pc)
+        return;
+    if ((*pc)->map)
+        munmap((*pc)->map, (*pc)->map_size);
+    if ((*pc)->fd >= 0) {
+        close((*pc)->fd);
+        unlink((*pc)->tmp);
+    }
+    swr_free(&(*pc)->swr);
+    av_channel_layout_uninit(&(*pc)->layout);
+    av_freep(&(*pc)->buf);
+    av_freep(pc);
+}
@@ -0,0 +1,106 @@
+/*
+ * pcmcache.h: cache of decoded PCM (tmp30 -P).
+ *
+ * The first transcode of a source spills what its decoder puts out,
+ * converted to interleaved float at the source's rate and layout, to an
+ * entry of the output cache (xcache.h), which shares that cache's
+ * directory, size bound and eviction. Later transcodes of the same bytes,
+ * with any encoder settings, map the entry and feed the resampler straight
+ * from it: no demuxing, no decoding, no copy.
+ *
+ * An entry is
+ *   - a header, PCMCACHE_HEADER bytes, so the samples start page aligned
+ *   - the samples, channels * 4 bytes each
+ * The header is written last, so a half-written file is never mistaken
+ * for an entry. A sample's place in it follows from its position, so a
+ * trim (-s, -t) or a snippet of an edit list (-E) starts reading right
+ * there. Only a transcode of the whole input makes an entry.
+ */
+
+#ifndef PCMCACHE_H
+#define PCMCACHE_H
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/frame.h>
+
+#include "xcache.h"
+
+#define PCMCACHE_HEADER 4096
+/* Samples handed out per pcmcache_read */
+#define PCMCACHE_BLOCK  4096
+
+struct pcmcache;
+
+/**
+ * Open the entry of an input for reading.
+ * @param[out] pc    Reader
+ * @param      xc    Cache, from xcache_init
+ * @param      input Input file name
+ * @return Error code (0 if successful), AVERROR(ENOENT) if there is none
+ */
+int pcmcache_open(struct pcmcache **pc, struct xcache *xc, const char *input);
+
+/**
+ * Start an entry for an input that is about to be decoded.
+ * @param[out] pc        Writer
+ * @param      xc        Cache, from xcache_init
+ * @param      input     Input file name
+ * @param      dec       Decoder of the input
+ * @return Error code (0 if successful)
+ */
+int pcmcache_create(struct pcmcache **pc, struct xcache *xc, const char *input,
+                    const AVCodecContext *dec);
+
+/**
+ * Whether pc was opened for reading.
+ */
+int pcmcache_reading(const struct pcmcache *pc);
+
+/**
+ * Describe the samples of an entry as a decoder would: interleaved float
+ * at their rate and layout.
+ * @param[out] avctx Codec context, to be freed with avcodec_free_context
+ * @return Error code (0 if successful)
+ */
+int pcmcache_codec_context(const struct pcmcache *pc, AVCodecContext **avctx);
+
+/**
+ * Append a decoded frame to the entry being written.
+ * @return Error code (0 if successful)
+ */
+int pcmcache_write(struct pcmcache *pc, const AVFrame *frame);
+
+/**
+ * Make the entry being written complete and put it into the cache.
+ * @return Error code (0 if successful)
+ */
+int pcmcache_commit(struct pcmcache *pc);
+
+/**
+ * Point at the next samples of an entry being read.
+ * @param[out] data        Interleaved float samples, in the mapped entry
+ * @param      nb_samples  Most samples to take
+ * @return Number of samples, 0 at the end
+ */
+int pcmcache_read(struct pcmcache *pc, const uint8_t **data, int nb_samples);
+
+/**
+ * Move the read position of an entry, to the end at most.
+ * @param sample Position, in samples from the start of the input
+ * @return Error code (0 if successful)
+ */
+int pcmcache_seek(struct pcmcache *pc, int64_t sample);
+
+/**
+ * Position of the next sample pcmcache_read hands out.
+ */
+int64_t pcmcache_position(const struct pcmcache *pc);
+
+/**
+ * Close a reader, or a writer, whose unfinished entry is dropped.
+ */
+void pcmcache_free(struct pcmcache **pc);
+
+#endif /* PCMCACHE_H */
@@ -0,0 +1,314 @@
+/*
+ * seg.c: see seg.h.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libavutil/avstring.h>
+#include <libavutil/dict.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "seg.h"
+
+/* A finished segment, as the playlist lists it */
+struct segment {
+    double duration;
+    char name[256];
+};
+
+struct seg {
+    char playlist[4096];
+    char base[4096];        /* segment names up to the index */
+    char ext[16];
+    const AVOutputFormat *oformat;
+    const AVCodecContext *enc;
+    int64_t samples;
+    int first, last;        /* segments written, last not included */
+    int part;
+    int target;             /* #EXT-X-TARGETDURATION */
+    AVFormatContext *fcx;   /* segment being written, or NULL */
+    int cur;                /* its index */
+    int64_t cur_samples;
+    int64_t bytes;
+    struct segment *done;
+    int nb_done;
+};
+
+int64_t seg_samples(const AVCodecContext *enc, double seconds)
+{
+    const int fs = enc->frame_size > 0 ? enc->frame_size : 1024;
+
+    return FFMAX(llrint(seconds * enc->sample_rate / fs), 1) * fs;
+}
+
+int seg_open(struct seg **sg, const char *playlist, const AVOutputFormat *oformat, const AVCodecContext *enc,
+             int64_t samples, int first, int count, int part)
+{
+    struct seg *s;
+    const char *ext = oformat->extensions ? oformat->extensions : oformat->name;
+    char *dot;
+
+    if (!(s = av_mallocz(sizeof(*s))))
+        return AVERROR(ENOMEM);
+    av_strlcpy(s->playlist, playlist, sizeof(s->playlist));
+    av_strlcpy(s->base, playlist, sizeof(s->base));
+    if ((dot = strrchr(s->base, '.')) && !strchr(dot, '/'))
+        *dot = 0;
+    /* The first of the format's extensions, "aac" for ADTS. */
+    av_strlcpy(s->ext, ext, FFMIN(sizeof(s->ext), strcspn(ext, ",") + 1));
+    s->oformat = oformat;
+    s->enc     = enc;
+    s->samples = samples;
+    s->first   = first;
+    s->last    = count ? first + count : INT_MAX;
+    s->part    = part;
+    /* Durations rounded to the nearest second may not exceed it. */
+    s->target  = FFMAX((samples + enc->sample_rate / 2) / enc->sample_rate, 1);
+    s->cur     = -1;
+    *sg = s;
+    return 0;
+}
+
+static void segment_name(char *buf, size_t size, const struct seg *sg, int index)
+{
+    snprintf(buf, size, "%s%05d.%s", sg->base, index, sg->ext);
+}
+
+/* Replace a file with what write() puts into it, so that readers never
+ * see half of it. */
+static int replace_file(const char *path, void (*write)(FILE *f, const struct segment *done, int n, int target, int final),
+                        const struct segment *done, int n, int target, int final)
+{
+    char tmp[4096];
+    FILE *f;
+    int error;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(f = fopen(tmp, "w"))) {
+        error = AVERROR(errno);
+        fprintf(stderr, "Could not write '%s' (error '%s')\n", tmp, av_err2str(error));
+        return error;
+    }
+    write(f, done, n, target, final);
+    if (fflush(f) || ferror(f) || fclose(f)) {
+        error = AVERROR(errno);
+        fprintf(stderr, "Could not write '%s' (error '%s')\n", tmp, av_err2str(error));
+        unlink(tmp);
+        return error;
+    }
+    if (rename(tmp, path) < 0) {
+        error = AVERROR(errno);
+        fprintf(stderr, "Could not rename '%s' to '%s' (error '%s')\n", tmp, path, av_err2str(error));
+        unlink(tmp);
+        return error;
+    }
+    return 0;
+}
+
+static void put_playlist(FILE *f, const struct segment *done, int n, int target, int final)
+{
+    int i;
+
+    fprintf(f, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:0\n"
+            "#EXT-X-PLAYLIST-TYPE:%s\n", target, final ? "VOD" : "EVENT");
+    for (i = 0; i < n; i++)
+        fprintf(f, "#EXTINF:%.6f,\n%s\n", done[i].duration, done[i].name);
+    if (final)
+        fprintf(f, "#EXT-X-ENDLIST\n");
+}
+
+static void put_part(FILE *f, const struct segment *done, int n, int target, int final)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        fprintf(f, "%.6f %s\n", done[i].duration, done[i].name);
+}
+
+static void part_name(char *buf, size_t size, const char *playlist, int first)
+{
+    snprintf(buf, size, "%s.%d.part", playlist, first);
+}
+
+static int open_segment(struct seg *sg, int index)
+{
+    AVDictionary *options = NULL;
+    AVStream *stream;
+    char name[4096];
+    int error;
+
+    segment_name(name, sizeof(name), sg, index);
+    if ((error = avformat_alloc_output_context2(&sg->fcx, sg->oformat, NULL, name)) < 0) {
+        fprintf(stderr, "Could not allocate output format context\n");
+        return error;
+    }
+    if ((error = avio_open(&sg->fcx->pb, name, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open segment '%s' (error '%s')\n", name, av_err2str(error));
+        goto cleanup;
+    }
+    if (!(stream = avformat_new_stream(sg->fcx, NULL))) {
+        fprintf(stderr, "Could not create new stream\n");
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    stream->time_base = (AVRational){ 1, sg->enc->sample_rate };
+    if ((error = avcodec_parameters_from_context(stream->codecpar, sg->enc)) < 0) {
+        fprintf(stderr, "Could not initialize stream parameters\n");
+        goto cleanup;
+    }
+    /* Segments are played one after the other: nothing in them but the
+     * packets. */
+    av_dict_set(&options, "write_xing", "0", 0);
+    av_dict_set(&options, "id3v2_version", "0", 0);
+    error = avformat_write_header(sg->fcx, &options);
+    av_dict_free(&options);
+    if (error < 0) {
+        fprintf(stderr, "Could not write segment header (error '%s')\n", av_err2str(error));
+        goto cleanup;
+    }
+    sg->cur         = index;
+    sg->cur_samples = 0;
+    return 0;
+
+cleanup:
+    avio_closep(&sg->fcx->pb);
+    avformat_free_context(sg->fcx);
+    sg->fcx = NULL;
+    return error;
+}
+
+static int finish_segment(struct seg *sg)
+{
+    struct segment *done;
+    char name[4096];
+    const char *slash;
+    int error, ret;
+
+    if (!sg->fcx)
+        return 0;
+    if ((error = av_write_trailer(sg->fcx)) < 0)
+        fprintf(stderr, "Could not write segment trailer (error '%s')\n", av_err2str(error));
+    sg->bytes += avio_tell(sg->fcx->pb);
+    /* Closing is what gets the segment to the file. */
+    if ((ret = avio_closep(&sg->fcx->pb)) < 0 && error >= 0) {
+        fprintf(stderr, "Could not close segment (error '%s')\n", av_err2str(ret));
+        error = ret;
+    }
+    avformat_free_context(sg->fcx);
+    sg->fcx = NULL;
+    if (error < 0)
+        return error;
+
+    if (!(done = av_realloc_array(sg->done, sg->nb_done + 1, sizeof(*done))))
+        return AVERROR(ENOMEM);
+    sg->done = done;
+    /* The playlist refers to segments next to it. */
+    segment_name(name, sizeof(name), sg, sg->cur);
+    slash = strrchr(name, '/');
+    av_strlcpy(done[sg->nb_done].name, slash ? slash + 1 : name, sizeof(done->name));
+    done[sg->nb_done].duration = (double)sg->cur_samples / sg->enc->sample_rate;
+    sg->nb_done++;
+    if (sg->part)
+        return 0;
+    return replace_file(sg->playlist, put_playlist, sg->done, sg->nb_done, sg->target, 0);
+}
+
+int seg_write(struct seg *sg, AVPacket *pkt)
+{
+    const int64_t pos = pkt->pts + sg->enc->initial_padding;
+    int64_t index = pos / sg->samples - (pos < 0 && pos % sg->samples);
+    int error;
+
+    if (index < sg->first || index >= sg->last)
+        return 0;
+    if (index != sg->cur || !sg->fcx) {
+        if ((error = finish_segment(sg)) < 0 ||
+            (error = open_segment(sg, index)) < 0)
+            return error;
+    }
+    sg->cur_samples += pkt->duration;
+    pkt->stream_index = 0;
+    if ((error = av_write_frame(sg->fcx, pkt)) < 0)
+        fprintf(stderr, "Could not write frame (error '%s')\n", av_err2str(error));
+    return error;
+}
+
+int64_t seg_bytes(const struct seg *sg)
+{
+    return sg->bytes + (sg->fcx ? avio_tell(sg->fcx->pb) : 0);
+}
+
+int seg_finish(struct seg *sg)
+{
+    char name[4096];
+    int error;
+
+    if ((error = finish_segment(sg)) < 0)
+        return error;
+    if (!sg->part)
+        return replace_file(sg->playlist, put_playlist, sg->done, sg->nb_done, sg->target, 1);
+    part_name(name, sizeof(name), sg->playlist, sg->first);
+    return replace_file(name, put_part, sg->done, sg->nb_done, sg->target, 1);
+}
+
+void seg_free(struct seg **sg)
+{
+    struct seg *s = *sg;
+
+    if (!s)
+        return;
+    if (s->fcx) {
+        avio_closep(&s->fcx->pb);
+        avformat_free_context(s->fcx);
+    }
+    av_free(s->done);
+    av_freep(sg);
+}
+
+int seg_merge(const char *playlist, const int *first, int n)
+{
+    struct segment *done = NULL, *d;
+    char name[4096], line[512];
+    int nb_done = 0, target = 1;
+    int error = 0, i;
+    FILE *f;
+
+    for (i = 0; i < n && !error; i++) {
+        part_name(name, sizeof(name), playlist, first[i]);
+        if (!(f = fopen(name, "r"))) {
+            error = AVERROR(errno);
+            fprintf(stderr, "Could not read '%s' (error '%s')\n", name, av_err2str(error));
+            break;
+        }
+        while (fgets(line, sizeof(line), f)) {
+            char *end;
+            if (!(d = av_realloc_array(done, nb_done + 1, sizeof(*done)))) {
+                error = AVERROR(ENOMEM);
+                break;
+            }
+            done = d;
+            d += nb_done++;
+            d->duration = strtod(line, &end);
+            line[strcspn(line, "\n")] = 0;
+            av_strlcpy(d->name, end + strspn(end, " "), sizeof(d->name));
+            target = FFMAX(target, (int)lrint(d->duration));
+        }
+        fclose(f);
+    }
+    if (!error)
+        error = replace_file(playlist, put_playlist, done, nb_done, target, 1);
+    av_free(done);
+    if (error < 0)
+        return error;
+    for (i = 0; i < n; i++) {
+        part_name(name, sizeof(name), playlist, first[i]);
+        unlink(name);
+    }
+    return nb_done;
+}
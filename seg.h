@@ -0,0 +1,88 @@
+/*
+ * seg.h: segmented output of tmp30 (-S option), HLS style.
+ *
+ * The encoder's packets go to a series of files of a fixed number of
+ * samples each, a multiple of the encoder's frame size, so that segments
+ * are cut between packets: packet pts + encoder delay, divided by the
+ * segment length, is the segment a packet belongs to. That puts every
+ * packet in the same segment whoever encodes it, which lets workers
+ * encode disjoint ranges of segments in parallel (-j option), each from
+ * its own seek into the input.
+ *
+ * Each segment is a whole file (MP3 or ADTS, no Xing frame or ID3 tag)
+ * that is closed as soon as the next packet belongs to the next one, and
+ * the playlist, <name>.m3u8, lists the finished segments: it is replaced
+ * atomically after each one, an EVENT playlist that becomes VOD with
+ * #EXT-X-ENDLIST when the last one is done. Workers write their part of
+ * the list to <playlist>.<first segment>.part instead, which seg_merge
+ * turns into the playlist once they have all finished.
+ */
+
+#ifndef SEG_H
+#define SEG_H
+
+#include <stdint.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+struct seg;
+
+/**
+ * Segment length for an encoder: seconds rounded to whole frames.
+ * @return Samples per segment
+ */
+int64_t seg_samples(const AVCodecContext *enc, double seconds);
+
+/**
+ * Start segmenting.
+ * @param      playlist Playlist file name; segments are named after it,
+ *                      without its extension, with a five digit index
+ * @param      oformat  Container of the segments, mp3 or adts
+ * @param      enc      Encoder the packets come from
+ * @param      samples  Samples per segment, see seg_samples
+ * @param      first    First segment to write, earlier packets are dropped
+ * @param      count    Number of segments to write, 0 for all the rest
+ * @param      part     Write the list of segments to a part file for
+ *                      seg_merge, at the end, instead of the playlist
+ * @param[out] sg       Segmenter
+ * @return Error code (0 if successful)
+ */
+int seg_open(struct seg **sg, const char *playlist, const AVOutputFormat *oformat, const AVCodecContext *enc,
+             int64_t samples, int first, int count, int part);
+
+/**
+ * Write a packet into its segment, finishing the current one (trailer,
+ * close, playlist) when the packet is past it. Packets outside the range
+ * of segments are dropped.
+ * @return Error code (0 if successful)
+ */
+int seg_write(struct seg *sg, AVPacket *pkt);
+
+/**
+ * Bytes written to the segments so far.
+ */
+int64_t seg_bytes(const struct seg *sg);
+
+/**
+ * Finish the last segment and the playlist (or part file).
+ * @return Error code (0 if successful)
+ */
+int seg_finish(struct seg *sg);
+
+/**
+ * Free the segmenter. A segment still open is left incomplete, and out
+ * of the playlist.
+ */
+void seg_free(struct seg **sg);
+
+/**
+ * Write the playlist from the part files of workers, and remove them.
+ * @param playlist Playlist file name
+ * @param first    First segment of each worker, in order
+ * @param n        Number of workers
+ * @return Number of segments listed, or an error code
+ */
+int seg_merge(const char *playlist, const int *first, int n);
+
+#endif /* SEG_H */
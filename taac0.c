@@ -28,6 +28,7 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include <libavutil/mem.h>
 #include <libavformat/avformat.h>
@@ -44,6 +45,8 @@
 
 #include <libswresample/swresample.h>
 
+#include "fastopen.h"
+
 /* The output bit rate in bit/s */
 #define OUTPUT_BIT_RATE 96000
 /* The number of output channels */
@@ -52,28 +55,46 @@
 /**
  * Open an input file and the required decoder.
  * @param      filename             File to be opened
+ * @param      fo                   Fast-open state (see fastopen.h)
  * @param[out] inpfcx Format context of opened file
  * @param[out] inpccx  Codec context of opened file
  * @return Error code (0 if successful)
  */
-static int open_input_file(const char *filename, AVFormatContext **inpfcx, AVCodecContext **inpccx)
+static int open_input_file(const char *filename, struct fastopen *fo, AVFormatContext **inpfcx, AVCodecContext **inpccx)
 {
     AVCodecContext *avctx;
     const AVCodec *input_codec;
+    const AVInputFormat *iformat;
     const AVStream *stream;
+    AVDictionary *options = NULL;
     int error;
 
+    /* In fast mode this guesses the container and limits the probe. */
+    iformat = fastopen_begin(fo, filename, &options);
+
     /* Open the input file to read from it. */
-    if ((error = avformat_open_input(inpfcx, filename, NULL,
-                                     NULL)) < 0) {
+    error = avformat_open_input(inpfcx, filename, iformat, &options);
+    av_dict_free(&options);
+    if (error < 0) {
+        *inpfcx = NULL;
+        if (fo->enabled)
+            goto fallback;
         fprintf(stderr, "Could not open input file '%s' (error '%s')\n",
                 filename, av_err2str(error));
-        *inpfcx = NULL;
         return error;
     }
+    (*inpfcx)->opaque = fo;
 
     /* Get information on the input file (number of streams etc.). */
-    if ((error = avformat_find_stream_info(*inpfcx, NULL)) < 0) {
+    if (fo->enabled)
+        error = fastopen_stream_info(fo, *inpfcx);
+    else
+        error = avformat_find_stream_info(*inpfcx, NULL);
+    if (error == FASTOPEN_FALLBACK && fo->enabled) {
+        avformat_close_input(inpfcx);
+        goto fallback;
+    }
+    if (error < 0) {
         fprintf(stderr, "Could not open find stream info (error '%s')\n",
                 av_err2str(error));
         avformat_close_input(inpfcx);
@@ -125,10 +146,22 @@ static int open_input_file(const char *filename, AVFormatContext **inpfcx, AVCod
     /* Set the packet timebase for the decoder. */
     avctx->pkt_timebase = stream->time_base;
 
+    /* Check what fast open assumed against the first decoded frame. */
+    if (fo->enabled && fastopen_verify(fo, *inpfcx, avctx) < 0) {
+        avcodec_free_context(&avctx);
+        avformat_close_input(inpfcx);
+        goto fallback;
+    }
+    fastopen_store(fo, *inpfcx, avctx);
+
     /* Save the decoder context for easier access later. */
     *inpccx = avctx;
 
     return 0;
+
+fallback:
+    fastopen_fallback(fo);
+    return open_input_file(filename, fo, inpfcx, inpccx);
 }
 
 /**
@@ -375,7 +408,7 @@ static int decode_audio_frame(AVFrame *frame,
     *data_present = 0;
     *finished = 0;
     /* Read one audio frame from the input file into a temporary packet. */
-    if ((error = av_read_frame(inpfcx, input_packet)) < 0) {
+    if ((error = fastopen_read_frame(inpfcx, input_packet)) < 0) {
         /* If we are at the end of the file, flush the decoder below. */
         if (error == AVERROR_EOF)
             *finished = 1;
@@ -413,6 +446,7 @@ static int decode_audio_frame(AVFrame *frame,
     /* Default case: Return decoded data. */
     } else {
         *data_present = 1;
+        fastopen_frame_decoded(inpfcx);
         goto cleanup;
     }
 
@@ -773,19 +807,22 @@ int main(int argc, char **argv)
     AVCodecContext *inpccx = NULL, *outccx = NULL;
     SwrContext *resccx = NULL;
     AVAudioFifo *fifo = NULL;
+    struct fastopen fo;
     int ret = AVERROR_EXIT;
+    int fast = argc > 1 && !strcmp(argv[1], "-F");
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
+    if (argc != 3 + fast) {
+        fprintf(stderr, "Usage: %s [-F] <input file> <output file>\n", argv[0]);
         exit(1);
     }
+    fastopen_init(&fo, fast);
 
     /* Open the input file for reading. */
-    if (open_input_file(argv[1], &inpfcx,
+    if (open_input_file(argv[1 + fast], &fo, &inpfcx,
                         &inpccx))
         goto cleanup;
     /* Open the output file for writing. */
-    if (open_output_file(argv[2], inpccx,
+    if (open_output_file(argv[2 + fast], inpccx,
                          &outfcx, &outccx))
         goto cleanup;
     /* Initialize the resampler to be able to convert audio sample formats. */
@@ -870,6 +907,7 @@ cleanup:
         avcodec_free_context(&inpccx);
     if (inpfcx)
         avformat_close_input(&inpfcx);
+    fastopen_uninit(&fo);
 
     return ret;
 }
@@ -27,7 +27,14 @@
  * @author Andreas Unterweger (dustsigns@gmail.com)
  */
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <libavutil/mem.h>
 #include <libavformat/avformat.h>
@@ -41,45 +48,267 @@
 #include <libavutil/channel_layout.h>
 #include <libavutil/frame.h>
 #include <libavutil/opt.h>
+#include <libavutil/parseutils.h>
+#include <libavutil/time.h>
 
 #include <libswresample/swresample.h>
 
+#include "ckpt.h"
+#include "editlist.h"
+#include "fastopen.h"
+#include "fgraph.h"
+#include "fmtneg.h"
+#include "fpool.h"
+#include "live.h"
+#include "loud.h"
+#include "pcmcache.h"
+#include "seg.h"
+#include "tmp30.h"
+#include "tpool.h"
+#include "tstretch.h"
+#include "tune.h"
+#include "xcache.h"
+#include "xio.h"
+#include "xstat.h"
+#include "zfifo.h"
+
 /* The output bit rate in bit/s */
 #define OUTPUT_BIT_RATE 96000
 /* The number of output channels */
 #define OUTPUT_CHANNELS 2
+/* Upper bound of warm contexts a pool keeps per parameter set */
+#define POOL_MAX_CTX 8
+/* Upper bound of parameter sets a pool remembers, each of encoders and
+ * resamplers; jobs with others open their own and don't warm them */
+#define POOL_MAX_KEYS 32
+/* Seconds between checkpoints when resuming without -k */
+#define CKPT_INTERVAL 60
+/* Frames a resumed encoder runs beyond its delay before its packets are
+ * kept, so that its state has settled on the signal */
+#define RESUME_PREROLL_FRAMES 2
+/* Upper bound of segment workers (-j) */
+#define SEG_MAX_JOBS 64
+/* Seconds of samples a split's output (-X) may queue for its encoder
+ * before the decoder waits */
+#define SPLIT_QUEUE_SECONDS 10
+/* Most planes of a sample buffer (SWR_CH_MAX) */
+#define MAX_PLANES 64
+
+/* Everything that determines how an encoder is opened; encoders opened
+ * from equal keys are interchangeable. */
+struct enckey {
+    const AVCodec *codec;
+    int64_t bit_rate;
+    int channels;
+    int vbr, quality;
+    int sample_rate;
+    enum AVSampleFormat sample_fmt;
+    int global_header;
+    int standalone;         /* no MP3 bit reservoir, see tmp30_opts.resumable */
+};
+
+/* Same for a resampler. */
+struct swrkey {
+    AVChannelLayout in_layout, out_layout;
+    enum AVSampleFormat in_fmt, out_fmt;
+    int in_rate, out_rate;
+};
+
+struct encentry {
+    struct enckey key;
+    AVCodecContext *ctx[POOL_MAX_CTX];
+    int nb_ctx;
+    int opening;            /* replacements being opened right now */
+};
+
+struct swrentry {
+    struct swrkey key;
+    SwrContext *ctx[POOL_MAX_CTX];
+    int nb_ctx;
+};
+
+/* Warm encoders and resamplers shared by the transcodes of one process
+ * (the daemon, tmp30d.c). */
+struct tmp30_pool {
+    pthread_mutex_t lock;
+    int spares;             /* opened encoders to keep ready per key */
+    struct encentry *enc;
+    int nb_enc;
+    struct swrentry *swr;
+    int nb_swr;
+    unsigned enc_hits, enc_misses;
+    unsigned swr_hits, swr_misses;
+};
+
+/* State of one transcode run. Kept out of globals so that the library
+ * build (tmp30.h) can run several transcodes in one process. */
+struct xcode {
+    AVFormatContext *inpfcx, *outfcx;
+    AVCodecContext *inpccx, *outccx;
+    SwrContext *resccx;
+    AVAudioFifo *fifo;
+    struct zfifo *zf;       /* takes the place of fifo with zerocopy */
+    struct fpool *fp;       /* decoded and converted sample buffers */
+    int zerocopy;           /* see tmp30_opts.zerocopy */
+    int64_t pts;            /* timestamp for the next audio frame */
+    struct tmp30_pool *pool;
+    struct enckey enckey;   /* how outccx was opened, to give it back */
+    struct swrkey swrkey;   /* same for resccx */
+    struct xstat *st;       /* run statistics, NULL when not reporting */
+    const char *loudness;   /* loudness normalization setting, see loud.h */
+    struct loud *ld;        /* loudness stage, NULL without normalization */
+    const char *filters;    /* filter graph description, see fgraph.h */
+    struct fgraph *fg;      /* filter stage in place of the resampler, or NULL */
+    const char *tempo;      /* time-stretch setting, see tstretch.h */
+    struct tstretch *ts;    /* time-stretch stage, NULL at the input's tempo */
+    int in_done;            /* the input is decoded to the end */
+    int resumable;          /* output a checkpoint can be resumed into */
+    int64_t written;        /* end of the last packet in the output, in
+                               samples; earlier packets are dropped */
+    int64_t drop_until;     /* decoded samples before this are dropped */
+    int64_t stop_at;        /* decoded samples from this position on are
+                               dropped and the input is done (trimming,
+                               segment workers), or INT64_MAX */
+    int64_t in_pts;         /* pts of the last decoded input frame */
+    /* Edit list (-E), see editlist.h */
+    const struct editlist *el;
+    int next_edit;          /* the snippet to go on with */
+    struct fastopen *fo;    /* fast-open state of the input */
+    enum xio_mode iomode;
+    struct pcmcache *pcm;   /* decoded samples cached to read instead of
+                               decoding, or being cached; see pcmcache.h */
+    struct xcache *cache;   /* cache the snippets' decoded samples are
+                               looked up in (-P), or NULL */
+    char conversion[128];   /* what the resampler does, see fmtneg.h */
+    struct seg *sg;         /* segmented output (-S) in place of outfcx */
+    /* Live input (-l), see live.h */
+    struct live *lv;
+    int64_t budget;         /* latency budget in microseconds */
+    const char *rotate_pattern; /* strftime() pattern of the output files */
+    int rotate;             /* seconds per output file, 0 for one file */
+    time_t rotate_slot;     /* the current file's */
+    unsigned live_padded, live_stalls;
+    int64_t live_dropped;   /* samples */
+    /* Checkpoints (-k, -K), see ckpt.h */
+    const char *ckpt_out;   /* output to keep a checkpoint for, or NULL */
+    int64_t ckpt_every;     /* microseconds between checkpoints */
+    int64_t ckpt_last;      /* when the last one was taken */
+    struct ckpt ck;
+};
 
-/* Global timestamp for the audio frames. */
-static int64_t pts = 0;
+/**
+ * Close an input file opened by open_input_file, together with the
+ * custom I/O context if one was attached to it.
+ * @param inpfcx Format context of the input file
+ */
+static void close_input_file(AVFormatContext **inpfcx)
+{
+    AVIOContext *pb = NULL;
+
+    if (!*inpfcx)
+        return;
+    if ((*inpfcx)->flags & AVFMT_FLAG_CUSTOM_IO)
+        pb = (*inpfcx)->pb;
+    avformat_close_input(inpfcx);
+    xio_close(&pb);
+}
 
 /**
  * Open an input file and the required decoder.
  * @param      filename             File to be opened
+ * @param      iomode               How to read the file (see xio.h)
+ * @param      pb                   Already opened I/O context (from xio.h),
+ *                                  or NULL to open filename. Owned by the
+ *                                  input from here on, even on failure.
+ * @param      format               Input container short name, or NULL to
+ *                                  probe it
+ * @param      fo                   Fast-open state (see fastopen.h), or NULL
+ *                                  for a plain full probe. Only used when
+ *                                  pb is NULL.
+ * @param      enc                  Encoder the decoded samples go to, whose
+ *                                  sample formats the decoder is asked
+ *                                  for, or NULL
+ * @param      int_cb               Interrupt callback of the input (see
+ *                                  live.h), or NULL for none
+ * @param      fp                   Pool the decoder takes its frames from
+ *                                  (see fpool.h), or NULL
  * @param[out] inpfcx Format context of opened file
  * @param[out] inpccx  Codec context of opened file
  * @return Error code (0 if successful)
  */
-static int open_input_file(const char *filename, AVFormatContext **inpfcx, AVCodecContext **inpccx)
+static int open_input_file(const char *filename, enum xio_mode iomode, AVIOContext *pb, const char *format, struct fastopen *fo, const AVCodec *enc,
+                           const AVIOInterruptCB *int_cb, struct fpool *fp, AVFormatContext **inpfcx, AVCodecContext **inpccx)
 {
     AVCodecContext *avctx;
     const AVCodec *input_codec;
+    const AVInputFormat *iformat = NULL;
     const AVStream *stream;
-    int error;
+    AVDictionary *options = NULL;
+    int fast, error;
+
+    if (format && !(iformat = av_find_input_format(format))) {
+        fprintf(stderr, "Unknown input format '%s'\n", format);
+        xio_close(&pb);
+        return AVERROR(EINVAL);
+    }
+
+    if (pb)
+        fo = NULL;
+    if (fo) {
+        const AVInputFormat *hint = fastopen_begin(fo, filename, &options);
+        if (!iformat)
+            iformat = hint;
+    }
+    fast = fo && fo->enabled;
+
+    /* Attach our own I/O context unless libavformat's file protocol is wanted. */
+    if (!pb && iomode != XIO_DEFAULT &&
+        (error = xio_open_file(filename, iomode, &pb)) < 0) {
+        fprintf(stderr, "Could not open input file '%s' (error '%s')\n", filename, av_err2str(error));
+        av_dict_free(&options);
+        return error;
+    }
+    if (pb || int_cb) {
+        if (!(*inpfcx = avformat_alloc_context())) {
+            fprintf(stderr, "Could not allocate input format context\n");
+            av_dict_free(&options);
+            xio_close(&pb);
+            return AVERROR(ENOMEM);
+        }
+        (*inpfcx)->pb = pb;
+        /* The protocol takes its copy when it is opened. */
+        if (int_cb)
+            (*inpfcx)->interrupt_callback = *int_cb;
+    }
 
     /* Open the input file to read from it. */
-    if ((error = avformat_open_input(inpfcx, filename, NULL,
-                                     NULL)) < 0) {
+    error = avformat_open_input(inpfcx, filename, iformat, &options);
+    av_dict_free(&options);
+    if (error < 0) {
+        *inpfcx = NULL;
+        xio_close(&pb);
+        /* The guessed container may simply be wrong. */
+        if (fast)
+            goto fallback;
         fprintf(stderr, "Could not open input file '%s' (error '%s')\n",
                 filename, av_err2str(error));
-        *inpfcx = NULL;
         return error;
     }
+    (*inpfcx)->opaque = fo;
 
     /* Get information on the input file (number of streams etc.). */
-    if ((error = avformat_find_stream_info(*inpfcx, NULL)) < 0) {
+    if (fast)
+        error = fastopen_stream_info(fo, *inpfcx);
+    else
+        error = avformat_find_stream_info(*inpfcx, NULL);
+    if (error == FASTOPEN_FALLBACK && fast) {
+        close_input_file(inpfcx);
+        goto fallback;
+    }
+    if (error < 0) {
         fprintf(stderr, "Could not open find stream info (error '%s')\n",
                 av_err2str(error));
-        avformat_close_input(inpfcx);
+        close_input_file(inpfcx);
         return error;
     }
 
@@ -87,7 +316,7 @@ static int open_input_file(const char *filename, AVFormatContext **inpfcx, AVCod
     if ((*inpfcx)->nb_streams != 1) {
         fprintf(stderr, "Expected one audio input stream, but found %d\n",
                 (*inpfcx)->nb_streams);
-        avformat_close_input(inpfcx);
+        close_input_file(inpfcx);
         return AVERROR_EXIT;
     }
 
@@ -96,7 +325,7 @@ static int open_input_file(const char *filename, AVFormatContext **inpfcx, AVCod
     /* Find a decoder for the audio stream. */
     if (!(input_codec = avcodec_find_decoder(stream->codecpar->codec_id))) {
         fprintf(stderr, "Could not find input codec\n");
-        avformat_close_input(inpfcx);
+        close_input_file(inpfcx);
         return AVERROR_EXIT;
     }
 
@@ -104,34 +333,254 @@ static int open_input_file(const char *filename, AVFormatContext **inpfcx, AVCod
     avctx = avcodec_alloc_context3(input_codec);
     if (!avctx) {
         fprintf(stderr, "Could not allocate a decoding context\n");
-        avformat_close_input(inpfcx);
+        close_input_file(inpfcx);
         return AVERROR(ENOMEM);
     }
 
     /* Initialize the stream parameters with demuxer information. */
     error = avcodec_parameters_to_context(avctx, stream->codecpar);
     if (error < 0) {
-        avformat_close_input(inpfcx);
+        close_input_file(inpfcx);
         avcodec_free_context(&avctx);
         return error;
     }
 
+    /* Decoders that can put out more than one format put out the
+     * encoder's, if asked, and there is nothing left to convert. */
+    fmtneg_request(avctx, enc);
+    if (fp)
+        fpool_attach(fp, avctx);
+
     /* Open the decoder for the audio stream to use it later. */
     if ((error = avcodec_open2(avctx, input_codec, NULL)) < 0) {
         fprintf(stderr, "Could not open input codec (error '%s')\n",
                 av_err2str(error));
         avcodec_free_context(&avctx);
-        avformat_close_input(inpfcx);
+        close_input_file(inpfcx);
         return error;
     }
 
     /* Set the packet timebase for the decoder. */
     avctx->pkt_timebase = stream->time_base;
 
+    /* Check what fast open assumed against the first decoded frame. */
+    if (fast && fastopen_verify(fo, *inpfcx, avctx) < 0) {
+        avcodec_free_context(&avctx);
+        close_input_file(inpfcx);
+        goto fallback;
+    }
+    if (fo)
+        fastopen_store(fo, *inpfcx, avctx);
+
     /* Save the decoder context for easier access later. */
     *inpccx = avctx;
 
     return 0;
+
+fallback:
+    fastopen_fallback(fo);
+    return open_input_file(filename, iomode, NULL, format, fo, enc, int_cb, fp, inpfcx, inpccx);
+}
+
+/**
+ * Look up an encoder by encoder name ("libmp3lame") or codec name ("mp3").
+ * @param name Name, or an empty string for MP3
+ * @return The encoder, or NULL if there is none
+ */
+static const AVCodec *find_encoder(const char *name)
+{
+    const AVCodecDescriptor *desc;
+    const AVCodec *codec;
+
+    if (!*name)
+        return avcodec_find_encoder(AV_CODEC_ID_MP3);
+    if ((codec = avcodec_find_encoder_by_name(name)))
+        return codec;
+    if ((desc = avcodec_descriptor_get_by_name(name)))
+        return avcodec_find_encoder(desc->id);
+    return NULL;
+}
+
+/**
+ * Fill in an encoder key from the transcode settings.
+ * @param[out] key           Encoder parameters
+ * @param      opts          Transcode settings
+ * @param      sample_rate   Sample rate of the input, which the encoder keeps
+ * @param      in_fmt        Sample format of the decoder, which the encoder
+ *                           takes or comes closest to (see fmtneg.h)
+ * @param      global_header Whether the container wants global headers
+ * @return Error code (0 if successful)
+ */
+static int init_enckey(struct enckey *key, const struct tmp30_opts *opts, int sample_rate, enum AVSampleFormat in_fmt, int global_header)
+{
+    memset(key, 0, sizeof(*key));
+    if (!(key->codec = find_encoder(opts->codec))) {
+        fprintf(stderr, "Could not find an encoder for '%s'\n", *opts->codec ? opts->codec : "mp3");
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    key->bit_rate      = opts->bit_rate ? opts->bit_rate : OUTPUT_BIT_RATE;
+    key->channels      = opts->channels ? opts->channels : OUTPUT_CHANNELS;
+    key->vbr           = opts->vbr;
+    key->quality       = opts->quality;
+    key->sample_rate   = sample_rate;
+    /* The loudness and time-stretch stages put out planar float whatever
+     * they are fed. */
+    key->sample_fmt    = fmtneg_pick(key->codec, opts->loudness || opts->tempo ? AV_SAMPLE_FMT_FLTP : in_fmt);
+    key->global_header = global_header;
+    key->standalone    = opts->resumable;
+    return 0;
+}
+
+static int enckey_equal(const struct enckey *a, const struct enckey *b)
+{
+    return a->codec == b->codec && a->bit_rate == b->bit_rate &&
+           a->channels == b->channels && a->vbr == b->vbr &&
+           (!a->vbr || a->quality == b->quality) &&
+           a->sample_rate == b->sample_rate && a->sample_fmt == b->sample_fmt &&
+           a->global_header == b->global_header &&
+           a->standalone == b->standalone;
+}
+
+/**
+ * Open an encoder with the given parameters.
+ * @param      key    Encoder parameters
+ * @param[out] outccx Opened codec context
+ * @return Error code (0 if successful)
+ */
+static int open_encoder(const struct enckey *key, AVCodecContext **outccx)
+{
+    AVCodecContext *avctx;
+    int error;
+
+    avctx = avcodec_alloc_context3(key->codec);
+    if (!avctx) {
+        fprintf(stderr, "Could not allocate an encoding context\n");
+        return AVERROR(ENOMEM);
+    }
+
+    /* Set the basic encoder parameters. */
+    av_channel_layout_default(&avctx->ch_layout, key->channels);
+    avctx->sample_rate    = key->sample_rate;
+    avctx->sample_fmt     = key->sample_fmt;
+    avctx->bit_rate       = key->bit_rate;
+    /* VBR the way ffmpeg's -q:a does it. */
+    if (key->vbr) {
+        avctx->flags         |= AV_CODEC_FLAG_QSCALE;
+        avctx->global_quality = FF_QP2LAMBDA * key->quality;
+    }
+
+    /* Some container formats (like MP4) require global headers to be present.
+     * Mark the encoder so that it behaves accordingly. */
+    if (key->global_header)
+        avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    /* Frames that borrow bits from earlier ones can't follow a resume,
+     * which starts a new encoder; only libmp3lame has the option. */
+    if (key->standalone)
+        av_opt_set_int(avctx, "reservoir", 0, AV_OPT_SEARCH_CHILDREN);
+
+    /* Open the encoder for the audio stream to use it later. */
+    if ((error = avcodec_open2(avctx, key->codec, NULL)) < 0) {
+        fprintf(stderr, "Could not open output codec (error '%s')\n", av_err2str(error));
+        avcodec_free_context(&avctx);
+        return error;
+    }
+    *outccx = avctx;
+    return 0;
+}
+
+/**
+ * Find the pool entry for an encoder key, optionally adding it unless
+ * the pool has POOL_MAX_KEYS already. Called with the pool locked.
+ */
+static struct encentry *find_encentry(struct tmp30_pool *pool, const struct enckey *key, int add)
+{
+    struct encentry *e;
+    int i;
+
+    for (i = 0; i < pool->nb_enc; i++)
+        if (enckey_equal(&pool->enc[i].key, key))
+            return &pool->enc[i];
+    if (!add || pool->nb_enc == POOL_MAX_KEYS ||
+        av_reallocp_array(&pool->enc, pool->nb_enc + 1, sizeof(*pool->enc)) < 0)
+        return NULL;
+    e = &pool->enc[pool->nb_enc++];
+    memset(e, 0, sizeof(*e));
+    e->key = *key;
+    return e;
+}
+
+/**
+ * Take a warm encoder from the pool, or open a new one if there is
+ * no pool or no warm encoder for these parameters.
+ * @param      pool   Pool, or NULL
+ * @param      key    Encoder parameters
+ * @param[out] outccx Opened codec context
+ * @return Error code (0 if successful)
+ */
+static int get_encoder(struct tmp30_pool *pool, const struct enckey *key, AVCodecContext **outccx)
+{
+    struct encentry *e;
+
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        /* Remember the key even on a miss, so that replenishing keeps
+         * encoders for it ready for the next job. */
+        e = find_encentry(pool, key, 1);
+        if (e && e->nb_ctx) {
+            *outccx = e->ctx[--e->nb_ctx];
+            pool->enc_hits++;
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+        pool->enc_misses++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return open_encoder(key, outccx);
+}
+
+/**
+ * Give an encoder back after a transcode. Encoders that can be reset
+ * after draining (AV_CODEC_CAP_ENCODER_FLUSH) go back into the pool,
+ * the others are freed and replaced by tmp30_pool_replenish.
+ * @param pool   Pool, or NULL
+ * @param key    Parameters the encoder was opened with
+ * @param outccx Codec context, set to NULL on return
+ */
+static void put_encoder(struct tmp30_pool *pool, const struct enckey *key, AVCodecContext **outccx)
+{
+    struct encentry *e;
+
+    if (!*outccx)
+        return;
+    if (pool && ((*outccx)->codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH)) {
+        avcodec_flush_buffers(*outccx);
+        pthread_mutex_lock(&pool->lock);
+        e = find_encentry(pool, key, 0);
+        if (e && e->nb_ctx < POOL_MAX_CTX) {
+            e->ctx[e->nb_ctx++] = *outccx;
+            *outccx = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    avcodec_free_context(outccx);
+}
+
+/**
+ * Close an output file opened by open_output_file. A custom I/O context
+ * is released through xio_close, a file through avio_closep.
+ * @param outfcx Format context of the output file
+ */
+static void close_output_file(AVFormatContext **outfcx)
+{
+    if (!*outfcx)
+        return;
+    if ((*outfcx)->flags & AVFMT_FLAG_CUSTOM_IO)
+        xio_close(&(*outfcx)->pb);
+    else
+        avio_closep(&(*outfcx)->pb);
+    avformat_free_context(*outfcx);
+    *outfcx = NULL;
 }
 
 /**
@@ -139,21 +588,28 @@ static int open_input_file(const char *filename, AVFormatContext **inpfcx, AVCod
  * Also set some basic encoder parameters.
  * Some of these parameters are based on the input file's parameters.
  * @param      filename              File to be opened
+ * @param      pb                    Already opened I/O context (from xio.h),
+ *                                   or NULL to open filename. Owned by the
+ *                                   output from here on, even on failure.
+ * @param      opts                  Transcode settings: output container
+ *                                   (NULL to guess it from the file
+ *                                   extension), encoder and pool
  * @param      inpccx   Codec context of input file
+ * @param[out] key                   Parameters the encoder was opened with
  * @param[out] outfcx Format context of output file
  * @param[out] outccx  Codec context of output file
  * @return Error code (0 if successful)
  */
-static int open_output_file(const char *filename, AVCodecContext *inpccx, AVFormatContext **outfcx, AVCodecContext **outccx)
+static int open_output_file(const char *filename, AVIOContext *pb, const struct tmp30_opts *opts, AVCodecContext *inpccx, struct enckey *key, AVFormatContext **outfcx, AVCodecContext **outccx)
 {
     AVCodecContext *avctx          = NULL;
-    AVIOContext *output_io_context = NULL;
+    AVIOContext *output_io_context = pb;
     AVStream *stream               = NULL;
-    const AVCodec *output_codec    = NULL;
     int error;
 
     /* Open the output file to write to it. */
-    if ((error = avio_open(&output_io_context, filename, AVIO_FLAG_WRITE)) < 0) {
+    if (!output_io_context &&
+        (error = avio_open(&output_io_context, filename, AVIO_FLAG_WRITE)) < 0) {
         fprintf(stderr, "Could not open output file '%s' (error '%s')\n", filename, av_err2str(error));
         return error;
     }
@@ -161,14 +617,23 @@ static int open_output_file(const char *filename, AVCodecContext *inpccx, AVForm
     /* Create a new format context for the output container format. */
     if (!(*outfcx = avformat_alloc_context())) {
         fprintf(stderr, "Could not allocate output format context\n");
+        if (pb)
+            xio_close(&output_io_context);
+        else
+            avio_closep(&output_io_context);
         return AVERROR(ENOMEM);
     }
 
-    /* Associate the output file (pointer) with the container format context. */
+    /* Associate the output file (pointer) with the container format context.
+     * A custom context is marked so that close_output_file knows how to
+     * release it. */
     (*outfcx)->pb = output_io_context;
+    if (pb)
+        (*outfcx)->flags |= AVFMT_FLAG_CUSTOM_IO;
 
-    /* Guess the desired container format based on the file extension. */
-    if (!((*outfcx)->oformat = av_guess_format(NULL, filename, NULL))) {
+    /* Guess the desired container format based on the file extension,
+     * unless it was named explicitly. */
+    if (!((*outfcx)->oformat = av_guess_format(opts->out_format, filename, NULL))) {
         fprintf(stderr, "Could not find output file format\n");
         goto cleanup;
     }
@@ -179,12 +644,6 @@ static int open_output_file(const char *filename, AVCodecContext *inpccx, AVForm
         goto cleanup;
     }
 
-    /* Find the encoder to be used by its name. */
-    if (!(output_codec = avcodec_find_encoder(AV_CODEC_ID_MP3))) {
-        fprintf(stderr, "Could not find an MP3 encoder.\n");
-        goto cleanup;
-    }
-
     /* Create a new audio stream in the output file container. */
     if (!(stream = avformat_new_stream(*outfcx, NULL))) {
         fprintf(stderr, "Could not create new stream\n");
@@ -192,35 +651,19 @@ static int open_output_file(const char *filename, AVCodecContext *inpccx, AVForm
         goto cleanup;
     }
 
-    avctx = avcodec_alloc_context3(output_codec);
-    if (!avctx) {
-        fprintf(stderr, "Could not allocate an encoding context\n");
-        error = AVERROR(ENOMEM);
+    /* Take a warm encoder from the pool or open one.
+     * The input file's sample rate and, if the encoder takes it, sample
+     * format are used to avoid a conversion. */
+    if ((error = init_enckey(key, opts, inpccx->sample_rate, inpccx->sample_fmt,
+                             !!((*outfcx)->oformat->flags & AVFMT_GLOBALHEADER))) < 0)
+        goto cleanup;
+    if ((error = get_encoder(opts->pool, key, &avctx)) < 0)
         goto cleanup;
-    }
-
-    /* Set the basic encoder parameters.
-     * The input file's sample rate is used to avoid a sample rate conversion. */
-    av_channel_layout_default(&avctx->ch_layout, OUTPUT_CHANNELS);
-    avctx->sample_rate    = inpccx->sample_rate;
-    avctx->sample_fmt     = output_codec->sample_fmts[0];
-    avctx->bit_rate       = OUTPUT_BIT_RATE;
 
     /* Set the sample rate for the container. */
     stream->time_base.den = inpccx->sample_rate;
     stream->time_base.num = 1;
 
-    /* Some container formats (like MP4) require global headers to be present.
-     * Mark the encoder so that it behaves accordingly. */
-    if ((*outfcx)->oformat->flags & AVFMT_GLOBALHEADER)
-        avctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-
-    /* Open the encoder for the audio stream to use it later. */
-    if ((error = avcodec_open2(avctx, output_codec, NULL)) < 0) {
-        fprintf(stderr, "Could not open output codec (error '%s')\n", av_err2str(error));
-        goto cleanup;
-    }
-
     error = avcodec_parameters_from_context(stream->codecpar, avctx);
     if (error < 0) {
         fprintf(stderr, "Could not initialize stream parameters\n");
@@ -234,9 +677,7 @@ static int open_output_file(const char *filename, AVCodecContext *inpccx, AVForm
 
 cleanup:
     avcodec_free_context(&avctx);
-    avio_closep(&(*outfcx)->pb);
-    avformat_free_context(*outfcx);
-    *outfcx = NULL;
+    close_output_file(outfcx);
     return error < 0 ? error : AVERROR_EXIT;
 }
 
@@ -274,10 +715,12 @@ static int init_input_frame(AVFrame **frame)
  * libswresample takes care of this, but requires initialization.
  * @param      inpccx  Codec context of the input file
  * @param      outccx Codec context of the output file
+ * @param      out_fmt Sample format to convert to; the encoder's, or planar
+ *                     float for the loudness or time-stretch stage
  * @param[out] resccx     Resample context for the required conversion
  * @return Error code (0 if successful)
  */
-static int init_resampler(AVCodecContext *inpccx, AVCodecContext *outccx, SwrContext **resccx)
+static int init_resampler(AVCodecContext *inpccx, AVCodecContext *outccx, enum AVSampleFormat out_fmt, SwrContext **resccx)
 {
         int error;
 
@@ -285,19 +728,12 @@ static int init_resampler(AVCodecContext *inpccx, AVCodecContext *outccx, SwrCon
          * Create a resampler context for the conversion.
          * Set the conversion parameters.
          */
-        error = swr_alloc_set_opts2(resccx, &outccx->ch_layout, outccx->sample_fmt, outccx->sample_rate,
+        error = swr_alloc_set_opts2(resccx, &outccx->ch_layout, out_fmt, outccx->sample_rate,
                                             &inpccx->ch_layout, inpccx->sample_fmt, inpccx->sample_rate, 0, NULL);
         if (error < 0) {
             fprintf(stderr, "Could not allocate resample context\n");
             return error;
         }
-        /*
-        * Perform a sanity check so that the number of converted samples is
-        * not greater than the number of samples to be converted.
-        * If the sample rates differ, this case has to be handled differently
-        */
-        av_assert0(outccx->sample_rate == inpccx->sample_rate);
-
         /* Open the resampler with the specified parameters. */
         if ((error = swr_init(*resccx)) < 0) {
             fprintf(stderr, "Could not open resample context\n");
@@ -307,6 +743,110 @@ static int init_resampler(AVCodecContext *inpccx, AVCodecContext *outccx, SwrCon
     return 0;
 }
 
+static void init_swrkey(struct swrkey *key, AVCodecContext *inpccx, AVCodecContext *outccx, enum AVSampleFormat out_fmt)
+{
+    memset(key, 0, sizeof(*key));
+    av_channel_layout_copy(&key->in_layout, &inpccx->ch_layout);
+    av_channel_layout_copy(&key->out_layout, &outccx->ch_layout);
+    key->in_fmt   = inpccx->sample_fmt;
+    key->out_fmt  = out_fmt;
+    key->in_rate  = inpccx->sample_rate;
+    key->out_rate = outccx->sample_rate;
+}
+
+static int swrkey_equal(const struct swrkey *a, const struct swrkey *b)
+{
+    return a->in_fmt == b->in_fmt && a->out_fmt == b->out_fmt &&
+           a->in_rate == b->in_rate && a->out_rate == b->out_rate &&
+           !av_channel_layout_compare(&a->in_layout, &b->in_layout) &&
+           !av_channel_layout_compare(&a->out_layout, &b->out_layout);
+}
+
+static void uninit_swrkey(struct swrkey *key)
+{
+    av_channel_layout_uninit(&key->in_layout);
+    av_channel_layout_uninit(&key->out_layout);
+}
+
+/**
+ * Take a resampler for the conversion from the pool, or set up a new one.
+ * Pooled resamplers are re-initialized, which drops any state left from
+ * their previous job.
+ * @param      pool    Pool, or NULL
+ * @param      inpccx  Codec context of the input file
+ * @param      outccx  Codec context of the output file
+ * @param      out_fmt Sample format to convert to
+ * @param[out] key     Conversion parameters, to give the resampler back
+ * @param[out] resccx  Resample context for the required conversion
+ * @return Error code (0 if successful)
+ */
+static int get_resampler(struct tmp30_pool *pool, AVCodecContext *inpccx, AVCodecContext *outccx, enum AVSampleFormat out_fmt, struct swrkey *key, SwrContext **resccx)
+{
+    int i;
+
+    init_swrkey(key, inpccx, outccx, out_fmt);
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        for (i = 0; i < pool->nb_swr; i++) {
+            struct swrentry *e = &pool->swr[i];
+            if (swrkey_equal(&e->key, key) && e->nb_ctx) {
+                *resccx = e->ctx[--e->nb_ctx];
+                pool->swr_hits++;
+                break;
+            }
+        }
+        if (!*resccx)
+            pool->swr_misses++;
+        pthread_mutex_unlock(&pool->lock);
+        if (*resccx) {
+            int error;
+            if ((error = swr_init(*resccx)) < 0) {
+                fprintf(stderr, "Could not open resample context\n");
+                swr_free(resccx);
+            }
+            return error;
+        }
+    }
+    return init_resampler(inpccx, outccx, out_fmt, resccx);
+}
+
+/**
+ * Give a resampler back to the pool, or free it without one.
+ * @param pool   Pool, or NULL
+ * @param key    Conversion parameters, released here
+ * @param resccx Resample context, set to NULL on return
+ */
+static void put_resampler(struct tmp30_pool *pool, struct swrkey *key, SwrContext **resccx)
+{
+    struct swrentry *e = NULL;
+    int i;
+
+    if (pool && *resccx) {
+        pthread_mutex_lock(&pool->lock);
+        for (i = 0; i < pool->nb_swr && !e; i++)
+            if (swrkey_equal(&pool->swr[i].key, key))
+                e = &pool->swr[i];
+        if (!e && pool->nb_swr < POOL_MAX_KEYS &&
+            av_reallocp_array(&pool->swr, pool->nb_swr + 1, sizeof(*pool->swr)) >= 0) {
+            e = &pool->swr[pool->nb_swr++];
+            memset(e, 0, sizeof(*e));
+            av_channel_layout_copy(&e->key.in_layout, &key->in_layout);
+            av_channel_layout_copy(&e->key.out_layout, &key->out_layout);
+            e->key.in_fmt   = key->in_fmt;
+            e->key.out_fmt  = key->out_fmt;
+            e->key.in_rate  = key->in_rate;
+            e->key.out_rate = key->out_rate;
+        }
+        if (e && e->nb_ctx < POOL_MAX_CTX) {
+            e->ctx[e->nb_ctx++] = *resccx;
+            *resccx = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    swr_free(resccx);
+    uninit_swrkey(key);
+}
+
 /**
  * Initialize a FIFO buffer for the audio samples to be encoded.
  * @param[out] fifo                 Sample buffer
@@ -325,13 +865,14 @@ static int init_fifo(AVAudioFifo **fifo, AVCodecContext *outccx)
 
 /**
  * Write the header of the output file container.
- * @param outfcx Format context of the output file
+ * @param outfcx  Format context of the output file
+ * @param options Muxer options, or NULL
  * @return Error code (0 if successful)
  */
-static int write_output_file_header(AVFormatContext *outfcx) // take a format context (fcx) and wirte out (fcx must clearly contain outfname).
+static int write_output_file_header(AVFormatContext *outfcx, AVDictionary **options) // take a format context (fcx) and wirte out (fcx must clearly contain outfname).
 {
     int error;
-    if ((error = avformat_write_header(outfcx, NULL)) < 0) {
+    if ((error = avformat_write_header(outfcx, options)) < 0) {
         fprintf(stderr, "Could not write output file header (error '%s')\n", av_err2str(error));
         return error;
     }
@@ -343,18 +884,24 @@ static int write_output_file_header(AVFormatContext *outfcx) // take a format co
  * @param      frame                Audio frame to be decoded
  * @param      inpfcx Format context of the input file
  * @param      inpccx  Codec context of the input file
+ * @param      lv                   Live input to take the packet from
+ *                                  instead, or NULL
  * @param[out] data_present         Indicates whether data has been decoded
  * @param[out] finished             Indicates whether the end of file has
  *                                  been reached and all data has been
  *                                  decoded. If this flag is false, there
  *                                  is more data to be decoded, i.e., this
  *                                  function has to be called again.
+ * @param      st                   Run statistics, or NULL
  * @return Error code (0 if successful)
  */
-static int decode_audio_frame(AVFrame *frame, AVFormatContext *inpfcx, AVCodecContext *inpccx, int *data_present, int *finished)
+static int decode_audio_frame(AVFrame *frame, AVFormatContext *inpfcx, AVCodecContext *inpccx, struct live *lv, int *data_present, int *finished, struct xstat *st)
 {
     /* Packet used for temporary storage. */
     AVPacket *input_packet;
+    struct xstat_mark m;
+    /* At the end of the input: the empty packet flushes the decoder. */
+    int eof = 0;
 
     int error = init_packet(&input_packet);
     if (error < 0)
@@ -362,26 +909,38 @@ static int decode_audio_frame(AVFrame *frame, AVFormatContext *inpfcx, AVCodecCo
 
     *data_present = 0;
     *finished = 0;
+    xstat_mark(st, &m);
     /* Read one audio frame from the input file (fcx) into a temporary packet. */
-    if ((error = av_read_frame(inpfcx, input_packet)) < 0) {
+    if ((error = lv ? live_read(lv, input_packet) : fastopen_read_frame(inpfcx, input_packet)) < 0) {
         /* If we are at the end of the file, flush the decoder below. */
         if (error == AVERROR_EOF)
-            *finished = 1;
-        else {
+            eof = 1;
+        /* Nothing came in; an empty packet would flush the decoder. */
+        else if (error == AVERROR(EAGAIN)) {
+            error = 0;
+            goto cleanup;
+        } else {
             fprintf(stderr, "Could not read frame (error '%s')\n", av_err2str(error));
             goto cleanup;
         }
     }
+    xstat_add(st, XSTAT_DEMUX, &m, 0, !eof, 0, input_packet->size);
+    /* A live packet was read when the input thread got it. */
+    if (lv && !eof)
+        xstat_read(st, live_arrival(lv) * 1000);
 
     /* Send the audio frame stored in the temporary packet to the decoder.
-     * The input audio stream decoder is used to do this. */
-    if ((error = avcodec_send_packet(inpccx, input_packet)) < 0) {
+     * The input audio stream decoder is used to do this. Once flushing,
+     * the decoder refuses further empty packets with AVERROR_EOF. */
+    if ((error = avcodec_send_packet(inpccx, input_packet)) < 0 && !(eof && error == AVERROR_EOF)) {
         fprintf(stderr, "Could not send packet for decoding (error '%s')\n", av_err2str(error));
         goto cleanup;
     }
 
-    /* Receive one frame from the decoder. */
+    /* Receive one frame from the decoder; at the end of the input, one it
+     * held back, until it has none left. */
     error = avcodec_receive_frame(inpccx, frame);
+    xstat_add(st, XSTAT_DECODE, &m, error >= 0, !eof, error >= 0 ? frame->nb_samples : 0, 0);
     /* If the decoder asks for more data to be able to decode a frame,
      * return indicating that no data is present. */
     if (error == AVERROR(EAGAIN)) {
@@ -399,6 +958,7 @@ static int decode_audio_frame(AVFrame *frame, AVFormatContext *inpfcx, AVCodecCo
     /* Default case: Return decoded data. */
     } else {
         *data_present = 1;
+        fastopen_frame_decoded(inpfcx);
         goto cleanup;
     }
 
@@ -407,57 +967,49 @@ cleanup:
     return error;
 }
 
-/**
- * Initialize a temporary storage for the specified number of audio samples.
- * The conversion requires temporary storage due to the different format.
- * The number of audio samples to be allocated is specified in frame_size.
- * @param[out] converted_input_samples Array of converted samples. The
- *                                     dimensions are reference, channel
- *                                     (for multi-channel audio), sample.
- * @param      outccx    Codec context of the output file
- * @param      frame_size              Number of samples to be converted in
- *                                     each round
- * @return Error code (0 if successful)
- */
-static int init_converted_samples(uint8_t ***conv_isamps, AVCodecContext *outccx, int frame_size)
-{
-    int error;
-
-    /* Allocate as many pointers as there are audio channels.
-     * Each pointer will point to the audio samples of the corresponding
-     * channels (although it may be NULL for interleaved formats).
-     * Allocate memory for the samples of all channels in one consecutive
-     * block for convenience. */
-    if ((error = av_samples_alloc_array_and_samples(conv_isamps, NULL, outccx->ch_layout.nb_channels, frame_size, outccx->sample_fmt, 0)) < 0) {
-        fprintf(stderr, "Could not allocate converted input samples (error '%s')\n", av_err2str(error));
-        return error;
-    }
-    return 0;
-}
-
 /**
  * Convert the input audio samples into the output sample format.
  * The conversion happens on a per-frame basis, the size of which is
- * specified by frame_size.
+ * specified by frame_size. At another sample rate, more or fewer
+ * samples come out, and some are held back until the next call.
  * @param      input_data       Samples to be decoded. The dimensions are
  *                              channel (for multi-channel audio), sample.
+ *                              NULL takes out what is held back.
  * @param[out] converted_data   Converted samples. The dimensions are channel
  *                              (for multi-channel audio), sample.
+ * @param      out_size         Room for converted samples, from
+ *                              swr_get_out_samples()
  * @param      frame_size       Number of samples to be converted
  * @param      resccx Resample context for the conversion
- * @return Error code (0 if successful)
+ * @return Number of converted samples, or an error code
  */
-static int convert_samples(const uint8_t **input_data, uint8_t **converted_data, const int frame_size, SwrContext *resccx)
+static int convert_samples(const uint8_t **input_data, uint8_t **converted_data, const int out_size, const int frame_size, SwrContext *resccx)
 {
-    int error;
+    int ret;
 
     /* Convert the samples using the resampler. */
-    if ((error = swr_convert(resccx, converted_data, frame_size, input_data, frame_size)) < 0) {
-        fprintf(stderr, "Could not convert input samples (error '%s')\n", av_err2str(error));
-        return error;
-    }
+    if ((ret = swr_convert(resccx, converted_data, out_size, input_data, frame_size)) < 0)
+        fprintf(stderr, "Could not convert input samples (error '%s')\n", av_err2str(ret));
 
-    return 0;
+    return ret;
+}
+
+/**
+ * Point at the samples of a buffer from an offset on.
+ * @param[out] dst      One pointer per plane
+ * @param      src      Buffer
+ * @param      offset   Samples to leave out
+ * @param      channels Number of channels
+ * @param      fmt      Sample format
+ */
+static void offset_samples(const uint8_t **dst, const uint8_t *const *src, int offset, int channels, enum AVSampleFormat fmt)
+{
+    const int planar = av_sample_fmt_is_planar(fmt);
+    const int step   = offset * av_get_bytes_per_sample(fmt) * (planar ? 1 : channels);
+    int i;
+
+    for (i = 0; i < (planar ? FFMIN(channels, MAX_PLANES) : 1); i++)
+        dst[i] = src[i] + step;
 }
 
 /**
@@ -487,69 +1039,334 @@ static int add_samples_to_fifo(AVAudioFifo *fifo, uint8_t **converted_input_samp
     return 0;
 }
 
+/**
+ * Position of an input timestamp, in samples from the start of the stream.
+ * @param stream      Input stream
+ * @param pts         Timestamp in the stream's time base
+ * @param sample_rate Sample rate of the stream
+ * @return Sample position
+ */
+static int64_t input_position(const AVStream *stream, int64_t pts, int sample_rate)
+{
+    if (stream->start_time != AV_NOPTS_VALUE)
+        pts -= stream->start_time;
+    return av_rescale_q(pts, stream->time_base, (AVRational){ 1, sample_rate });
+}
+
+/**
+ * Cut a decoded frame down to the samples from skip to nb_samples, into
+ * a buffer of its own (the filters may want theirs aligned).
+ * @param frame      Frame, replaced by the cut one
+ * @param stream     Stream the frame comes from
+ * @param skip       Samples to drop from the start
+ * @param nb_samples Samples to keep up to
+ * @return Error code (0 if successful)
+ */
+static int trim_frame(AVFrame *frame, const AVStream *stream, int skip, int nb_samples)
+{
+    AVFrame *cut;
+    int error;
+
+    if (!skip && nb_samples == frame->nb_samples)
+        return 0;
+    if (!(cut = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    cut->format      = frame->format;
+    cut->sample_rate = frame->sample_rate;
+    cut->nb_samples  = nb_samples - skip;
+    if ((error = av_channel_layout_copy(&cut->ch_layout, &frame->ch_layout)) < 0 ||
+        (error = av_frame_get_buffer(cut, 0)) < 0 ||
+        (error = av_frame_copy_props(cut, frame)) < 0) {
+        av_frame_free(&cut);
+        return error;
+    }
+    av_samples_copy(cut->extended_data, frame->extended_data, 0, skip, cut->nb_samples,
+                    frame->ch_layout.nb_channels, frame->format);
+    if (frame->pts != AV_NOPTS_VALUE)
+        cut->pts = frame->pts + av_rescale_q(skip, (AVRational){ 1, frame->sample_rate }, stream->time_base);
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, cut);
+    av_frame_free(&cut);
+    return 0;
+}
+
+/**
+ * Put a decoded frame through the filter stage and store what comes out,
+ * in the format of the loudness stage or the FIFO already.
+ * @param fg     Filter stage
+ * @param frame  Decoded frame, taken over; NULL for none
+ * @param flush  The input ends here, the filters put out what they hold
+ * @param fifo   Buffer to store into
+ * @param zf     Zero-copy FIFO used instead, or NULL
+ * @param ld     Loudness stage to store into instead, or NULL
+ * @param outccx Codec context of the output file
+ * @param st     Run statistics, or NULL
+ * @return Error code (0 if successful)
+ */
+static int filter_and_store(struct fgraph *fg, AVFrame *frame, int flush, AVAudioFifo *fifo, struct zfifo *zf,
+                            struct loud *ld, AVCodecContext *outccx, struct xstat *st)
+{
+    struct xstat_mark m;
+    AVFrame *out;
+    int error;
+
+    xstat_mark(st, &m);
+    if ((frame && fgraph_send(fg, frame) < 0) || (flush && fgraph_send(fg, NULL) < 0))
+        return AVERROR_EXIT;
+    if (!(out = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    while ((error = fgraph_receive(fg, out)) >= 0) {
+        const int nb_samples = out->nb_samples;
+
+        xstat_add(st, XSTAT_FILTER, &m, 1, 0, nb_samples, 0);
+        if (ld) {
+            error = loud_write(ld, (const float *const *)out->extended_data, nb_samples, fifo);
+            xstat_queue(st, nb_samples, 0);
+            xstat_add(st, XSTAT_LOUDNESS, &m, 1, 0, nb_samples, 0);
+        } else if (zf) {
+            uint8_t **planes;
+            if ((error = zfifo_space(zf, nb_samples, &planes)) >= 0) {
+                av_samples_copy(planes, out->extended_data, 0, 0, nb_samples,
+                                outccx->ch_layout.nb_channels, outccx->sample_fmt);
+                zfifo_commit(zf, nb_samples);
+                xstat_queue(st, nb_samples, 0);
+                xstat_fifo(st, zfifo_size(zf));
+            }
+        } else {
+            error = add_samples_to_fifo(fifo, out->extended_data, nb_samples);
+            xstat_queue(st, nb_samples, 0);
+            xstat_add(st, XSTAT_FIFO, &m, 0, 0, nb_samples, 0);
+            xstat_fifo(st, av_audio_fifo_size(fifo));
+        }
+        av_frame_unref(out);
+        if (error < 0)
+            break;
+    }
+    av_frame_free(&out);
+    return error == AVERROR(EAGAIN) || error == AVERROR_EOF ? 0 : AVERROR_EXIT;
+}
+
+/**
+ * Store converted samples: through the loudness or time-stretch stage,
+ * if there is one, or else into the FIFO buffer.
+ * @param fifo       FIFO buffer
+ * @param outccx     Codec context of the output file
+ * @param ld         Loudness stage, or NULL
+ * @param ts         Time-stretch stage, or NULL
+ * @param samples    Converted samples; planar float with ld or ts
+ * @param nb_samples Number of samples
+ * @param m          Mark of when the conversion started
+ * @param st         Timing statistics, or NULL
+ * @return Error code (0 if successful)
+ */
+static int store_samples(AVAudioFifo *fifo, AVCodecContext *outccx, struct loud *ld, struct tstretch *ts,
+                         uint8_t **samples, int nb_samples, struct xstat_mark *m, struct xstat *st)
+{
+    if (ld || ts) {
+        const float *planes[AV_NUM_DATA_POINTERS];
+        int c, n;
+        for (c = 0; c < FFMIN(outccx->ch_layout.nb_channels, AV_NUM_DATA_POINTERS); c++)
+            planes[c] = (const float *)samples[c];
+        if (ld) {
+            /* Measure and normalize; what leaves the lookahead goes on
+             * into the FIFO. */
+            if (loud_write(ld, planes, nb_samples, fifo))
+                return AVERROR_EXIT;
+            xstat_queue(st, nb_samples, 0);
+            xstat_add(st, XSTAT_LOUDNESS, m, 1, 0, nb_samples, 0);
+        } else {
+            /* Stretch; the output the samples complete goes on into
+             * the FIFO. */
+            if ((n = tstretch_write(ts, planes, nb_samples, fifo)) < 0)
+                return AVERROR_EXIT;
+            xstat_queue(st, n, 0);
+            xstat_add(st, XSTAT_STRETCH, m, 1, 0, nb_samples, 0);
+        }
+    } else {
+        /* Add the converted input samples to the FIFO buffer for later
+         * processing. */
+        if (add_samples_to_fifo(fifo, samples, nb_samples))
+            return AVERROR_EXIT;
+        xstat_queue(st, nb_samples, 0);
+        xstat_add(st, XSTAT_FIFO, m, 0, 0, nb_samples, 0);
+    }
+    xstat_fifo(st, av_audio_fifo_size(fifo));
+    return 0;
+}
+
 /**
  * Read one audio frame from the input file, decode, convert and store
  * it in the FIFO buffer.
  * @param      fifo                 Buffer used for temporary storage
+ * @param      zf                   Zero-copy FIFO used instead, or NULL
  * @param      inpfcx Format context of the input file
  * @param      inpccx  Codec context of the input file
  * @param      outccx Codec context of the output file
- * @param      resampler_context    Resample context for the conversion
+ * @param      resampler_context    Resample context for the conversion, or
+ *                                  NULL if the decoded samples need none
+ * @param      fp                   Where the converted samples go
+ * @param      ld                   Loudness stage the converted samples go
+ *                                  through on their way to the FIFO, or NULL
+ * @param      ts                   Time-stretch stage they go through
+ *                                  instead, or NULL
+ * @param      fg                   Filter stage the decoded samples go
+ *                                  through in place of the resampler, or NULL
+ * @param      drop_until           Samples before this position are decoded
+ *                                  (or read from pcm) but dropped (resume,
+ *                                  trim); INT64_MIN for none
+ * @param      stop_at              Samples from this position on are
+ *                                  dropped, and reaching it finishes the
+ *                                  input; INT64_MAX for none
+ * @param      pcm                  Cached decoded samples to take instead of
+ *                                  decoding, or cache to add the decoded
+ *                                  samples to, or NULL
+ * @param      lv                   Live input to read from, or NULL
+ * @param[out] in_pts               Timestamp of the decoded frame
  * @param[out] finished             Indicates whether the end of file has
  *                                  been reached and all data has been
  *                                  decoded. If this flag is false,
  *                                  there is more data to be decoded,
  *                                  i.e., this function has to be called
  *                                  again.
+ * @param      st                   Run statistics, or NULL
  * @return Error code (0 if successful)
  */
-static int read_decode_convert_and_store(AVAudioFifo *fifo, AVFormatContext *inpfcx, AVCodecContext *inpccx, AVCodecContext *outccx, SwrContext *resampler_context, int *finished)
+static int read_decode_convert_and_store(AVAudioFifo *fifo, struct zfifo *zf, AVFormatContext *inpfcx, AVCodecContext *inpccx, AVCodecContext *outccx, SwrContext *resampler_context, struct fpool *fp, struct loud *ld, struct tstretch *ts, struct fgraph *fg, int64_t drop_until, int64_t stop_at, struct pcmcache *pcm, struct live *lv, int64_t *in_pts, int *finished, struct xstat *st)
 {
     int ret = AVERROR_EXIT;
+    struct xstat_mark m;
+    /* Samples to convert: the decoded frame's, or the cache's. */
+    const uint8_t *pcm_data;
+    const uint8_t **input_data;
+    int nb_samples;
 
     /* Temporary storage of the input samples of the frame read from the file. */
     AVFrame *input_frame = NULL;
+    /* Storage for the converted input samples, kept by fp from frame to frame. */
+    uint8_t **conv_isamps; // converted_input_samples
     /* Initialize temporary storage for one input frame. */
     if (init_input_frame(&input_frame))
         goto cleanup;
 
-    /* Decode one frame worth of audio samples. */
+    /* Decode one frame worth of audio samples, or take as many straight
+     * out of the cache. */
     int data_present;
-    if (decode_audio_frame(input_frame, inpfcx, inpccx, &data_present, finished))
-        goto cleanup;
+    /* Position of the cache's samples */
+    int64_t pcm_pos = AV_NOPTS_VALUE;
+    if (pcm && pcmcache_reading(pcm)) {
+        xstat_mark(st, &m);
+        pcm_pos      = pcmcache_position(pcm);
+        nb_samples   = pcmcache_read(pcm, &pcm_data, PCMCACHE_BLOCK);
+        input_data   = &pcm_data;
+        data_present = nb_samples > 0;
+        *finished    = !data_present;
+        xstat_read(st, 0);
+        xstat_add(st, XSTAT_DECODE, &m, data_present, 0, nb_samples, 0);
+    } else {
+        if (decode_audio_frame(input_frame, inpfcx, inpccx, lv, &data_present, finished, st))
+            goto cleanup;
+        if (data_present && pcm && pcmcache_write(pcm, input_frame) < 0)
+            goto cleanup;
+        input_data = (const uint8_t **)input_frame->extended_data;
+        nb_samples = input_frame->nb_samples;
+    }
 
     /* If we are at the end of the file and there are no more samples
      * in the decoder which are delayed, we are actually finished.
      * This must not be treated as an error. */
     if (*finished) {
-        ret = 0;
+        /* The filters hold on to some samples until they know it. */
+        ret = fg ? filter_and_store(fg, NULL, 1, fifo, zf, ld, outccx, st) : 0;
         goto cleanup;
     }
 
-    /* Temporary storage for the converted input samples. */
-    uint8_t **conv_isamps = NULL; // converted_input_samples
     /* If there is decoded data, convert and store it. */
     if (data_present) {
-        /* Initialize the temporary storage for the converted input samples. */
-        if (init_converted_samples(&conv_isamps, outccx, input_frame->nb_samples))
+        const uint8_t *from[MAX_PLANES];
+        int64_t pos = pcm_pos;
+        int skip = 0, kept, size = 0;
+
+        if (pos == AV_NOPTS_VALUE && input_frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            *in_pts = input_frame->best_effort_timestamp;
+            pos = input_position(inpfcx->streams[0], *in_pts, inpccx->sample_rate);
+        }
+        if (pos != AV_NOPTS_VALUE) {
+            if (drop_until != INT64_MIN)
+                skip = av_clip64(drop_until - pos, 0, nb_samples);
+            /* What is past the end is cut off, and nothing more is read. */
+            if (stop_at != INT64_MAX && pos + nb_samples >= stop_at) {
+                nb_samples = av_clip64(stop_at - pos, 0, nb_samples);
+                *finished  = 1;
+            }
+        }
+        /* The filters take the frame by reference, less what is
+         * dropped, and put out what goes on as it is. */
+        if (fg) {
+            if (skip < nb_samples &&
+                trim_frame(input_frame, inpfcx->streams[0], skip, nb_samples) < 0)
+                goto cleanup;
+            ret = filter_and_store(fg, skip < nb_samples ? input_frame : NULL, *finished,
+                                   fifo, zf, ld, outccx, st);
+            goto cleanup;
+        }
+        if (skip >= nb_samples) {
+            ret = 0;
+            goto cleanup;
+        }
+
+        xstat_mark(st, &m);
+        /* Only what is kept is converted: the FIFO may still hold the
+         * end of the last snippet of an edit list. */
+        if (skip) {
+            offset_samples(from, (const uint8_t *const *)input_data, skip,
+                           inpccx->ch_layout.nb_channels, inpccx->sample_fmt);
+            input_data = from;
+        }
+        kept = nb_samples - skip;
+        /* At another sample rate, the resampler makes more or fewer. */
+        if (resampler_context && (size = swr_get_out_samples(resampler_context, kept)) < 0)
             goto cleanup;
 
-        /* Convert the input samples to the desired output sample format.
-         * This requires a temporary storage provided by converted_input_samples. */
-        if (convert_samples((const uint8_t**)input_frame->extended_data, conv_isamps, input_frame->nb_samples, resampler_context))
+        /* The zero-copy FIFO is converted into where the samples stay
+         * until the encoder has read them. */
+        if (zf) {
+            uint8_t **planes;
+            if (zfifo_space(zf, resampler_context ? size : kept, &planes) < 0)
+                goto cleanup;
+            if (!resampler_context)
+                av_samples_copy(planes, (uint8_t *const *)input_data, 0, 0, kept,
+                                outccx->ch_layout.nb_channels, outccx->sample_fmt);
+            else if ((kept = convert_samples(input_data, planes, size, kept, resampler_context)) < 0)
+                goto cleanup;
+            zfifo_commit(zf, kept);
+            xstat_queue(st, kept, 0);
+            xstat_add(st, XSTAT_CONVERT, &m, 1, 0, nb_samples, 0);
+            xstat_fifo(st, zfifo_size(zf));
+            ret = 0;
             goto cleanup;
+        }
 
-        /* Add the converted input samples to the FIFO buffer for later processing. */
-        if (add_samples_to_fifo(fifo, conv_isamps, input_frame->nb_samples))
+        if (resampler_context) {
+            /* Get the storage for the converted input samples. */
+            if (fpool_scratch(fp, &conv_isamps, outccx->ch_layout.nb_channels, size,
+                              ld || ts ? AV_SAMPLE_FMT_FLTP : outccx->sample_fmt))
+                goto cleanup;
+
+            /* Convert the input samples to the desired output sample format.
+             * This requires a temporary storage provided by converted_input_samples. */
+            if ((kept = convert_samples(input_data, conv_isamps, size, kept, resampler_context)) < 0)
+                goto cleanup;
+            xstat_add(st, XSTAT_CONVERT, &m, 1, 0, nb_samples, 0);
+        } else
+            /* Already in the output format: stored as decoded. */
+            conv_isamps = (uint8_t **)input_data;
+
+        if (store_samples(fifo, outccx, ld, ts, conv_isamps, kept, &m, st))
             goto cleanup;
-        ret = 0;
     }
     ret = 0;
 
 cleanup:
-    if (conv_isamps)
-        av_freep(&conv_isamps[0]);
-    av_freep(&conv_isamps);
     av_frame_free(&input_frame);
 
     return ret;
@@ -598,16 +1415,24 @@ static int init_output_frame(AVFrame **frame, AVCodecContext *outccx, int frame_
  * Encode one frame worth of audio to the output file.
  * @param      frame                 Samples to be encoded
  * @param      outfcx Format context of the output file
+ * @param      sg                    Segmenter to write to instead, or NULL
  * @param      outccx  Codec context of the output file
+ * @param[in,out] pts                Timestamp for the frame, advanced by
+ *                                   its number of samples
+ * @param[in,out] written            End of the last packet in the output,
+ *                                   in samples; packets starting before it
+ *                                   are dropped (resume)
  * @param[out] data_present          Indicates whether data has been
  *                                   encoded
+ * @param      st                    Run statistics, or NULL
  * @return Error code (0 if successful)
  */
-static int encode_audio_frame(AVFrame *frame, AVFormatContext *outfcx, AVCodecContext *outccx, int *data_present)
+static int encode_audio_frame(AVFrame *frame, AVFormatContext *outfcx, struct seg *sg, AVCodecContext *outccx, int64_t *pts, int64_t *written, int *data_present, struct xstat *st)
 {
     /* Packet used for temporary storage. */
     AVPacket *output_packet;
-    int error;
+    struct xstat_mark m;
+    int size, error;
 
     error = init_packet(&output_packet);
     if (error < 0)
@@ -615,11 +1440,12 @@ static int encode_audio_frame(AVFrame *frame, AVFormatContext *outfcx, AVCodecCo
 
     /* Set a timestamp based on the sample rate for the container. */
     if (frame) {
-        frame->pts = pts;
-        pts += frame->nb_samples;
+        frame->pts = *pts;
+        *pts += frame->nb_samples;
     }
 
     *data_present = 0;
+    xstat_mark(st, &m);
     /* Send the audio frame stored in the temporary packet to the encoder.
      * The output audio stream encoder is used to do this. */
     error = avcodec_send_frame(outccx, frame);
@@ -632,6 +1458,8 @@ static int encode_audio_frame(AVFrame *frame, AVFormatContext *outfcx, AVCodecCo
 
     /* Receive one encoded frame from the encoder. */
     error = avcodec_receive_packet(outccx, output_packet);
+    size = error >= 0 ? output_packet->size : 0;
+    xstat_add(st, XSTAT_ENCODE, &m, frame != NULL, error >= 0, frame ? frame->nb_samples : 0, size);
     /* If the encoder asks for more data to be able to provide an
      * encoded frame, return indicating that no data is present. */
     if (error == AVERROR(EAGAIN)) {
@@ -649,12 +1477,23 @@ static int encode_audio_frame(AVFrame *frame, AVFormatContext *outfcx, AVCodecCo
         *data_present = 1;
     }
 
-    /* Write one audio frame from the temporary packet to the output file. */
-    if (*data_present &&
+    /* A resumed encoder repeats what is already in the output. */
+    if (output_packet->pts < *written)
+        goto cleanup;
+    *written = output_packet->pts + output_packet->duration;
+
+    /* Write one audio frame from the temporary packet to the output file,
+     * or to the segment it belongs to. */
+    if (sg) {
+        if ((error = seg_write(sg, output_packet)) < 0)
+            goto cleanup;
+    } else if (*data_present &&
         (error = av_write_frame(outfcx, output_packet)) < 0) {
         fprintf(stderr, "Could not write frame (error '%s')\n", av_err2str(error));
         goto cleanup;
     }
+    if (*data_present)
+        xstat_add(st, XSTAT_MUX, &m, 0, 1, 0, size);
 
 cleanup:
     av_packet_free(&output_packet);
@@ -665,36 +1504,52 @@ cleanup:
  * Load one audio frame from the FIFO buffer, encode and write it to the
  * output file.
  * @param fifo                  Buffer used for temporary storage
+ * @param zf                    Zero-copy FIFO used instead, or NULL
  * @param outfcx Format context of the output file
+ * @param sg                    Segmenter to write to instead, or NULL
  * @param outccx  Codec context of the output file
+ * @param pts                   Timestamp for the next frame
+ * @param written               End of the output so far, see encode_audio_frame
+ * @param st                    Run statistics, or NULL
  * @return Error code (0 if successful)
  */
-static int load_encode_and_write(AVAudioFifo *fifo, AVFormatContext *outfcx, AVCodecContext *outccx)
+static int load_encode_and_write(AVAudioFifo *fifo, struct zfifo *zf, AVFormatContext *outfcx, struct seg *sg, AVCodecContext *outccx, int64_t *pts, int64_t *written, struct xstat *st)
 {
     /* Temporary storage of the output samples of the frame written to the file. */
     AVFrame *output_frame;
     /* Use the maximum number of possible samples per frame.
      * If there is less than the maximum possible frame size in the FIFO
      * buffer use this number. Otherwise, use the maximum possible frame size. */
-    const int frame_size = FFMIN(av_audio_fifo_size(fifo),
+    const int frame_size = FFMIN(zf ? zfifo_size(zf) : av_audio_fifo_size(fifo),
                                  outccx->frame_size);
+    struct xstat_mark m;
     int data_written;
 
+    xstat_mark(st, &m);
+    /* A zero-copy frame is the samples where they are in the FIFO. */
+    if (zf) {
+        if (!(output_frame = av_frame_alloc()) || zfifo_lend(zf, output_frame, frame_size) < 0) {
+            av_frame_free(&output_frame);
+            return AVERROR_EXIT;
+        }
     /* Initialize temporary storage for one output frame. */
-    if (init_output_frame(&output_frame, outccx, frame_size))
+    } else if (init_output_frame(&output_frame, outccx, frame_size))
         return AVERROR_EXIT;
 
     /* Read as many samples from the FIFO buffer as required to fill the frame.
      * The samples are stored in the frame temporarily. */
-    if (av_audio_fifo_read(fifo, (void **)output_frame->data, frame_size) < frame_size) {
+    if (!zf && av_audio_fifo_read(fifo, (void **)output_frame->data, frame_size) < frame_size) {
         fprintf(stderr, "Could not read data from FIFO\n");
         av_frame_free(&output_frame);
         return AVERROR_EXIT;
     }
+    /* The samples were counted going in. */
+    xstat_dequeue(st, frame_size, 1);
+    xstat_add(st, XSTAT_FIFO, &m, 0, 0, 0, 0);
 
     /* Encode one frame worth of audio samples. */
-    if (encode_audio_frame(output_frame, outfcx,
-                           outccx, &data_written)) {
+    if (encode_audio_frame(output_frame, outfcx, sg,
+                           outccx, pts, written, &data_written, st)) {
         av_frame_free(&output_frame);
         return AVERROR_EXIT;
     }
@@ -718,45 +1573,200 @@ static int write_output_file_trailer(AVFormatContext *outfcx)
     return 0;
 }
 
-int main(int argc, char **argv)
+/**
+ * Record how much of the output is complete, see ckpt.h.
+ * @param xc Transcode state
+ * @return Error code (0 if successful)
+ */
+static int take_checkpoint(struct xcode *xc)
 {
-    AVFormatContext *inpfcx = NULL, *outfcx = NULL;
-    AVCodecContext *inpccx = NULL, *outccx = NULL;
-    SwrContext *resccx = NULL;
-    AVAudioFifo *fifo = NULL;
-    int ret = AVERROR_EXIT;
-
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
-        exit(1);
+    AVIOContext *pb = xc->outfcx->pb;
+
+    xc->ckpt_last = av_gettime_relative();
+    /* Nothing written yet, nothing to resume from. */
+    if (xc->written == INT64_MIN)
+        return 0;
+    avio_flush(pb);
+    if (pb->error < 0) {
+        fprintf(stderr, "Could not write output (error '%s')\n", av_err2str(pb->error));
+        return pb->error;
     }
+    xc->ck.out_bytes   = avio_tell(pb);
+    xc->ck.out_samples = xc->written;
+    xc->ck.in_pts      = xc->in_pts;
+    return ckpt_save(xc->ckpt_out, &xc->ck);
+}
 
-    /* Open the input file for reading. */
-    if (open_input_file(argv[1], &inpfcx, &inpccx))
-        goto cleanup;
-
-    /* Open the output file for writing. */
-    if (open_output_file(argv[2], inpccx, &outfcx, &outccx))
-        goto cleanup;
+/**
+ * Number of samples waiting for the encoder.
+ * @param xc Transcode state
+ */
+static int fifo_size(const struct xcode *xc)
+{
+    return xc->zf ? zfifo_size(xc->zf) : av_audio_fifo_size(xc->fifo);
+}
 
-    /* Initialize the resampler to be able to convert audio sample formats. */
-    if (init_resampler(inpccx, outccx, &resccx))
-        goto cleanup;
+/**
+ * Flush the encoder, as it may have delayed frames.
+ * @param xc Transcode state
+ * @return Error code (0 if successful)
+ */
+static int flush_encoder(struct xcode *xc)
+{
+    int data_written;
 
-    /* Initialize the FIFO buffer to store audio samples to be encoded. */
-    if (init_fifo(&fifo, outccx))
-        goto cleanup;
+    do {
+        if (encode_audio_frame(NULL, xc->outfcx, xc->sg, xc->outccx, &xc->pts, &xc->written, &data_written, xc->st))
+            return AVERROR_EXIT;
+    } while (data_written);
+    return 0;
+}
 
-    /* Write the header of the output file container. */
-    if (write_output_file_header(outfcx))
-        goto cleanup;
+/**
+ * Seek the input to a little before a sample and start the encoder at it;
+ * the samples decoded before it are dropped.
+ * @param xc    Transcode state
+ * @param start Input sample, see preroll_start
+ * @param fo    Fast-open state, whose kept packets are no longer wanted
+ * @return Error code (0 if successful)
+ */
+static int seek_input(struct xcode *xc, int64_t start, struct fastopen *fo)
+{
+    const AVStream *stream = xc->inpfcx->streams[0];
+    const int rate = xc->inpccx->sample_rate;
+    int64_t seek;
+    int error;
+
+    /* Half a second for the decoder to settle before the samples count. */
+    seek = av_rescale_q(FFMAX(start - rate / 2, 0), (AVRational){ 1, rate }, stream->time_base);
+    if (stream->start_time != AV_NOPTS_VALUE)
+        seek += stream->start_time;
+    fastopen_discard(fo);
+    if ((error = av_seek_frame(xc->inpfcx, 0, seek, AVSEEK_FLAG_BACKWARD)) < 0) {
+        fprintf(stderr, "Could not seek input (error '%s')\n", av_err2str(error));
+        return error;
+    }
+    avcodec_flush_buffers(xc->inpccx);
+    xc->pts        = start;
+    xc->drop_until = start;
+    return 0;
+}
+
+/**
+ * Start on a snippet of the input: seek to a little before its start, if
+ * the input can seek (else the samples up to it are decoded and dropped),
+ * or right to it in cached samples, and finish the input at its end. The
+ * encoder's timestamps go on.
+ * @param xc Transcode state with the input opened
+ * @param e  Snippet
+ * @return Error code (0 if successful)
+ */
+static int start_edit(struct xcode *xc, const struct edit *e)
+{
+    const int rate = xc->inpccx->sample_rate;
+    const int64_t start = av_rescale(e->start, rate, AV_TIME_BASE), pts = xc->pts;
+    int error;
+
+    xc->drop_until = INT64_MIN;
+    xc->stop_at    = e->length ? start + av_rescale(e->length, rate, AV_TIME_BASE) : INT64_MAX;
+    /* Cached samples are right where their position says. */
+    if (xc->pcm && pcmcache_reading(xc->pcm))
+        return pcmcache_seek(xc->pcm, start);
+    if (start && xc->inpfcx->pb && xc->inpfcx->pb->seekable) {
+        if ((error = seek_input(xc, start, xc->fo)) < 0)
+            return error;
+        xc->pts = pts;
+    } else if (start)
+        xc->drop_until = start;
+    return 0;
+}
+
+/**
+ * Take out what the resampler holds back at the end of a snippet: at
+ * another sample rate, the last input samples only come out once it is
+ * told that no more follow. Its next swr_init() starts it over.
+ * @param xc Transcode state
+ * @return Number of samples stored (0 if none were held back), or an
+ *         error code
+ */
+static int flush_resampler(struct xcode *xc)
+{
+    struct xstat_mark m;
+    uint8_t **planes;
+    int size, n;
+
+    if (!xc->resccx || swr_get_delay(xc->resccx, xc->inpccx->sample_rate) <= 0)
+        return 0;
+    if ((size = swr_get_out_samples(xc->resccx, 0)) <= 0)
+        return size;
+    xstat_mark(xc->st, &m);
+    if (xc->zf ? zfifo_space(xc->zf, size, &planes) < 0 :
+        fpool_scratch(xc->fp, &planes, xc->outccx->ch_layout.nb_channels, size,
+                      xc->ld || xc->ts ? AV_SAMPLE_FMT_FLTP : xc->outccx->sample_fmt) != 0)
+        return AVERROR_EXIT;
+    if ((n = convert_samples(NULL, planes, size, 0, xc->resccx)) <= 0)
+        return n;
+    if (xc->zf) {
+        zfifo_commit(xc->zf, n);
+        xstat_queue(xc->st, n, 0);
+        xstat_add(xc->st, XSTAT_CONVERT, &m, 0, 0, 0, 0);
+        xstat_fifo(xc->st, zfifo_size(xc->zf));
+    } else if (store_samples(xc->fifo, xc->outccx, xc->ld, xc->ts, planes, n, &m, xc->st))
+        return AVERROR_EXIT;
+    return n;
+}
+
+/**
+ * Go on with the next snippet of the edit list: its file takes the place
+ * of the finished input, and the FIFO, encoder and output go on.
+ * @param xc Transcode state
+ * @return Error code (0 if successful)
+ */
+static int next_edit(struct xcode *xc)
+{
+    const struct edit *e = &xc->el->edits[xc->next_edit++];
+    const enum AVSampleFormat conv_fmt = xc->ld || xc->ts ? AV_SAMPLE_FMT_FLTP : xc->outccx->sample_fmt;
+    int error;
+
+    put_resampler(xc->pool, &xc->swrkey, &xc->resccx);
+    avcodec_free_context(&xc->inpccx);
+    close_input_file(&xc->inpfcx);
+    pcmcache_free(&xc->pcm);
+    fastopen_uninit(xc->fo);
+    fastopen_init(xc->fo, xc->fo->enabled);
+    /* The snippet's decoded samples may be cached from a whole run. */
+    if (xc->cache && pcmcache_open(&xc->pcm, xc->cache, e->file) == 0 &&
+        pcmcache_codec_context(xc->pcm, &xc->inpccx) < 0)
+        pcmcache_free(&xc->pcm);
+    if (xc->pcm)
+        fprintf(stderr, "Decoded samples of '%s' taken from the cache\n", e->file);
+    else if ((error = open_input_file(e->file, xc->iomode, NULL, NULL, xc->fo, xc->ld || xc->ts ? NULL : xc->outccx->codec,
+                                      NULL, xc->fp, &xc->inpfcx, &xc->inpccx)) < 0)
+        return error;
+    /* A snippet at another sample rate than the output's (the first
+     * one's) is resampled to it. */
+    if (!fmtneg_passthrough(xc->inpccx, &xc->outccx->ch_layout, conv_fmt, xc->outccx->sample_rate) &&
+        get_resampler(xc->pool, xc->inpccx, xc->outccx, conv_fmt, &xc->swrkey, &xc->resccx))
+        return AVERROR_EXIT;
+    xc->in_done = 0;
+    return start_edit(xc, e);
+}
+
+/**
+ * Decode, convert, encode and write until the input ends.
+ * @param xc Transcode state, with conversion and FIFO set up and the
+ *           output header written
+ * @return Error code (0 if successful)
+ */
+static int transcode_loop(struct xcode *xc)
+{
+    struct xstat_mark m;
 
     /* Loop as long as we have input samples to read or output samples
      * to write; abort as soon as we have neither. */
-    unsigned outlooptimes=0;
     while (1) {
         /* Use the encoder's desired frame size for processing. */
-        const int output_frame_size = outccx->frame_size;
+        const int output_frame_size = xc->outccx->frame_size;
         int finished = 0;
 
         /* Make sure that there is one frame worth of samples in the FIFO
@@ -764,66 +1774,1626 @@ int main(int argc, char **argv)
          * Since the decoder's and the encoder's frame size may differ, we
          * need to FIFO buffer to store as many frames worth of input samples
          * that they make up at least one frame worth of output samples. */
-        while (av_audio_fifo_size(fifo) < output_frame_size) {
+        while (fifo_size(xc) < output_frame_size) {
+            int n = 0;
+
             /* Decode one frame worth of audio samples, convert it to the
              * output sample format and put it into the FIFO buffer. */
-            if (read_decode_convert_and_store(fifo, inpfcx, inpccx, outccx, resccx, &finished))
-                goto cleanup;
+            if (!xc->in_done) {
+                if (read_decode_convert_and_store(xc->fifo, xc->zf, xc->inpfcx, xc->inpccx, xc->outccx, xc->resccx, xc->fp, xc->ld, xc->ts, xc->fg, xc->drop_until, xc->stop_at, xc->pcm, NULL, &xc->in_pts, &xc->in_done, xc->st))
+                    return AVERROR_EXIT;
+                continue;
+            }
+
+            /* The snippet's last samples, if the resampler held them
+             * back, go first. */
+            if ((n = flush_resampler(xc)) != 0) {
+                if (n < 0)
+                    return AVERROR_EXIT;
+                continue;
+            }
+
+            /* An edit list goes on with its next snippet. */
+            if (xc->el && xc->next_edit < xc->el->nb_edits) {
+                if (next_edit(xc) < 0)
+                    return AVERROR_EXIT;
+                continue;
+            }
+
+            /* The loudness stage still holds its lookahead, or in two-pass
+             * mode all of the input; take it out a frame at a time. */
+            if (xc->ld) {
+                xstat_mark(xc->st, &m);
+                if ((n = loud_flush(xc->ld, xc->fifo, output_frame_size)) < 0)
+                    return AVERROR_EXIT;
+                xstat_add(xc->st, XSTAT_LOUDNESS, &m, 0, 0, 0, 0);
+            }
+            /* So does the time-stretch stage the last frames' worth. */
+            if (xc->ts) {
+                xstat_mark(xc->st, &m);
+                if ((n = tstretch_flush(xc->ts, xc->fifo, output_frame_size)) < 0)
+                    return AVERROR_EXIT;
+                xstat_queue(xc->st, n, 0);
+                xstat_add(xc->st, XSTAT_STRETCH, &m, 0, 0, 0, 0);
+            }
 
             /* If we are at the end of the input file, we continue
              * encoding the remaining audio samples to the output file. */
-            if (finished)
+            if (!n) {
+                finished = 1;
                 break;
+            }
         }
 
         /* If we have enough samples for the encoder, we encode them.
          * At the end of the file, we pass the remaining samples to
          * the encoder. */
-        while (av_audio_fifo_size(fifo) >= output_frame_size || (finished && av_audio_fifo_size(fifo) > 0)) {
+        while (fifo_size(xc) >= output_frame_size || (finished && fifo_size(xc) > 0)) {
             /* Take one frame worth of audio samples from the FIFO buffer,
              * encode it and write it to the output file. */
-            // if(outlooptimes<4000) {
-            //     outlooptimes++;
-            //     continue;
-            // }
-            if (load_encode_and_write(fifo, outfcx, outccx))
-                goto cleanup;
+            if (load_encode_and_write(xc->fifo, xc->zf, xc->outfcx, xc->sg, xc->outccx, &xc->pts, &xc->written, xc->st))
+                return AVERROR_EXIT;
         }
 
+        if (xc->ckpt_out && av_gettime_relative() - xc->ckpt_last >= xc->ckpt_every &&
+            take_checkpoint(xc) < 0)
+            return AVERROR_EXIT;
+
         /* If we are at the end of the input file and have encoded
          * all remaining samples, we can exit this loop and finish. */
         if (finished) {
-            int data_written;
-            /* Flush the encoder as it may have delayed frames. */
-            do {
-                if (encode_audio_frame(NULL, outfcx, outccx, &data_written))
-                    goto cleanup;
-            } while (data_written);
+            if (flush_encoder(xc))
+                return AVERROR_EXIT;
             break;
         }
-        outlooptimes++;
     } //end of while(1)
-    printf("outer loop, how many times? %u\n", outlooptimes);
+    return 0;
+}
+
+/**
+ * Drop samples from the start of the FIFO.
+ * @param xc         Transcode state
+ * @param nb_samples Number of samples
+ */
+static void fifo_drain(struct xcode *xc, int nb_samples)
+{
+    if (xc->zf)
+        zfifo_drain(xc->zf, nb_samples);
+    else
+        av_audio_fifo_drain(xc->fifo, nb_samples);
+    xstat_dequeue(xc->st, nb_samples, 0);
+}
+
+/**
+ * Add silence to the FIFO.
+ * @param xc         Transcode state
+ * @param nb_samples Number of samples
+ * @return Error code (0 if successful)
+ */
+static int fifo_silence(struct xcode *xc, int nb_samples)
+{
+    const int channels = xc->outccx->ch_layout.nb_channels;
+    uint8_t **data;
+
+    if (xc->zf) {
+        if (zfifo_space(xc->zf, nb_samples, &data) < 0)
+            return AVERROR_EXIT;
+        av_samples_set_silence(data, 0, nb_samples, channels, xc->outccx->sample_fmt);
+        zfifo_commit(xc->zf, nb_samples);
+        xstat_queue(xc->st, nb_samples, 1);
+        return 0;
+    }
+    if (fpool_scratch(xc->fp, &data, channels, nb_samples, xc->outccx->sample_fmt) < 0)
+        return AVERROR_EXIT;
+    av_samples_set_silence(data, 0, nb_samples, channels, xc->outccx->sample_fmt);
+    xstat_queue(xc->st, nb_samples, 1);
+    return add_samples_to_fifo(xc->fifo, data, nb_samples);
+}
+
+/**
+ * Open one more output file for the running encoder, in the container
+ * of the current one.
+ * @param      filename File to be opened
+ * @param      oformat  Container format
+ * @param      outccx   Codec context of the encoder
+ * @param[out] outfcx   Format context of the opened file, header written
+ * @return Error code (0 if successful)
+ */
+static int open_next_output(const char *filename, const AVOutputFormat *oformat, AVCodecContext *outccx, AVFormatContext **outfcx)
+{
+    AVStream *stream;
+    int error;
+
+    if ((error = avformat_alloc_output_context2(outfcx, oformat, NULL, filename)) < 0) {
+        fprintf(stderr, "Could not allocate output format context\n");
+        return error;
+    }
+    if ((error = avio_open(&(*outfcx)->pb, filename, AVIO_FLAG_WRITE)) < 0) {
+        fprintf(stderr, "Could not open output file '%s' (error '%s')\n", filename, av_err2str(error));
+        goto cleanup;
+    }
+    if (!(stream = avformat_new_stream(*outfcx, NULL))) {
+        fprintf(stderr, "Could not create new stream\n");
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    stream->time_base.den = outccx->sample_rate;
+    stream->time_base.num = 1;
+    if ((error = avcodec_parameters_from_context(stream->codecpar, outccx)) < 0) {
+        fprintf(stderr, "Could not initialize stream parameters\n");
+        goto cleanup;
+    }
+    (*outfcx)->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+    if ((error = write_output_file_header(*outfcx, NULL)) < 0)
+        goto cleanup;
+    return 0;
+
+cleanup:
+    close_output_file(outfcx);
+    return error;
+}
+
+/**
+ * Name of the output file for a point in time.
+ * @param[out] buf     Name
+ * @param      size    Size of buf
+ * @param      pattern strftime() pattern
+ * @param      t       Point in time
+ */
+static void rotate_name(char *buf, size_t size, const char *pattern, time_t t)
+{
+    struct tm tm;
+
+    if (!strftime(buf, size, pattern, localtime_r(&t, &tm)))
+        av_strlcpy(buf, pattern, size);
+}
+
+/**
+ * Go on in a new output file once the current one's time is up.
+ * @param xc Transcode state
+ * @return Error code (0 if successful)
+ */
+static int rotate_output(struct xcode *xc)
+{
+    const time_t now = time(NULL);
+    const AVOutputFormat *oformat = xc->outfcx->oformat;
+    char name[4096];
+
+    if (now / xc->rotate == xc->rotate_slot)
+        return 0;
+    xc->rotate_slot = now / xc->rotate;
+    rotate_name(name, sizeof(name), xc->rotate_pattern, now);
+    if (write_output_file_trailer(xc->outfcx))
+        return AVERROR_EXIT;
+    close_output_file(&xc->outfcx);
+    if (open_next_output(name, oformat, xc->outccx, &xc->outfcx) < 0)
+        return AVERROR_EXIT;
+    fprintf(stderr, "Writing to '%s'\n", name);
+    return 0;
+}
+
+/**
+ * Like transcode_loop, but with live input (see live.h): never wait for
+ * input longer than the latency budget allows. When the time is up, the
+ * samples in the FIFO are padded with silence to a frame and go out, or
+ * if there are none the input stalled, and about a budget's worth of
+ * silence goes out, so that the output keeps pace with the clock. After
+ * a burst, samples beyond the budget are dropped.
+ * @param xc Transcode state, as for transcode_loop
+ * @return Error code (0 if successful)
+ */
+static int live_loop(struct xcode *xc)
+{
+    const int frame_size = xc->outccx->frame_size;
+    const int budget_samples = av_rescale(xc->budget, xc->outccx->sample_rate, 1000000);
+    struct live_stats ls;
+    /* When the oldest samples in the FIFO came in */
+    int64_t oldest = 0;
+    int ret, n;
+
+    for (;;) {
+        const int64_t timeout = fifo_size(xc) ? oldest + xc->budget - av_gettime_relative() : xc->budget;
+
+        if ((ret = live_wait(xc->lv, timeout)) == AVERROR_EOF)
+            break;
+        if (ret < 0) {
+            fprintf(stderr, "Could not read frame (error '%s')\n", av_err2str(ret));
+            return ret;
+        }
+        if (ret > 0) {
+            const int before = fifo_size(xc);
+            int added, fresh;
+
+            if (read_decode_convert_and_store(xc->fifo, xc->zf, xc->inpfcx, xc->inpccx, xc->outccx, xc->resccx, xc->fp, NULL, NULL, NULL, INT64_MIN, INT64_MAX, NULL, xc->lv, &xc->in_pts, &xc->in_done, xc->st))
+                return AVERROR_EXIT;
+            if ((added = fifo_size(xc) - before) > 0 && !before)
+                oldest = live_arrival(xc->lv);
+            /* Behind after a burst: keep the newest budget's worth. */
+            if ((n = fifo_size(xc) - budget_samples - frame_size) > 0) {
+                fifo_drain(xc, n);
+                xc->live_dropped += n;
+            }
+            /* What stays behind after the full frames is the newest; all
+             * of it came with this packet if no more than the packet added. */
+            fresh = fifo_size(xc) % frame_size <= added;
+            while (fifo_size(xc) >= frame_size)
+                if (load_encode_and_write(xc->fifo, xc->zf, xc->outfcx, xc->sg, xc->outccx, &xc->pts, &xc->written, xc->st))
+                    return AVERROR_EXIT;
+            if (fresh && fifo_size(xc))
+                oldest = live_arrival(xc->lv);
+        } else {
+            /* Out of time */
+            if (fifo_size(xc)) {
+                n = frame_size - fifo_size(xc);
+                xc->live_padded++;
+            } else {
+                n = FFMAX(1, (budget_samples + frame_size / 2) / frame_size) * frame_size;
+                xc->live_stalls++;
+            }
+            if (fifo_silence(xc, n) < 0)
+                return AVERROR_EXIT;
+            while (fifo_size(xc) >= frame_size)
+                if (load_encode_and_write(xc->fifo, xc->zf, xc->outfcx, xc->sg, xc->outccx, &xc->pts, &xc->written, xc->st))
+                    return AVERROR_EXIT;
+        }
+        if (xc->rotate && rotate_output(xc) < 0)
+            return AVERROR_EXIT;
+    }
+
+    /* The input ended: what the decoder held back, what is left, then
+     * what the encoder holds. */
+    while (!xc->in_done)
+        if (read_decode_convert_and_store(xc->fifo, xc->zf, xc->inpfcx, xc->inpccx, xc->outccx, xc->resccx, xc->fp, NULL, NULL, NULL, INT64_MIN, INT64_MAX, NULL, xc->lv, &xc->in_pts, &xc->in_done, xc->st))
+            return AVERROR_EXIT;
+    while (fifo_size(xc) > 0)
+        if (load_encode_and_write(xc->fifo, xc->zf, xc->outfcx, xc->sg, xc->outccx, &xc->pts, &xc->written, xc->st))
+            return AVERROR_EXIT;
+    if (flush_encoder(xc))
+        return AVERROR_EXIT;
+
+    live_stats(xc->lv, &ls);
+    fprintf(stderr, "Live: %u frames padded, %u stalls, %" PRId64 " samples dropped; "
+            "%" PRIu64 " packets, %" PRIu64 " late, %" PRIu64 " over the queue\n",
+            xc->live_padded, xc->live_stalls, xc->live_dropped, ls.packets, ls.late, ls.overflow);
+    return 0;
+}
+
+/**
+ * Run a transcode between an opened input and output: set up conversion
+ * and FIFO, then decode, convert, encode and write until the input ends.
+ * @param xc Transcode state with the input and output contexts opened
+ * @return Error code (0 if successful)
+ */
+static int transcode(struct xcode *xc)
+{
+    struct xstat_mark m;
+    enum AVSampleFormat conv_fmt;
+    int error;
+
+    /* With loudness normalization, the resampler converts to planar float
+     * for the loudness stage, which converts to the encoder's format. */
+    if (xc->loudness) {
+        struct loud_opts lo;
+        if (loud_parse(xc->loudness, &lo) ||
+            loud_alloc(&xc->ld, &lo, &xc->outccx->ch_layout, xc->outccx->sample_rate, xc->outccx->sample_fmt))
+            return AVERROR_EXIT;
+    }
+    /* The same for time-stretching. */
+    if (xc->tempo) {
+        struct tstretch_opts to;
+        if (tstretch_parse(xc->tempo, &to) ||
+            tstretch_alloc(&xc->ts, &to, &xc->outccx->ch_layout, xc->outccx->sample_rate, xc->outccx->sample_fmt))
+            return AVERROR_EXIT;
+    }
+
+    /* Initialize the resampler to be able to convert audio sample formats,
+     * unless the decoder already puts out what the next stage takes. */
+    conv_fmt = xc->ld || xc->ts ? AV_SAMPLE_FMT_FLTP : xc->outccx->sample_fmt;
+    fmtneg_describe(xc->conversion, sizeof(xc->conversion), xc->inpccx,
+                    &xc->outccx->ch_layout, conv_fmt, xc->outccx->sample_rate);
+    /* With filters, their last one (aformat) converts instead. */
+    if (xc->filters) {
+        if (fgraph_alloc(&xc->fg, xc->filters, xc->inpccx, xc->inpfcx->streams[0]->time_base,
+                         conv_fmt, &xc->outccx->ch_layout, xc->outccx->sample_rate) < 0)
+            return AVERROR_EXIT;
+        av_strlcat(xc->conversion, " (filter graph)", sizeof(xc->conversion));
+    } else if (!fmtneg_passthrough(xc->inpccx, &xc->outccx->ch_layout, conv_fmt, xc->outccx->sample_rate) &&
+        get_resampler(xc->pool, xc->inpccx, xc->outccx, conv_fmt, &xc->swrkey, &xc->resccx))
+        return AVERROR_EXIT;
+
+    /* Initialize the FIFO buffer to store audio samples to be encoded.
+     * The loudness and time-stretch stages write into an AVAudioFifo, so
+     * they get one even with zerocopy. A zero-copy one starts with a
+     * second of samples, more than decoders put out at a time. */
+    if (xc->zerocopy && !xc->ld && !xc->ts) {
+        if (zfifo_alloc(&xc->zf, xc->outccx->sample_fmt, &xc->outccx->ch_layout,
+                        xc->outccx->sample_rate, xc->outccx->sample_rate) < 0)
+            return AVERROR_EXIT;
+    } else if (init_fifo(&xc->fifo, xc->outccx))
+        return AVERROR_EXIT;
+
+    /* Write the header of the output file container. A resumable one
+     * has none, nor anything patched in at the end (Xing frame). Segments
+     * get theirs as they are opened. */
+    xstat_mark(xc->st, &m);
+    if (xc->sg)
+        error = 0;
+    else if (xc->resumable) {
+        AVDictionary *options = NULL;
+        av_dict_set(&options, "write_xing", "0", 0);
+        av_dict_set(&options, "id3v2_version", "0", 0);
+        error = write_output_file_header(xc->outfcx, &options);
+        av_dict_free(&options);
+    } else
+        error = write_output_file_header(xc->outfcx, NULL);
+    if (error)
+        return AVERROR_EXIT;
+    xstat_add(xc->st, XSTAT_MUX, &m, 0, 0, 0, 0);
+
+    /* Decode, convert, encode and write until the input ends. */
+    if ((xc->lv ? live_loop(xc) : transcode_loop(xc)) < 0)
+        return AVERROR_EXIT;
+
+    /* Write the trailer of the output file container, or finish the
+     * last segment and the playlist. */
+    xstat_mark(xc->st, &m);
+    if (xc->sg ? seg_finish(xc->sg) < 0 : write_output_file_trailer(xc->outfcx) != 0)
+        return AVERROR_EXIT;
+    xstat_add(xc->st, XSTAT_MUX, &m, 0, 0, 0, 0);
+    if (xc->st)
+        xc->st->out_bytes = xc->sg ? seg_bytes(xc->sg) : avio_tell(xc->outfcx->pb);
+    if (xc->ld)
+        loud_report(xc->ld, stderr);
+    if (xc->ts)
+        tstretch_report(xc->ts, stderr);
+    if (xc->fg)
+        fgraph_report(xc->fg, stderr);
+    return 0;
+}
 
-    /* Write the trailer of the output file container. */
-    if (write_output_file_trailer(outfcx))
+/**
+ * Stop the run clock and write the JSON run report, if one was asked for.
+ * @param xc    Transcode state, before xcode_free
+ * @param in    Input name for the report
+ * @param out   Output name for the report
+ * @param path  Report file, "-" for stdout, NULL for none
+ * @param error Result of the run
+ */
+static void write_report(struct xcode *xc, const char *in, const char *out, const char *path, int error)
+{
+    if (!xc->st)
+        return;
+    xstat_stop(xc->st);
+    xc->st->input    = in;
+    xc->st->output   = out;
+    xc->st->encoder  = xc->outccx ? xc->outccx->codec->name : NULL;
+    xc->st->conversion = *xc->conversion ? xc->conversion : NULL;
+    xc->st->in_rate  = xc->inpccx ? xc->inpccx->sample_rate : 0;
+    xc->st->out_rate = xc->outccx ? xc->outccx->sample_rate : 0;
+    if (xc->fp) {
+        struct fpool_stats ps;
+        fpool_stats(xc->fp, &ps);
+        xc->st->pool_gets      = ps.gets;
+        xc->st->pool_allocs    = ps.allocs;
+        xc->st->pool_fallbacks = ps.fallbacks;
+        xc->st->pool_bytes     = ps.bytes;
+    }
+    if (path)
+        xstat_write_json(xc->st, path, error);
+}
+
+/**
+ * Release everything a transcode run allocated.
+ * @param xc Transcode state
+ */
+static void xcode_free(struct xcode *xc)
+{
+    live_stop(&xc->lv);
+    if (xc->fifo)
+        av_audio_fifo_free(xc->fifo);
+    zfifo_free(&xc->zf);
+    loud_free(&xc->ld);
+    tstretch_free(&xc->ts);
+    fgraph_free(&xc->fg);
+    pcmcache_free(&xc->pcm);
+    put_resampler(xc->pool, &xc->swrkey, &xc->resccx);
+    put_encoder(xc->pool, &xc->enckey, &xc->outccx);
+    close_output_file(&xc->outfcx);
+    seg_free(&xc->sg);
+    if (xc->inpccx)
+        avcodec_free_context(&xc->inpccx);
+    close_input_file(&xc->inpfcx);
+    fpool_free(&xc->fp);
+}
+
+/**
+ * Transcode between two files, each given by name or by an I/O context.
+ * Both contexts are released on return.
+ * @param      in       Input file name, used for messages when inpb is set
+ * @param      inpb     Input I/O context, or NULL to open in
+ * @param      out      Output file name, used to guess the container and
+ *                      for messages when outpb is set; NULL without a name
+ * @param      outpb    Output I/O context, or NULL to open out
+ * @param      opts     Transcode settings
+ * @param[out] outbuf   If not NULL, receives the bytes collected by an
+ *                      xio_open_membuf output
+ * @param[out] out_size Number of bytes in *outbuf
+ * @return Error code (0 if successful)
+ */
+static int transcode_io(const char *in, AVIOContext *inpb, const char *out, AVIOContext *outpb, const struct tmp30_opts *opts, uint8_t **outbuf, size_t *out_size)
+{
+    struct xcode xc = { .pool = opts->pool, .loudness = opts->loudness, .resumable = opts->resumable,
+                        .filters = opts->filters, .tempo = opts->tempo,
+                        .zerocopy = opts->zerocopy, .written = INT64_MIN, .drop_until = INT64_MIN,
+                        .stop_at = INT64_MAX };
+    struct xstat st;
+    int ret;
+
+    if (opts->report) {
+        xc.st = &st;
+        xstat_start(xc.st);
+    }
+
+    if (!out && !opts->out_format) {
+        fprintf(stderr, "An output format is required without an output file\n");
+        xio_close(&inpb);
+        xio_close(&outpb);
+        return AVERROR(EINVAL);
+    }
+    /* The decoder's frames come from our pool. */
+    if ((ret = fpool_alloc(&xc.fp)) < 0) {
+        xio_close(&inpb);
+        xio_close(&outpb);
+        return ret;
+    }
+    /* The loudness or time-stretch stage is what takes the decoded
+     * samples, and it wants planar float, which decoders give by default. */
+    if ((ret = open_input_file(in, XIO_DEFAULT, inpb, opts->in_format, NULL,
+                               opts->loudness || opts->tempo ? NULL : find_encoder(opts->codec),
+                               NULL, xc.fp, &xc.inpfcx, &xc.inpccx)) < 0) {
+        fpool_free(&xc.fp);
+        xio_close(&outpb);
+        return ret;
+    }
+    if ((ret = open_output_file(out ? out : "memory", outpb, opts, xc.inpccx, &xc.enckey, &xc.outfcx, &xc.outccx)) < 0)
+        goto cleanup;
+    if ((ret = transcode(&xc)) < 0)
         goto cleanup;
+    if (outbuf)
+        ret = xio_membuf_take(xc.outfcx->pb, outbuf, out_size);
+
+cleanup:
+    write_report(&xc, in, out, opts->report, ret);
+    xcode_free(&xc);
+    return ret;
+}
+
+int tmp30_transcode_mem(const uint8_t *in, size_t in_size,
+                        uint8_t **out, size_t *out_size,
+                        const struct tmp30_opts *opts)
+{
+    AVIOContext *inpb = NULL, *outpb = NULL;
+    int ret;
+
+    *out      = NULL;
+    *out_size = 0;
+    if ((ret = xio_open_mem(in, in_size, &inpb)) < 0)
+        return ret;
+    if ((ret = xio_open_membuf(&outpb)) < 0) {
+        xio_close(&inpb);
+        return ret;
+    }
+    return transcode_io("memory", inpb, NULL, outpb, opts, out, out_size);
+}
+
+int tmp30_transcode_cb(int (*read)(void *opaque, uint8_t *buf, int buf_size),
+                       int64_t (*rseek)(void *opaque, int64_t offset, int whence),
+                       void *ropaque,
+                       int (*write)(void *opaque, const uint8_t *buf, int buf_size),
+                       int64_t (*wseek)(void *opaque, int64_t offset, int whence),
+                       void *wopaque,
+                       const struct tmp30_opts *opts)
+{
+    AVIOContext *inpb = NULL, *outpb = NULL;
+    int ret;
+
+    if ((ret = xio_open_read_cb(read, rseek, ropaque, &inpb)) < 0)
+        return ret;
+    if ((ret = xio_open_write_cb(write, wseek, wopaque, &outpb)) < 0) {
+        xio_close(&inpb);
+        return ret;
+    }
+    return transcode_io("callback", inpb, NULL, outpb, opts, NULL, NULL);
+}
+
+int tmp30_transcode_file(const char *in, int infd, const char *out, int outfd,
+                         const struct tmp30_opts *opts)
+{
+    AVIOContext *inpb = NULL, *outpb = NULL;
+    int ret;
+
+    /* Passed descriptors are read through a mapping; they come from a
+     * client that opened a regular file for us. */
+    if (!in && (ret = xio_open_fd(infd, XIO_MMAP, &inpb)) < 0) {
+        if (outfd >= 0)
+            close(outfd);
+        return ret;
+    }
+    if (outfd >= 0 && (ret = xio_open_fd_out(outfd, &outpb)) < 0) {
+        xio_close(&inpb);
+        return ret;
+    }
+    return transcode_io(in ? in : "descriptor", inpb, out, outpb, opts, NULL, NULL);
+}
+
+void tmp30_free(void *ptr)
+{
+    av_free(ptr);
+}
+
+int tmp30_strerror(int error, char *buf, size_t size)
+{
+    return av_strerror(error, buf, size);
+}
+
+int tmp30_parse_profile(const char *profile, struct tmp30_opts *opts)
+{
+    char buf[128], *tok, *save, *end;
+    long val;
+
+    if (av_strlcpy(buf, profile, sizeof(buf)) >= sizeof(buf))
+        return AVERROR(EINVAL);
+    if (!(tok = strtok_r(buf, ":", &save)) ||
+        av_strlcpy(opts->codec, tok, sizeof(opts->codec)) >= sizeof(opts->codec))
+        goto fail;
+
+    while ((tok = strtok_r(NULL, ":", &save))) {
+        if (*tok == 'v' || *tok == 'q') {
+            /* VBR quality, lame's -V scale for MP3 */
+            val = strtol(tok + 1, &end, 10);
+            if (end == tok + 1 || *end)
+                goto fail;
+            opts->vbr     = 1;
+            opts->quality = val;
+            continue;
+        }
+        val = strtol(tok, &end, 10);
+        if (end == tok || val <= 0)
+            goto fail;
+        if (!strcmp(end, "k"))
+            opts->bit_rate = val * 1000;
+        else if (!strcmp(end, "ch"))
+            opts->channels = val;
+        else if (!*end)
+            opts->bit_rate = val;
+        else
+            goto fail;
+    }
+    return 0;
+
+fail:
+    fprintf(stderr, "Invalid profile '%s' (expected codec[:<n>k][:v<q>][:<n>ch])\n", profile);
+    return AVERROR(EINVAL);
+}
+
+struct tmp30_pool *tmp30_pool_alloc(int spares)
+{
+    struct tmp30_pool *pool;
+
+    if (!(pool = av_mallocz(sizeof(*pool))))
+        return NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->spares = FFMIN(spares, POOL_MAX_CTX);
+    return pool;
+}
+
+int tmp30_pool_warm(struct tmp30_pool *pool, const struct tmp30_opts *opts,
+                    int sample_rate, const char *out_format)
+{
+    const AVOutputFormat *oformat;
+    struct enckey key;
+    int error;
+
+    if (!(oformat = av_guess_format(out_format, NULL, NULL))) {
+        fprintf(stderr, "Unknown output format '%s'\n", out_format);
+        return AVERROR(EINVAL);
+    }
+    if ((error = init_enckey(&key, opts, sample_rate, AV_SAMPLE_FMT_FLTP,
+                             !!(oformat->flags & AVFMT_GLOBALHEADER))) < 0)
+        return error;
+    pthread_mutex_lock(&pool->lock);
+    error = find_encentry(pool, &key, 1) ? 0 : pool->nb_enc == POOL_MAX_KEYS ? AVERROR(ENOSPC) : AVERROR(ENOMEM);
+    pthread_mutex_unlock(&pool->lock);
+    if (error < 0) {
+        if (error == AVERROR(ENOSPC))
+            fprintf(stderr, "Too many warm-ups (at most %d)\n", POOL_MAX_KEYS);
+        return error;
+    }
+    tmp30_pool_replenish(pool);
+    return 0;
+}
+
+void tmp30_pool_replenish(struct tmp30_pool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->nb_enc; i++) {
+        while (pool->enc[i].nb_ctx + pool->enc[i].opening < pool->spares) {
+            struct enckey key = pool->enc[i].key;
+            AVCodecContext *avctx;
+            int error;
+
+            /* Open outside the lock; the entry array may grow meanwhile,
+             * so it is looked up by index again afterwards. */
+            pool->enc[i].opening++;
+            pthread_mutex_unlock(&pool->lock);
+            error = open_encoder(&key, &avctx);
+            pthread_mutex_lock(&pool->lock);
+            pool->enc[i].opening--;
+            if (error < 0)
+                break;
+            if (pool->enc[i].nb_ctx < POOL_MAX_CTX)
+                pool->enc[i].ctx[pool->enc[i].nb_ctx++] = avctx;
+            else
+                avcodec_free_context(&avctx);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void tmp30_pool_stats(struct tmp30_pool *pool, FILE *f)
+{
+    int i, warm = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < pool->nb_enc; i++)
+        warm += pool->enc[i].nb_ctx;
+    fprintf(f, "encoders: %u hits, %u misses, %d warm in %d sets; "
+               "resamplers: %u hits, %u misses\n",
+            pool->enc_hits, pool->enc_misses, warm, pool->nb_enc,
+            pool->swr_hits, pool->swr_misses);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void tmp30_pool_free(struct tmp30_pool **pool)
+{
+    int i, j;
+
+    if (!*pool)
+        return;
+    for (i = 0; i < (*pool)->nb_enc; i++)
+        for (j = 0; j < (*pool)->enc[i].nb_ctx; j++)
+            avcodec_free_context(&(*pool)->enc[i].ctx[j]);
+    for (i = 0; i < (*pool)->nb_swr; i++) {
+        for (j = 0; j < (*pool)->swr[i].nb_ctx; j++)
+            swr_free(&(*pool)->swr[i].ctx[j]);
+        uninit_swrkey(&(*pool)->swr[i].key);
+    }
+    av_freep(&(*pool)->enc);
+    av_freep(&(*pool)->swr);
+    pthread_mutex_destroy(&(*pool)->lock);
+    av_freep(pool);
+}
+
+#ifndef TMP30_NO_MAIN
+/**
+ * Describe everything besides the input's bytes that the output depends
+ * on, for the output cache.
+ * @param[out] buf    Description
+ * @param      size   Size of buf
+ * @param      opts   Transcode settings
+ * @param      inpccx Codec context of the input file
+ * @param      out    Output file name
+ * @return Error code (0 if successful)
+ */
+static int cache_params(char *buf, size_t size, const struct tmp30_opts *opts, AVCodecContext *inpccx, const char *out)
+{
+    const AVOutputFormat *oformat;
+    struct enckey key;
+    int error;
+
+    if (!(oformat = av_guess_format(opts->out_format, out, NULL))) {
+        fprintf(stderr, "Could not find output file format\n");
+        return AVERROR_EXIT;
+    }
+    if ((error = init_enckey(&key, opts, inpccx->sample_rate, inpccx->sample_fmt,
+                             !!(oformat->flags & AVFMT_GLOBALHEADER))) < 0)
+        return error;
+    snprintf(buf, size, "tmp30 %s %s %s|%s|%s %" PRId64 " %d %d %d %d %d %d %d|%s",
+             LIBAVFORMAT_IDENT, LIBAVCODEC_IDENT, LIBSWRESAMPLE_IDENT, oformat->name,
+             key.codec->name, key.bit_rate, key.channels, key.vbr, key.vbr ? key.quality : 0,
+             key.sample_rate, key.global_header, key.standalone,
+             key.sample_fmt,
+             opts->loudness ? opts->loudness : "");
+    return 0;
+}
+
+/**
+ * Start keeping checkpoints of a transcode whose input and output are open.
+ * @param xc      Transcode state
+ * @param in      Input file name
+ * @param out     Output file name, the checkpoint is named after it
+ * @param seconds Time between checkpoints
+ * @return Error code (0 if successful)
+ */
+static int init_checkpoints(struct xcode *xc, const char *in, const char *out, double seconds)
+{
+    const char *name = xc->outfcx->oformat->name;
+    int error;
+
+    /* Formats without a header or anything patched in at the end, and
+     * whose packets just follow each other. */
+    if (strcmp(name, "mp3") && strcmp(name, "mp2") && strcmp(name, "adts")) {
+        fprintf(stderr, "Checkpoints need streamable output (.mp3, .mp2 or ADTS .aac), not %s\n", name);
+        return AVERROR(EINVAL);
+    }
+    if ((error = ckpt_identify(&xc->ck, in)) < 0)
+        return error;
+    av_strlcpy(xc->ck.encoder, xc->enckey.codec->name, sizeof(xc->ck.encoder));
+    xc->ck.bit_rate    = xc->enckey.bit_rate;
+    xc->ck.vbr         = xc->enckey.vbr;
+    xc->ck.quality     = xc->enckey.vbr ? xc->enckey.quality : 0;
+    xc->ck.channels    = xc->enckey.channels;
+    xc->ck.sample_rate = xc->enckey.sample_rate;
+    xc->ckpt_out   = out;
+    xc->ckpt_every = seconds * 1000000;
+    xc->ckpt_last  = av_gettime_relative();
+    return 0;
+}
+
+/**
+ * Where an encoder has to start for its packets to line up with a point
+ * in the output: its delay plus RESUME_PREROLL_FRAMES frames early, so
+ * that its state has settled on the signal by then.
+ * @param xc          Transcode state with the encoder opened
+ * @param out_samples Output position, the end of a packet of an
+ *                    uninterrupted run
+ * @return Input sample to start at; negative if that is before the start
+ */
+static int64_t preroll_start(const struct xcode *xc, int64_t out_samples)
+{
+    const int fs = xc->outccx->frame_size, delay = xc->outccx->initial_padding;
+
+    return out_samples + delay - (int64_t)(RESUME_PREROLL_FRAMES + (delay + fs - 1) / fs) * fs;
+}
+
+/**
+ * Pick up a transcode at its checkpoint. The output is cut back to what
+ * the checkpoint says is complete, and the input is decoded again from a
+ * little before that. The new encoder starts early (preroll_start), at a
+ * sample chosen so that its packets line up with the end of the output,
+ * and its packets up to there are dropped; the output goes on without gap
+ * or overlap, though not bit-identical to an uninterrupted run.
+ * @param xc    Transcode state, after init_checkpoints
+ * @param saved The checkpoint
+ * @param out   Output file name
+ * @param fo    Fast-open state, whose kept packets are no longer wanted
+ * @return Error code (0 if successful)
+ */
+static int resume_transcode(struct xcode *xc, const struct ckpt *saved, const char *out, struct fastopen *fo)
+{
+    const int rate = xc->inpccx->sample_rate;
+    int64_t start, length = 0;
+    struct stat sb;
+    int error;
+
+    if (!ckpt_same_job(saved, &xc->ck)) {
+        fprintf(stderr, "The checkpoint of '%s' is for another input or encoder setting\n", out);
+        return AVERROR(EINVAL);
+    }
+    start = preroll_start(xc, saved->out_samples);
+    if (start >= 0) {
+        if (stat(out, &sb) < 0 || sb.st_size < saved->out_bytes) {
+            fprintf(stderr, "'%s' is shorter than its checkpoint\n", out);
+            return AVERROR_INVALIDDATA;
+        }
+        length = saved->out_bytes;
+    }
+    if (truncate(out, length) < 0 ||
+        (error = avio_seek(xc->outfcx->pb, length, SEEK_SET)) < 0) {
+        fprintf(stderr, "Could not cut '%s' back to its checkpoint\n", out);
+        return AVERROR(EIO);
+    }
+    if (start < 0) {
+        fprintf(stderr, "Checkpoint is too close to the start, transcoding from the beginning\n");
+        return 0;
+    }
+    if ((error = seek_input(xc, start, fo)) < 0)
+        return error;
+    xc->written = saved->out_samples;
+    fprintf(stderr, "Resuming at %.3f s, %lld bytes of output kept\n",
+            (double)saved->out_samples / rate, (long long)saved->out_bytes);
+    return 0;
+}
+
+/**
+ * Open the encoder for segmented output and start the segmenter. A worker
+ * whose segments don't start at the beginning seeks the input to them,
+ * as a resume does (see resume_transcode), and stops decoding once it has
+ * the input of its last segment.
+ * @param xc       Transcode state with the input opened
+ * @param playlist Playlist file name, see seg.h
+ * @param opts     Transcode settings, out_format the segments' container
+ * @param seconds  Segment length
+ * @param first    First segment to write
+ * @param count    Number of segments to write, 0 for all the rest
+ * @param part     Whether this is one of several workers
+ * @param fo       Fast-open state
+ * @return Error code (0 if successful)
+ */
+static int open_segments(struct xcode *xc, const char *playlist, const struct tmp30_opts *opts,
+                         double seconds, int first, int count, int part, struct fastopen *fo)
+{
+    const AVOutputFormat *oformat;
+    int64_t samples, start;
+    int error;
+
+    if (!(oformat = av_guess_format(opts->out_format, NULL, NULL))) {
+        fprintf(stderr, "Could not find output file format\n");
+        return AVERROR_EXIT;
+    }
+    if ((error = init_enckey(&xc->enckey, opts, xc->inpccx->sample_rate, xc->inpccx->sample_fmt,
+                             !!(oformat->flags & AVFMT_GLOBALHEADER))) < 0 ||
+        (error = get_encoder(opts->pool, &xc->enckey, &xc->outccx)) < 0)
+        return error;
+    samples = seg_samples(xc->outccx, seconds);
+    if ((error = seg_open(&xc->sg, playlist, oformat, xc->outccx, samples, first, count, part)) < 0)
+        return error;
+
+    /* Two frames beyond the last segment for the encoder's lookahead; the
+     * worker's encoder timeline is the input's. */
+    if (count)
+        xc->stop_at = (first + count) * samples + 2 * xc->outccx->frame_size;
+    if (!first)
+        return 0;
+    /* The first segment starts with the packet at its start less the
+     * encoder delay, see seg.h. */
+    xc->written = first * samples - xc->outccx->initial_padding;
+    if ((start = preroll_start(xc, xc->written)) < 0)
+        return 0;
+    return seek_input(xc, start, fo);
+}
+
+/**
+ * Split segmented output among worker processes, each encoding a range of
+ * segments from its own seek into the input, and write the playlist once
+ * they have all finished.
+ * @param      in       Input file name
+ * @param      playlist Playlist file name
+ * @param      seconds  Segment length
+ * @param      jobs     Number of workers
+ * @param[out] first    In a worker: its first segment
+ * @param[out] count    In a worker: its number of segments, 0 for all the
+ *                      rest
+ * @return 1 in a worker, which goes on to transcode; 0 in the parent once
+ *         the workers succeeded, an error code if not
+ */
+static int segment_workers(const char *in, const char *playlist, double seconds, int jobs, int *first, int *count)
+{
+    AVFormatContext *fcx = NULL;
+    int firsts[SEG_MAX_JOBS];
+    int64_t duration, length;
+    int total, started, failed = 0, status, error, k;
+    pid_t pid;
+
+    /* How many segments there are, as far as the container knows; the
+     * last worker goes on to the end whatever it says. */
+    if ((error = avformat_open_input(&fcx, in, NULL, NULL)) < 0 ||
+        (error = avformat_find_stream_info(fcx, NULL)) < 0) {
+        fprintf(stderr, "Could not open input file '%s' (error '%s')\n", in, av_err2str(error));
+        avformat_close_input(&fcx);
+        return error;
+    }
+    duration = fcx->duration;
+    avformat_close_input(&fcx);
+    if (duration <= 0) {
+        fprintf(stderr, "The length of '%s' is unknown, it can't be split among workers\n", in);
+        return AVERROR(EINVAL);
+    }
+    length = seconds * AV_TIME_BASE;
+    total  = FFMAX((duration + length - 1) / length, 1);
+    jobs   = FFMIN(jobs, total);
+
+    fflush(stderr);
+    for (started = 0; started < jobs; started++) {
+        firsts[started] = (int64_t)started * total / jobs;
+        if ((pid = fork()) < 0) {
+            fprintf(stderr, "Could not start worker %d\n", started);
+            failed = 1;
+            break;
+        }
+        if (!pid) {
+            *first = firsts[started];
+            *count = started < jobs - 1 ? (int64_t)(started + 1) * total / jobs - *first : 0;
+            return 1;
+        }
+    }
+    for (k = 0; k < started; k++)
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+            failed = 1;
+    if (failed) {
+        fprintf(stderr, "A worker failed, '%s' is not written\n", playlist);
+        return AVERROR_EXIT;
+    }
+    if ((total = seg_merge(playlist, firsts, jobs)) < 0)
+        return total;
+    fprintf(stderr, "%d segments of '%s' written by %d workers\n", total, playlist, jobs);
+    return 0;
+}
+
+/* One output of a split (-X): an encoder and muxer taking the decoded
+ * samples of its range. Its encode jobs run on the work pool one at a
+ * time, the decoder feeds its FIFO under the split's lock. */
+struct branch {
+    struct split *sp;
+    struct xcode xc;        /* FIFO, encoder and output */
+    const char *out;
+    int64_t start, end;     /* range in input samples, end INT64_MAX for to the end */
+    int queued;             /* an encode job is queued or running */
+    int final;              /* no more samples come */
+    int error;
+};
+
+struct split {
+    pthread_mutex_t lock;
+    pthread_cond_t drained; /* an encode job took samples from a FIFO */
+    struct tpool *tp;
+    struct branch *br;
+    int nb_br;
+    int limit;              /* samples in a branch's FIFO the decoder waits at */
+};
+
+/**
+ * Encode what a branch's FIFO holds in whole frames, and once no more
+ * samples come, the rest; then flush the encoder and finish the output.
+ * A job of the work pool.
+ * @param arg Branch
+ * @return Error code (0 if successful)
+ */
+static int branch_encode(void *arg)
+{
+    struct branch *b = arg;
+    struct split *sp = b->sp;
+    AVCodecContext *outccx = b->xc.outccx;
+    AVFrame *frame = NULL;
+    int final, n, data_written, error = 0;
+
+    pthread_mutex_lock(&sp->lock);
+    for (;;) {
+        n = av_audio_fifo_size(b->xc.fifo);
+        final = b->final;
+        if (!(n >= outccx->frame_size || (final && n > 0)))
+            break;
+        n = FFMIN(n, outccx->frame_size);
+        if ((error = init_output_frame(&frame, outccx, n)) ||
+            av_audio_fifo_read(b->xc.fifo, (void **)frame->data, n) < n) {
+            fprintf(stderr, "Could not read data from FIFO\n");
+            error = AVERROR_EXIT;
+            break;
+        }
+        pthread_cond_signal(&sp->drained);
+        pthread_mutex_unlock(&sp->lock);
+        error = encode_audio_frame(frame, b->xc.outfcx, NULL, outccx, &b->xc.pts, &b->xc.written, &data_written, NULL);
+        av_frame_free(&frame);
+        pthread_mutex_lock(&sp->lock);
+        if (error < 0)
+            break;
+    }
+    if (error) {
+        av_frame_free(&frame);
+        b->error = error;
+        final = 0;
+        /* The decoder may be waiting for this FIFO. */
+        pthread_cond_signal(&sp->drained);
+    }
+    b->queued = 0;
+    pthread_mutex_unlock(&sp->lock);
+
+    /* Nothing else touches a final branch. */
+    if (final && (flush_encoder(&b->xc) || write_output_file_trailer(b->xc.outfcx)))
+        error = b->error = AVERROR_EXIT;
+    if (error < 0)
+        fprintf(stderr, "Could not write '%s'\n", b->out);
+    return error < 0 ? error : 0;
+}
+
+/**
+ * Queue a branch's encode job, unless it has one.
+ * @return Error code (0 if successful)
+ */
+static int branch_queue(struct branch *b)
+{
+    if (b->queued)
+        return 0;
+    b->queued = 1;
+    return tpool_submit(b->sp->tp, branch_encode, b);
+}
+
+/**
+ * Hand decoded samples to the branches whose ranges they fall into, and
+ * finish the branches whose ranges they end.
+ * @param sp         Split
+ * @param data       Samples, in the encoders' format
+ * @param pos        Input position of the first one
+ * @param nb_samples Number of samples, 0 at the end of the input
+ * @param fmt        Sample format
+ * @param channels   Number of channels
+ * @return Error code (0 if successful)
+ */
+static int split_feed(struct split *sp, uint8_t **data, int64_t pos, int nb_samples,
+                      enum AVSampleFormat fmt, int channels)
+{
+    const int planar = av_sample_fmt_is_planar(fmt);
+    const int step = av_get_bytes_per_sample(fmt) * (planar ? 1 : channels);
+    int error = 0, i, c;
+
+    pthread_mutex_lock(&sp->lock);
+    for (i = 0; i < sp->nb_br && !error; i++) {
+        struct branch *b = &sp->br[i];
+        const int64_t from = FFMAX(b->start, pos), to = FFMIN(b->end, pos + nb_samples);
+
+        if (b->final || b->error)
+            continue;
+        if (from < to) {
+            uint8_t *planes[AV_NUM_DATA_POINTERS];
+
+            /* Hold back while the encoder is behind. */
+            while (av_audio_fifo_size(b->xc.fifo) > sp->limit && !b->error)
+                pthread_cond_wait(&sp->drained, &sp->lock);
+            if (b->error)
+                continue;
+            for (c = 0; c < (planar ? channels : 1); c++)
+                planes[c] = data[c] + (from - pos) * step;
+            if (av_audio_fifo_write(b->xc.fifo, (void **)planes, to - from) < to - from) {
+                fprintf(stderr, "Could not write data to FIFO\n");
+                error = AVERROR_EXIT;
+                break;
+            }
+        }
+        if (!nb_samples || pos + nb_samples >= b->end)
+            b->final = 1;
+        if (b->final || av_audio_fifo_size(b->xc.fifo) >= b->xc.outccx->frame_size)
+            error = branch_queue(b);
+    }
+    pthread_mutex_unlock(&sp->lock);
+    return error;
+}
+
+/**
+ * Split the input into tracks in one decode: every decoded sample goes
+ * to the outputs whose ranges it falls into, each with an encoder of its
+ * own on the work pool. The input is seeked to the first start and read
+ * up to the last end.
+ * @param xc     Transcode state with the input opened
+ * @param tracks Ranges and output files, see editlist.h
+ * @param opts   Transcode settings of every output
+ * @param jobs   Number of encoder threads
+ * @return Error code (0 if successful)
+ */
+static int split_transcode(struct xcode *xc, const struct editlist *tracks, const struct tmp30_opts *opts, int jobs)
+{
+    const int rate = xc->inpccx->sample_rate;
+    struct split sp = { .nb_br = tracks->nb_edits };
+    struct edit range = { .start = INT64_MAX };
+    AVCodecContext *enc;
+    enum AVSampleFormat fmt;
+    int64_t pos, end = 0;
+    uint8_t **data;
+    int error, i, n;
+
+    pthread_mutex_init(&sp.lock, NULL);
+    pthread_cond_init(&sp.drained, NULL);
+    if (!(sp.br = av_calloc(sp.nb_br, sizeof(*sp.br)))) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    for (i = 0; i < sp.nb_br; i++) {
+        const struct edit *e = &tracks->edits[i];
+        struct branch *b = &sp.br[i];
+
+        b->sp    = &sp;
+        b->out   = e->file;
+        b->xc    = (struct xcode){ .written = INT64_MIN };
+        b->start = av_rescale(e->start, rate, AV_TIME_BASE);
+        /* Without a duration, up to the next track or the end. */
+        if (e->length)
+            b->end = b->start + av_rescale(e->length, rate, AV_TIME_BASE);
+        else if (i + 1 < sp.nb_br && tracks->edits[i + 1].start > e->start)
+            b->end = av_rescale(tracks->edits[i + 1].start, rate, AV_TIME_BASE);
+        else
+            b->end = INT64_MAX;
+        range.start = FFMIN(range.start, e->start);
+        end         = FFMAX(end, b->end);
+        if ((error = open_output_file(b->out, NULL, opts, xc->inpccx, &b->xc.enckey,
+                                      &b->xc.outfcx, &b->xc.outccx)) < 0 ||
+            (error = write_output_file_header(b->xc.outfcx, NULL)) < 0 ||
+            (error = init_fifo(&b->xc.fifo, b->xc.outccx)) < 0)
+            goto cleanup;
+    }
+    /* Decode once, converted to what the encoders take; they are opened
+     * alike, so the first one stands for all. */
+    enc = sp.br[0].xc.outccx;
+    fmt = enc->sample_fmt;
+    sp.limit = SPLIT_QUEUE_SECONDS * rate;
+    fmtneg_describe(xc->conversion, sizeof(xc->conversion), xc->inpccx, &enc->ch_layout, fmt, enc->sample_rate);
+    if ((!fmtneg_passthrough(xc->inpccx, &enc->ch_layout, fmt, enc->sample_rate) &&
+         get_resampler(xc->pool, xc->inpccx, enc, fmt, &xc->swrkey, &xc->resccx)) ||
+        init_fifo(&xc->fifo, enc)) {
+        error = AVERROR_EXIT;
+        goto cleanup;
+    }
+    if ((error = tpool_alloc(&sp.tp, FFMIN(jobs, sp.nb_br))) < 0 ||
+        (error = start_edit(xc, &range)) < 0)
+        goto cleanup;
+    xc->stop_at = end;
+
+    /* The FIFO starts at the first start, whether seeked to or decoded
+     * up to. */
+    pos = av_rescale(range.start, rate, AV_TIME_BASE);
+    while (!xc->in_done) {
+        if (read_decode_convert_and_store(xc->fifo, NULL, xc->inpfcx, xc->inpccx, enc, xc->resccx, xc->fp, NULL, NULL, NULL,
+                                          xc->drop_until, xc->stop_at, NULL, NULL, &xc->in_pts, &xc->in_done, xc->st)) {
+            error = AVERROR_EXIT;
+            goto cleanup;
+        }
+        if (!(n = av_audio_fifo_size(xc->fifo)))
+            continue;
+        if ((error = fpool_scratch(xc->fp, &data, enc->ch_layout.nb_channels, n, fmt)) < 0)
+            goto cleanup;
+        av_audio_fifo_read(xc->fifo, (void **)data, n);
+        if ((error = split_feed(&sp, data, pos, n, fmt, enc->ch_layout.nb_channels)) < 0)
+            goto cleanup;
+        pos += n;
+    }
+    error = split_feed(&sp, NULL, pos, 0, fmt, enc->ch_layout.nb_channels);
+
+cleanup:
+    /* Whatever was queued finishes before the outputs go. */
+    if (sp.tp) {
+        int ret = tpool_wait(sp.tp);
+        if (!error)
+            error = ret;
+        tpool_free(&sp.tp);
+    }
+    if (!error)
+        fprintf(stderr, "Split: %d tracks from one decode, %d encoder threads\n", sp.nb_br, FFMIN(jobs, sp.nb_br));
+    for (i = 0; sp.br && i < sp.nb_br; i++)
+        xcode_free(&sp.br[i].xc);
+    av_free(sp.br);
+    pthread_cond_destroy(&sp.drained);
+    pthread_mutex_destroy(&sp.lock);
+    return error;
+}
+
+int main(int argc, char **argv)
+{
+    struct xcode xc = { .written = INT64_MIN, .drop_until = INT64_MIN, .stop_at = INT64_MAX };
+    struct tmp30_opts opts = { 0 };
+    struct fastopen fo;
+    struct xstat st;
+    struct ckpt saved;
+    struct xcache cache;
+    struct editlist el = { 0 };
+    struct tune_opts tune;
+    AVIOContext *outpb = NULL;
+    enum xio_mode iomode = XIO_DEFAULT;
+    const char *in, *out, *edits = NULL, *tracks = NULL;
+    char out_name[4096];
+    double every = 0, budget = 0, segment = 0;
+    int fast = 0, resume = 0, cached = 0, spill = 0, rotate = 0, latency = 0;
+    /* Autotune (-A), only predict (-n) */
+    int tuned = 0, predict = 0, tune_jobs = 0;
+    /* Segment workers (-S) or encoder threads (-X), 0 when not given */
+    int jobs = 0, first = 0, count = 0;
+    /* Trimming (-s, -t), in microseconds */
+    int64_t trim_start = 0, trim_length = 0;
+    int ret = AVERROR_EXIT;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "A:cE:f:FHI:j:k:KL:l:np:PR:r:S:s:T:t:X:Z")) != -1) {
+        switch (opt) {
+        case 'A':
+            if (tune_parse(optarg, &tune))
+                exit(1);
+            tuned = 1;
+            break;
+        case 'c':
+            cached = 1;
+            break;
+        case 'E':
+            edits = optarg;
+            break;
+        case 'f':
+            opts.filters = optarg;
+            break;
+        case 'F':
+            fast = 1;
+            break;
+        case 'H':
+            latency = 1;
+            break;
+        case 'j':
+            if ((jobs = atoi(optarg)) < 1 || jobs > SEG_MAX_JOBS)
+                goto usage;
+            break;
+        case 'k':
+            if ((every = atof(optarg)) <= 0)
+                goto usage;
+            break;
+        case 'K':
+            resume = 1;
+            break;
+        case 'I':
+            if (xio_parse_mode(optarg, &iomode))
+                exit(1);
+            break;
+        case 'L': {
+            struct loud_opts lo;
+            if (loud_parse(optarg, &lo))
+                exit(1);
+            opts.loudness = optarg;
+            break;
+        }
+        case 'l':
+            if ((budget = atof(optarg)) <= 0)
+                goto usage;
+            break;
+        case 'n':
+            predict = 1;
+            break;
+        case 'p':
+            if (tmp30_parse_profile(optarg, &opts))
+                exit(1);
+            break;
+        case 'P':
+            spill = 1;
+            break;
+        case 'R':
+            if ((rotate = atoi(optarg)) <= 0)
+                goto usage;
+            break;
+        case 'r':
+            opts.report = optarg;
+            break;
+        case 'S':
+            if ((segment = atof(optarg)) <= 0)
+                goto usage;
+            break;
+        case 's':
+            if (av_parse_time(&trim_start, optarg, 1) < 0 || trim_start < 0)
+                goto usage;
+            break;
+        case 'T': {
+            struct tstretch_opts to;
+            if (tstretch_parse(optarg, &to))
+                exit(1);
+            opts.tempo = optarg;
+            break;
+        }
+        case 't':
+            if (av_parse_time(&trim_length, optarg, 1) < 0 || trim_length <= 0)
+                goto usage;
+            break;
+        case 'X':
+            tracks = optarg;
+            break;
+        case 'Z':
+            opts.zerocopy = 1;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != (edits || tracks ? 1 : 2)) {
+usage:
+        fprintf(stderr, "Usage: %s [-A target [-n] [-j threads]] [-c] [-E edit list] [-f filters] [-F] [-H] [-I default|mmap|readahead] [-k seconds] [-K] [-l ms [-R seconds]] [-L loudness] [-p profile] [-P] [-r report.json] [-s start] [-S seconds [-j jobs]] [-T tempo] [-t duration] [-X track list [-j threads]] [-Z] <input file> <output file>\n", argv[0]);
+        fprintf(stderr, "       %s -E <edit list> [options] <output file>\n", argv[0]);
+        fprintf(stderr, "       %s -X <track list> [options] <input file>\n", argv[0]);
+        fprintf(stderr, "  -A: the encoder setting of least CPU time that makes a size or bit rate, e.g. 4.5MB, 96k, 96k:10%%, see tune.h\n");
+        fprintf(stderr, "  -n: with -A, only print the predicted size and time; -j: trial encodes at once, one per core by default\n");
+        fprintf(stderr, "  -c: take the output from the cache or add it there, see xcache.h\n");
+        fprintf(stderr, "  -E: render the snippets of an edit list into the output file, see editlist.h\n");
+        fprintf(stderr, "  -f: libavfilter graph between decoder and encoder, e.g. atempo=0.5,volume=3dB, see fgraph.h\n");
+        fprintf(stderr, "  -F: fast open, see fastopen.h\n");
+        fprintf(stderr, "  -H: print latency percentiles per stage at the end and on SIGUSR1, see xstat.h\n");
+        fprintf(stderr, "  -k: checkpoint every so many seconds; -K: resume from the checkpoint, see ckpt.h\n");
+        fprintf(stderr, "  -l: live input, latency budget in milliseconds, see live.h\n");
+        fprintf(stderr, "  -R: with -l, a new output file every so many seconds, named by strftime(output file)\n");
+        fprintf(stderr, "  -L: normalize to <LUFS>[:tp<dBFS>][:la<seconds>][:2pass], e.g. -16, -23:2pass, see loud.h\n");
+        fprintf(stderr, "  -P: take the decoded samples from the cache or add them there, see pcmcache.h\n");
+        fprintf(stderr, "  -r: write a JSON run report (- for stdout), see xstat.h\n");
+        fprintf(stderr, "  -s, -t: only from start on, only duration long, [[hh:]mm:]ss[.xxx], e.g. -s 1:00 -t 10\n");
+        fprintf(stderr, "  -S: segments of so many seconds, output file is their playlist (.m3u8), see seg.h\n");
+        fprintf(stderr, "  -j: with -S, split the segments among so many worker processes\n");
+        fprintf(stderr, "  -T: change the tempo, not the pitch, <tempo>[:fast|good|best], e.g. 0.25 for quarter speed, see tstretch.h\n");
+        fprintf(stderr, "  -X: split into the tracks of a list in one decode, see editlist.h; -j: encoder threads\n");
+        fprintf(stderr, "  -Z: encode from the FIFO without copying, see zfifo.h\n");
+        fprintf(stderr, "  profile: codec[:<n>k][:v<q>][:<n>ch], e.g. mp3:128k, mp3:v5, aac:96k:1ch; with -A only codec and channels count\n");
+        fprintf(stderr, "  - as input or output file is stdin or stdout\n");
+        exit(1);
+    }
+    out = argv[argc - 1];
+    /* With -A alone, -j only bounds the trial encodes. */
+    if (tuned && !segment && !tracks) {
+        tune_jobs = jobs;
+        jobs      = 0;
+    }
+    if (edits) {
+        if (budget || every || resume || cached || jobs > 1 || trim_start || trim_length) {
+            fprintf(stderr, "-E goes without -c, -j, -k, -K, -l, -s and -t\n");
+            exit(1);
+        }
+        if (editlist_load(&el, edits) < 0)
+            exit(1);
+        in = el.edits[0].file;
+    } else
+        in = argv[optind];
+    if (tracks) {
+        if (every || resume || budget || cached || spill || edits || opts.loudness || opts.report || latency ||
+            segment || trim_start || trim_length || opts.zerocopy) {
+            fprintf(stderr, "-X goes without -c, -E, -H, -k, -K, -l, -L, -P, -r, -S, -s, -t and -Z\n");
+            exit(1);
+        }
+        if (editlist_load(&el, tracks) < 0)
+            exit(1);
+        /* One encoder thread per core unless told otherwise. */
+        if (!jobs)
+            jobs = FFMAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+        out = tracks;
+    }
+    if (budget && (every || resume || opts.loudness || cached || spill)) {
+        fprintf(stderr, "Live input can't be cached, checkpointed or normalized: -l goes without -c, -k, -K, -L and -P\n");
+        exit(1);
+    }
+    if (rotate && (!budget || !strchr(out, '%'))) {
+        fprintf(stderr, "-R needs -l and an output file name with strftime conversions, e.g. live-%%Y%%m%%d-%%H%%M.mp3\n");
+        exit(1);
+    }
+    if (segment && (every || resume || cached || rotate || !strcmp(out, "-"))) {
+        fprintf(stderr, "Segmented output is many files: -S goes without -c, -k, -K, -R and output to stdout\n");
+        exit(1);
+    }
+    if (cached && !strcmp(out, "-")) {
+        fprintf(stderr, "The cache takes and stores output files: -c goes without output to stdout\n");
+        exit(1);
+    }
+    if (jobs > 1 && !tracks && (!segment || budget || opts.loudness || spill || opts.report || !strcmp(in, "-"))) {
+        fprintf(stderr, "-j needs -A, -S or -X; with -S an input file to seek in, and it goes without -l, -L, -P and -r\n");
+        exit(1);
+    }
+    if (opts.filters && (budget || every || resume || spill || edits || tracks || jobs > 1)) {
+        fprintf(stderr, "Filters keep state across the input: -f goes without -E, -j, -k, -K, -l, -P and -X\n");
+        exit(1);
+    }
+    if (opts.tempo && (budget || every || resume || opts.loudness || opts.filters || tracks || jobs > 1)) {
+        fprintf(stderr, "-T goes without -f, -j, -k, -K, -l, -L and -X\n");
+        exit(1);
+    }
+    if ((trim_start || trim_length) && (budget || every || resume || jobs > 1)) {
+        fprintf(stderr, "-s and -t go without -j, -k, -K and -l\n");
+        exit(1);
+    }
+    if (predict && !tuned)
+        goto usage;
+    /* The trials encode the input as it is, and a resume must go on with
+     * the setting it started with. */
+    if (tuned && (edits || tracks || budget || resume || opts.loudness || opts.filters || opts.tempo ||
+                  !strcmp(in, "-"))) {
+        fprintf(stderr, "-A needs an input file to seek in, and goes without -E, -f, -K, -l, -L, -T and -X\n");
+        exit(1);
+    }
+    /* Before the setting goes into the container of stdout or of the
+     * segments, and before segment workers start. */
+    if (tuned) {
+        const AVOutputFormat *ofmt = segment || !strcmp(out, "-") ? NULL : av_guess_format(opts.out_format, out, NULL);
+        if (tune_pick(&tune, in, trim_start, trim_length, ofmt, &opts, tune_jobs ? tune_jobs : jobs,
+                      predict ? stdout : stderr) < 0)
+            exit(1);
+        if (predict)
+            return 0;
+    }
+    if (!strcmp(in, "-"))
+        in = "pipe:0";
+    /* Nothing to guess the container from on stdout. */
+    if (!strcmp(out, "-")) {
+        const AVCodec *codec = find_encoder(opts.codec);
+        out = "pipe:1";
+        opts.out_format = codec && codec->id == AV_CODEC_ID_AAC ? "adts" : "mp3";
+    }
+    if (rotate) {
+        xc.rotate_slot = time(NULL) / rotate;
+        rotate_name(out_name, sizeof(out_name), out, time(NULL));
+        xc.rotate_pattern = out;
+        xc.rotate = rotate;
+        out = out_name;
+    }
+    if ((every || resume) && opts.loudness) {
+        fprintf(stderr, "Loudness normalization can't be resumed, -L goes without -k/-K\n");
+        exit(1);
+    }
+    if ((every || resume) && spill) {
+        fprintf(stderr, "Cached samples have no input to checkpoint, -P goes without -k/-K\n");
+        exit(1);
+    }
+    if (resume && !every)
+        every = CKPT_INTERVAL;
+    opts.resumable = every > 0;
+    if (segment) {
+        const AVCodec *codec = find_encoder(opts.codec);
+        opts.out_format = codec && codec->id == AV_CODEC_ID_AAC ? "adts" : "mp3";
+        /* Each segment decodes on its own: no bit reservoir across a cut. */
+        opts.resumable = 1;
+        /* The parent only waits for the workers and writes the playlist. */
+        if (jobs > 1 && (ret = segment_workers(in, out, segment, jobs, &first, &count)) <= 0)
+            return ret;
+    }
+    /* Only resume what has a checkpoint; otherwise start afresh. */
+    if (resume && (ret = ckpt_load(out, &saved)) < 0) {
+        if (ret != AVERROR(ENOENT)) {
+            fprintf(stderr, "Could not read the checkpoint of '%s' (error '%s')\n", out, av_err2str(ret));
+            exit(1);
+        }
+        fprintf(stderr, "No checkpoint for '%s', transcoding from the beginning\n", out);
+        resume = 0;
+    }
+    ret = AVERROR_EXIT;
+    fastopen_init(&fo, fast);
+    xc.fo        = &fo;
+    xc.iomode    = iomode;
+    xc.loudness  = opts.loudness;
+    xc.filters   = opts.filters;
+    xc.tempo     = opts.tempo;
+    xc.resumable = opts.resumable;
+    xc.zerocopy  = opts.zerocopy;
+    if (opts.report || latency) {
+        xc.st = &st;
+        xstat_start(xc.st);
+    }
+    if (latency)
+        xstat_latency_on_signal(SIGUSR1);
+
+    /* Snippets already in the output's codec, with cuts between their
+     * packets, are copied rather than decoded and encoded again. */
+    if (edits && !opts.loudness && !opts.tempo && !segment && !opts.vbr && find_encoder(opts.codec) &&
+        editlist_copyable(&el, find_encoder(opts.codec), opts.bit_rate,
+                          opts.channels ? opts.channels : OUTPUT_CHANNELS) == 1) {
+        ret = editlist_copy(&el, out, opts.out_format);
+        goto cleanup;
+    }
+
+    /* Without a usable cache the transcode goes ahead regardless. */
+    if ((cached || spill) && xcache_init(&cache) < 0)
+        cached = spill = 0;
+
+    /* The decoder's frames come from our pool. */
+    if (fpool_alloc(&xc.fp) < 0)
+        goto cleanup;
+
+    /* Open the input file for reading, unless its decoded samples are
+     * cached; then they are what is read. */
+    if (spill && pcmcache_open(&xc.pcm, &cache, in) == 0 &&
+        pcmcache_codec_context(xc.pcm, &xc.inpccx) < 0)
+        pcmcache_free(&xc.pcm);
+    if (xc.pcm)
+        fprintf(stderr, "Decoded samples of '%s' taken from the cache\n", in);
+    else {
+        /* Live, live_stop can break off a read that blocks. */
+        const AVIOInterruptCB live_cb = { live_interrupt, &xc.lv };
+
+        if (open_input_file(in, iomode, NULL, NULL, &fo, opts.loudness || opts.tempo ? NULL : find_encoder(opts.codec),
+                            budget ? &live_cb : NULL, xc.fp, &xc.inpfcx, &xc.inpccx))
+            goto cleanup;
+        /* Only the whole input makes an entry. */
+        if (spill && !edits && !trim_start && !trim_length)
+            pcmcache_create(&xc.pcm, &cache, in, xc.inpccx);
+    }
+    if (spill)
+        xc.cache = &cache;
+
+    /* A split writes its tracks itself. */
+    if (tracks) {
+        ret = split_transcode(&xc, &el, &opts, jobs);
+        goto cleanup;
+    }
+
+    /* Look the output up in the cache; a partial output being resumed
+     * isn't. */
+    if (cached && !resume) {
+        char params[1024];
+        if ((ret = cache_params(params, sizeof(params), &opts, xc.inpccx, out)) < 0)
+            goto cleanup;
+        if (trim_start || trim_length)
+            av_strlcatf(params, sizeof(params), "|%" PRId64 "+%" PRId64, trim_start, trim_length);
+        if (opts.filters)
+            av_strlcatf(params, sizeof(params), "|%s", opts.filters);
+        if (opts.tempo)
+            av_strlcatf(params, sizeof(params), "|T%s", opts.tempo);
+        ret = AVERROR_EXIT;
+        if (xcache_key(&cache, in, params) < 0)
+            cached = 0;
+        else if (xcache_get(&cache, out) == 0) {
+            xcache_report(&cache, 1, stderr);
+            if (every)
+                ckpt_remove(out);
+            ret = 0;
+            goto cleanup;
+        }
+        /* A hit leaves a read-only link to an entry in place of the
+         * output; replace it rather than write through it. */
+        unlink(out);
+    } else
+        cached = 0;
+
+    /* Open the output file for writing; a resumed one without truncating it. */
+    if (resume) {
+        int fd = open(out, O_WRONLY);
+        if (fd < 0 || xio_open_fd_out(fd, &outpb) < 0) {
+            fprintf(stderr, "Could not open output file '%s'\n", out);
+            goto cleanup;
+        }
+    }
+    if (segment) {
+        if (open_segments(&xc, out, &opts, segment, first, count, jobs > 1, &fo))
+            goto cleanup;
+        if (jobs > 1 && count)
+            fprintf(stderr, "Worker %d: segments %d to %d\n", (int)getpid(), first, first + count - 1);
+        else if (jobs > 1)
+            fprintf(stderr, "Worker %d: segments %d to the end\n", (int)getpid(), first);
+    } else if (open_output_file(out, outpb, &opts, xc.inpccx, &xc.enckey, &xc.outfcx, &xc.outccx))
+        goto cleanup;
+
+    /* Live: packets go out as soon as they are made (segments as soon as
+     * they are complete), and the input is read on a thread of its own. */
+    if (budget) {
+        if (xc.outfcx)
+            xc.outfcx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        xc.budget = budget * 1000;
+        if (live_start(&xc.lv, xc.inpfcx, xc.budget) < 0)
+            goto cleanup;
+    }
+
+    if (every &&
+        (init_checkpoints(&xc, in, out, every) ||
+         (resume && resume_transcode(&xc, &saved, out, &fo))))
+        goto cleanup;
+
+    /* Trim: seek to a little before the start rather than decode up to it
+     * (a pipe is decoded up to it), drop what comes before the exact
+     * sample, and stop reading at the end. The output starts at 0. An
+     * edit list starts with its first snippet the same way. */
+    if (trim_start || trim_length) {
+        const struct edit trim = { .start = trim_start, .length = trim_length };
+        if (start_edit(&xc, &trim) < 0)
+            goto cleanup;
+    } else if (edits) {
+        xc.el        = &el;
+        xc.next_edit = 1;
+        if (start_edit(&xc, &el.edits[0]) < 0)
+            goto cleanup;
+    }
+
+    if (transcode(&xc))
+        goto cleanup;
+    if (every)
+        ckpt_remove(out);
+    if (xc.pcm && !pcmcache_reading(xc.pcm))
+        pcmcache_commit(xc.pcm);
+    if (cached) {
+        xcache_put(&cache, out);
+        xcache_report(&cache, 0, stderr);
+    }
+    fprintf(stderr, "Sample conversion: %s\n", xc.conversion);
+    if (latency)
+        xstat_print_latency(xc.st, stderr);
     ret = 0;
 
 cleanup:
-    if (fifo)
-        av_audio_fifo_free(fifo);
-    swr_free(&resccx);
-    if (outccx)
-        avcodec_free_context(&outccx);
-    if (outfcx) {
-        avio_closep(&outfcx->pb);
-        avformat_free_context(outfcx);
-    }
-    if (inpccx)
-        avcodec_free_context(&inpccx);
-    if (inpfcx)
-        avformat_close_input(&inpfcx);
+    write_report(&xc, in, out, opts.report, ret);
+    xcode_free(&xc);
+    fastopen_uninit(&fo);
+    editlist_free(&el);
 
     return ret;
 }
+#endif /* TMP30_NO_MAIN */
@@ -0,0 +1,155 @@
+/*
+ * tmp30.h: in-memory transcoding API on top of tmp30.c.
+ *
+ * Build libtmp30.a (make libtmp30.a), which is tmp30.c without main(),
+ * and link it together with the FFmpeg libraries. Neither call touches
+ * the filesystem: input comes from a buffer or a read callback, output
+ * goes to a growable buffer or a write callback.
+ * Calls on different threads are independent of each other.
+ */
+
+#ifndef TMP30_H
+#define TMP30_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* whence value asking a seek callback for the total size (AVSEEK_SIZE). */
+#define TMP30_SEEK_SIZE 0x10000
+
+/* Where tmp30d listens unless told otherwise. */
+#define TMP30D_SOCKET "/tmp/tmp30d.sock"
+
+/* Warm encoders and resamplers shared between transcodes (tmp30d.c). */
+struct tmp30_pool;
+
+/* Settings of one transcode. Zeroed fields mean tmp30's defaults:
+ * MP3 at 96 kbit/s, stereo, at the input's sample rate. */
+struct tmp30_opts {
+    const char *in_format;   /* input container short name, NULL to probe */
+    const char *out_format;  /* output container short name, e.g. "mp3";
+                                NULL to guess it from the output file name */
+    char codec[32];          /* encoder ("libmp3lame") or codec ("aac") name */
+    int64_t bit_rate;        /* bit/s */
+    int channels;
+    int vbr;                 /* encode VBR at quality instead of bit_rate */
+    int quality;             /* VBR quality, lame's -V scale for MP3 */
+    struct tmp30_pool *pool; /* where to take encoders and resamplers from */
+    const char *report;      /* write a JSON run report to this file ("-" for
+                                stdout), NULL for none; see xstat.h */
+    const char *loudness;    /* normalize loudness, "<LUFS>[:tp<dBFS>][:la<s>]
+                                [:2pass]" as for tmp30 -L, NULL for none;
+                                see loud.h */
+    int resumable;           /* output a checkpoint can be resumed into
+                                (tmp30 -k): no Xing frame or ID3 tag, and
+                                no MP3 bit reservoir; see ckpt.h */
+    int zerocopy;            /* convert into and encode from a zero-copy
+                                FIFO (tmp30 -Z); not with loudness; see
+                                zfifo.h */
+    const char *filters;     /* libavfilter graph the decoded samples go
+                                through, "atempo=0.5,volume=3dB" as for
+                                tmp30 -f, NULL for none; see fgraph.h */
+    const char *tempo;       /* time-stretch, "<tempo>[:fast|good|best]" as
+                                for tmp30 -T, NULL for none; not with
+                                loudness or filters; see tstretch.h */
+};
+
+/**
+ * Parse an encoder profile "codec[:<n>k][:v<q>][:<n>ch]" into opts,
+ * e.g. "mp3:128k", "mp3:v5" or "aac:96k:1ch".
+ * @return Error code (0 if successful)
+ */
+int tmp30_parse_profile(const char *profile, struct tmp30_opts *opts);
+
+/**
+ * Transcode a buffer holding a complete input file.
+ * @param      in       Input bytes
+ * @param      in_size  Number of input bytes
+ * @param[out] out      Output bytes, to be released with tmp30_free
+ * @param[out] out_size Number of output bytes
+ * @param      opts     Transcode settings
+ * @return Error code (0 if successful, a negative AVERROR code otherwise)
+ */
+int tmp30_transcode_mem(const uint8_t *in, size_t in_size,
+                        uint8_t **out, size_t *out_size,
+                        const struct tmp30_opts *opts);
+
+/**
+ * Transcode between caller callbacks.
+ * read returns the number of bytes read, 0 at the end of the input or a
+ * negative error code. write returns the number of bytes consumed or a
+ * negative error code. Either seek callback may be NULL; without an
+ * output seek callback, containers that patch their header at the end
+ * (MP4, the MP3 Xing frame) are written in their streaming form or fail.
+ * Seek callbacks get SEEK_SET, SEEK_CUR, SEEK_END or TMP30_SEEK_SIZE.
+ * @return Error code (0 if successful, a negative AVERROR code otherwise)
+ */
+int tmp30_transcode_cb(int (*read)(void *opaque, uint8_t *buf, int buf_size),
+                       int64_t (*rseek)(void *opaque, int64_t offset, int whence),
+                       void *ropaque,
+                       int (*write)(void *opaque, const uint8_t *buf, int buf_size),
+                       int64_t (*wseek)(void *opaque, int64_t offset, int whence),
+                       void *wopaque,
+                       const struct tmp30_opts *opts);
+
+/**
+ * Transcode between files given by path or by descriptor. Descriptors
+ * are taken over and closed; an input descriptor must refer to a
+ * regular file.
+ * @param in    Input path, or NULL to read infd
+ * @param infd  Input descriptor, used when in is NULL
+ * @param out   Output path; with outfd it only names the container
+ * @param outfd Output descriptor, or -1 to create out
+ * @param opts  Transcode settings
+ * @return Error code (0 if successful, a negative AVERROR code otherwise)
+ */
+int tmp30_transcode_file(const char *in, int infd, const char *out, int outfd,
+                         const struct tmp30_opts *opts);
+
+/**
+ * Release a buffer returned by tmp30_transcode_mem.
+ */
+void tmp30_free(void *ptr);
+
+/**
+ * Describe an error code returned by the functions above.
+ */
+int tmp30_strerror(int error, char *buf, size_t size);
+
+/**
+ * Allocate a pool of warm contexts. Encoders that cannot be reset after
+ * a transcode are freed on return and opened again by
+ * tmp30_pool_replenish, off the request path.
+ * @param spares Opened encoders to keep ready per parameter set
+ * @return The pool, or NULL when out of memory
+ */
+struct tmp30_pool *tmp30_pool_alloc(int spares);
+
+/**
+ * Open spare encoders for a profile ahead of the first job using it.
+ * They take the sample format closest to planar float, which is what the
+ * MP3, AAC, Vorbis and Opus decoders put out.
+ * @param opts        Encoder settings
+ * @param sample_rate Sample rate of the expected inputs
+ * @param out_format  Output container short name
+ * @return Error code (0 if successful)
+ */
+int tmp30_pool_warm(struct tmp30_pool *pool, const struct tmp30_opts *opts,
+                    int sample_rate, const char *out_format);
+
+/**
+ * Bring every parameter set seen so far back to its number of spares.
+ * The pool remembers the first 32 (POOL_MAX_KEYS in tmp30.c), warm-ups
+ * first; a job with another set opens a fresh encoder.
+ */
+void tmp30_pool_replenish(struct tmp30_pool *pool);
+
+/**
+ * Print hit/miss counters of the pool.
+ */
+void tmp30_pool_stats(struct tmp30_pool *pool, FILE *f);
+
+void tmp30_pool_free(struct tmp30_pool **pool);
+
+#endif /* TMP30_H */
@@ -0,0 +1,145 @@
+/*
+ * tmp30c.c: client for tmp30d.c.
+ *
+ * Sends one job to the daemon and prints its answer. By default the
+ * daemon opens the files itself, so they are sent as absolute paths;
+ * with -f the client opens them and passes the descriptors, which works
+ * across mount namespaces and for files only the client can access.
+ *
+ * Exit status: 0 on success, 1 on error, 2 if the daemon was busy.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "tmp30.h"
+
+/**
+ * Send the request line, with descriptors attached if there are any.
+ */
+static int send_request(int sock, const char *line, const int *fds, int nfds)
+{
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { 0 };
+    struct iovec iov = { (void *)line, strlen(line) };
+    struct cmsghdr *cmsg;
+
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+    if (nfds) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    /* The line is short enough to go out in one piece. */
+    if (sendmsg(sock, &msg, 0) != (ssize_t)iov.iov_len) {
+        perror("sendmsg");
+        return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s socket] [-p profile] [-f] <input file> <output file>\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = TMP30D_SOCKET, *profile = "mp3";
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char line[3 * PATH_MAX], in[PATH_MAX], out[PATH_MAX], answer[512];
+    int pass_fds = 0, fds[2], nfds = 0;
+    int sock, opt, n;
+
+    while ((opt = getopt(argc, argv, "s:p:f")) != -1) {
+        switch (opt) {
+        case 's': path     = optarg; break;
+        case 'p': profile  = optarg; break;
+        case 'f': pass_fds = 1;      break;
+        default:  usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2)
+        usage(argv[0]);
+
+    if (pass_fds) {
+        if ((fds[0] = open(argv[optind], O_RDONLY)) < 0) {
+            perror(argv[optind]);
+            return 1;
+        }
+        if ((fds[1] = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+            perror(argv[optind + 1]);
+            return 1;
+        }
+        nfds = 2;
+        snprintf(line, sizeof(line), "JOB\t%s\tfd\tfd:%s\n", profile, argv[optind + 1]);
+    } else {
+        if (!realpath(argv[optind], in)) {
+            perror(argv[optind]);
+            return 1;
+        }
+        /* The output does not exist yet, so realpath cannot be used on it. */
+        if (argv[optind + 1][0] == '/')
+            snprintf(out, sizeof(out), "%s", argv[optind + 1]);
+        else if (!getcwd(out, sizeof(out)) ||
+                 strlen(out) + 1 + strlen(argv[optind + 1]) >= sizeof(out)) {
+            fprintf(stderr, "Output path too long\n");
+            return 1;
+        } else {
+            strcat(out, "/");
+            strcat(out, argv[optind + 1]);
+        }
+        snprintf(line, sizeof(line), "JOB\t%s\t%s\t%s\n", profile, in, out);
+    }
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return 1;
+    }
+    if (send_request(sock, line, fds, nfds) < 0)
+        return 1;
+    if (nfds) {
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    /* The daemon closes the connection after its single-line answer. */
+    for (n = 0; n < (int)sizeof(answer) - 1; ) {
+        ssize_t r = read(sock, answer + n, sizeof(answer) - 1 - n);
+        if (r <= 0)
+            break;
+        n += r;
+    }
+    answer[n] = '\0';
+    close(sock);
+    if (!n) {
+        fprintf(stderr, "No answer from %s\n", path);
+        return 1;
+    }
+    fputs(answer, answer[0] == 'O' ? stdout : stderr);
+    if (!strncmp(answer, "OK", 2))
+        return 0;
+    return strncmp(answer, "BUSY", 4) ? 1 : 2;
+}
@@ -0,0 +1,462 @@
+/*
+ * tmp30d.c: transcode daemon on top of libtmp30 (tmp30.h).
+ *
+ * A tmp30 run pays for loading the FFmpeg libraries, opening the encoder
+ * and LAME's table setup every time. The daemon pays once, keeps spare
+ * encoders and resamplers opened per parameter set, and runs jobs on a
+ * fixed number of worker threads. tmp30c.c is the client.
+ *
+ * Protocol: one job per connection. The client sends one line
+ *     JOB <tab> profile <tab> input <tab> output <newline>
+ * where input is a path or "fd", and output a path or "fd:<name>", <name>
+ * only choosing the container. Descriptors travel with the line as
+ * SCM_RIGHTS, input first. Paths are opened by the daemon, so they have
+ * to be absolute. The reply is a single line:
+ *     OK <milliseconds>     ERR <message>     BUSY
+ * BUSY means the job queue was full and nothing was done.
+ *
+ * The daemon opens paths with its own rights, so the socket is made
+ * accessible to its owner only, and a peer of another user (but root)
+ * is turned away.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tmp30.h"
+
+#define REQUEST_MAX 8192
+
+struct job {
+    int conn;
+    char profile[64];
+    char in[PATH_MAX], out[PATH_MAX];
+    int infd, outfd;
+};
+
+/* Bounded job queue between the accept loop and the workers. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct job **jobs;
+    int cap, head, count;
+    int quit;
+} queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static struct tmp30_pool *pool;
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+static double ms_since(const struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+static void reply(int conn, const char *fmt, ...)
+{
+    char line[512];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+        return;
+    n = n < (int)sizeof(line) - 1 ? n : (int)sizeof(line) - 2;
+    line[n++] = '\n';
+    if (write(conn, line, n) < 0)
+        perror("reply");
+}
+
+static void free_job(struct job *job)
+{
+    if (job->infd >= 0)
+        close(job->infd);
+    if (job->outfd >= 0)
+        close(job->outfd);
+    close(job->conn);
+    free(job);
+}
+
+/**
+ * Queue a job unless the queue is full (admission control).
+ * @return 0 if queued, -1 if the daemon is busy
+ */
+static int push_job(struct job *job)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&queue.lock);
+    if (queue.count < queue.cap) {
+        queue.jobs[(queue.head + queue.count++) % queue.cap] = job;
+        pthread_cond_signal(&queue.cond);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return ret;
+}
+
+/**
+ * Wait for the next job. Returns NULL when the daemon shuts down.
+ */
+static struct job *pop_job(void)
+{
+    struct job *job = NULL;
+
+    pthread_mutex_lock(&queue.lock);
+    while (!queue.count && !queue.quit)
+        pthread_cond_wait(&queue.cond, &queue.lock);
+    if (queue.count) {
+        job = queue.jobs[queue.head];
+        queue.head = (queue.head + 1) % queue.cap;
+        queue.count--;
+    }
+    pthread_mutex_unlock(&queue.lock);
+    return job;
+}
+
+static void run_job(struct job *job)
+{
+    struct tmp30_opts opts = { 0 };
+    struct timespec t0;
+    char err[128];
+    int ret;
+
+    if (tmp30_parse_profile(job->profile, &opts) < 0) {
+        reply(job->conn, "ERR invalid profile '%s'", job->profile);
+        return;
+    }
+    opts.pool = pool;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    /* The descriptors are closed by tmp30_transcode_file. */
+    ret = tmp30_transcode_file(job->infd >= 0 ? NULL : job->in, job->infd,
+                               job->out, job->outfd, &opts);
+    job->infd = job->outfd = -1;
+    if (ret < 0) {
+        tmp30_strerror(ret, err, sizeof(err));
+        reply(job->conn, "ERR %s", err);
+    } else
+        reply(job->conn, "OK %.1f", ms_since(&t0));
+}
+
+static void *worker(void *arg)
+{
+    struct job *job;
+
+    while ((job = pop_job())) {
+        run_job(job);
+        free_job(job);
+        /* Replace the encoders this job used up, now that the client
+         * has its answer. */
+        tmp30_pool_replenish(pool);
+    }
+    return NULL;
+}
+
+/**
+ * Read the request line and any descriptors sent along with it.
+ * @param conn Connected client socket
+ * @param buf  Buffer for the request line
+ * @param size Size of buf
+ * @param fds  Receives the first two descriptors, -1 where none came;
+ *             any more are closed. Left for the caller to close, also
+ *             on failure.
+ * @return 0 if a complete line was read, -1 otherwise
+ */
+static int read_request(int conn, char *buf, size_t size, int fds[2])
+{
+    union {
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    size_t len = 0;
+    ssize_t n;
+
+    fds[0] = fds[1] = -1;
+    while (len < size - 1) {
+        iov.iov_base       = buf + len;
+        iov.iov_len        = size - 1 - len;
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        if ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+            return -1;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                int i, fd;
+
+                /* They may come with any part of the line. */
+                for (i = 0; i < nfds; i++) {
+                    memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                    if (fds[0] < 0)
+                        fds[0] = fd;
+                    else if (fds[1] < 0)
+                        fds[1] = fd;
+                    else
+                        close(fd);
+                }
+            }
+        }
+        /* Descriptors that didn't fit were dropped by the kernel. */
+        if (msg.msg_flags & MSG_CTRUNC)
+            return -1;
+        len += n;
+        buf[len] = '\0';
+        if (memchr(buf, '\n', len))
+            return 0;
+    }
+    return -1;
+}
+
+/**
+ * Turn a request line into a job.
+ * @return 0 if the request is well-formed, -1 otherwise
+ */
+static int parse_request(char *line, const int fds[2], struct job *job)
+{
+    char *save, *cmd, *profile, *in, *out;
+    int nfds = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+    cmd     = strtok_r(line, "\t", &save);
+    profile = strtok_r(NULL, "\t", &save);
+    in      = strtok_r(NULL, "\t", &save);
+    out     = strtok_r(NULL, "\t", &save);
+    if (!cmd || strcmp(cmd, "JOB") || !profile || !in || !out)
+        return -1;
+    if (snprintf(job->profile, sizeof(job->profile), "%s", profile) >= sizeof(job->profile))
+        return -1;
+
+    if (!strcmp(in, "fd")) {
+        if ((job->infd = fds[nfds++]) < 0)
+            return -1;
+    } else if (*in != '/' || snprintf(job->in, sizeof(job->in), "%s", in) >= sizeof(job->in))
+        return -1;
+
+    if (!strncmp(out, "fd:", 3)) {
+        if ((job->outfd = fds[nfds++]) < 0)
+            return -1;
+        out += 3;
+    } else if (*out != '/')
+        return -1;
+    if (snprintf(job->out, sizeof(job->out), "%s", out) >= sizeof(job->out))
+        return -1;
+    return 0;
+}
+
+/**
+ * Check that the peer runs as the daemon's user, or as root.
+ */
+static int peer_allowed(int conn)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+        return 0;
+    return cred.uid == getuid() || cred.uid == 0;
+}
+
+/**
+ * Accept one connection and queue its job, or turn it away.
+ */
+static void handle_connection(int conn)
+{
+    struct timeval tv = { 2, 0 };
+    char *line = NULL;
+    struct job *job;
+    int fds[2] = { -1, -1 };
+    int ok, i;
+
+    if (!peer_allowed(conn)) {
+        reply(conn, "ERR permission denied");
+        close(conn);
+        return;
+    }
+
+    /* A client that connects and says nothing must not stall the accept loop. */
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (!(job = calloc(1, sizeof(*job))) || !(line = malloc(REQUEST_MAX))) {
+        close(conn);
+        free(job);
+        return;
+    }
+    job->conn = conn;
+    job->infd = job->outfd = -1;
+    ok = read_request(conn, line, REQUEST_MAX, fds) == 0 &&
+         parse_request(line, fds, job) == 0;
+    /* Close whatever descriptors came that the job did not take. */
+    for (i = 0; i < 2; i++)
+        if (fds[i] >= 0 && fds[i] != job->infd && fds[i] != job->outfd)
+            close(fds[i]);
+    if (!ok) {
+        reply(conn, "ERR malformed request");
+        free_job(job);
+    } else {
+        if (push_job(job) < 0) {
+            reply(conn, "BUSY");
+            free_job(job);
+        }
+    }
+    free(line);
+}
+
+/**
+ * Parse a -w argument "profile@rate/format" and warm the pool for it.
+ */
+static int warm(const char *arg)
+{
+    struct tmp30_opts opts = { 0 };
+    char profile[64], format[32];
+    int rate;
+
+    if (sscanf(arg, "%63[^@]@%d/%31s", profile, &rate, format) != 3) {
+        fprintf(stderr, "Invalid warm-up '%s' (expected profile@rate/format)\n", arg);
+        return -1;
+    }
+    if (tmp30_parse_profile(profile, &opts) < 0 ||
+        tmp30_pool_warm(pool, &opts, rate, format) < 0)
+        return -1;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s socket] [-j workers] [-q queue] [-n spares] [-w profile@rate/format]...\n", prog);
+    fprintf(stderr, "  e.g. %s -j 4 -w mp3:96k@48000/mp3 -w aac:128k@44100/adts\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = TMP30D_SOCKET;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct sigaction sa = { .sa_handler = on_signal };
+    int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    int qlen = 0, spares = 1;
+    pthread_t *threads;
+    sigset_t sigs, oldsigs;
+    mode_t mask;
+    int sock, opt, i;
+
+    /* Warm-ups need the pool, which needs the spares count: collect them first. */
+    const char **warms = calloc(argc, sizeof(*warms));
+    int nwarms = 0;
+
+    while ((opt = getopt(argc, argv, "s:j:q:n:w:")) != -1) {
+        switch (opt) {
+        case 's': path     = optarg;       break;
+        case 'j': nworkers = atoi(optarg); break;
+        case 'q': qlen     = atoi(optarg); break;
+        case 'n': spares   = atoi(optarg); break;
+        case 'w': warms[nwarms++] = optarg; break;
+        default:  usage(argv[0]);
+        }
+    }
+    if (optind != argc || nworkers < 1 || spares < 0 || qlen < 0)
+        usage(argv[0]);
+    /* Queue twice as many jobs as there are workers by default: enough to
+     * keep them busy, few enough to bound the wait of an admitted job. */
+    queue.cap = qlen ? qlen : 2 * nworkers;
+
+    if (!(pool = tmp30_pool_alloc(spares)) ||
+        !(queue.jobs = calloc(queue.cap, sizeof(*queue.jobs))) ||
+        !(threads = calloc(nworkers, sizeof(*threads)))) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (i = 0; i < nwarms; i++)
+        if (warm(warms[i]) < 0)
+            return 1;
+    free(warms);
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(path);
+    /* The socket file takes its mode from the umask: owner only, from
+     * the start. */
+    mask = umask(0177);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, 0600) < 0 || listen(sock, 64) < 0) {
+        perror(path);
+        return 1;
+    }
+    umask(mask);
+
+    /* No SA_RESTART: a signal has to interrupt accept. */
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* SIGINT and SIGTERM have to interrupt accept: the workers, and the
+     * threads they start, never take them. */
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+    for (i = 0; i < nworkers; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+    fprintf(stderr, "tmp30d: listening on %s, %d workers, queue %d\n", path, nworkers, queue.cap);
+
+    while (!stop) {
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno != EINTR)
+                perror("accept");
+            continue;
+        }
+        handle_connection(conn);
+    }
+
+    /* Let queued jobs finish, then stop the workers. */
+    pthread_mutex_lock(&queue.lock);
+    queue.quit = 1;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.lock);
+    for (i = 0; i < nworkers; i++)
+        pthread_join(threads[i], NULL);
+
+    close(sock);
+    unlink(path);
+    tmp30_pool_stats(pool, stderr);
+    tmp30_pool_free(&pool);
+    free(queue.jobs);
+    free(threads);
+    return 0;
+}
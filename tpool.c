@@ -0,0 +1,146 @@
+/*
+ * tpool.c: see tpool.h.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "tpool.h"
+
+struct job {
+    int (*run)(void *arg);
+    void *arg;
+};
+
+struct tpool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;    /* a job was queued, or the pool is stopping */
+    pthread_cond_t idle;    /* a job finished */
+    pthread_t *threads;
+    int nb_threads;
+    /* Ring of queued jobs, oldest first */
+    struct job *jobs;
+    int cap, head, count;
+    int running;
+    int error;
+    int quit;
+};
+
+static void *worker(void *arg)
+{
+    struct tpool *tp = arg;
+    struct job job;
+    int error;
+
+    pthread_mutex_lock(&tp->lock);
+    for (;;) {
+        while (!tp->count && !tp->quit)
+            pthread_cond_wait(&tp->work, &tp->lock);
+        if (!tp->count)
+            break;
+        job = tp->jobs[tp->head];
+        tp->head = (tp->head + 1) % tp->cap;
+        tp->count--;
+        tp->running++;
+        pthread_mutex_unlock(&tp->lock);
+
+        error = job.run(job.arg);
+
+        pthread_mutex_lock(&tp->lock);
+        if (error < 0 && !tp->error)
+            tp->error = error;
+        tp->running--;
+        pthread_cond_broadcast(&tp->idle);
+    }
+    pthread_mutex_unlock(&tp->lock);
+    return NULL;
+}
+
+int tpool_alloc(struct tpool **tp, int threads)
+{
+    struct tpool *t;
+    int error;
+
+    if (!(t = av_mallocz(sizeof(*t))) ||
+        !(t->threads = av_calloc(threads, sizeof(*t->threads)))) {
+        av_free(t);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->work, NULL);
+    pthread_cond_init(&t->idle, NULL);
+    for (t->nb_threads = 0; t->nb_threads < threads; t->nb_threads++)
+        if ((error = pthread_create(&t->threads[t->nb_threads], NULL, worker, t))) {
+            fprintf(stderr, "Could not start a pool thread\n");
+            tpool_free(&t);
+            return AVERROR(error);
+        }
+    *tp = t;
+    return 0;
+}
+
+int tpool_submit(struct tpool *tp, int (*job)(void *arg), void *arg)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&tp->lock);
+    if (tp->count == tp->cap) {
+        const int cap = tp->cap ? 2 * tp->cap : 16;
+        struct job *jobs;
+        int i;
+
+        if (!(jobs = av_malloc_array(cap, sizeof(*jobs)))) {
+            ret = AVERROR(ENOMEM);
+            goto unlock;
+        }
+        /* Unwrap the ring. */
+        for (i = 0; i < tp->count; i++)
+            jobs[i] = tp->jobs[(tp->head + i) % tp->cap];
+        av_free(tp->jobs);
+        tp->jobs = jobs;
+        tp->cap  = cap;
+        tp->head = 0;
+    }
+    tp->jobs[(tp->head + tp->count++) % tp->cap] = (struct job){ job, arg };
+    pthread_cond_signal(&tp->work);
+unlock:
+    pthread_mutex_unlock(&tp->lock);
+    return ret;
+}
+
+int tpool_wait(struct tpool *tp)
+{
+    int error;
+
+    pthread_mutex_lock(&tp->lock);
+    while (tp->count || tp->running)
+        pthread_cond_wait(&tp->idle, &tp->lock);
+    error = tp->error;
+    pthread_mutex_unlock(&tp->lock);
+    return error;
+}
+
+void tpool_free(struct tpool **tp)
+{
+    struct tpool *t = *tp;
+    int i;
+
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->quit = 1;
+    pthread_cond_broadcast(&t->work);
+    pthread_mutex_unlock(&t->lock);
+    for (i = 0; i < t->nb_threads; i++)
+        pthread_join(t->threads[i], NULL);
+    pthread_cond_destroy(&t->idle);
+    pthread_cond_destroy(&t->work);
+    pthread_mutex_destroy(&t->lock);
+    av_free(t->threads);
+    av_free(t->jobs);
+    av_freep(tp);
+}
@@ -0,0 +1,43 @@
+/*
+ * tpool.h: work pool of tmp30, a fixed number of threads that run queued
+ * jobs (the encoders of -X, the trial encodes of -A).
+ *
+ * Jobs run in the order they were queued, any number at a time, so a job
+ * that must not run alongside another of its kind has to see to that
+ * itself (tmp30 queues one encode job per output at a time). The queue
+ * grows as needed; whoever queues holds back when the work piles up.
+ */
+
+#ifndef TPOOL_H
+#define TPOOL_H
+
+struct tpool;
+
+/**
+ * Start a pool.
+ * @param threads Number of threads, 1 or more
+ * @return Error code (0 if successful)
+ */
+int tpool_alloc(struct tpool **tp, int threads);
+
+/**
+ * Queue a job.
+ * @param job Function run on one of the threads; a negative result is
+ *            kept for tpool_wait
+ * @param arg Its argument
+ * @return Error code (0 if successful)
+ */
+int tpool_submit(struct tpool *tp, int (*job)(void *arg), void *arg);
+
+/**
+ * Wait until the queue is empty and no job is running.
+ * @return The first error a job returned since the pool started, or 0
+ */
+int tpool_wait(struct tpool *tp);
+
+/**
+ * Let the queued jobs finish, stop the threads and free the pool.
+ */
+void tpool_free(struct tpool **tp);
+
+#endif /* TPOOL_H */
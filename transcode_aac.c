@@ -32,6 +32,7 @@
  */
 
 #include <stdio.h>
+#include <unistd.h>
 
 #include <libavutil/mem.h>
 #include <libavformat/avformat.h>
@@ -48,41 +49,102 @@
 
 #include <libswresample/swresample.h>
 
+#include "fastopen.h"
+#include "fmtneg.h"
+#include "xio.h"
+
 /* The output bit rate in bit/s */
 #define OUTPUT_BIT_RATE 96000
 /* The number of output channels */
 #define OUTPUT_CHANNELS 2
 
+/**
+ * Close an input file opened by open_input_file, together with the
+ * custom I/O context if one was attached to it.
+ * @param input_format_context Format context of the input file
+ */
+static void close_input_file(AVFormatContext **input_format_context)
+{
+    AVIOContext *pb = NULL;
+
+    if (!*input_format_context)
+        return;
+    if ((*input_format_context)->flags & AVFMT_FLAG_CUSTOM_IO)
+        pb = (*input_format_context)->pb;
+    avformat_close_input(input_format_context);
+    xio_close(&pb);
+}
+
 /**
  * Open an input file and the required decoder.
  * @param      filename             File to be opened
+ * @param      iomode               How to read the file (see xio.h)
+ * @param      fo                   Fast-open state (see fastopen.h)
  * @param[out] input_format_context Format context of opened file
  * @param[out] input_codec_context  Codec context of opened file
  * @return Error code (0 if successful)
  */
 static int open_input_file(const char *filename,
+                           enum xio_mode iomode,
+                           struct fastopen *fo,
                            AVFormatContext **input_format_context,
                            AVCodecContext **input_codec_context)
 {
     AVCodecContext *avctx;
     const AVCodec *input_codec;
+    const AVInputFormat *iformat;
     const AVStream *stream;
+    AVIOContext *pb = NULL;
+    AVDictionary *options = NULL;
     int error;
 
+    /* In fast mode this guesses the container and limits the probe. */
+    iformat = fastopen_begin(fo, filename, &options);
+
+    /* Attach our own I/O context unless libavformat's file protocol is wanted. */
+    if (iomode != XIO_DEFAULT) {
+        if ((error = xio_open_file(filename, iomode, &pb)) < 0) {
+            fprintf(stderr, "Could not open input file '%s' (error '%s')\n",
+                    filename, av_err2str(error));
+            return error;
+        }
+        if (!(*input_format_context = avformat_alloc_context())) {
+            fprintf(stderr, "Could not allocate input format context\n");
+            xio_close(&pb);
+            return AVERROR(ENOMEM);
+        }
+        (*input_format_context)->pb = pb;
+    }
+
     /* Open the input file to read from it. */
-    if ((error = avformat_open_input(input_format_context, filename, NULL,
-                                     NULL)) < 0) {
+    error = avformat_open_input(input_format_context, filename, iformat,
+                                &options);
+    av_dict_free(&options);
+    if (error < 0) {
+        *input_format_context = NULL;
+        xio_close(&pb);
+        /* The guessed container may simply be wrong. */
+        if (fo->enabled)
+            goto fallback;
         fprintf(stderr, "Could not open input file '%s' (error '%s')\n",
                 filename, av_err2str(error));
-        *input_format_context = NULL;
         return error;
     }
+    (*input_format_context)->opaque = fo;
 
     /* Get information on the input file (number of streams etc.). */
-    if ((error = avformat_find_stream_info(*input_format_context, NULL)) < 0) {
+    if (fo->enabled)
+        error = fastopen_stream_info(fo, *input_format_context);
+    else
+        error = avformat_find_stream_info(*input_format_context, NULL);
+    if (error == FASTOPEN_FALLBACK && fo->enabled) {
+        close_input_file(input_format_context);
+        goto fallback;
+    }
+    if (error < 0) {
         fprintf(stderr, "Could not open find stream info (error '%s')\n",
                 av_err2str(error));
-        avformat_close_input(input_format_context);
+        close_input_file(input_format_context);
         return error;
     }
 
@@ -90,7 +152,7 @@ static int open_input_file(const char *filename,
     if ((*input_format_context)->nb_streams != 1) {
         fprintf(stderr, "Expected one audio input stream, but found %d\n",
                 (*input_format_context)->nb_streams);
-        avformat_close_input(input_format_context);
+        close_input_file(input_format_context);
         return AVERROR_EXIT;
     }
 
@@ -99,7 +161,7 @@ static int open_input_file(const char *filename,
     /* Find a decoder for the audio stream. */
     if (!(input_codec = avcodec_find_decoder(stream->codecpar->codec_id))) {
         fprintf(stderr, "Could not find input codec\n");
-        avformat_close_input(input_format_context);
+        close_input_file(input_format_context);
         return AVERROR_EXIT;
     }
 
@@ -107,34 +169,51 @@ static int open_input_file(const char *filename,
     avctx = avcodec_alloc_context3(input_codec);
     if (!avctx) {
         fprintf(stderr, "Could not allocate a decoding context\n");
-        avformat_close_input(input_format_context);
+        close_input_file(input_format_context);
         return AVERROR(ENOMEM);
     }
 
     /* Initialize the stream parameters with demuxer information. */
     error = avcodec_parameters_to_context(avctx, stream->codecpar);
     if (error < 0) {
-        avformat_close_input(input_format_context);
+        close_input_file(input_format_context);
         avcodec_free_context(&avctx);
         return error;
     }
 
+    /* Ask the decoder for a sample format the AAC encoder takes; the ones
+     * that can put out more than one then need no conversion. */
+    fmtneg_request(avctx, avcodec_find_encoder(AV_CODEC_ID_AAC));
+
     /* Open the decoder for the audio stream to use it later. */
     if ((error = avcodec_open2(avctx, input_codec, NULL)) < 0) {
         fprintf(stderr, "Could not open input codec (error '%s')\n",
                 av_err2str(error));
         avcodec_free_context(&avctx);
-        avformat_close_input(input_format_context);
+        close_input_file(input_format_context);
         return error;
     }
 
     /* Set the packet timebase for the decoder. */
     avctx->pkt_timebase = stream->time_base;
 
+    /* Check what fast open assumed against the first decoded frame. */
+    if (fo->enabled && fastopen_verify(fo, *input_format_context, avctx) < 0) {
+        avcodec_free_context(&avctx);
+        close_input_file(input_format_context);
+        goto fallback;
+    }
+    fastopen_store(fo, *input_format_context, avctx);
+
     /* Save the decoder context for easier access later. */
     *input_codec_context = avctx;
 
     return 0;
+
+fallback:
+    fastopen_fallback(fo);
+    return open_input_file(filename, iomode, fo, input_format_context,
+                           input_codec_context);
 }
 
 /**
@@ -209,10 +288,11 @@ static int open_output_file(const char *filename,
     }
 
     /* Set the basic encoder parameters.
-     * The input file's sample rate is used to avoid a sample rate conversion. */
+     * The input file's sample rate and, if the encoder takes it, sample
+     * format are used to avoid a conversion. */
     av_channel_layout_default(&avctx->ch_layout, OUTPUT_CHANNELS);
     avctx->sample_rate    = input_codec_context->sample_rate;
-    avctx->sample_fmt     = output_codec->sample_fmts[0];
+    avctx->sample_fmt     = fmtneg_pick(output_codec, input_codec_context->sample_fmt);
     avctx->bit_rate       = OUTPUT_BIT_RATE;
 
     /* Set the sample rate for the container. */
@@ -387,7 +467,7 @@ static int decode_audio_frame(AVFrame *frame,
     *data_present = 0;
     *finished = 0;
     /* Read one audio frame from the input file into a temporary packet. */
-    if ((error = av_read_frame(input_format_context, input_packet)) < 0) {
+    if ((error = fastopen_read_frame(input_format_context, input_packet)) < 0) {
         /* If we are at the end of the file, flush the decoder below. */
         if (error == AVERROR_EOF)
             *finished = 1;
@@ -425,6 +505,7 @@ static int decode_audio_frame(AVFrame *frame,
     /* Default case: Return decoded data. */
     } else {
         *data_present = 1;
+        fastopen_frame_decoded(input_format_context);
         goto cleanup;
     }
 
@@ -535,7 +616,8 @@ static int add_samples_to_fifo(AVAudioFifo *fifo,
  * @param      input_format_context Format context of the input file
  * @param      input_codec_context  Codec context of the input file
  * @param      output_codec_context Codec context of the output file
- * @param      resampler_context    Resample context for the conversion
+ * @param      resampler_context    Resample context for the conversion, or
+ *                                  NULL if the decoded samples need none
  * @param[out] finished             Indicates whether the end of file has
  *                                  been reached and all data has been
  *                                  decoded. If this flag is false,
@@ -574,6 +656,15 @@ static int read_decode_convert_and_store(AVAudioFifo *fifo,
     }
     /* If there is decoded data, convert and store it. */
     if (data_present) {
+        /* Already in the output format: stored as decoded. */
+        if (!resampler_context) {
+            if (add_samples_to_fifo(fifo, input_frame->extended_data,
+                                    input_frame->nb_samples))
+                goto cleanup;
+            ret = 0;
+            goto cleanup;
+        }
+
         /* Initialize the temporary storage for the converted input samples. */
         if (init_converted_samples(&converted_input_samples, output_codec_context,
                                    input_frame->nb_samples))
@@ -785,23 +876,51 @@ int main(int argc, char **argv)
     AVCodecContext *input_codec_context = NULL, *output_codec_context = NULL;
     SwrContext *resample_context = NULL;
     AVAudioFifo *fifo = NULL;
+    char conversion[128];
+    struct fastopen fo;
+    enum xio_mode iomode = XIO_DEFAULT;
+    int fast = 0;
     int ret = AVERROR_EXIT;
+    int opt;
 
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
+    while ((opt = getopt(argc, argv, "FI:")) != -1) {
+        switch (opt) {
+        case 'F':
+            fast = 1;
+            break;
+        case 'I':
+            if (xio_parse_mode(optarg, &iomode))
+                exit(1);
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (argc - optind != 2) {
+usage:
+        fprintf(stderr, "Usage: %s [-F] [-I default|mmap|readahead] <input file> <output file>\n",
+                argv[0]);
         exit(1);
     }
+    fastopen_init(&fo, fast);
 
     /* Open the input file for reading. */
-    if (open_input_file(argv[1], &input_format_context,
+    if (open_input_file(argv[optind], iomode, &fo, &input_format_context,
                         &input_codec_context))
         goto cleanup;
     /* Open the output file for writing. */
-    if (open_output_file(argv[2], input_codec_context,
+    if (open_output_file(argv[optind + 1], input_codec_context,
                          &output_format_context, &output_codec_context))
         goto cleanup;
-    /* Initialize the resampler to be able to convert audio sample formats. */
-    if (init_resampler(input_codec_context, output_codec_context,
+    /* Initialize the resampler to be able to convert audio sample formats,
+     * unless the decoder already puts out what the encoder takes. */
+    fmtneg_describe(conversion, sizeof(conversion), input_codec_context,
+                    &output_codec_context->ch_layout, output_codec_context->sample_fmt,
+                    output_codec_context->sample_rate);
+    fprintf(stderr, "Sample conversion: %s\n", conversion);
+    if (!fmtneg_passthrough(input_codec_context, &output_codec_context->ch_layout,
+                            output_codec_context->sample_fmt, output_codec_context->sample_rate) &&
+        init_resampler(input_codec_context, output_codec_context,
                        &resample_context))
         goto cleanup;
     /* Initialize the FIFO buffer to store audio samples to be encoded. */
@@ -880,8 +999,8 @@ cleanup:
     }
     if (input_codec_context)
         avcodec_free_context(&input_codec_context);
-    if (input_format_context)
-        avformat_close_input(&input_format_context);
+    close_input_file(&input_format_context);
+    fastopen_uninit(&fo);
 
     return ret;
 }
@@ -0,0 +1,491 @@
+/*
+ * tstretch.c: see tstretch.h.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include <libswresample/swresample.h>
+
+#include "tstretch.h"
+
+/* Four floats: an SSE or NEON register, and what GCC's generic vectors
+ * lower to without a -march. Loads and stores go through memcpy, so
+ * nothing needs to be aligned. */
+typedef float vfloat __attribute__((vector_size(16)));
+#define VLEN ((int)(sizeof(vfloat) / sizeof(float)))
+
+static const struct tier {
+    const char *name;
+    double frame;   /* frame length, seconds */
+    double seek;    /* search range each way, seconds */
+    int decimate;   /* the search compares every so many samples of the mix,
+                       then every sample around the best match */
+} tiers[] = {
+    [TSTRETCH_FAST] = { "fast", 0.030, 0.008, 4 },
+    [TSTRETCH_GOOD] = { "good", 0.040, 0.012, 2 },
+    [TSTRETCH_BEST] = { "best", 0.050, 0.015, 1 },
+};
+
+struct tstretch {
+    struct tstretch_opts o;
+    const struct tier *t;
+    int channels, rate;
+    int win, hop;           /* frame length and output hop (win / 2), samples */
+    int seek;               /* search range each way, samples */
+    float *window;          /* periodic Hann: halves a hop apart add up to 1 */
+
+    /* Input the frames to come are taken from: in[ch][i] and mix[i] are
+     * input sample in_base + i */
+    float **in;
+    float *mix;             /* mean of the channels, for the search */
+    int in_len, in_cap;
+    int64_t in_base;
+    int64_t in_total;       /* samples taken in */
+
+    /* Frames */
+    int64_t frames;         /* added so far */
+    int64_t prev;           /* where the last one was taken from */
+    float *tmpl, *cand;     /* decimated template and search range */
+    double shift;           /* summed distance from the nominal positions */
+
+    /* Output: the frames added up; acc[ch][0] is output sample
+     * frames * hop, what the next frame starts at */
+    float **acc;
+    int64_t out_total;      /* samples moved into the FIFO */
+    SwrContext *swr;        /* float to the FIFO's format, NULL if fltp */
+    enum AVSampleFormat out_fmt;
+    uint8_t **conv;
+    int conv_size;
+};
+
+/* Sum of the lanes. */
+static float hsum(vfloat v)
+{
+    return (v[0] + v[1]) + (v[2] + v[3]);
+}
+
+/* Sum of a[i] * b[i]. */
+static float dot(const float *restrict a, const float *restrict b, int n)
+{
+    vfloat s0 = { 0 }, s1 = { 0 }, x, y;
+    float sum = 0;
+    int i;
+
+    for (i = 0; i + 2 * VLEN <= n; i += 2 * VLEN) {
+        memcpy(&x, a + i, sizeof(x));
+        memcpy(&y, b + i, sizeof(y));
+        s0 += x * y;
+        memcpy(&x, a + i + VLEN, sizeof(x));
+        memcpy(&y, b + i + VLEN, sizeof(y));
+        s1 += x * y;
+    }
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+    return sum + hsum(s0 + s1);
+}
+
+/* The correlation of t with c at the offsets 0 to 3 into sum: t is loaded
+ * once for all four, and their additions don't wait on each other. */
+static void dot4(const float *restrict t, const float *restrict c, int n, float *sum)
+{
+    vfloat s0 = { 0 }, s1 = { 0 }, s2 = { 0 }, s3 = { 0 }, x, y;
+    int i, k;
+
+    for (i = 0; i + VLEN <= n; i += VLEN) {
+        memcpy(&x, t + i, sizeof(x));
+        memcpy(&y, c + i, sizeof(y));
+        s0 += x * y;
+        memcpy(&y, c + i + 1, sizeof(y));
+        s1 += x * y;
+        memcpy(&y, c + i + 2, sizeof(y));
+        s2 += x * y;
+        memcpy(&y, c + i + 3, sizeof(y));
+        s3 += x * y;
+    }
+    sum[0] = hsum(s0);
+    sum[1] = hsum(s1);
+    sum[2] = hsum(s2);
+    sum[3] = hsum(s3);
+    for (; i < n; i++)
+        for (k = 0; k < 4; k++)
+            sum[k] += t[i] * c[i + k];
+}
+
+/* acc[i] += x[i] * w[i], the overlap-add. */
+static void add_windowed(float *restrict acc, const float *restrict x, const float *restrict w, int n)
+{
+    vfloat a, b, c;
+    int i;
+
+    for (i = 0; i + VLEN <= n; i += VLEN) {
+        memcpy(&a, acc + i, sizeof(a));
+        memcpy(&b, x + i, sizeof(b));
+        memcpy(&c, w + i, sizeof(c));
+        a += b * c;
+        memcpy(acc + i, &a, sizeof(a));
+    }
+    for (; i < n; i++)
+        acc[i] += x[i] * w[i];
+}
+
+/* y[i] = sum of x[i * d] to x[i * d + d - 1], a crude lowpass before the
+ * search looks at every d-th sample. */
+static void decimate(float *y, const float *x, int n, int d)
+{
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        float s = 0;
+        for (j = 0; j < d; j++)
+            s += x[i * d + j];
+        y[i] = s;
+    }
+}
+
+/**
+ * Find where in c the template matches best: the highest normalized
+ * cross-correlation of len samples, over n consecutive offsets. c has
+ * n + len - 1 samples, and 3 more that are read but don't count.
+ * @param mid Offset preferred on a tie (silence): the nominal one
+ * @return Offset into c
+ */
+static int best_match(const float *tmpl, const float *c, int len, int n, int mid)
+{
+    const double eps = 1e-9 * len;
+    double e = dot(c, c, len), score, best = -HUGE_VAL;
+    float xc[4];
+    int m, k, at = mid;
+
+    for (m = 0; m < n; m += 4) {
+        dot4(tmpl, c + m, len, xc);
+        for (k = 0; k < 4 && m + k < n; k++) {
+            score = xc[k] / sqrt(FFMAX(e, 0) + eps);
+            /* The nominal offset wins ties. */
+            if (score > best || (score == best && m + k == mid)) {
+                best = score;
+                at   = m + k;
+            }
+            /* The energy under the next offset, slid along by one. */
+            e += (double)c[m + k + len] * c[m + k + len] - (double)c[m + k] * c[m + k];
+        }
+    }
+    return at;
+}
+
+/* Input position frame k is nominally taken from. */
+static int64_t nominal(const struct tstretch *ts, int64_t k)
+{
+    return llrint(k * ts->hop * ts->o.tempo);
+}
+
+/**
+ * Where to take the next frame from: around its nominal position, where
+ * it looks most like the hop that followed the last frame.
+ * @param a Nominal position
+ */
+static int64_t search(struct tstretch *ts, int64_t a)
+{
+    const int d = ts->t->decimate;
+    const int64_t lo = FFMAX(a - ts->seek, 0), hi = a + ts->seek;
+    const float *tmpl = ts->mix + (ts->prev + ts->hop - ts->in_base);
+    const float *cand = ts->mix + (lo - ts->in_base);
+    const int len = ts->win / d, n = (hi - lo) / d + 1;
+    int64_t s, rlo, rhi;
+
+    if (d == 1)
+        return lo + best_match(tmpl, cand, len, n, a - lo);
+    decimate(ts->tmpl, tmpl, len, d);
+    decimate(ts->cand, cand, n + len - 1, d);
+    s = lo + (int64_t)d * best_match(ts->tmpl, ts->cand, len, n, (a - lo) / d);
+
+    /* The decimated search is only good to d samples. */
+    rlo = FFMAX(s - d + 1, lo);
+    rhi = FFMIN(s + d - 1, hi);
+    return rlo + best_match(tmpl, ts->mix + (rlo - ts->in_base), ts->win, rhi - rlo + 1, s - rlo);
+}
+
+/**
+ * Drop the input no frame needs any more and make room for nb_samples.
+ * @return Error code (0 if successful)
+ */
+static int make_room(struct tstretch *ts, int nb_samples)
+{
+    int64_t keep = 0;
+    int drop, ch;
+
+    /* The next frame's template starts a hop after the last frame, and its
+     * search range seek before its nominal position. */
+    if (ts->frames)
+        keep = FFMAX(FFMIN(ts->prev + ts->hop, nominal(ts, ts->frames) - ts->seek), 0);
+    if ((drop = FFMIN(keep - ts->in_base, ts->in_len)) > 0) {
+        for (ch = 0; ch < ts->channels; ch++)
+            memmove(ts->in[ch], ts->in[ch] + drop, (ts->in_len - drop) * sizeof(float));
+        memmove(ts->mix, ts->mix + drop, (ts->in_len - drop) * sizeof(float));
+        ts->in_base += drop;
+        ts->in_len  -= drop;
+    }
+
+    if (ts->in_len + nb_samples > ts->in_cap) {
+        const int cap = FFMAX(2 * ts->in_cap, ts->in_len + nb_samples);
+        float *p;
+
+        for (ch = 0; ch <= ts->channels; ch++) {
+            float **buf = ch < ts->channels ? &ts->in[ch] : &ts->mix;
+            /* dot4 reads a few samples past the end. */
+            if (!(p = av_realloc_array(*buf, cap + VLEN, sizeof(float))))
+                return AVERROR(ENOMEM);
+            *buf = p;
+        }
+        ts->in_cap = cap;
+    }
+    return 0;
+}
+
+/**
+ * Add the next frame to the output, if the input it needs is there. At
+ * the end of the input, what is missing is silence.
+ * @param flush The input has ended
+ * @return 1 if a frame was added, 0 if it needs more input, or an error code
+ */
+static int add_frame(struct tstretch *ts, int flush)
+{
+    const int64_t a = nominal(ts, ts->frames);
+    /* The template, the search range, and enough input that the output
+     * doesn't run ahead of it. */
+    const int64_t need = FFMAX(ts->frames ? FFMAX(ts->prev + ts->hop, a + ts->seek) + ts->win : ts->win,
+                               nominal(ts, ts->frames + 1));
+    int64_t s;
+    int ch, error;
+
+    if (ts->in_base + ts->in_len < need) {
+        const int pad = need - ts->in_base - ts->in_len;
+
+        if (!flush)
+            return 0;
+        if ((error = make_room(ts, pad)) < 0)
+            return error;
+        for (ch = 0; ch < ts->channels; ch++)
+            memset(ts->in[ch] + ts->in_len, 0, pad * sizeof(float));
+        memset(ts->mix + ts->in_len, 0, pad * sizeof(float));
+        ts->in_len += pad;
+    }
+
+    s = ts->frames ? search(ts, a) : 0;
+    for (ch = 0; ch < ts->channels; ch++) {
+        const float *x = ts->in[ch] + (s - ts->in_base);
+
+        add_windowed(ts->acc[ch], x, ts->window, ts->win);
+        /* Nothing overlaps the first frame's rising half. */
+        if (!ts->frames)
+            memcpy(ts->acc[ch], x, ts->hop * sizeof(float));
+    }
+    ts->shift += llabs(s - a);
+    ts->prev = s;
+    ts->frames++;
+    return 1;
+}
+
+static int put_samples(struct tstretch *ts, AVAudioFifo *fifo, float **data, int len)
+{
+    void **out = (void **)data;
+    int error;
+
+    if (ts->swr) {
+        if (len > ts->conv_size) {
+            if (ts->conv)
+                av_freep(&ts->conv[0]);
+            av_freep(&ts->conv);
+            ts->conv_size = 0;
+            if ((error = av_samples_alloc_array_and_samples(&ts->conv, NULL, ts->channels, len, ts->out_fmt, 0)) < 0)
+                return error;
+            ts->conv_size = len;
+        }
+        if ((error = swr_convert(ts->swr, ts->conv, len, (const uint8_t **)data, len)) < 0) {
+            fprintf(stderr, "Could not convert stretched samples (error '%s')\n", av_err2str(error));
+            return error;
+        }
+        out = (void **)ts->conv;
+    }
+    if (av_audio_fifo_write(fifo, out, len) < len) {
+        fprintf(stderr, "Could not write data to FIFO\n");
+        return AVERROR_EXIT;
+    }
+    return 0;
+}
+
+/**
+ * Move the first len samples of the sum, which no frame to come overlaps,
+ * into the FIFO and slide the sum along by a hop.
+ * @return Error code (0 if successful)
+ */
+static int release(struct tstretch *ts, AVAudioFifo *fifo, int len)
+{
+    int ch, error;
+
+    if ((error = put_samples(ts, fifo, ts->acc, len)) < 0)
+        return error;
+    for (ch = 0; ch < ts->channels; ch++) {
+        memmove(ts->acc[ch], ts->acc[ch] + ts->hop, (ts->win - ts->hop) * sizeof(float));
+        memset(ts->acc[ch] + ts->win - ts->hop, 0, ts->hop * sizeof(float));
+    }
+    ts->out_total += len;
+    return 0;
+}
+
+int tstretch_parse(const char *spec, struct tstretch_opts *o)
+{
+    char *end;
+    int i;
+
+    o->tempo = strtod(spec, &end);
+    o->tier  = TSTRETCH_GOOD;
+    if (end == spec)
+        goto fail;
+    if (*end == ':') {
+        for (i = 0; i < FF_ARRAY_ELEMS(tiers) && strcmp(end + 1, tiers[i].name); i++)
+            ;
+        if (i == FF_ARRAY_ELEMS(tiers))
+            goto fail;
+        o->tier = i;
+    } else if (*end)
+        goto fail;
+    if (!(o->tempo >= TSTRETCH_MIN && o->tempo <= TSTRETCH_MAX))
+        goto fail;
+    return 0;
+
+fail:
+    fprintf(stderr, "Invalid time-stretch setting '%s', expected <tempo>[:fast|good|best] "
+            "(tempo %g..%g, 0.5 is half speed)\n", spec, TSTRETCH_MIN, (double)TSTRETCH_MAX);
+    return AVERROR(EINVAL);
+}
+
+int tstretch_alloc(struct tstretch **ts, const struct tstretch_opts *o,
+                   const AVChannelLayout *layout, int rate, enum AVSampleFormat out_fmt)
+{
+    struct tstretch *s;
+    int ch, error, i;
+
+    if (!(s = av_mallocz(sizeof(*s))))
+        return AVERROR(ENOMEM);
+    *ts = s;
+    s->o        = *o;
+    s->t        = &tiers[o->tier];
+    s->channels = layout->nb_channels;
+    s->rate     = rate;
+    s->hop      = FFMAX(lrint(s->t->frame * rate / 2), VLEN);
+    s->win      = 2 * s->hop;
+    s->seek     = lrint(s->t->seek * rate);
+    s->out_fmt  = out_fmt;
+
+    if (!(s->window = av_malloc_array(s->win, sizeof(*s->window))) ||
+        !(s->tmpl = av_malloc_array(s->win, sizeof(*s->tmpl))) ||
+        !(s->cand = av_malloc_array(s->win + 2 * s->seek + VLEN, sizeof(*s->cand))) ||
+        !(s->in = av_calloc(s->channels, sizeof(*s->in))) ||
+        !(s->acc = av_calloc(s->channels, sizeof(*s->acc))))
+        goto nomem;
+    for (ch = 0; ch < s->channels; ch++)
+        if (!(s->acc[ch] = av_calloc(s->win, sizeof(float))))
+            goto nomem;
+    for (i = 0; i < s->win; i++)
+        s->window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / s->win);
+
+    if (out_fmt != AV_SAMPLE_FMT_FLTP) {
+        if ((error = swr_alloc_set_opts2(&s->swr, layout, out_fmt, rate, layout, AV_SAMPLE_FMT_FLTP, rate, 0, NULL)) < 0 ||
+            (error = swr_init(s->swr)) < 0) {
+            fprintf(stderr, "Could not open time-stretch output conversion\n");
+            goto fail;
+        }
+    }
+    return 0;
+
+nomem:
+    error = AVERROR(ENOMEM);
+fail:
+    tstretch_free(ts);
+    return error;
+}
+
+int tstretch_write(struct tstretch *ts, const float *const *data, int nb_samples, AVAudioFifo *fifo)
+{
+    int moved = 0, ch, error, i;
+    float *mix;
+
+    if ((error = make_room(ts, nb_samples)) < 0)
+        return error;
+    for (ch = 0; ch < ts->channels; ch++)
+        memcpy(ts->in[ch] + ts->in_len, data[ch], nb_samples * sizeof(float));
+    mix = ts->mix + ts->in_len;
+    memcpy(mix, data[0], nb_samples * sizeof(float));
+    for (ch = 1; ch < ts->channels; ch++)
+        for (i = 0; i < nb_samples; i++)
+            mix[i] += data[ch][i];
+    for (i = 0; i < nb_samples; i++)
+        mix[i] *= 1.0f / ts->channels;
+    ts->in_len   += nb_samples;
+    ts->in_total += nb_samples;
+
+    /* Each frame completes a hop of the output. */
+    while ((error = add_frame(ts, 0)) > 0) {
+        if ((error = release(ts, fifo, ts->hop)) < 0)
+            return error;
+        moved += ts->hop;
+    }
+    return error < 0 ? error : moved;
+}
+
+int tstretch_flush(struct tstretch *ts, AVAudioFifo *fifo, int want)
+{
+    const int64_t total = llrint(ts->in_total / ts->o.tempo);
+    int moved = 0, len, error;
+
+    while (moved < want && ts->out_total < total) {
+        if ((error = add_frame(ts, 1)) < 0)
+            return error;
+        len = FFMIN(ts->hop, total - ts->out_total);
+        if ((error = release(ts, fifo, len)) < 0)
+            return error;
+        moved += len;
+    }
+    return moved;
+}
+
+void tstretch_report(const struct tstretch *ts, FILE *f)
+{
+    fprintf(f, "Time-stretch: tempo %.3f (%s), %" PRId64 " samples in, %" PRId64 " out; "
+            "%.0f ms frames, search +-%.0f ms, frames %.2f ms off their nominal position on average\n",
+            ts->o.tempo, ts->t->name, ts->in_total, ts->out_total, ts->win * 1000.0 / ts->rate,
+            ts->seek * 1000.0 / ts->rate, ts->frames ? ts->shift * 1000 / ts->rate / ts->frames : 0);
+}
+
+void tstretch_free(struct tstretch **ts)
+{
+    struct tstretch *s = *ts;
+    int ch;
+
+    if (!s)
+        return;
+    for (ch = 0; s->in && ch < s->channels; ch++)
+        av_free(s->in[ch]);
+    for (ch = 0; s->acc && ch < s->channels; ch++)
+        av_free(s->acc[ch]);
+    av_free(s->in);
+    av_free(s->acc);
+    av_free(s->mix);
+    av_free(s->window);
+    av_free(s->tmpl);
+    av_free(s->cand);
+    swr_free(&s->swr);
+    if (s->conv)
+        av_freep(&s->conv[0]);
+    av_freep(&s->conv);
+    av_freep(ts);
+}
@@ -0,0 +1,95 @@
+/*
+ * tstretch.h: time-stretch stage of tmp30 (-T option), e.g. a quarter
+ * speed preview in one pass where atempo has to be chained.
+ *
+ * Sits between the resampler and the FIFO, like the loudness stage: the
+ * resampler hands it planar float at the output rate and layout, and it
+ * passes the stretched samples on to the FIFO in the encoder's sample
+ * format. The pitch stays.
+ *
+ * WSOLA (waveform similarity overlap-add): frames of the input, Hann
+ * windowed with 50% overlap, are added up one output hop apart. Each one
+ * is taken from tempo times further into the input than the last, give or
+ * take a search range, at the offset where it looks most like what would
+ * have followed the frame before it (normalized cross-correlation on a
+ * mono mix of the channels), so the waveforms line up where they overlap.
+ * Any tempo from TSTRETCH_MIN to TSTRETCH_MAX is one stage.
+ *
+ * Tiers trade quality for speed: fast searches a narrower range on every
+ * 4th sample of the mix, good on every 2nd, both then the samples around
+ * the best; best every sample of a wider range, with longer frames. The
+ * correlation and overlap-add loops work on 4 floats at a time, the
+ * correlation at 4 offsets at once (GCC vector extensions: SSE, NEON or
+ * whatever the target has).
+ */
+
+#ifndef TSTRETCH_H
+#define TSTRETCH_H
+
+#include <stdio.h>
+
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+
+#define TSTRETCH_MIN 0.1
+#define TSTRETCH_MAX 10
+
+enum tstretch_tier {
+    TSTRETCH_FAST,
+    TSTRETCH_GOOD,
+    TSTRETCH_BEST,
+};
+
+struct tstretch_opts {
+    double tempo;             /* 0.5 is half speed, twice as long */
+    enum tstretch_tier tier;
+};
+
+struct tstretch;
+
+/**
+ * Parse "<tempo>[:fast|good|best]", e.g. "0.25" or "0.5:best". The
+ * default tier is good.
+ * @return Error code (0 if successful)
+ */
+int tstretch_parse(const char *spec, struct tstretch_opts *o);
+
+/**
+ * Set up a time-stretch stage.
+ * @param[out] ts      Time-stretch stage
+ * @param      o       Settings
+ * @param      layout  Channel layout of the samples
+ * @param      rate    Sample rate
+ * @param      out_fmt Sample format to write into the FIFO
+ * @return Error code (0 if successful)
+ */
+int tstretch_alloc(struct tstretch **ts, const struct tstretch_opts *o,
+                   const AVChannelLayout *layout, int rate, enum AVSampleFormat out_fmt);
+
+/**
+ * Take in nb_samples of planar float and move the output they complete
+ * into the FIFO.
+ * @param fifo FIFO in the output sample format
+ * @return Number of samples moved, or a negative error code
+ */
+int tstretch_write(struct tstretch *ts, const float *const *data, int nb_samples, AVAudioFifo *fifo);
+
+/**
+ * At the end of the input, move the rest of the output into the FIFO, a
+ * part at a time. All of it comes to the input's length over the tempo.
+ * @param fifo FIFO in the output sample format
+ * @param want Stop once at least this many samples were moved
+ * @return Number of samples moved, 0 once everything has been,
+ *         or a negative error code
+ */
+int tstretch_flush(struct tstretch *ts, AVAudioFifo *fifo, int want);
+
+/**
+ * Print the settings and the samples taken in and put out.
+ */
+void tstretch_report(const struct tstretch *ts, FILE *f);
+
+void tstretch_free(struct tstretch **ts);
+
+#endif /* TSTRETCH_H */
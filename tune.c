@@ -0,0 +1,617 @@
+/*
+ * tune.c: see tune.h.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/avstring.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/error.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/mem.h>
+#include <libswresample/swresample.h>
+
+#include "fmtneg.h"
+#include "tpool.h"
+#include "tune.h"
+
+/* What tmp30 encodes unless -p says otherwise. */
+#define TUNE_CHANNELS 2
+/* Every GRID_STEP-th setting of a kind, and its last, is tried first. */
+#define GRID_STEP 3
+/* How far off the model may be: settings it puts within this much of
+ * the target's range are tried too. */
+#define MODEL_SLACK 0.15
+#define MAX_CANDS 64
+
+/* Decoded chunks of the input, planar float at the output's channels */
+struct chunks {
+    uint8_t **data[TUNE_CHUNKS];
+    int nb_samples[TUNE_CHUNKS];
+    int nb;
+    AVChannelLayout layout;
+    int rate;
+    double seconds;          /* of audio in all of them */
+    double decode_cpu;       /* decode and conversion CPU seconds per second */
+};
+
+/* Kinds of settings, each tried on a grid and interpolated in between */
+enum kind {
+    MP3_CBR,
+    MP3_VBR,
+    AAC_CBR,
+    NB_KINDS,
+};
+
+/* One setting. Within a kind they are in the order of their size. */
+struct cand {
+    const struct chunks *ch;
+    const AVCodec *codec;
+    int vbr;
+    int value;               /* bit/s, or VBR quality */
+    char name[32];           /* as for -p, e.g. "mp3:v4" */
+    int tried, failed, modelled;
+    double rate;             /* bytes per second of audio */
+    double lo, hi;           /* least and most of the chunks (tried only) */
+    double cpu;              /* encode CPU seconds per second of audio */
+};
+
+static const int mp3_rates[] = { 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 };
+static const int aac_rates[] = { 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 };
+
+int tune_parse(const char *spec, struct tune_opts *o)
+{
+    const char *p;
+    char *end;
+    double v, scale = 1;
+
+    memset(o, 0, sizeof(*o));
+    o->tolerance = 0.05;
+    v = strtod(spec, &end);
+    if (end == spec || v <= 0)
+        goto fail;
+    if (*end == 'k') {
+        o->bit_rate = llrint(v * 1000);
+        end++;
+    } else {
+        if (*end == 'K' || *end == 'M' || *end == 'G') {
+            scale = *end == 'K' ? 1e3 : *end == 'M' ? 1e6 : 1e9;
+            end++;
+        }
+        if (*end == 'B')
+            end++;
+        o->size = llrint(v * scale);
+    }
+    if (*end == ':') {
+        p = end + 1;
+        v = strtod(p, &end);
+        if (end == p || strcmp(end, "%") || v < 0 || v >= 100)
+            goto fail;
+        o->tolerance = v / 100;
+    } else if (*end)
+        goto fail;
+    if (o->size || o->bit_rate)
+        return 0;
+
+fail:
+    fprintf(stderr, "Invalid target '%s', expected a size (4.5MB) or a bit rate (96k), then [:<n>%%] under it that will do\n",
+            spec);
+    return AVERROR(EINVAL);
+}
+
+static int64_t cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/**
+ * Decode the chunks: TUNE_CHUNKS spread evenly over [start, end), each
+ * reached by seeking, or all of it when it is no longer than they are.
+ * @param start First sample, counted from the start of the input
+ * @param end   Sample after the last one
+ * @return Error code (0 if successful)
+ */
+static int decode_chunks(AVFormatContext *fcx, AVCodecContext *dec, int64_t start, int64_t end, struct chunks *ch)
+{
+    const AVStream *st = fcx->streams[0];
+    const AVRational tb = { 1, dec->sample_rate };
+    const int64_t t0 = st->start_time != AV_NOPTS_VALUE ? st->start_time : 0;
+    const int64_t len = (int64_t)TUNE_CHUNK_SECONDS * dec->sample_rate;
+    const int channels = ch->layout.nb_channels;
+    SwrContext *swr = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = av_frame_alloc();
+    uint8_t **tmp = NULL;
+    int64_t t = cpu_ns(), decoded = 0;
+    int tmp_size = 0, i, c, error;
+
+    if (!pkt || !frame) {
+        error = AVERROR(ENOMEM);
+        goto cleanup;
+    }
+    if ((error = swr_alloc_set_opts2(&swr, &ch->layout, AV_SAMPLE_FMT_FLTP, dec->sample_rate,
+                                     &dec->ch_layout, dec->sample_fmt, dec->sample_rate, 0, NULL)) < 0 ||
+        (error = swr_init(swr)) < 0) {
+        fprintf(stderr, "Could not set up the conversion of the trial chunks (error '%s')\n", av_err2str(error));
+        goto cleanup;
+    }
+
+    ch->nb = end - start <= TUNE_CHUNKS * len ? 1 : TUNE_CHUNKS;
+    for (i = 0; i < ch->nb; i++) {
+        const int64_t from = ch->nb == 1 ? start : start + (end - start) * (2 * i + 1) / (2 * TUNE_CHUNKS) - len / 2;
+        const int64_t want = ch->nb == 1 ? end - start : len;
+        int64_t have = 0, next = from;
+        int eof = 0;
+
+        if ((error = av_samples_alloc_array_and_samples(&ch->data[i], NULL, channels, want,
+                                                        AV_SAMPLE_FMT_FLTP, 0)) < 0)
+            goto cleanup;
+        /* Half a second early, like tmp30 -s, for the decoder to settle. */
+        if ((error = av_seek_frame(fcx, 0, t0 + av_rescale_q(FFMAX(from - dec->sample_rate / 2, 0), tb, st->time_base),
+                                   AVSEEK_FLAG_BACKWARD)) < 0) {
+            fprintf(stderr, "Could not seek to a trial chunk (error '%s')\n", av_err2str(error));
+            goto cleanup;
+        }
+        avcodec_flush_buffers(dec);
+
+        while (have < want && !eof) {
+            if ((error = av_read_frame(fcx, pkt)) == AVERROR_EOF)
+                error = avcodec_send_packet(dec, NULL);
+            else if (error < 0) {
+                fprintf(stderr, "Could not read frame (error '%s')\n", av_err2str(error));
+                goto cleanup;
+            } else if (pkt->stream_index) {
+                av_packet_unref(pkt);
+                continue;
+            } else {
+                error = avcodec_send_packet(dec, pkt);
+                av_packet_unref(pkt);
+            }
+            /* A damaged packet costs its samples, as in tmp30. */
+            if (error < 0 && error != AVERROR_INVALIDDATA && error != AVERROR_EOF) {
+                fprintf(stderr, "Could not send packet for decoding (error '%s')\n", av_err2str(error));
+                goto cleanup;
+            }
+            while (have < want && (error = avcodec_receive_frame(dec, frame)) >= 0) {
+                const int64_t pos = frame->pts != AV_NOPTS_VALUE ?
+                                    av_rescale_q(frame->pts - t0, st->time_base, tb) : next;
+                const int skip = FFMAX(from - pos, 0);
+                int n;
+
+                next = pos + frame->nb_samples;
+                decoded += frame->nb_samples;
+                if (skip < frame->nb_samples) {
+                    if (frame->nb_samples > tmp_size) {
+                        if (tmp)
+                            av_freep(&tmp[0]);
+                        av_freep(&tmp);
+                        tmp_size = 0;
+                        if ((error = av_samples_alloc_array_and_samples(&tmp, NULL, channels, frame->nb_samples,
+                                                                        AV_SAMPLE_FMT_FLTP, 0)) < 0)
+                            goto cleanup;
+                        tmp_size = frame->nb_samples;
+                    }
+                    if ((n = swr_convert(swr, tmp, frame->nb_samples, (const uint8_t **)frame->extended_data,
+                                         frame->nb_samples)) < 0) {
+                        error = n;
+                        fprintf(stderr, "Could not convert input samples (error '%s')\n", av_err2str(error));
+                        goto cleanup;
+                    }
+                    n = FFMIN(n - skip, want - have);
+                    for (c = 0; c < channels && n > 0; c++)
+                        memcpy(ch->data[i][c] + have * sizeof(float), tmp[c] + skip * sizeof(float),
+                               n * sizeof(float));
+                    have += FFMAX(n, 0);
+                }
+                av_frame_unref(frame);
+            }
+            if (error == AVERROR_EOF)
+                eof = 1;
+            else if (error < 0 && error != AVERROR(EAGAIN)) {
+                fprintf(stderr, "Could not decode frame (error '%s')\n", av_err2str(error));
+                goto cleanup;
+            }
+        }
+        if (!have) {
+            fprintf(stderr, "Nothing decoded for trial chunk %d\n", i + 1);
+            error = AVERROR_INVALIDDATA;
+            goto cleanup;
+        }
+        ch->nb_samples[i] = have;
+        ch->seconds += (double)have / dec->sample_rate;
+    }
+    ch->decode_cpu = (cpu_ns() - t) / 1e9 / ((double)decoded / dec->sample_rate);
+    error = 0;
+
+cleanup:
+    if (tmp)
+        av_freep(&tmp[0]);
+    av_freep(&tmp);
+    swr_free(&swr);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    return error;
+}
+
+/**
+ * Open an encoder for a setting the way tmp30 opens it (open_encoder).
+ * @return Error code (0 if successful)
+ */
+static int open_trial(const struct cand *c, AVCodecContext **enc)
+{
+    AVCodecContext *avctx;
+    int error;
+
+    if (!(avctx = avcodec_alloc_context3(c->codec)))
+        return AVERROR(ENOMEM);
+    if ((error = av_channel_layout_copy(&avctx->ch_layout, &c->ch->layout)) < 0) {
+        avcodec_free_context(&avctx);
+        return error;
+    }
+    avctx->sample_rate = c->ch->rate;
+    avctx->sample_fmt  = AV_SAMPLE_FMT_FLTP;
+    avctx->time_base   = (AVRational){ 1, c->ch->rate };
+    if (c->vbr) {
+        avctx->flags         |= AV_CODEC_FLAG_QSCALE;
+        avctx->global_quality = FF_QP2LAMBDA * c->value;
+    } else
+        avctx->bit_rate = c->value;
+    if ((error = avcodec_open2(avctx, c->codec, NULL)) < 0) {
+        avcodec_free_context(&avctx);
+        return error;
+    }
+    *enc = avctx;
+    return 0;
+}
+
+/**
+ * Encode all the chunks with one setting, each with an encoder of its
+ * own, timing only the encoder calls. A job of the work pool; a setting
+ * that fails is left out rather than stopping the others.
+ * @param arg Setting
+ * @return 0
+ */
+static int trial(void *arg)
+{
+    struct cand *c = arg;
+    const struct chunks *ch = c->ch;
+    AVCodecContext *enc = NULL;
+    AVPacket *pkt = av_packet_alloc();
+    AVFrame *frame = NULL;
+    int64_t bytes = 0, ns = 0, t;
+    int i, k, pos, n, error = 0;
+
+    if (!pkt)
+        error = AVERROR(ENOMEM);
+    c->lo = HUGE_VAL;
+    c->hi = 0;
+    for (i = 0; i < ch->nb && !error; i++) {
+        int64_t chunk_bytes = 0;
+
+        if ((error = open_trial(c, &enc)) < 0)
+            break;
+        for (pos = 0;; pos += n) {
+            n = FFMIN(enc->frame_size ? enc->frame_size : 1024, ch->nb_samples[i] - pos);
+            if (n > 0) {
+                if (!(frame = av_frame_alloc())) {
+                    error = AVERROR(ENOMEM);
+                    break;
+                }
+                frame->nb_samples  = n;
+                frame->format      = AV_SAMPLE_FMT_FLTP;
+                frame->sample_rate = ch->rate;
+                frame->pts         = pos;
+                if ((error = av_channel_layout_copy(&frame->ch_layout, &ch->layout)) < 0 ||
+                    (error = av_frame_get_buffer(frame, 0)) < 0)
+                    break;
+                for (k = 0; k < ch->layout.nb_channels; k++)
+                    memcpy(frame->extended_data[k], ch->data[i][k] + pos * sizeof(float), n * sizeof(float));
+            }
+            /* A frame of NULL at the end flushes the encoder. */
+            t = cpu_ns();
+            error = avcodec_send_frame(enc, frame);
+            while (error >= 0 && (error = avcodec_receive_packet(enc, pkt)) >= 0) {
+                chunk_bytes += pkt->size;
+                av_packet_unref(pkt);
+            }
+            ns += cpu_ns() - t;
+            av_frame_free(&frame);
+            if (error == AVERROR_EOF) {
+                error = 0;
+                break;
+            }
+            if (error != AVERROR(EAGAIN))
+                break;
+            error = 0;
+        }
+        avcodec_free_context(&enc);
+        if (error < 0)
+            break;
+        bytes += chunk_bytes;
+        c->lo = FFMIN(c->lo, chunk_bytes * (double)ch->rate / ch->nb_samples[i]);
+        c->hi = FFMAX(c->hi, chunk_bytes * (double)ch->rate / ch->nb_samples[i]);
+    }
+    av_frame_free(&frame);
+    avcodec_free_context(&enc);
+    av_packet_free(&pkt);
+    if (error < 0) {
+        fprintf(stderr, "Trial encode of %s failed (error '%s'), left out\n", c->name, av_err2str(error));
+        c->failed = 1;
+        return 0;
+    }
+    c->rate  = bytes / ch->seconds;
+    c->cpu   = ns / 1e9 / ch->seconds;
+    c->tried = 1;
+    return 0;
+}
+
+/* Where a setting sits on its kind's axis: CBR bytes go with the bit
+ * rate, VBR bytes about exponentially with the quality. */
+static double axis(const struct cand *c)
+{
+    return c->vbr ? c->value : log(c->value);
+}
+
+/**
+ * Fill in the settings of a kind that weren't tried from the tried ones
+ * around them, log bytes and time linear on the kind's axis.
+ * @param c Settings of the kind
+ * @param n Number of them
+ */
+static void model(struct cand *c, int n)
+{
+    int i, a, b;
+
+    for (i = 0; i < n; i++) {
+        double x;
+
+        if (c[i].tried || c[i].failed)
+            continue;
+        for (a = i - 1; a >= 0 && !c[a].tried; a--)
+            ;
+        for (b = i + 1; b < n && !c[b].tried; b++)
+            ;
+        if ((c[i].modelled = a >= 0 && b < n)) {
+            x = (axis(&c[i]) - axis(&c[a])) / (axis(&c[b]) - axis(&c[a]));
+            c[i].rate = exp(log(c[a].rate) + x * (log(c[b].rate) - log(c[a].rate)));
+            c[i].cpu  = c[a].cpu + x * (c[b].cpu - c[a].cpu);
+        }
+    }
+}
+
+/**
+ * Add the settings of a kind, in the order of their size.
+ * @return Number of them
+ */
+static int add_kind(struct cand *c, enum kind kind, const AVCodec *codec, int channels, const struct chunks *ch)
+{
+    const int n = kind == MP3_CBR ? FF_ARRAY_ELEMS(mp3_rates) :
+                  kind == AAC_CBR ? FF_ARRAY_ELEMS(aac_rates) : 10;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        memset(&c[i], 0, sizeof(c[i]));
+        c[i].ch    = ch;
+        c[i].codec = codec;
+        c[i].vbr   = kind == MP3_VBR;
+        /* lame's -V 9 is the smallest, 0 the largest */
+        c[i].value = kind == MP3_CBR ? mp3_rates[i] * 1000 : kind == AAC_CBR ? aac_rates[i] * 1000 : 9 - i;
+        if (c[i].vbr)
+            snprintf(c[i].name, sizeof(c[i].name), "mp3:v%d", c[i].value);
+        else
+            snprintf(c[i].name, sizeof(c[i].name), "%s:%dk", kind == AAC_CBR ? "aac" : "mp3", c[i].value / 1000);
+        if (channels != TUNE_CHANNELS)
+            av_strlcatf(c[i].name, sizeof(c[i].name), ":%dch", channels);
+    }
+    return n;
+}
+
+/**
+ * The encoder for a kind, if the output can have it: the container takes
+ * its codec, it is the codec of -p if that names one, and it takes planar
+ * float, as the trials feed it.
+ */
+static const AVCodec *kind_encoder(enum kind kind, const AVOutputFormat *ofmt, const char *want)
+{
+    const enum AVCodecID id = kind == AAC_CBR ? AV_CODEC_ID_AAC : AV_CODEC_ID_MP3;
+    const AVCodecDescriptor *desc;
+    const AVCodec *codec = NULL;
+
+    if (*want) {
+        if (!(codec = avcodec_find_encoder_by_name(want)) &&
+            (desc = avcodec_descriptor_get_by_name(want)))
+            codec = avcodec_find_encoder(desc->id);
+        if (!codec || codec->id != id)
+            return NULL;
+    } else if (!(codec = avcodec_find_encoder(id)))
+        return NULL;
+    /* Only lame has the VBR qualities. */
+    if (kind == MP3_VBR && strcmp(codec->name, "libmp3lame"))
+        return NULL;
+    if (ofmt && avformat_query_codec(ofmt, id, FF_COMPLIANCE_NORMAL) != 1)
+        return NULL;
+    return fmtneg_pick(codec, AV_SAMPLE_FMT_FLTP) == AV_SAMPLE_FMT_FLTP ? codec : NULL;
+}
+
+int tune_pick(const struct tune_opts *o, const char *in, int64_t start, int64_t length,
+              const AVOutputFormat *ofmt, struct tmp30_opts *opts, int threads, FILE *f)
+{
+    const int channels = opts->channels ? opts->channels : TUNE_CHANNELS;
+    AVFormatContext *fcx = NULL;
+    AVCodecContext *dec = NULL;
+    const AVCodec *codec;
+    struct chunks ch = { 0 };
+    struct cand cands[MAX_CANDS], *best = NULL;
+    int first[NB_KINDS + 1], trials = 0, kind, i, error;
+    struct tpool *tp = NULL;
+    const char *note = "";
+    double seconds, target, lo;
+    int64_t end;
+
+    if ((error = avformat_open_input(&fcx, in, NULL, NULL)) < 0 ||
+        (error = avformat_find_stream_info(fcx, NULL)) < 0) {
+        fprintf(stderr, "Could not open input file '%s' (error '%s')\n", in, av_err2str(error));
+        goto cleanup;
+    }
+    /* Like tmp30, the audio is the first stream. */
+    if (fcx->nb_streams < 1 || fcx->streams[0]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+        fprintf(stderr, "'%s' has no audio as its first stream\n", in);
+        error = AVERROR_INVALIDDATA;
+        goto cleanup;
+    }
+    if (fcx->duration <= 0 || !fcx->pb || !(fcx->pb->seekable & AVIO_SEEKABLE_NORMAL)) {
+        fprintf(stderr, "'%s' can't be seeked in or its length is unknown, there's nothing to predict from\n", in);
+        error = AVERROR(EINVAL);
+        goto cleanup;
+    }
+    if (!(codec = avcodec_find_decoder(fcx->streams[0]->codecpar->codec_id)) ||
+        !(dec = avcodec_alloc_context3(codec))) {
+        fprintf(stderr, "Could not find a decoder for '%s'\n", in);
+        error = AVERROR_DECODER_NOT_FOUND;
+        goto cleanup;
+    }
+    if ((error = avcodec_parameters_to_context(dec, fcx->streams[0]->codecpar)) < 0 ||
+        (error = avcodec_open2(dec, codec, NULL)) < 0) {
+        fprintf(stderr, "Could not open input codec (error '%s')\n", av_err2str(error));
+        goto cleanup;
+    }
+
+    end = length ? FFMIN(start + length, fcx->duration) : fcx->duration;
+    if (end <= start) {
+        fprintf(stderr, "Nothing of '%s' is left after the start\n", in);
+        error = AVERROR(EINVAL);
+        goto cleanup;
+    }
+    seconds = (double)(end - start) / AV_TIME_BASE;
+    av_channel_layout_default(&ch.layout, channels);
+    ch.rate = dec->sample_rate;
+    if ((error = decode_chunks(fcx, dec, av_rescale(start, ch.rate, AV_TIME_BASE),
+                               av_rescale(end, ch.rate, AV_TIME_BASE), &ch)) < 0)
+        goto cleanup;
+
+    /* The settings, kind by kind. */
+    first[0] = 0;
+    for (kind = 0; kind < NB_KINDS; kind++) {
+        first[kind + 1] = first[kind];
+        if ((codec = kind_encoder(kind, ofmt, opts->codec)))
+            first[kind + 1] += add_kind(&cands[first[kind]], kind, codec, channels, &ch);
+    }
+    if (!first[NB_KINDS]) {
+        fprintf(stderr, "No MP3 or AAC encoder for %s to tune\n", ofmt ? ofmt->name : "the output");
+        error = AVERROR_ENCODER_NOT_FOUND;
+        goto cleanup;
+    }
+    target = o->size ? o->size : o->bit_rate * seconds / 8;
+    lo     = target * (1 - o->tolerance);
+
+    /* First the grid, then what the model puts near the target and, for
+     * each kind, the settings it puts either side of it. */
+    if (threads <= 0)
+        threads = FFMAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+    if ((error = tpool_alloc(&tp, threads)) < 0)
+        goto cleanup;
+    for (kind = 0; kind < NB_KINDS; kind++)
+        for (i = first[kind]; i < first[kind + 1]; i++)
+            if ((i - first[kind]) % GRID_STEP == 0 || i == first[kind + 1] - 1) {
+                if ((error = tpool_submit(tp, trial, &cands[i])) < 0)
+                    goto cleanup;
+                trials++;
+            }
+    if ((error = tpool_wait(tp)) < 0)
+        goto cleanup;
+    for (kind = 0; kind < NB_KINDS; kind++) {
+        int under = -1, over = -1;
+
+        model(&cands[first[kind]], first[kind + 1] - first[kind]);
+        for (i = first[kind]; i < first[kind + 1]; i++) {
+            if (!cands[i].modelled)
+                continue;
+            if (cands[i].rate * seconds <= target)
+                under = i;
+            else if (over < 0)
+                over = i;
+        }
+        for (i = first[kind]; i < first[kind + 1]; i++) {
+            const double size = cands[i].rate * seconds;
+
+            if (cands[i].modelled &&
+                ((size >= lo / (1 + MODEL_SLACK) && size <= target * (1 + MODEL_SLACK)) ||
+                 i == under || i == over)) {
+                if ((error = tpool_submit(tp, trial, &cands[i])) < 0)
+                    goto cleanup;
+                trials++;
+            }
+        }
+    }
+    if ((error = tpool_wait(tp)) < 0)
+        goto cleanup;
+
+    /* Of what makes the target, the least encode time; else the closest
+     * under it; else the smallest. */
+    for (i = 0; i < first[NB_KINDS]; i++)
+        if (cands[i].tried && cands[i].rate * seconds <= target && cands[i].rate * seconds >= lo &&
+            (!best || cands[i].cpu < best->cpu))
+            best = &cands[i];
+    if (!best) {
+        note = ", nothing within the tolerance, the closest under the target";
+        for (i = 0; i < first[NB_KINDS]; i++)
+            if (cands[i].tried && cands[i].rate * seconds <= target && (!best || cands[i].rate > best->rate))
+                best = &cands[i];
+    }
+    if (!best) {
+        note = ", every setting makes more than the target, the smallest";
+        for (i = 0; i < first[NB_KINDS]; i++)
+            if (cands[i].tried && (!best || cands[i].rate < best->rate))
+                best = &cands[i];
+    }
+    if (!best) {
+        fprintf(stderr, "No trial encode of '%s' succeeded\n", in);
+        error = AVERROR_EXIT;
+        goto cleanup;
+    }
+
+    fprintf(f, "Autotune: target %.2f MB (%.1f kbit/s over %.1f s), up to %.0f%% under it; %d trial encodes of %d x %.1f s on %d threads\n",
+            target / 1e6, target * 8 / seconds / 1e3, seconds, o->tolerance * 100, trials, ch.nb,
+            ch.seconds / ch.nb, threads);
+    fprintf(f, "  %-16s %10s %10s %10s\n", "setting", "kbit/s", "MB", "encode s");
+    for (i = 0; i < first[NB_KINDS]; i++) {
+        const struct cand *c = &cands[i];
+
+        if (c->failed)
+            fprintf(f, "  %-16s %10s %10s %10s  failed\n", c->name, "-", "-", "-");
+        else if (c->tried || c->modelled)
+            fprintf(f, "  %-16s %10.1f %10.2f %10.2f  %s%s\n", c->name, c->rate * 8 / 1e3, c->rate * seconds / 1e6,
+                    c->cpu * seconds, c->tried ? "tried" : "model", c == best ? ", picked" : "");
+    }
+    fprintf(f, "Autotune: %s, %.2f MB (%.2f to %.2f MB by the chunks), %.1f kbit/s, %.1f s encode + %.1f s decode CPU%s\n",
+            best->name, best->rate * seconds / 1e6, best->lo * seconds / 1e6, best->hi * seconds / 1e6,
+            best->rate * 8 / 1e3, best->cpu * seconds, ch.decode_cpu * seconds, note);
+
+    av_strlcpy(opts->codec, best->codec->name, sizeof(opts->codec));
+    opts->vbr      = best->vbr;
+    opts->quality  = best->vbr ? best->value : 0;
+    opts->bit_rate = best->vbr ? 0 : best->value;
+    error = 0;
+
+cleanup:
+    tpool_free(&tp);
+    for (i = 0; i < TUNE_CHUNKS; i++) {
+        if (ch.data[i])
+            av_freep(&ch.data[i][0]);
+        av_freep(&ch.data[i]);
+    }
+    av_channel_layout_uninit(&ch.layout);
+    avcodec_free_context(&dec);
+    avformat_close_input(&fcx);
+    return error;
+}
@@ -0,0 +1,73 @@
+/*
+ * tune.h: encode-settings autotuner of tmp30 (-A option), the setting of
+ * least encode time that makes an output of a given size or bit rate,
+ * e.g. about the size of the Opus source without trying qscales by hand.
+ *
+ * A few chunks of the input (TUNE_CHUNKS of TUNE_CHUNK_SECONDS, spread
+ * evenly over it and reached by seeking) are decoded once, into planar
+ * float at the output's channels. The candidates are the MP3 CBR bit
+ * rates and VBR qualities and the AAC bit rates, as far as the output
+ * container takes the codec (only the codec of -p, if it names one).
+ * Each trial encodes all the chunks with one setting, as a job on a work
+ * pool (tpool.h, a thread per core unless told otherwise), and counts the
+ * bytes of the packets and the thread CPU time of the encoder calls.
+ *
+ * Models: per setting, bytes and encode CPU time per second of audio,
+ * times the length of the input. A coarse grid of each kind of setting
+ * is tried first; the rest are interpolated between the grid points
+ * around them (log bytes and time linear in the log of the bit rate, or
+ * in the VBR quality), and those the model puts near the target are
+ * tried as well. Of the tried settings that make at most the target and
+ * no more than the tolerance less, the one of least encode time wins;
+ * with none, the one that comes closest under the target; with none
+ * under, the smallest.
+ *
+ * The sizes are those of the packets, without the container's header
+ * and index (a few hundred bytes for MP3, more for MP4).
+ */
+
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <libavformat/avformat.h>
+
+#include "tmp30.h"
+
+#define TUNE_CHUNKS        4
+#define TUNE_CHUNK_SECONDS 10
+
+struct tune_opts {
+    int64_t size;            /* bytes of the output, or */
+    int64_t bit_rate;        /* bit/s of the output */
+    double tolerance;        /* how much under the target still makes it */
+};
+
+/**
+ * Parse "<size>[:<n>%]" or "<bit rate>[:<n>%]": a size in bytes with an
+ * optional KB, MB or GB (powers of 1000), e.g. "4.5MB", or a bit rate
+ * ending in k, e.g. "96k". The tolerance defaults to 5%.
+ * @return Error code (0 if successful)
+ */
+int tune_parse(const char *spec, struct tune_opts *o);
+
+/**
+ * Pick the encoder setting for a transcode, and print the trials and the
+ * predicted size and time.
+ * @param         o       Target
+ * @param         in      Input file, which must be seekable and of known length
+ * @param         start   Start of the part that is transcoded, microseconds
+ * @param         length  Length of it, 0 for to the end
+ * @param         ofmt    Output container, NULL for any
+ * @param[in,out] opts    Takes codec (empty for MP3 and AAC) and channels;
+ *                        codec, bit_rate, vbr and quality are set
+ * @param         threads Trial encodes run at once, 0 for one per core
+ * @param         f       Where the trials and the prediction are printed
+ * @return Error code (0 if successful)
+ */
+int tune_pick(const struct tune_opts *o, const char *in, int64_t start, int64_t length,
+              const AVOutputFormat *ofmt, struct tmp30_opts *opts, int threads, FILE *f);
+
+#endif /* TUNE_H */
@@ -0,0 +1,937 @@
+/*
+ * ubench.c: micro-benchmarks of the primitives the transcode path is
+ * built from, to tell which one moved when end-to-end times move.
+ *
+ *   fifo    av_audio_fifo_write + read of one frame, per frame size
+ *   zfifo   the same through zfifo.h: space + commit + lend + free, the
+ *           samples aren't moved
+ *   swr     swr_convert of one frame, per format pair (and a rate change)
+ *   enc     avcodec_send_frame + receive_packet, per encoder
+ *   demux   av_read_frame of one packet, per container (input in memory)
+ *   fwrite  decode_audio's one-fwrite-per-sample loop, and one block write
+ *   stretch tstretch.h at each tier next to tmp30 -f with the atempo
+ *           chain for the same tempo, per input sample
+ *
+ * Each is reported in ns per sample (per channel), twice: cache-warm,
+ * back to back on the same buffers, and cache-cold, with the caches
+ * flushed by walking a buffer larger than the last-level cache before
+ * every call. Only the calls themselves are timed.
+ *
+ * With -q the stretches are compared for quality instead: a harmonic
+ * tone is stretched, and each block of the output is fitted with the
+ * tone's harmonics; what the fit leaves over is the error (SNR in dB,
+ * higher is better). The length of the output over the input's divided
+ * by the tempo should be 1.
+ *
+ * Usage: ubench [-c] [-f filter] [-q] [-t seconds]
+ *   -c  CSV output (name,warm_ns_per_sample,cold_ns_per_sample, or
+ *       name,snr_db,length with -q)
+ *   -f  only run benchmarks whose name contains filter
+ *   -q  stretch quality instead of timing
+ *   -t  time to spend on each warm measurement (default 0.2)
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+
+#include <libavutil/audio_fifo.h>
+#include <libavutil/avstring.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/samplefmt.h>
+
+#include <libswresample/swresample.h>
+
+#include "fgraph.h"
+#include "tstretch.h"
+#include "xio.h"
+#include "zfifo.h"
+
+/* Cold runs per benchmark; each one walks the whole eviction buffer. */
+#define COLD_RUNS 200
+#define CHANNELS  2
+#define RATE      48000
+
+/* One benchmarked operation: does its work once and returns the number
+ * of samples it handled, or a negative error code. */
+typedef int (*op_fn)(void *arg);
+
+static struct {
+    int csv;
+    int quality;
+    const char *filter;
+    double seconds;
+    uint8_t *evict;
+    size_t evict_size;
+} cfg = { 0, 0, NULL, 0.2 };
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Push everything else out of the caches. */
+static void evict_caches(void)
+{
+    size_t i;
+
+    for (i = 0; i < cfg.evict_size; i += 64)
+        cfg.evict[i]++;
+}
+
+/* Uniform noise in [-0.5, 0.5), the same every run. */
+static float noise(void)
+{
+    static uint32_t s = 1;
+
+    s = s * 1664525 + 1013904223;
+    return (s >> 8) * (1.0f / 16777216) - 0.5f;
+}
+
+/**
+ * Time op cache-warm and cache-cold and print one result line.
+ * @return Error code (0 if successful)
+ */
+static int measure(const char *name, op_fn op, void *arg)
+{
+    int64_t t0, t, warm_ns = 0, cold_ns = 0, warm_samples = 0, cold_samples = 0;
+    int i, n;
+
+    if (cfg.filter && !strstr(name, cfg.filter))
+        return 0;
+
+    /* Warm up, then time back-to-back calls. */
+    for (i = 0; i < 16; i++)
+        if ((n = op(arg)) < 0)
+            goto fail;
+    t0 = now_ns();
+    do {
+        for (i = 0; i < 16; i++) {
+            if ((n = op(arg)) < 0)
+                goto fail;
+            warm_samples += n;
+        }
+        warm_ns = now_ns() - t0;
+    } while (warm_ns < cfg.seconds * 1e9);
+
+    for (i = 0; i < COLD_RUNS; i++) {
+        evict_caches();
+        t = now_ns();
+        if ((n = op(arg)) < 0)
+            goto fail;
+        cold_ns += now_ns() - t;
+        cold_samples += n;
+    }
+
+    if (cfg.csv)
+        printf("%s,%.3f,%.3f\n", name, (double)warm_ns / warm_samples, (double)cold_ns / cold_samples);
+    else
+        printf("%-36s %12.3f %12.3f\n", name, (double)warm_ns / warm_samples, (double)cold_ns / cold_samples);
+    fflush(stdout);
+    return 0;
+
+fail:
+    fprintf(stderr, "%s failed (error '%s')\n", name, av_err2str(n));
+    return n;
+}
+
+/**
+ * Allocate sample buffers for nb_samples and fill them with noise.
+ */
+static int alloc_samples(uint8_t **data, enum AVSampleFormat fmt, int nb_samples)
+{
+    int planes = av_sample_fmt_is_planar(fmt) ? CHANNELS : 1;
+    int per_plane = nb_samples * (planes == 1 ? CHANNELS : 1);
+    int i, j, error;
+
+    if ((error = av_samples_alloc(data, NULL, CHANNELS, nb_samples, fmt, 0)) < 0)
+        return error;
+    for (i = 0; i < planes; i++) {
+        for (j = 0; j < per_plane; j++) {
+            float v = noise();
+            switch (av_get_packed_sample_fmt(fmt)) {
+            case AV_SAMPLE_FMT_S16: ((int16_t *)data[i])[j] = v * 32767; break;
+            case AV_SAMPLE_FMT_S32: ((int32_t *)data[i])[j] = v * 2147483647.0; break;
+            case AV_SAMPLE_FMT_FLT: ((float *)data[i])[j] = v; break;
+            case AV_SAMPLE_FMT_DBL: ((double *)data[i])[j] = v; break;
+            default: ((uint8_t *)data[i])[j] = 128 + v * 255; break;
+            }
+        }
+    }
+    return 0;
+}
+
+/* --- fifo --- */
+
+struct fifo_arg {
+    AVAudioFifo *fifo;
+    uint8_t *data[8];
+    int frame_size;
+};
+
+static int fifo_op(void *arg)
+{
+    struct fifo_arg *a = arg;
+
+    if (av_audio_fifo_write(a->fifo, (void **)a->data, a->frame_size) < a->frame_size ||
+        av_audio_fifo_read(a->fifo, (void **)a->data, a->frame_size) < a->frame_size)
+        return AVERROR_EXIT;
+    return a->frame_size;
+}
+
+static int bench_fifo(void)
+{
+    static const int sizes[] = { 64, 256, 1024, 1152, 4096 };
+    struct fifo_arg a;
+    char name[64];
+    int i, error = 0;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(sizes) && !error; i++) {
+        memset(&a, 0, sizeof(a));
+        a.frame_size = sizes[i];
+        /* tmp30's FIFO: the encoder's format, grown as needed. */
+        if (!(a.fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, CHANNELS, 1)) ||
+            alloc_samples(a.data, AV_SAMPLE_FMT_FLTP, a.frame_size) < 0)
+            return AVERROR(ENOMEM);
+        snprintf(name, sizeof(name), "fifo fltp/%dch/%d", CHANNELS, a.frame_size);
+        error = measure(name, fifo_op, &a);
+        av_audio_fifo_free(a.fifo);
+        av_freep(&a.data[0]);
+    }
+    return error;
+}
+
+struct zfifo_arg {
+    struct zfifo *zf;
+    AVFrame *frame;
+    int frame_size;
+};
+
+static int zfifo_op(void *arg)
+{
+    struct zfifo_arg *a = arg;
+    uint8_t **planes;
+
+    if (zfifo_space(a->zf, a->frame_size, &planes) < 0)
+        return AVERROR_EXIT;
+    zfifo_commit(a->zf, a->frame_size);
+    if (zfifo_lend(a->zf, a->frame, a->frame_size) < 0)
+        return AVERROR_EXIT;
+    av_frame_unref(a->frame);
+    return a->frame_size;
+}
+
+static int bench_zfifo(void)
+{
+    static const int sizes[] = { 64, 256, 1024, 1152, 4096 };
+    AVChannelLayout layout;
+    struct zfifo_arg a;
+    char name[64];
+    int i, error = 0;
+
+    av_channel_layout_default(&layout, CHANNELS);
+    for (i = 0; i < FF_ARRAY_ELEMS(sizes) && !error; i++) {
+        memset(&a, 0, sizeof(a));
+        a.frame_size = sizes[i];
+        if (!(a.frame = av_frame_alloc()) ||
+            zfifo_alloc(&a.zf, AV_SAMPLE_FMT_FLTP, &layout, 48000, 48000) < 0) {
+            av_frame_free(&a.frame);
+            return AVERROR(ENOMEM);
+        }
+        snprintf(name, sizeof(name), "zfifo fltp/%dch/%d", CHANNELS, a.frame_size);
+        error = measure(name, zfifo_op, &a);
+        zfifo_free(&a.zf);
+        av_frame_free(&a.frame);
+    }
+    return error;
+}
+
+/* --- swr --- */
+
+struct swr_arg {
+    SwrContext *swr;
+    uint8_t *in[8], *out[8];
+    int in_samples, out_samples;
+};
+
+static int swr_op(void *arg)
+{
+    struct swr_arg *a = arg;
+    int n = swr_convert(a->swr, a->out, a->out_samples, (const uint8_t **)a->in, a->in_samples);
+
+    return n < 0 ? n : a->in_samples;
+}
+
+static int bench_swr(void)
+{
+    /* Decoder outputs into encoder inputs, as tmp30 meets them. */
+    static const struct {
+        enum AVSampleFormat in, out;
+        int in_rate, out_rate;
+    } pairs[] = {
+        { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLTP, RATE,  RATE  },  /* opus/aac -> aac: copy */
+        { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S32P, RATE,  RATE  },  /* -> libmp3lame */
+        { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16,  RATE,  RATE  },  /* -> mp2, libopus */
+        { AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_FLTP, RATE,  RATE  },  /* mp2 -> aac */
+        { AV_SAMPLE_FMT_S16,  AV_SAMPLE_FMT_FLTP, RATE,  RATE  },  /* wav -> aac */
+        { AV_SAMPLE_FMT_S32,  AV_SAMPLE_FMT_S32P, RATE,  RATE  },  /* flac 24 bit -> libmp3lame */
+        { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLTP, 44100, RATE  },  /* rate change */
+        { AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLTP, 96000, 44100 },
+    };
+    AVChannelLayout layout = AV_CHANNEL_LAYOUT_STEREO;
+    struct swr_arg a;
+    char name[96];
+    int i, error = 0;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(pairs) && !error; i++) {
+        memset(&a, 0, sizeof(a));
+        a.in_samples = 1024;
+        a.out_samples = av_rescale_rnd(a.in_samples, pairs[i].out_rate, pairs[i].in_rate, AV_ROUND_UP) + 64;
+        if ((error = swr_alloc_set_opts2(&a.swr, &layout, pairs[i].out, pairs[i].out_rate,
+                                         &layout, pairs[i].in, pairs[i].in_rate, 0, NULL)) < 0 ||
+            (error = swr_init(a.swr)) < 0 ||
+            (error = alloc_samples(a.in, pairs[i].in, a.in_samples)) < 0 ||
+            (error = av_samples_alloc(a.out, NULL, CHANNELS, a.out_samples, pairs[i].out, 0)) < 0) {
+            fprintf(stderr, "Could not set up the resampler\n");
+            swr_free(&a.swr);
+            av_freep(&a.in[0]);
+            return error;
+        }
+        snprintf(name, sizeof(name), "swr %s->%s", av_get_sample_fmt_name(pairs[i].in),
+                 av_get_sample_fmt_name(pairs[i].out));
+        if (pairs[i].in_rate != pairs[i].out_rate)
+            snprintf(name + strlen(name), sizeof(name) - strlen(name), " %d->%d",
+                     pairs[i].in_rate, pairs[i].out_rate);
+        error = measure(name, swr_op, &a);
+        swr_free(&a.swr);
+        av_freep(&a.in[0]);
+        av_freep(&a.out[0]);
+    }
+    return error;
+}
+
+/* --- enc --- */
+
+struct enc_arg {
+    AVCodecContext *ctx;
+    AVFrame *frame;
+    AVPacket *pkt;
+    AVFormatContext *fcx;  /* muxer when encoding the demux inputs, else NULL */
+};
+
+static int enc_op(void *arg)
+{
+    struct enc_arg *a = arg;
+    int error;
+
+    a->frame->pts += a->frame->nb_samples;
+    if ((error = avcodec_send_frame(a->ctx, a->frame)) < 0)
+        return error;
+    while ((error = avcodec_receive_packet(a->ctx, a->pkt)) >= 0) {
+        if (a->fcx) {
+            av_packet_rescale_ts(a->pkt, a->ctx->time_base, a->fcx->streams[0]->time_base);
+            error = av_write_frame(a->fcx, a->pkt);
+        }
+        av_packet_unref(a->pkt);
+        if (error < 0)
+            return error;
+    }
+    return error == AVERROR(EAGAIN) ? a->frame->nb_samples : error;
+}
+
+/**
+ * Open an encoder with a frame of noise to feed it.
+ * @param global_header For containers that want AV_CODEC_FLAG_GLOBAL_HEADER
+ */
+static int open_encoder(const char *name, int global_header, struct enc_arg *a)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name(name);
+    AVChannelLayout layout = AV_CHANNEL_LAYOUT_STEREO;
+    int error;
+
+    memset(a, 0, sizeof(*a));
+    if (!codec)
+        return AVERROR_ENCODER_NOT_FOUND;
+    if (!(a->ctx = avcodec_alloc_context3(codec)) || !(a->frame = av_frame_alloc()) ||
+        !(a->pkt = av_packet_alloc()))
+        return AVERROR(ENOMEM);
+    av_channel_layout_copy(&a->ctx->ch_layout, &layout);
+    a->ctx->sample_rate = RATE;
+    a->ctx->sample_fmt  = codec->sample_fmts[0];
+    a->ctx->bit_rate    = 128000;
+    a->ctx->time_base   = (AVRational){ 1, RATE };
+    if (global_header)
+        a->ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if ((error = avcodec_open2(a->ctx, codec, NULL)) < 0)
+        return error;
+
+    a->frame->nb_samples  = a->ctx->frame_size ? a->ctx->frame_size : 1024;
+    a->frame->format      = a->ctx->sample_fmt;
+    a->frame->sample_rate = RATE;
+    av_channel_layout_copy(&a->frame->ch_layout, &layout);
+    if ((error = av_frame_get_buffer(a->frame, 0)) < 0)
+        return error;
+    /* Fill it with noise in the encoder's format. */
+    {
+        uint8_t *tmp[8] = { NULL };
+        if ((error = alloc_samples(tmp, a->ctx->sample_fmt, a->frame->nb_samples)) < 0)
+            return error;
+        av_samples_copy(a->frame->extended_data, tmp, 0, 0, a->frame->nb_samples,
+                        CHANNELS, a->ctx->sample_fmt);
+        av_freep(&tmp[0]);
+    }
+    return 0;
+}
+
+static void close_encoder(struct enc_arg *a)
+{
+    avcodec_free_context(&a->ctx);
+    av_frame_free(&a->frame);
+    av_packet_free(&a->pkt);
+}
+
+static const char *const encoders[] = { "mp2", "libmp3lame", "aac", "libopus", "flac" };
+
+static int bench_enc(void)
+{
+    struct enc_arg a;
+    char name[64];
+    int i, error = 0;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(encoders) && !error; i++) {
+        snprintf(name, sizeof(name), "enc %s", encoders[i]);
+        if (cfg.filter && !strstr(name, cfg.filter))
+            continue;
+        /* A missing encoder is not a failure of the others. */
+        if ((error = open_encoder(encoders[i], 0, &a)) < 0) {
+            fprintf(stderr, "%s: not available (error '%s'), skipped\n", name, av_err2str(error));
+            error = 0;
+        } else
+            error = measure(name, enc_op, &a);
+        close_encoder(&a);
+    }
+    return error;
+}
+
+/* --- demux --- */
+
+struct demux_arg {
+    AVFormatContext *fcx;
+    AVPacket *pkt;
+    int frame_size;
+};
+
+static int demux_op(void *arg)
+{
+    struct demux_arg *a = arg;
+    const AVStream *st = a->fcx->streams[0];
+    int error;
+
+    if ((error = av_read_frame(a->fcx, a->pkt)) == AVERROR_EOF) {
+        /* Around again; rare enough not to matter. */
+        if ((error = av_seek_frame(a->fcx, -1, 0, AVSEEK_FLAG_BACKWARD)) < 0)
+            return error;
+        error = av_read_frame(a->fcx, a->pkt);
+    }
+    if (error < 0)
+        return error;
+    error = a->pkt->duration > 0 ?
+            av_rescale_q(a->pkt->duration, st->time_base, (AVRational){ 1, st->codecpar->sample_rate }) :
+            a->frame_size;
+    av_packet_unref(a->pkt);
+    return error;
+}
+
+/**
+ * Encode seconds of noise into a container in memory.
+ */
+static int make_input(const char *encoder, const char *container, int seconds, uint8_t **data, size_t *size)
+{
+    AVFormatContext *fcx = NULL;
+    struct enc_arg a;
+    AVStream *st;
+    int64_t n;
+    int error;
+
+    if ((error = avformat_alloc_output_context2(&fcx, NULL, container, NULL)) < 0)
+        return error;
+    error = open_encoder(encoder, !!(fcx->oformat->flags & AVFMT_GLOBALHEADER), &a);
+    a.fcx = fcx;
+    if (error < 0 || (error = xio_open_membuf(&a.fcx->pb)) < 0)
+        goto end;
+    if (!(st = avformat_new_stream(a.fcx, NULL))) {
+        error = AVERROR(ENOMEM);
+        goto end;
+    }
+    st->time_base = a.ctx->time_base;
+    if ((error = avcodec_parameters_from_context(st->codecpar, a.ctx)) < 0 ||
+        (error = avformat_write_header(a.fcx, NULL)) < 0)
+        goto end;
+    for (n = 0; n < (int64_t)seconds * RATE; n += a.frame->nb_samples)
+        if ((error = enc_op(&a)) < 0)
+            goto end;
+    if ((error = avcodec_send_frame(a.ctx, NULL)) < 0)
+        goto end;
+    while (avcodec_receive_packet(a.ctx, a.pkt) >= 0) {
+        av_packet_rescale_ts(a.pkt, a.ctx->time_base, st->time_base);
+        av_write_frame(a.fcx, a.pkt);
+        av_packet_unref(a.pkt);
+    }
+    if ((error = av_write_trailer(a.fcx)) < 0)
+        goto end;
+    error = xio_membuf_take(a.fcx->pb, data, size);
+
+end:
+    close_encoder(&a);
+    if (a.fcx) {
+        xio_close(&a.fcx->pb);
+        avformat_free_context(a.fcx);
+    }
+    return error;
+}
+
+static int bench_demux(void)
+{
+    static const struct {
+        const char *encoder, *container;
+    } inputs[] = {
+        { "mp2",        "mp2"  },
+        { "libmp3lame", "mp3"  },
+        { "aac",        "adts" },
+        { "aac",        "ipod" },  /* .m4a */
+        { "libopus",    "ogg"  },
+        { "flac",       "flac" },
+    };
+    struct demux_arg a;
+    uint8_t *data = NULL;
+    size_t size;
+    char name[64];
+    int i, error = 0;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(inputs) && !error; i++) {
+        AVIOContext *pb = NULL;
+
+        snprintf(name, sizeof(name), "demux %s (%s)", inputs[i].container, inputs[i].encoder);
+        if (cfg.filter && !strstr(name, cfg.filter))
+            continue;
+        memset(&a, 0, sizeof(a));
+        if ((error = make_input(inputs[i].encoder, inputs[i].container, 10, &data, &size)) < 0) {
+            fprintf(stderr, "%s: could not make input (error '%s'), skipped\n", name, av_err2str(error));
+            error = 0;
+            continue;
+        }
+        if ((error = xio_open_mem(data, size, &pb)) < 0 ||
+            !(a.fcx = avformat_alloc_context()) || !(a.pkt = av_packet_alloc())) {
+            xio_close(&pb);
+            error = error < 0 ? error : AVERROR(ENOMEM);
+        } else {
+            a.fcx->pb = pb;
+            if ((error = avformat_open_input(&a.fcx, NULL, NULL, NULL)) < 0 ||
+                (error = avformat_find_stream_info(a.fcx, NULL)) < 0)
+                fprintf(stderr, "%s: could not open input (error '%s')\n", name, av_err2str(error));
+            else {
+                a.frame_size = a.fcx->streams[0]->codecpar->frame_size;
+                error = measure(name, demux_op, &a);
+            }
+            avformat_close_input(&a.fcx);
+            xio_close(&pb);
+        }
+        av_packet_free(&a.pkt);
+        av_freep(&data);
+    }
+    return error;
+}
+
+/* --- fwrite --- */
+
+struct fwrite_arg {
+    FILE *f;
+    uint8_t *data[8];
+    uint8_t *block;
+    int nb_samples, data_size;
+};
+
+/* The output loop of decode_audio.c, one fwrite per sample and channel. */
+static int fwrite_loop_op(void *arg)
+{
+    struct fwrite_arg *a = arg;
+    int i, ch;
+
+    for (i = 0; i < a->nb_samples; i++)
+        for (ch = 0; ch < CHANNELS; ch++)
+            fwrite(a->data[ch] + a->data_size * i, 1, a->data_size, a->f);
+    return a->nb_samples;
+}
+
+/* For comparison: interleave into a block and write it at once. */
+static int fwrite_block_op(void *arg)
+{
+    struct fwrite_arg *a = arg;
+    int i, ch;
+
+    for (i = 0; i < a->nb_samples; i++)
+        for (ch = 0; ch < CHANNELS; ch++)
+            memcpy(a->block + (i * CHANNELS + ch) * a->data_size,
+                   a->data[ch] + a->data_size * i, a->data_size);
+    fwrite(a->block, a->data_size * CHANNELS, a->nb_samples, a->f);
+    return a->nb_samples;
+}
+
+static int bench_fwrite(void)
+{
+    struct fwrite_arg a = { 0 };
+    int error;
+
+    /* mp2 frames, as decode_audio gets them: 1152 samples of s16p. */
+    a.nb_samples = 1152;
+    a.data_size  = av_get_bytes_per_sample(AV_SAMPLE_FMT_S16P);
+    if (!(a.f = fopen("/dev/null", "wb")))
+        return AVERROR(errno);
+    if ((error = alloc_samples(a.data, AV_SAMPLE_FMT_S16P, a.nb_samples)) < 0 ||
+        !(a.block = av_malloc(a.nb_samples * CHANNELS * a.data_size))) {
+        fclose(a.f);
+        av_freep(&a.data[0]);
+        return error < 0 ? error : AVERROR(ENOMEM);
+    }
+    if (!(error = measure("fwrite loop s16p/2ch/1152", fwrite_loop_op, &a)))
+        error = measure("fwrite block s16p/2ch/1152", fwrite_block_op, &a);
+    fclose(a.f);
+    av_freep(&a.data[0]);
+    av_freep(&a.block);
+    return error;
+}
+
+/* --- stretch --- */
+
+#define STRETCH_BLOCK 1024
+/* The quality test tone: QHARM harmonics of QF0 Hz, QSECONDS long (times
+ * the tempo when faster, so that as much comes out), fitted in blocks of
+ * QBLOCK samples (a whole number of cycles of each). */
+#define QF0      130
+#define QHARM    5
+#define QSECONDS 10
+#define QBLOCK   (RATE / 10)
+
+struct stretch_arg {
+    double tempo;
+    struct tstretch *ts;   /* tstretch.h, or */
+    struct fgraph *fg;     /* the atempo chain */
+    AVAudioFifo *fifo;     /* what ts puts out */
+    AVFrame *in;           /* the block put in */
+    AVFrame *frame;
+    uint8_t *tmp[8];       /* what is taken out of fifo */
+    int64_t pts;
+};
+
+/* tmp30 -f for the tempo: atempo takes 0.5 to 2 (up to 100 in newer
+ * FFmpeg), so a quarter speed is two of them. */
+static int atempo_chain(char *buf, size_t size, double tempo)
+{
+    int n = 1;
+
+    *buf = 0;
+    for (; tempo < 0.5; tempo /= 0.5, n++)
+        av_strlcat(buf, "atempo=0.5,", size);
+    for (; tempo > 2; tempo /= 2, n++)
+        av_strlcat(buf, "atempo=2,", size);
+    av_strlcatf(buf, size, "atempo=%g", tempo);
+    return n;
+}
+
+/**
+ * Set up a stretch with a block of noise to feed it.
+ * @param tier Tier of tstretch.h, or -1 for the atempo chain
+ */
+static int open_stretch(double tempo, int tier, struct stretch_arg *a)
+{
+    AVChannelLayout layout = AV_CHANNEL_LAYOUT_STEREO;
+    AVCodecContext *dec;
+    char desc[256];
+    int i, j, error;
+
+    memset(a, 0, sizeof(*a));
+    a->tempo = tempo;
+    if (!(a->in = av_frame_alloc()) || !(a->frame = av_frame_alloc()) ||
+        !(a->fifo = av_audio_fifo_alloc(AV_SAMPLE_FMT_FLTP, CHANNELS, STRETCH_BLOCK)))
+        return AVERROR(ENOMEM);
+    a->in->nb_samples  = STRETCH_BLOCK;
+    a->in->format      = AV_SAMPLE_FMT_FLTP;
+    a->in->sample_rate = RATE;
+    av_channel_layout_copy(&a->in->ch_layout, &layout);
+    if ((error = av_frame_get_buffer(a->in, 0)) < 0 ||
+        (error = av_samples_alloc(a->tmp, NULL, CHANNELS, STRETCH_BLOCK, AV_SAMPLE_FMT_FLTP, 0)) < 0)
+        return error;
+    for (i = 0; i < CHANNELS; i++)
+        for (j = 0; j < STRETCH_BLOCK; j++)
+            ((float *)a->in->extended_data[i])[j] = noise();
+
+    if (tier >= 0) {
+        struct tstretch_opts o = { tempo, tier };
+        return tstretch_alloc(&a->ts, &o, &layout, RATE, AV_SAMPLE_FMT_FLTP);
+    }
+    /* fgraph takes its input's format from the decoder. */
+    if (!(dec = avcodec_alloc_context3(NULL)))
+        return AVERROR(ENOMEM);
+    dec->sample_fmt  = AV_SAMPLE_FMT_FLTP;
+    dec->sample_rate = RATE;
+    av_channel_layout_copy(&dec->ch_layout, &layout);
+    atempo_chain(desc, sizeof(desc), tempo);
+    error = fgraph_alloc(&a->fg, desc, dec, (AVRational){ 1, RATE }, AV_SAMPLE_FMT_FLTP, &layout, RATE);
+    avcodec_free_context(&dec);
+    return error;
+}
+
+static void close_stretch(struct stretch_arg *a)
+{
+    tstretch_free(&a->ts);
+    fgraph_free(&a->fg);
+    av_audio_fifo_free(a->fifo);
+    av_frame_free(&a->in);
+    av_frame_free(&a->frame);
+    av_freep(&a->tmp[0]);
+}
+
+/* Append up to n samples to out, as far as it goes. */
+static void keep(float *out, int64_t *pos, int64_t cap, const float *src, int n)
+{
+    n = FFMIN(n, cap - *pos);
+    memcpy(out + *pos, src, n * sizeof(*out));
+    *pos += n;
+}
+
+/**
+ * Put the block in a->in through the stretch, or at the end what it still
+ * holds, and take out what comes out.
+ * @param last Put in the end instead of the block
+ * @param out  Where the first channel of the output goes, or NULL to drop it
+ * @param pos  Samples in out so far, advanced
+ * @param cap  Size of out
+ * @return Error code (0 if successful)
+ */
+static int stretch_feed(struct stretch_arg *a, int last, float *out, int64_t *pos, int64_t cap)
+{
+    int n, error;
+
+    if (a->ts) {
+        if (!last)
+            error = tstretch_write(a->ts, (const float *const *)a->in->extended_data,
+                                   a->in->nb_samples, a->fifo);
+        else
+            while ((error = tstretch_flush(a->ts, a->fifo, STRETCH_BLOCK)) > 0)
+                if (out)
+                    while ((n = FFMIN(av_audio_fifo_size(a->fifo), STRETCH_BLOCK)) > 0 &&
+                           av_audio_fifo_read(a->fifo, (void **)a->tmp, n) == n)
+                        keep(out, pos, cap, (const float *)a->tmp[0], n);
+        if (error < 0)
+            return error;
+        if (!out)
+            return av_audio_fifo_drain(a->fifo, av_audio_fifo_size(a->fifo));
+        while ((n = FFMIN(av_audio_fifo_size(a->fifo), STRETCH_BLOCK)) > 0) {
+            if (av_audio_fifo_read(a->fifo, (void **)a->tmp, n) < n)
+                return AVERROR_EXIT;
+            keep(out, pos, cap, (const float *)a->tmp[0], n);
+        }
+        return 0;
+    }
+
+    if (last)
+        error = fgraph_send(a->fg, NULL);
+    else {
+        a->in->pts = a->pts;
+        a->pts += a->in->nb_samples;
+        if ((error = av_frame_ref(a->frame, a->in)) >= 0)
+            error = fgraph_send(a->fg, a->frame);
+    }
+    if (error < 0)
+        return error;
+    while ((error = fgraph_receive(a->fg, a->frame)) >= 0) {
+        if (out)
+            keep(out, pos, cap, (const float *)a->frame->extended_data[0], a->frame->nb_samples);
+        av_frame_unref(a->frame);
+    }
+    return error == AVERROR(EAGAIN) || error == AVERROR_EOF ? 0 : error;
+}
+
+/* Per input sample, the output dropped. */
+static int stretch_op(void *arg)
+{
+    struct stretch_arg *a = arg;
+    int error;
+
+    if ((error = stretch_feed(a, 0, NULL, NULL, 0)) < 0)
+        return error;
+    return a->in->nb_samples;
+}
+
+static double tone(int64_t i)
+{
+    double v = 0;
+    int h;
+
+    for (h = 1; h <= QHARM; h++)
+        v += 0.25 / h * sin(2 * M_PI * h * QF0 * i / RATE + h);
+    return v;
+}
+
+/**
+ * Fit each block of x with the tone's harmonics, the phase and level of
+ * each free, leaving out the first and last half second.
+ * @return Energy of the fit over what it leaves, in dB
+ */
+static double tone_snr(const float *x, int64_t len)
+{
+    static double basis[2 * QHARM][QBLOCK];
+    double sig = 0, err = 0;
+    int64_t b;
+    int h, i;
+
+    /* A whole number of cycles of each harmonic per block, so cos and sin
+     * of them are orthogonal, and the same in every block. */
+    for (h = 0; h < QHARM; h++)
+        for (i = 0; i < QBLOCK; i++) {
+            basis[2 * h][i]     = cos(2 * M_PI * (h + 1) * QF0 * i / RATE);
+            basis[2 * h + 1][i] = sin(2 * M_PI * (h + 1) * QF0 * i / RATE);
+        }
+    for (b = RATE / 2; b + QBLOCK <= len - RATE / 2; b += QBLOCK) {
+        double fit[QBLOCK] = { 0 };
+
+        for (h = 0; h < 2 * QHARM; h++) {
+            double c = 0;
+            for (i = 0; i < QBLOCK; i++)
+                c += x[b + i] * basis[h][i];
+            c *= 2.0 / QBLOCK;
+            for (i = 0; i < QBLOCK; i++)
+                fit[i] += c * basis[h][i];
+        }
+        for (i = 0; i < QBLOCK; i++) {
+            sig += fit[i] * fit[i];
+            err += (x[b + i] - fit[i]) * (x[b + i] - fit[i]);
+        }
+    }
+    return 10 * log10(sig / FFMAX(err, 1e-30));
+}
+
+/**
+ * Stretch QSECONDS of the tone, or more when faster, and print one result
+ * line: the SNR of the output, and its length over the one the tempo asks
+ * for.
+ * @return Error code (0 if successful)
+ */
+static int stretch_quality(const char *name, struct stretch_arg *a)
+{
+    const int64_t len = llrint(QSECONDS * RATE * FFMAX(a->tempo, 1)), cap = llrint(len / a->tempo) + RATE;
+    float *out = av_malloc_array(cap, sizeof(*out));
+    int64_t pos = 0, i;
+    int j, ch, error = 0;
+
+    if (!out)
+        return AVERROR(ENOMEM);
+    for (i = 0; i < len && error >= 0; i += a->in->nb_samples) {
+        a->in->nb_samples = FFMIN(STRETCH_BLOCK, len - i);
+        if ((error = av_frame_make_writable(a->in)) < 0)
+            break;
+        for (ch = 0; ch < CHANNELS; ch++)
+            for (j = 0; j < a->in->nb_samples; j++)
+                ((float *)a->in->extended_data[ch])[j] = tone(i + j);
+        error = stretch_feed(a, 0, out, &pos, cap);
+    }
+    if (error >= 0)
+        error = stretch_feed(a, 1, out, &pos, cap);
+    if (error < 0)
+        fprintf(stderr, "%s failed (error '%s')\n", name, av_err2str(error));
+    else if (cfg.csv)
+        printf("%s,%.2f,%.4f\n", name, tone_snr(out, pos), pos * a->tempo / len);
+    else
+        printf("%-36s %12.2f %12.4f\n", name, tone_snr(out, pos), pos * a->tempo / len);
+    fflush(stdout);
+    av_free(out);
+    return error;
+}
+
+static const double tempos[] = { 0.1, 0.25, 0.5, 0.8, 2, 4, 10 };
+static const char *const tiers[] = { "fast", "good", "best" };
+
+static int bench_stretch(void)
+{
+    struct stretch_arg a;
+    char name[64], desc[256];
+    int i, tier, error = 0;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(tempos) && !error; i++) {
+        for (tier = -1; tier < (int)FF_ARRAY_ELEMS(tiers) && !error; tier++) {
+            if (tier < 0)
+                snprintf(name, sizeof(name), "stretch %g atempo*%d", tempos[i],
+                         atempo_chain(desc, sizeof(desc), tempos[i]));
+            else
+                snprintf(name, sizeof(name), "stretch %g tstretch:%s", tempos[i], tiers[tier]);
+            if (cfg.filter && !strstr(name, cfg.filter))
+                continue;
+            /* Without atempo in the libavfilter build tstretch is still
+             * worth a look. */
+            if ((error = open_stretch(tempos[i], tier, &a)) < 0) {
+                fprintf(stderr, "%s: not available (error '%s'), skipped\n", name, av_err2str(error));
+                error = 0;
+            } else if (cfg.quality)
+                error = stretch_quality(name, &a);
+            else
+                error = measure(name, stretch_op, &a);
+            close_stretch(&a);
+        }
+    }
+    return error;
+}
+
+int main(int argc, char **argv)
+{
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "cf:qt:")) != -1) {
+        switch (opt) {
+        case 'c': cfg.csv     = 1;            break;
+        case 'f': cfg.filter  = optarg;       break;
+        case 'q': cfg.quality = 1;            break;
+        case 't': cfg.seconds = atof(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-c] [-f filter] [-q] [-t seconds]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    /* Twice the last-level cache, and no less than 32 MiB when the size
+     * is not known. */
+    cfg.evict_size = FFMAX(llc > 0 ? 2 * llc : 0, 32 << 20);
+    if (!(cfg.evict = calloc(1, cfg.evict_size))) {
+        fprintf(stderr, "Could not allocate eviction buffer\n");
+        return 1;
+    }
+
+    if (cfg.quality) {
+        if (cfg.csv)
+            printf("name,snr_db,length\n");
+        else
+            printf("%-36s %12s %12s\n", "quality", "snr dB", "length");
+        return bench_stretch() < 0;
+    }
+    if (cfg.csv)
+        printf("name,warm_ns_per_sample,cold_ns_per_sample\n");
+    else
+        printf("%-36s %12s %12s\n", "ns/sample", "warm", "cold");
+    if (bench_fifo() < 0 || bench_zfifo() < 0 || bench_swr() < 0 || bench_enc() < 0 ||
+        bench_demux() < 0 || bench_fwrite() < 0 || bench_stretch() < 0)
+        return 1;
+    free(cfg.evict);
+    return 0;
+}
@@ -0,0 +1,407 @@
+/*
+ * xcache.c: see xcache.h.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "xcache.h"
+
+/* XXH64, as specified by its reference implementation; the reads assume
+ * a little-endian machine. */
+#define P1 UINT64_C(11400714785074694791)
+#define P2 UINT64_C(14029467366897019727)
+#define P3 UINT64_C(1609587929392839161)
+#define P4 UINT64_C(9650029242287828579)
+#define P5 UINT64_C(2870177450012600261)
+
+static uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc  = rotl64(acc, 31);
+    return acc * P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * P1 + P4;
+}
+
+uint64_t xcache_xxh64(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = data, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        const uint8_t *limit = end - 32;
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else
+        h = seed + P5;
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, read64(p));
+        h  = rotl64(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h ^= read32(p) * P1;
+        h  = rotl64(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h  = rotl64(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Copy src to dst: a reflink if the filesystem does them, else in the
+ * kernel. */
+static int clone_fd(int src, int dst)
+{
+    ssize_t n;
+
+    if (ioctl(dst, FICLONE, src) == 0)
+        return 0;
+    while ((n = copy_file_range(src, NULL, dst, NULL, 1 << 30, 0)) > 0)
+        ;
+    return n < 0 ? AVERROR(errno) : 0;
+}
+
+/* Read-modify-write of the stats file under its lock. */
+static void count(const struct xcache *xc, int hit, unsigned long long *hits, unsigned long long *misses)
+{
+    char path[4200], buf[128] = "";
+    int fd;
+
+    *hits = *misses = 0;
+    snprintf(path, sizeof(path), "%s/stats", xc->dir);
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return;
+    flock(fd, LOCK_EX);
+    if (pread(fd, buf, sizeof(buf) - 1, 0) > 0)
+        sscanf(buf, "hits %llu misses %llu", hits, misses);
+    if (hit >= 0) {
+        if (hit)
+            ++*hits;
+        else
+            ++*misses;
+        snprintf(buf, sizeof(buf), "hits %llu misses %llu\n", *hits, *misses);
+        if (ftruncate(fd, 0) < 0 || pwrite(fd, buf, strlen(buf), 0) < 0)
+            fprintf(stderr, "Could not update cache statistics\n");
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+static int is_entry(const char *name)
+{
+    return strlen(name) == 32 && strspn(name, "0123456789abcdef") == 32;
+}
+
+struct entry {
+    char name[33];
+    struct timespec mtime;
+    int64_t size;
+};
+
+static int by_age(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return (x->mtime.tv_sec > y->mtime.tv_sec) - (x->mtime.tv_sec < y->mtime.tv_sec);
+    return (x->mtime.tv_nsec > y->mtime.tv_nsec) - (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+/* Remove least recently used entries until the cache fits its bound,
+ * keeping the current one. */
+static void evict(const struct xcache *xc, int64_t *total, int *nb_entries)
+{
+    struct entry *e = NULL;
+    int nb = 0, i;
+    char path[4400];
+    struct dirent *de;
+    struct stat sb;
+    DIR *d;
+
+    *total = 0;
+    if (!(d = opendir(xc->dir)))
+        return;
+    while ((de = readdir(d))) {
+        if (!is_entry(de->d_name))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", xc->dir, de->d_name);
+        if (stat(path, &sb) < 0 || av_reallocp_array(&e, nb + 1, sizeof(*e)) < 0)
+            continue;
+        memcpy(e[nb].name, de->d_name, 33);
+        e[nb].mtime = sb.st_mtim;
+        e[nb].size  = sb.st_size;
+        *total += sb.st_size;
+        nb++;
+    }
+    closedir(d);
+
+    qsort(e, nb, sizeof(*e), by_age);
+    *nb_entries = nb;
+    for (i = 0; i < nb && *total > xc->max_bytes; i++) {
+        if (!strcmp(e[i].name, xc->key))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", xc->dir, e[i].name);
+        /* Another process may have got to it first. */
+        if (unlink(path) == 0 || errno == ENOENT) {
+            *total -= e[i].size;
+            --*nb_entries;
+        }
+    }
+    av_free(e);
+}
+
+int xcache_init(struct xcache *xc)
+{
+    const char *dir = getenv("FFPROGS_CACHE"), *size = getenv("FFPROGS_CACHE_SIZE");
+    char *p;
+
+    if (dir && *dir)
+        snprintf(xc->dir, sizeof(xc->dir), "%s", dir);
+    else
+        snprintf(xc->dir, sizeof(xc->dir), "%s/.cache/ffprogs", getenv("HOME") ? getenv("HOME") : ".");
+    xc->max_bytes = (int64_t)(size && atoi(size) > 0 ? atoi(size) : XCACHE_DEFAULT_SIZE) << 20;
+    xc->key[0] = 0;
+
+    /* mkdir -p */
+    for (p = xc->dir + 1; ; p++) {
+        if (*p == '/' || !*p) {
+            char c = *p;
+            *p = 0;
+            if (mkdir(xc->dir, 0755) < 0 && errno != EEXIST) {
+                int error = AVERROR(errno);
+                fprintf(stderr, "Could not create cache directory '%s' (error '%s')\n", xc->dir, av_err2str(error));
+                *p = c;
+                return error;
+            }
+            *p = c;
+            if (!c)
+                break;
+        }
+    }
+    return 0;
+}
+
+int xcache_key(struct xcache *xc, const char *input, const char *params)
+{
+    uint64_t h = 0;
+    struct stat sb;
+    void *data;
+    int fd, error;
+
+    if ((fd = open(input, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+        error = AVERROR(errno);
+        goto fail;
+    }
+    if (!S_ISREG(sb.st_mode)) {
+        error = AVERROR(EINVAL);
+        goto fail;
+    }
+    if (sb.st_size) {
+        if ((data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+            error = AVERROR(errno);
+            goto fail;
+        }
+        madvise(data, sb.st_size, MADV_SEQUENTIAL);
+        h = xcache_xxh64(data, sb.st_size, 0);
+        munmap(data, sb.st_size);
+    }
+    close(fd);
+    snprintf(xc->key, sizeof(xc->key), "%016" PRIx64 "%016" PRIx64, h, xcache_xxh64(params, strlen(params), h));
+    return 0;
+
+fail:
+    if (fd >= 0)
+        close(fd);
+    fprintf(stderr, "Could not hash '%s' for the cache (error '%s')\n", input, av_err2str(error));
+    return error;
+}
+
+int xcache_open(struct xcache *xc)
+{
+    char entry[4200];
+    unsigned long long hits, misses;
+    int fd;
+
+    snprintf(entry, sizeof(entry), "%s/%s", xc->dir, xc->key);
+    if ((fd = open(entry, O_RDONLY)) < 0) {
+        count(xc, 0, &hits, &misses);
+        return AVERROR(ENOENT);
+    }
+    /* Recently used now. */
+    futimens(fd, NULL);
+    count(xc, 1, &hits, &misses);
+    return fd;
+}
+
+int xcache_get(struct xcache *xc, const char *output)
+{
+    char entry[4200], tmp[4200];
+    int src, dst, error;
+
+    snprintf(entry, sizeof(entry), "%s/%s", xc->dir, xc->key);
+    snprintf(tmp, sizeof(tmp), "%s.xcache.%d", output, (int)getpid());
+    if ((src = xcache_open(xc)) < 0)
+        return src;
+
+    /* Reflink, else hardlink, else copy; then into place in one step. */
+    unlink(tmp);
+    if ((dst = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644)) >= 0 &&
+        ioctl(dst, FICLONE, src) == 0)
+        error = 0;
+    else {
+        if (dst >= 0) {
+            close(dst);
+            unlink(tmp);
+            dst = -1;
+        }
+        if (link(entry, tmp) == 0)
+            error = 0;
+        else if ((dst = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+            error = AVERROR(errno);
+        else
+            error = clone_fd(src, dst);
+    }
+    if (dst >= 0)
+        close(dst);
+    close(src);
+    if (!error && rename(tmp, output) < 0)
+        error = AVERROR(errno);
+    if (error < 0) {
+        unlink(tmp);
+        fprintf(stderr, "Could not take '%s' from the cache (error '%s')\n", output, av_err2str(error));
+        return error;
+    }
+    return 0;
+}
+
+int xcache_create(struct xcache *xc, char *tmp, size_t size)
+{
+    int fd;
+
+    snprintf(tmp, size, "%s/tmp.XXXXXX", xc->dir);
+    if ((fd = mkstemp(tmp)) < 0)
+        return AVERROR(errno);
+    return fd;
+}
+
+int xcache_commit(struct xcache *xc, int fd, const char *tmp)
+{
+    char entry[4200];
+    int64_t total;
+    int nb, error = 0;
+
+    /* Complete on disk before it gets its name. */
+    snprintf(entry, sizeof(entry), "%s/%s", xc->dir, xc->key);
+    if (fchmod(fd, 0444) < 0 || fsync(fd) < 0)
+        error = AVERROR(errno);
+    close(fd);
+    if (!error && rename(tmp, entry) < 0)
+        error = AVERROR(errno);
+    if (error < 0) {
+        unlink(tmp);
+        return error;
+    }
+    evict(xc, &total, &nb);
+    return 0;
+}
+
+int xcache_put(struct xcache *xc, const char *output)
+{
+    char tmp[4200];
+    int src, dst, error;
+
+    if ((src = open(output, O_RDONLY)) < 0) {
+        error = AVERROR(errno);
+        goto fail;
+    }
+    if ((dst = xcache_create(xc, tmp, sizeof(tmp))) < 0) {
+        error = dst;
+        close(src);
+        goto fail;
+    }
+    error = clone_fd(src, dst);
+    close(src);
+    if (error < 0) {
+        close(dst);
+        unlink(tmp);
+        goto fail;
+    }
+    if ((error = xcache_commit(xc, dst, tmp)) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    fprintf(stderr, "Could not store '%s' in the cache (error '%s')\n", output, av_err2str(error));
+    return error;
+}
+
+void xcache_report(const struct xcache *xc, int hit, FILE *f)
+{
+    unsigned long long hits, misses;
+    int64_t total;
+    int nb = 0;
+
+    count(xc, -1, &hits, &misses);
+    evict(xc, &total, &nb);
+    fprintf(f, "Cache %s %s: %llu hits, %llu misses, %d entries, %.1f of %.0f MiB\n",
+            hit ? "hit" : "miss", xc->key, hits, misses, nb,
+            total / 1048576.0, xc->max_bytes / 1048576.0);
+}
@@ -0,0 +1,95 @@
+/*
+ * xcache.h: content-addressed cache of transcode outputs (tmp30 -c).
+ *
+ * An entry is named by two XXH64 hashes: one of the input's bytes, one of
+ * a string holding every setting the output depends on (encoder, its
+ * parameters, container, library versions; see tmp30.c). A hit puts the
+ * entry in place of the output as a reflink where the filesystem can,
+ * else as a hardlink, else as a copy. Entries are read-only so that a
+ * hardlinked output can't be changed in place by accident.
+ *
+ * Entries are populated by writing a temporary file in the cache
+ * directory and renaming it over the entry's name, so concurrent writers
+ * of the same entry each leave a complete one. The cache is kept under
+ * its size bound by removing the least recently used entries (by mtime,
+ * which a hit refreshes). Hit and miss counts are kept in a stats file
+ * under flock.
+ *
+ * The cache is $FFPROGS_CACHE, or ~/.cache/ffprogs; its bound is
+ * $FFPROGS_CACHE_SIZE MiB, or XCACHE_DEFAULT_SIZE.
+ */
+
+#ifndef XCACHE_H
+#define XCACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Default size bound, MiB */
+#define XCACHE_DEFAULT_SIZE 1024
+
+struct xcache {
+    char dir[4096];
+    int64_t max_bytes;
+    char key[33];           /* entry name, set by xcache_key */
+};
+
+/**
+ * Find and create the cache directory.
+ * @return Error code (0 if successful)
+ */
+int xcache_init(struct xcache *xc);
+
+/**
+ * Compute the entry name for an input file and a settings string.
+ * @return Error code (0 if successful)
+ */
+int xcache_key(struct xcache *xc, const char *input, const char *params);
+
+/**
+ * Put the entry in place of output, if there is one, and count a hit or
+ * a miss.
+ * @return 0 on a hit, AVERROR(ENOENT) on a miss, or another error code
+ */
+int xcache_get(struct xcache *xc, const char *output);
+
+/**
+ * Store output as the entry, then trim the cache to its bound.
+ * @return Error code (0 if successful)
+ */
+int xcache_put(struct xcache *xc, const char *output);
+
+/**
+ * Open the entry for reading, count a hit or a miss and, on a hit, mark
+ * the entry used.
+ * @return File descriptor on a hit, AVERROR(ENOENT) on a miss
+ */
+int xcache_open(struct xcache *xc);
+
+/**
+ * Create a temporary file in the cache directory to populate the entry
+ * from.
+ * @param[out] tmp  Its name
+ * @param      size Size of tmp
+ * @return File descriptor, or a negative error code
+ */
+int xcache_create(struct xcache *xc, char *tmp, size_t size);
+
+/**
+ * Make a file from xcache_create the entry, close it, and trim the cache
+ * to its bound. The file is removed on failure.
+ * @return Error code (0 if successful)
+ */
+int xcache_commit(struct xcache *xc, int fd, const char *tmp);
+
+/**
+ * Print the outcome of a lookup with the cache's statistics.
+ */
+void xcache_report(const struct xcache *xc, int hit, FILE *f);
+
+/**
+ * XXH64 of len bytes.
+ */
+uint64_t xcache_xxh64(const void *data, size_t len, uint64_t seed);
+
+#endif /* XCACHE_H */
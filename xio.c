@@ -0,0 +1,682 @@
+/*
+ * xio.c: custom AVIOContexts for the transcoding programs.
+ * See xio.h for the modes and the memory/callback contexts.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/mem.h>
+#include <libavformat/avio.h>
+
+#include "xio.h"
+
+/* Size of the AVIOContext buffer in front of our read callbacks. */
+#define XIO_IOBUF_SIZE (256 * 1024)
+/* Readahead block size and the number of blocks kept ahead of the demuxer. */
+#define XIO_RA_BLOCK   (1024 * 1024)
+#define XIO_RA_NBLOCKS 8
+/* Window of a mapping advised MADV_WILLNEED ahead of the reader; it slides
+ * on once the reader is half way through it. */
+#define XIO_MMAP_WINDOW (XIO_RA_BLOCK * XIO_RA_NBLOCKS)
+
+/* avio_alloc_context's write callback takes a const buffer from libavformat 61 on. */
+#if LIBAVFORMAT_VERSION_MAJOR < 61
+#define XIO_WBUF uint8_t
+#else
+#define XIO_WBUF const uint8_t
+#endif
+
+/* Common head of every opaque we hand to avio_alloc_context. */
+struct xio {
+    void (*close)(struct xio *x);
+};
+
+/* Read-only view of bytes in memory: a file mapping or a caller's buffer. */
+struct xio_mem {
+    struct xio x;
+    const uint8_t *base;  /* NULL for an empty file */
+    int64_t size;
+    int64_t pos;
+    int mapped;           /* base is a file mapping */
+    int64_t will_from;    /* mapping: range advised MADV_WILLNEED */
+    int64_t will_to;
+};
+
+/* Growable, seekable output buffer. */
+struct xio_membuf {
+    struct xio x;
+    uint8_t *data;
+    int64_t size;   /* bytes written so far (high-water mark) */
+    int64_t alloc;
+    int64_t pos;
+};
+
+/* Output descriptor. */
+struct xio_fd {
+    struct xio x;
+    int fd;
+};
+
+/* Caller-supplied callbacks. */
+struct xio_cb {
+    struct xio x;
+    int (*read)(void *opaque, uint8_t *buf, int buf_size);
+    int (*write)(void *opaque, const uint8_t *buf, int buf_size);
+    int64_t (*seek)(void *opaque, int64_t offset, int whence);
+    void *opaque;
+};
+
+struct xio_rablock {
+    uint8_t *data;
+    int64_t off;    /* file offset of data[0] */
+    int len;
+};
+
+struct xio_ra {
+    struct xio x;
+    int fd;
+    int64_t size;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct xio_rablock blk[XIO_RA_NBLOCKS];
+    unsigned head, tail;  /* blocks [tail, head) hold file data in file order */
+    int64_t pos;          /* reader position */
+    int64_t next;         /* offset the thread reads next */
+    unsigned gen;         /* bumped whenever a seek drops the buffered blocks */
+    int err;              /* sticky read error */
+    int quit;
+};
+
+int xio_parse_mode(const char *name, enum xio_mode *mode)
+{
+    if (!strcmp(name, "default"))
+        *mode = XIO_DEFAULT;
+    else if (!strcmp(name, "mmap"))
+        *mode = XIO_MMAP;
+    else if (!strcmp(name, "readahead"))
+        *mode = XIO_READAHEAD;
+    else {
+        fprintf(stderr, "Unknown I/O mode '%s'\n", name);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+/**
+ * Resolve a seek request against the current position and file size.
+ * @return New absolute position, or a negative error code
+ */
+static int64_t xio_seek_target(int64_t pos, int64_t size, int64_t offset, int whence)
+{
+    int64_t target;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET: target = offset;        break;
+    case SEEK_CUR: target = pos + offset;  break;
+    case SEEK_END: target = size + offset; break;
+    default:       return AVERROR(EINVAL);
+    }
+    if (target < 0 || target > size)
+        return AVERROR(EINVAL);
+    return target;
+}
+
+/**
+ * Have the kernel read a window of a mapping ahead of the reader, instead
+ * of all of it at once: again when the reader is half way through the
+ * window, or has seeked out of it.
+ */
+static void xio_mmap_advise(struct xio_mem *m)
+{
+    const int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t start;
+
+    if (m->pos >= m->will_from &&
+        (m->pos + XIO_MMAP_WINDOW / 2 < m->will_to || m->will_to == m->size))
+        return;
+    start        = m->pos / page * page;
+    m->will_from = start;
+    m->will_to   = FFMIN(m->pos + XIO_MMAP_WINDOW, m->size);
+    madvise((void *)(m->base + start), m->will_to - start, MADV_WILLNEED);
+}
+
+static int xio_mem_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    struct xio_mem *m = opaque;
+    int n = FFMIN((int64_t)buf_size, m->size - m->pos);
+
+    if (n <= 0)
+        return AVERROR_EOF;
+    if (m->mapped)
+        xio_mmap_advise(m);
+    memcpy(buf, m->base + m->pos, n);
+    m->pos += n;
+    return n;
+}
+
+static int64_t xio_mem_seek(void *opaque, int64_t offset, int whence)
+{
+    struct xio_mem *m = opaque;
+    int64_t target;
+
+    if (whence & AVSEEK_SIZE)
+        return m->size;
+    if ((target = xio_seek_target(m->pos, m->size, offset, whence)) < 0)
+        return target;
+    return m->pos = target;
+}
+
+static void xio_mmap_close(struct xio *x)
+{
+    struct xio_mem *m = (struct xio_mem *)x;
+
+    if (m->base)
+        munmap((void *)m->base, m->size);
+    av_free(m);
+}
+
+static void xio_mem_close(struct xio *x)
+{
+    av_free(x);
+}
+
+/**
+ * Map a file for XIO_MMAP. The descriptor is not needed after mmap.
+ */
+static int xio_mmap_open(int fd, int64_t size, struct xio **x)
+{
+    struct xio_mem *m;
+    void *base;
+
+    if (!(m = av_mallocz(sizeof(*m))))
+        return AVERROR(ENOMEM);
+    m->x.close = xio_mmap_close;
+    m->size    = size;
+
+    /* mmap refuses zero-length mappings; an empty file simply reads EOF. */
+    if (size > 0) {
+        base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (base == MAP_FAILED) {
+            int error = AVERROR(errno);
+            av_free(m);
+            return error;
+        }
+        /* The demuxer walks the file front to back; let the kernel read ahead
+         * aggressively and drop pages behind us. What is read ahead is a
+         * window at a time (xio_mmap_advise), not the whole file. */
+        madvise(base, size, MADV_SEQUENTIAL);
+        m->base      = base;
+        m->mapped    = 1;
+        m->will_from = m->will_to = -1;
+    }
+    *x = &m->x;
+    return 0;
+}
+
+static void *xio_ra_thread(void *opaque)
+{
+    struct xio_ra *ra = opaque;
+
+    pthread_mutex_lock(&ra->lock);
+    while (!ra->quit) {
+        struct xio_rablock *b;
+        int64_t off;
+        unsigned gen;
+        ssize_t n;
+
+        /* Sleep while the ring is full, at end of file, or after an error. */
+        if (ra->head - ra->tail == XIO_RA_NBLOCKS || ra->next >= ra->size || ra->err) {
+            pthread_cond_wait(&ra->cond, &ra->lock);
+            continue;
+        }
+
+        /* The slot at head is not visible to the reader until head moves,
+         * so it can be filled without holding the lock. */
+        b   = &ra->blk[ra->head % XIO_RA_NBLOCKS];
+        off = ra->next;
+        gen = ra->gen;
+        pthread_mutex_unlock(&ra->lock);
+        do {
+            n = pread(ra->fd, b->data, XIO_RA_BLOCK, off);
+        } while (n < 0 && errno == EINTR);
+        pthread_mutex_lock(&ra->lock);
+
+        /* A seek in the meantime made this block useless. */
+        if (gen != ra->gen)
+            continue;
+        if (n < 0)
+            ra->err = AVERROR(errno);
+        else if (n == 0)
+            ra->size = off; /* file shrank underneath us */
+        else {
+            b->off = off;
+            b->len = n;
+            ra->head++;
+            ra->next = off + n;
+        }
+        pthread_cond_broadcast(&ra->cond);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return NULL;
+}
+
+static int xio_ra_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    struct xio_ra *ra = opaque;
+    int ret;
+
+    pthread_mutex_lock(&ra->lock);
+    for (;;) {
+        /* Hand back the blocks the reader has moved past. */
+        while (ra->tail != ra->head) {
+            struct xio_rablock *b = &ra->blk[ra->tail % XIO_RA_NBLOCKS];
+            if (b->off + b->len > ra->pos)
+                break;
+            ra->tail++;
+            pthread_cond_broadcast(&ra->cond);
+        }
+        if (ra->tail != ra->head) {
+            struct xio_rablock *b = &ra->blk[ra->tail % XIO_RA_NBLOCKS];
+            ret = FFMIN((int64_t)buf_size, b->off + b->len - ra->pos);
+            memcpy(buf, b->data + (ra->pos - b->off), ret);
+            ra->pos += ret;
+            break;
+        }
+        if (ra->err) {
+            ret = ra->err;
+            break;
+        }
+        if (ra->pos >= ra->size) {
+            ret = AVERROR_EOF;
+            break;
+        }
+        pthread_cond_wait(&ra->cond, &ra->lock);
+    }
+    pthread_mutex_unlock(&ra->lock);
+    return ret;
+}
+
+static int64_t xio_ra_seek(void *opaque, int64_t offset, int whence)
+{
+    struct xio_ra *ra = opaque;
+    int64_t target;
+
+    /* The thread sets the size when the file shrinks. */
+    pthread_mutex_lock(&ra->lock);
+    if (whence & AVSEEK_SIZE) {
+        target = ra->size;
+        goto done;
+    }
+    if ((target = xio_seek_target(ra->pos, ra->size, offset, whence)) < 0)
+        goto done;
+
+    /* Seeks inside the buffered range (the usual short seeks of a demuxer
+     * probing headers) only move the read position. Anything else drops
+     * the ring and restarts the thread at the new offset. */
+    if (ra->tail == ra->head ||
+        target < ra->blk[ra->tail % XIO_RA_NBLOCKS].off ||
+        target >= ra->next) {
+        ra->tail = ra->head;
+        ra->next = target;
+        ra->err  = 0;
+        ra->gen++;
+        pthread_cond_broadcast(&ra->cond);
+    }
+    ra->pos = target;
+
+done:
+    pthread_mutex_unlock(&ra->lock);
+    return target;
+}
+
+static void xio_ra_close(struct xio *x)
+{
+    struct xio_ra *ra = (struct xio_ra *)x;
+    int i;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->quit = 1;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->thread, NULL);
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    for (i = 0; i < XIO_RA_NBLOCKS; i++)
+        av_free(ra->blk[i].data);
+    close(ra->fd);
+    av_free(ra);
+}
+
+/**
+ * Start the readahead thread for XIO_READAHEAD. Takes ownership of fd.
+ */
+static int xio_ra_open(int fd, int64_t size, struct xio **x)
+{
+    struct xio_ra *ra;
+    int i, error;
+
+    if (!(ra = av_mallocz(sizeof(*ra)))) {
+        close(fd);
+        return AVERROR(ENOMEM);
+    }
+    ra->x.close = xio_ra_close;
+    ra->fd      = fd;
+    ra->size    = size;
+    for (i = 0; i < XIO_RA_NBLOCKS; i++) {
+        if (!(ra->blk[i].data = av_malloc(XIO_RA_BLOCK))) {
+            error = AVERROR(ENOMEM);
+            goto fail;
+        }
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+    if ((error = pthread_create(&ra->thread, NULL, xio_ra_thread, ra))) {
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        error = AVERROR(error);
+        goto fail;
+    }
+    *x = &ra->x;
+    return 0;
+
+fail:
+    for (i = 0; i < XIO_RA_NBLOCKS; i++)
+        av_free(ra->blk[i].data);
+    close(fd);
+    av_free(ra);
+    return error;
+}
+
+static int xio_membuf_write(void *opaque, XIO_WBUF *buf, int buf_size)
+{
+    struct xio_membuf *m = opaque;
+    int64_t end = m->pos + buf_size;
+
+    if (end > m->alloc) {
+        int64_t alloc = FFMAX(end, 2 * m->alloc);
+        uint8_t *data = av_realloc(m->data, alloc);
+        if (!data)
+            return AVERROR(ENOMEM);
+        m->data  = data;
+        m->alloc = alloc;
+    }
+    /* Muxers may seek past the end before writing; leave zeros in the gap. */
+    if (m->pos > m->size)
+        memset(m->data + m->size, 0, m->pos - m->size);
+    memcpy(m->data + m->pos, buf, buf_size);
+    m->pos  = end;
+    m->size = FFMAX(m->size, end);
+    return buf_size;
+}
+
+static int64_t xio_membuf_seek(void *opaque, int64_t offset, int whence)
+{
+    struct xio_membuf *m = opaque;
+    int64_t target;
+
+    if (whence & AVSEEK_SIZE)
+        return m->size;
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET: target = offset;           break;
+    case SEEK_CUR: target = m->pos + offset;  break;
+    case SEEK_END: target = m->size + offset; break;
+    default:       return AVERROR(EINVAL);
+    }
+    if (target < 0)
+        return AVERROR(EINVAL);
+    return m->pos = target;
+}
+
+static void xio_membuf_close(struct xio *x)
+{
+    struct xio_membuf *m = (struct xio_membuf *)x;
+
+    av_free(m->data);
+    av_free(m);
+}
+
+static int xio_fd_write(void *opaque, XIO_WBUF *buf, int buf_size)
+{
+    struct xio_fd *f = opaque;
+    int done = 0;
+
+    while (done < buf_size) {
+        ssize_t n = write(f->fd, buf + done, buf_size - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        done += n;
+    }
+    return done;
+}
+
+static int64_t xio_fd_seek(void *opaque, int64_t offset, int whence)
+{
+    struct xio_fd *f = opaque;
+    struct stat st;
+    off_t pos;
+
+    if (whence & AVSEEK_SIZE)
+        return fstat(f->fd, &st) < 0 ? AVERROR(errno) : st.st_size;
+    if ((pos = lseek(f->fd, offset, whence & ~AVSEEK_FORCE)) < 0)
+        return AVERROR(errno);
+    return pos;
+}
+
+static void xio_fd_close(struct xio *x)
+{
+    struct xio_fd *f = (struct xio_fd *)x;
+
+    close(f->fd);
+    av_free(f);
+}
+
+static int xio_cb_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    struct xio_cb *cb = opaque;
+    int n = cb->read(cb->opaque, buf, buf_size);
+
+    /* Callers signal the end of their data with 0, libavformat wants EOF. */
+    return n == 0 ? AVERROR_EOF : n;
+}
+
+static int xio_cb_write(void *opaque, XIO_WBUF *buf, int buf_size)
+{
+    struct xio_cb *cb = opaque;
+
+    return cb->write(cb->opaque, buf, buf_size);
+}
+
+static int64_t xio_cb_seek(void *opaque, int64_t offset, int whence)
+{
+    struct xio_cb *cb = opaque;
+
+    return cb->seek(cb->opaque, offset, whence & ~AVSEEK_FORCE);
+}
+
+static void xio_cb_close(struct xio *x)
+{
+    av_free(x);
+}
+
+/**
+ * Wrap an xio opaque into an AVIOContext. On failure x is released.
+ */
+static int xio_alloc(struct xio *x, int write_flag,
+                     int (*read_packet)(void *, uint8_t *, int),
+                     int (*write_packet)(void *, XIO_WBUF *, int),
+                     int64_t (*seek)(void *, int64_t, int),
+                     AVIOContext **pb)
+{
+    uint8_t *buffer;
+
+    if (!(buffer = av_malloc(XIO_IOBUF_SIZE))) {
+        x->close(x);
+        return AVERROR(ENOMEM);
+    }
+    if (!(*pb = avio_alloc_context(buffer, XIO_IOBUF_SIZE, write_flag, x,
+                                   read_packet, write_packet, seek))) {
+        av_free(buffer);
+        x->close(x);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+}
+
+int xio_open_file(const char *filename, enum xio_mode mode, AVIOContext **pb)
+{
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0)
+        return AVERROR(errno);
+    return xio_open_fd(fd, mode, pb);
+}
+
+int xio_open_fd(int fd, enum xio_mode mode, AVIOContext **pb)
+{
+    int (*read_packet)(void *, uint8_t *, int);
+    int64_t (*seek)(void *, int64_t, int);
+    struct xio *x = NULL;
+    struct stat st;
+    int error;
+
+    if (fstat(fd, &st) < 0) {
+        error = AVERROR(errno);
+        close(fd);
+        return error;
+    }
+    /* Both modes take the size from fstat and read by offset: a pipe or
+     * socket would look empty, and a device can't be mapped. */
+    if (!S_ISREG(st.st_mode)) {
+        fprintf(stderr, "The input of the mmap and readahead I/O modes has to be a regular file\n");
+        close(fd);
+        return AVERROR(EINVAL);
+    }
+
+    switch (mode) {
+    case XIO_MMAP:
+        error = xio_mmap_open(fd, st.st_size, &x);
+        close(fd);
+        read_packet = xio_mem_read;
+        seek        = xio_mem_seek;
+        break;
+    case XIO_READAHEAD:
+        error = xio_ra_open(fd, st.st_size, &x);
+        read_packet = xio_ra_read;
+        seek        = xio_ra_seek;
+        break;
+    default:
+        close(fd);
+        return AVERROR(EINVAL);
+    }
+    if (error < 0)
+        return error;
+    return xio_alloc(x, 0, read_packet, NULL, seek, pb);
+}
+
+int xio_open_fd_out(int fd, AVIOContext **pb)
+{
+    struct xio_fd *f;
+
+    if (!(f = av_mallocz(sizeof(*f)))) {
+        close(fd);
+        return AVERROR(ENOMEM);
+    }
+    f->x.close = xio_fd_close;
+    f->fd      = fd;
+    return xio_alloc(&f->x, 1, NULL, xio_fd_write, xio_fd_seek, pb);
+}
+
+int xio_open_mem(const uint8_t *buf, size_t size, AVIOContext **pb)
+{
+    struct xio_mem *m;
+
+    if (!(m = av_mallocz(sizeof(*m))))
+        return AVERROR(ENOMEM);
+    m->x.close = xio_mem_close;
+    m->base    = buf;
+    m->size    = size;
+    return xio_alloc(&m->x, 0, xio_mem_read, NULL, xio_mem_seek, pb);
+}
+
+int xio_open_membuf(AVIOContext **pb)
+{
+    struct xio_membuf *m;
+
+    if (!(m = av_mallocz(sizeof(*m))))
+        return AVERROR(ENOMEM);
+    m->x.close = xio_membuf_close;
+    return xio_alloc(&m->x, 1, NULL, xio_membuf_write, xio_membuf_seek, pb);
+}
+
+int xio_membuf_take(AVIOContext *pb, uint8_t **data, size_t *size)
+{
+    struct xio_membuf *m = pb->opaque;
+
+    avio_flush(pb);
+    if (pb->error < 0)
+        return pb->error;
+    *data = m->data;
+    *size = m->size;
+    m->data  = NULL;
+    m->size  = m->alloc = m->pos = 0;
+    return 0;
+}
+
+int xio_open_read_cb(int (*read)(void *opaque, uint8_t *buf, int buf_size),
+                     int64_t (*seek)(void *opaque, int64_t offset, int whence),
+                     void *opaque, AVIOContext **pb)
+{
+    struct xio_cb *cb;
+
+    if (!(cb = av_mallocz(sizeof(*cb))))
+        return AVERROR(ENOMEM);
+    cb->x.close = xio_cb_close;
+    cb->read    = read;
+    cb->seek    = seek;
+    cb->opaque  = opaque;
+    return xio_alloc(&cb->x, 0, xio_cb_read, NULL, seek ? xio_cb_seek : NULL, pb);
+}
+
+int xio_open_write_cb(int (*write)(void *opaque, const uint8_t *buf, int buf_size),
+                      int64_t (*seek)(void *opaque, int64_t offset, int whence),
+                      void *opaque, AVIOContext **pb)
+{
+    struct xio_cb *cb;
+
+    if (!(cb = av_mallocz(sizeof(*cb))))
+        return AVERROR(ENOMEM);
+    cb->x.close = xio_cb_close;
+    cb->write   = write;
+    cb->seek    = seek;
+    cb->opaque  = opaque;
+    return xio_alloc(&cb->x, 1, NULL, xio_cb_write, seek ? xio_cb_seek : NULL, pb);
+}
+
+void xio_close(AVIOContext **pb)
+{
+    struct xio *x;
+
+    if (!*pb)
+        return;
+    x = (*pb)->opaque;
+    if ((*pb)->write_flag)
+        avio_flush(*pb);
+    /* The context may have replaced its buffer, so free whatever it holds now. */
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    x->close(x);
+}
@@ -0,0 +1,117 @@
+/*
+ * xio.h: custom AVIOContexts for the transcoding programs.
+ *
+ * libavformat's file protocol reads the input in 32 KiB pieces, one read()
+ * per piece. The modes here replace it with either a private mapping of
+ * the whole file or a background thread that keeps a few large blocks
+ * ahead of the demuxer. Both are seekable.
+ *
+ * The memory and callback contexts let a transcode run without touching
+ * the filesystem at all (see tmp30.h).
+ */
+
+#ifndef XIO_H
+#define XIO_H
+
+#include <libavformat/avio.h>
+
+enum xio_mode {
+    XIO_DEFAULT = 0,  /* libavformat's own file protocol, no custom context */
+    XIO_MMAP,         /* demuxer reads are served from a mapping of the file */
+    XIO_READAHEAD,    /* a thread preads large blocks ahead of the demuxer */
+};
+
+/**
+ * Translate an I/O mode name ("default", "mmap", "readahead").
+ * @param      name Mode name as given on the command line
+ * @param[out] mode Parsed mode
+ * @return Error code (0 if successful)
+ */
+int xio_parse_mode(const char *name, enum xio_mode *mode);
+
+/**
+ * Open a file for reading through a custom I/O context.
+ * The context is to be attached to an AVFormatContext before
+ * avformat_open_input and released with xio_close after
+ * avformat_close_input.
+ * @param      filename File to be opened
+ * @param      mode     XIO_MMAP or XIO_READAHEAD
+ * @param[out] pb       Opened I/O context
+ * @return Error code (0 if successful)
+ */
+int xio_open_file(const char *filename, enum xio_mode mode, AVIOContext **pb);
+
+/**
+ * Like xio_open_file, for a descriptor of a regular file (anything else
+ * is refused with AVERROR(EINVAL)).
+ * The descriptor is taken over and closed with the context, or right
+ * away if opening fails.
+ * @return Error code (0 if successful)
+ */
+int xio_open_fd(int fd, enum xio_mode mode, AVIOContext **pb);
+
+/**
+ * Open a seekable write context on a descriptor, which is taken over
+ * as with xio_open_fd.
+ * @param      fd Output descriptor
+ * @param[out] pb Opened I/O context
+ * @return Error code (0 if successful)
+ */
+int xio_open_fd_out(int fd, AVIOContext **pb);
+
+/**
+ * Open a read-only context over a buffer owned by the caller.
+ * The buffer must outlive the context.
+ * @param      buf  Input bytes
+ * @param      size Number of input bytes
+ * @param[out] pb   Opened I/O context
+ * @return Error code (0 if successful)
+ */
+int xio_open_mem(const uint8_t *buf, size_t size, AVIOContext **pb);
+
+/**
+ * Open a seekable write context that collects everything in a growable
+ * buffer. Take the result with xio_membuf_take before xio_close.
+ * @param[out] pb Opened I/O context
+ * @return Error code (0 if successful)
+ */
+int xio_open_membuf(AVIOContext **pb);
+
+/**
+ * Flush a context opened by xio_open_membuf and hand its buffer over.
+ * @param      pb   I/O context
+ * @param[out] data Written bytes, to be freed with av_free
+ * @param[out] size Number of written bytes
+ * @return Error code (0 if successful)
+ */
+int xio_membuf_take(AVIOContext *pb, uint8_t **data, size_t *size);
+
+/**
+ * Open a read context on top of caller callbacks. read returns the number
+ * of bytes read, 0 at the end of the input or a negative AVERROR code.
+ * seek may be NULL for unseekable input; it also receives AVSEEK_SIZE
+ * queries, for which a negative return is fine.
+ * @return Error code (0 if successful)
+ */
+int xio_open_read_cb(int (*read)(void *opaque, uint8_t *buf, int buf_size),
+                     int64_t (*seek)(void *opaque, int64_t offset, int whence),
+                     void *opaque, AVIOContext **pb);
+
+/**
+ * Open a write context on top of caller callbacks. write returns the number
+ * of bytes consumed or a negative AVERROR code. Without seek the output is
+ * treated as a stream, which some containers (MP4) cannot be written to.
+ * @return Error code (0 if successful)
+ */
+int xio_open_write_cb(int (*write)(void *opaque, const uint8_t *buf, int buf_size),
+                      int64_t (*seek)(void *opaque, int64_t offset, int whence),
+                      void *opaque, AVIOContext **pb);
+
+/**
+ * Release an I/O context opened by one of the xio_open functions.
+ * Does nothing if *pb is NULL.
+ * @param pb I/O context, set to NULL on return
+ */
+void xio_close(AVIOContext **pb);
+
+#endif /* XIO_H */
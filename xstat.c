@@ -0,0 +1,291 @@
+/*
+ * xstat.c: see xstat.h.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <libavutil/common.h>
+#include <libavutil/error.h>
+
+#include "xstat.h"
+
+static const char *const stage_names[XSTAT_NB_STAGES] = {
+    [XSTAT_DEMUX]    = "demux",
+    [XSTAT_DECODE]   = "decode",
+    [XSTAT_FILTER]   = "filter",
+    [XSTAT_CONVERT]  = "convert",
+    [XSTAT_STRETCH]  = "stretch",
+    [XSTAT_LOUDNESS] = "loudness",
+    [XSTAT_FIFO]     = "fifo",
+    [XSTAT_ENCODE]   = "encode",
+    [XSTAT_MUX]      = "mux",
+};
+
+static volatile sig_atomic_t latency_wanted;
+
+static int64_t clock_ns(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return ts.tv_sec * INT64_C(1000000000) + ts.tv_nsec;
+}
+
+void xstat_start(struct xstat *st)
+{
+    int i;
+
+    if (!st)
+        return;
+    memset(st->stage, 0, sizeof(st->stage));
+    st->peak_fifo = 0;
+    /* A failed run writes no trailer, and no size with it. */
+    st->input = st->output = st->encoder = st->conversion = NULL;
+    st->in_rate = st->out_rate = 0;
+    st->out_bytes = 0;
+    st->pool_gets = st->pool_allocs = st->pool_fallbacks = 0;
+    st->pool_bytes = 0;
+    for (i = 0; i < XSTAT_NB_STAGES; i++)
+        lathist_reset(&st->lat[i]);
+    st->span_head = st->nb_spans = 0;
+    st->wall0_ns  = clock_ns(CLOCK_MONOTONIC);
+    st->cpu0_ns   = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    st->read_ns   = st->frame_ns = st->wall0_ns;
+}
+
+void xstat_stop(struct xstat *st)
+{
+    if (!st)
+        return;
+    st->wall_ns = clock_ns(CLOCK_MONOTONIC) - st->wall0_ns;
+    st->cpu_ns  = clock_ns(CLOCK_THREAD_CPUTIME_ID) - st->cpu0_ns;
+}
+
+void xstat_mark(const struct xstat *st, struct xstat_mark *m)
+{
+    if (!st)
+        return;
+    m->wall_ns = clock_ns(CLOCK_MONOTONIC);
+    m->cpu_ns  = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void xstat_add(struct xstat *st, enum xstat_stage stage, struct xstat_mark *m,
+               int frames, int packets, int64_t samples, int64_t bytes)
+{
+    struct xstat_stage_stat *s;
+    struct xstat_mark now;
+
+    if (!st)
+        return;
+    s = &st->stage[stage];
+    xstat_mark(st, &now);
+    s->wall_ns += now.wall_ns - m->wall_ns;
+    s->cpu_ns  += now.cpu_ns - m->cpu_ns;
+    s->calls++;
+    s->frames  += frames;
+    s->packets += packets;
+    s->samples += samples;
+    s->bytes   += bytes;
+    *m = now;
+
+    /* What came out of the stage is this old by now. */
+    switch (stage) {
+    case XSTAT_DEMUX:
+        if (packets)
+            st->read_ns = now.wall_ns;
+        break;
+    case XSTAT_DECODE:
+    case XSTAT_FILTER:
+    case XSTAT_CONVERT:
+    case XSTAT_STRETCH:
+    case XSTAT_LOUDNESS:
+        if (frames)
+            lathist_record(&st->lat[stage], (now.wall_ns - st->read_ns) / 1000);
+        break;
+    case XSTAT_ENCODE:
+    case XSTAT_MUX:
+        if (packets)
+            lathist_record(&st->lat[stage], (now.wall_ns - st->frame_ns) / 1000);
+        break;
+    default:
+        break;
+    }
+
+    if (latency_wanted) {
+        latency_wanted = 0;
+        xstat_print_latency(st, stderr);
+    }
+}
+
+void xstat_fifo(struct xstat *st, int samples)
+{
+    if (st && samples > st->peak_fifo)
+        st->peak_fifo = samples;
+}
+
+void xstat_read(struct xstat *st, int64_t ns)
+{
+    if (st)
+        st->read_ns = ns ? ns : clock_ns(CLOCK_MONOTONIC);
+}
+
+void xstat_queue(struct xstat *st, int nb_samples, int padding)
+{
+    int64_t t;
+    int last;
+
+    if (!st || nb_samples <= 0)
+        return;
+    t    = padding ? clock_ns(CLOCK_MONOTONIC) : st->read_ns;
+    last = (st->span_head + st->nb_spans - 1) % XSTAT_SPANS;
+    if (st->nb_spans && (st->nb_spans == XSTAT_SPANS || st->span[last].read_ns == t)) {
+        st->span[last].samples += nb_samples;
+        return;
+    }
+    last = (st->span_head + st->nb_spans++) % XSTAT_SPANS;
+    st->span[last].read_ns = t;
+    st->span[last].samples = nb_samples;
+}
+
+void xstat_dequeue(struct xstat *st, int nb_samples, int encoded)
+{
+    if (!st)
+        return;
+    if (encoded && st->nb_spans) {
+        st->frame_ns = st->span[st->span_head].read_ns;
+        lathist_record(&st->lat[XSTAT_FIFO], (clock_ns(CLOCK_MONOTONIC) - st->frame_ns) / 1000);
+    }
+    while (nb_samples > 0 && st->nb_spans) {
+        int n = FFMIN(nb_samples, st->span[st->span_head].samples);
+        nb_samples -= n;
+        if (!(st->span[st->span_head].samples -= n)) {
+            st->span_head = (st->span_head + 1) % XSTAT_SPANS;
+            st->nb_spans--;
+        }
+    }
+}
+
+void xstat_print_latency(const struct xstat *st, FILE *f)
+{
+    int i;
+
+    fprintf(f, "%-26s %10s %9s %9s %9s %9s\n", "Latency from read (ms)", "frames", "p50", "p99", "p99.9", "max");
+    for (i = 0; i < XSTAT_NB_STAGES; i++) {
+        const struct lathist *h = &st->lat[i];
+        if (!h->count)
+            continue;
+        fprintf(f, "  to the end of %-10s %10llu %9.3f %9.3f %9.3f %9.3f\n", stage_names[i],
+                (unsigned long long)h->count, lathist_percentile(h, 50) / 1e3,
+                lathist_percentile(h, 99) / 1e3, lathist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+}
+
+static void on_signal(int signo)
+{
+    latency_wanted = 1;
+}
+
+void xstat_latency_on_signal(int signo)
+{
+    struct sigaction sa = { .sa_handler = on_signal, .sa_flags = SA_RESTART };
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(signo, &sa, NULL);
+}
+
+/* Write s as a JSON string, or null. */
+static void json_string(FILE *f, const char *s)
+{
+    if (!s) {
+        fputs("null", f);
+        return;
+    }
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+int xstat_write_json(const struct xstat *st, const char *path, int error)
+{
+    const struct xstat_stage_stat *in  = &st->stage[XSTAT_DECODE];
+    const struct xstat_stage_stat *out = &st->stage[XSTAT_ENCODE];
+    double in_dur  = st->in_rate  ? (double)in->samples  / st->in_rate  : 0;
+    double out_dur = st->out_rate ? (double)out->samples / st->out_rate : 0;
+    double wall = st->wall_ns / 1e9, cpu = st->cpu_ns / 1e9;
+    char err[128] = "ok";
+    struct rusage ru;
+    FILE *f;
+    int i, n;
+
+    if (!strcmp(path, "-"))
+        f = stdout;
+    else if (!(f = fopen(path, "w"))) {
+        fprintf(stderr, "Could not open report file '%s'\n", path);
+        return AVERROR(errno);
+    }
+    if (error < 0)
+        av_strerror(error, err, sizeof(err));
+    /* ru_maxrss is in KiB on Linux, and process-wide. */
+    getrusage(RUSAGE_SELF, &ru);
+
+    fputs("{\n  \"input\": ", f);
+    json_string(f, st->input);
+    fputs(",\n  \"output\": ", f);
+    json_string(f, st->output);
+    fputs(",\n  \"encoder\": ", f);
+    json_string(f, st->encoder);
+    fputs(",\n  \"conversion\": ", f);
+    json_string(f, st->conversion);
+    fputs(",\n  \"status\": ", f);
+    json_string(f, err);
+    fprintf(f, ",\n  \"input_duration\": %.6f,\n  \"output_duration\": %.6f,\n", in_dur, out_dur);
+    fprintf(f, "  \"wall_time\": %.6f,\n  \"cpu_time\": %.6f,\n", wall, cpu);
+    fprintf(f, "  \"realtime_factor\": %.3f,\n", wall > 0 ? in_dur / wall : 0);
+    fprintf(f, "  \"peak_fifo_samples\": %d,\n  \"peak_rss_kb\": %ld,\n  \"minor_faults\": %ld,\n",
+            st->peak_fifo, ru.ru_maxrss, ru.ru_minflt);
+    fprintf(f, "  \"decoder_pool\": { \"gets\": %llu, \"allocs\": %llu, \"fallbacks\": %llu, \"bytes\": %lld },\n",
+            (unsigned long long)st->pool_gets, (unsigned long long)st->pool_allocs,
+            (unsigned long long)st->pool_fallbacks, (long long)st->pool_bytes);
+    fprintf(f, "  \"output_bytes\": %lld,\n  \"output_bitrate\": %.0f,\n",
+            (long long)st->out_bytes, out_dur > 0 ? st->out_bytes * 8 / out_dur : 0);
+    fputs("  \"latency_ms\": {", f);
+    for (i = 0, n = 0; i < XSTAT_NB_STAGES; i++) {
+        const struct lathist *h = &st->lat[i];
+        if (!h->count)
+            continue;
+        fprintf(f, "%s\n    \"%s\": { \"frames\": %llu, \"p50\": %.3f, \"p99\": %.3f, "
+                "\"p999\": %.3f, \"max\": %.3f }", n++ ? "," : "", stage_names[i],
+                (unsigned long long)h->count, lathist_percentile(h, 50) / 1e3,
+                lathist_percentile(h, 99) / 1e3, lathist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+    fputs(n ? "\n  },\n" : " },\n", f);
+    fputs("  \"stages\": {\n", f);
+    for (i = 0; i < XSTAT_NB_STAGES; i++) {
+        const struct xstat_stage_stat *s = &st->stage[i];
+        fprintf(f, "    \"%s\": { \"wall\": %.6f, \"cpu\": %.6f, \"calls\": %llu, "
+                "\"frames\": %llu, \"packets\": %llu, \"samples\": %llu, \"bytes\": %llu }%s\n",
+                stage_names[i], s->wall_ns / 1e9, s->cpu_ns / 1e9,
+                (unsigned long long)s->calls, (unsigned long long)s->frames,
+                (unsigned long long)s->packets, (unsigned long long)s->samples,
+                (unsigned long long)s->bytes, i < XSTAT_NB_STAGES - 1 ? "," : "");
+    }
+    fputs("  }\n}\n", f);
+
+    if (f != stdout && fclose(f)) {
+        fprintf(stderr, "Could not write report file '%s'\n", path);
+        return AVERROR(EIO);
+    }
+    return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * xstat.h: per-stage timing of a transcode and its JSON run report.
+ *
+ * Every stage of the pipeline (demux, decode, filter, convert, stretch,
+ * loudness, FIFO, encode, mux) is bracketed by marks; the time between two marks, wall
+ * and thread CPU, is charged to the stage named by the second. Marks chain, so one clock
+ * read ends a stage and starts the next. All calls do nothing when the
+ * struct xstat pointer is NULL, which is how timing is switched off.
+ *
+ * Latency is followed per frame as well: the time a packet was read goes
+ * with what is decoded from it, and with the samples into the FIFO (by
+ * sample count, see xstat_queue), so that when the encoder takes a frame
+ * it is known when its oldest sample was read. Each stage's latency, from
+ * the read to the end of that stage, goes into a histogram (lathist.h).
+ */
+
+#ifndef XSTAT_H
+#define XSTAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lathist.h"
+
+enum xstat_stage {
+    XSTAT_DEMUX,
+    XSTAT_DECODE,
+    XSTAT_FILTER,
+    XSTAT_CONVERT,
+    XSTAT_STRETCH,
+    XSTAT_LOUDNESS,
+    XSTAT_FIFO,
+    XSTAT_ENCODE,
+    XSTAT_MUX,
+    XSTAT_NB_STAGES
+};
+
+/* Runs of FIFO samples kept apart by read time; beyond this many, new
+ * samples join the newest run. */
+#define XSTAT_SPANS 256
+
+struct xstat_stage_stat {
+    int64_t wall_ns, cpu_ns;
+    uint64_t calls;
+    uint64_t frames;   /* decoded frames out, frames converted or encoded */
+    uint64_t packets;  /* packets read, decoded, produced or written */
+    uint64_t samples;  /* samples per channel through the stage */
+    uint64_t bytes;    /* compressed bytes read or written */
+};
+
+struct xstat {
+    struct xstat_stage_stat stage[XSTAT_NB_STAGES];
+    int64_t wall0_ns, cpu0_ns;  /* set by xstat_start */
+    int64_t wall_ns, cpu_ns;    /* set by xstat_stop */
+    int peak_fifo;              /* samples */
+    /* Filled in by the caller before xstat_write_json. */
+    const char *input, *output, *encoder;
+    const char *conversion;     /* decoder to encoder, see fmtneg.h */
+    int in_rate, out_rate;
+    int64_t out_bytes;
+    /* Decoder buffer pool, see fpool.h */
+    uint64_t pool_gets, pool_allocs, pool_fallbacks;
+    int64_t pool_bytes;
+    /* Latency from packet read to the end of each stage, in microseconds */
+    struct lathist lat[XSTAT_NB_STAGES];
+    int64_t read_ns;            /* when the packet being decoded was read */
+    int64_t frame_ns;           /* when the oldest sample of the frame being
+                                   encoded was read */
+    struct {
+        int64_t read_ns;
+        int samples;
+    } span[XSTAT_SPANS];        /* the FIFO's samples, oldest first */
+    int span_head, nb_spans;
+};
+
+/* Point in time a stage started at. */
+struct xstat_mark {
+    int64_t wall_ns, cpu_ns;
+};
+
+/**
+ * Zero the counters and start the run clock.
+ */
+void xstat_start(struct xstat *st);
+
+/**
+ * Stop the run clock.
+ */
+void xstat_stop(struct xstat *st);
+
+/**
+ * Take a mark for the stage about to start.
+ */
+void xstat_mark(const struct xstat *st, struct xstat_mark *m);
+
+/**
+ * Charge the time since m to a stage, add to its counters and move m to
+ * now, ready for the next stage.
+ */
+void xstat_add(struct xstat *st, enum xstat_stage stage, struct xstat_mark *m,
+               int frames, int packets, int64_t samples, int64_t bytes);
+
+/**
+ * Note the FIFO fill level after a write.
+ */
+void xstat_fifo(struct xstat *st, int samples);
+
+/**
+ * Note when the packet being decoded was read, for input that doesn't
+ * come through XSTAT_DEMUX (the live input thread, the PCM cache).
+ * @param ns CLOCK_MONOTONIC time in nanoseconds, 0 for now
+ */
+void xstat_read(struct xstat *st, int64_t ns);
+
+/**
+ * Samples went into the FIFO, or into the loudness stage ahead of it.
+ * @param padding Made up here (silence) rather than decoded from the
+ *                packet read last
+ */
+void xstat_queue(struct xstat *st, int nb_samples, int padding);
+
+/**
+ * Samples left the FIFO.
+ * @param encoded Taken by the encoder, rather than dropped; counts the
+ *                FIFO latency of the frame
+ */
+void xstat_dequeue(struct xstat *st, int nb_samples, int encoded);
+
+/**
+ * Print the latency percentiles of each stage.
+ */
+void xstat_print_latency(const struct xstat *st, FILE *f);
+
+/**
+ * Print them on a signal as well (SIGUSR1), at the end of the next stage
+ * of whichever transcode in the process gets there first.
+ */
+void xstat_latency_on_signal(int signo);
+
+/**
+ * Write the run report as one JSON object.
+ * @param path  File to write, "-" for stdout
+ * @param error Result of the run, reported as "status"
+ * @return Error code (0 if successful)
+ */
+int xstat_write_json(const struct xstat *st, const char *path, int error);
+
+#endif /* XSTAT_H */
@@ -0,0 +1,242 @@
+/*
+ * zfifo.c: see zfifo.h.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <libavutil/buffer.h>
+#include <libavutil/error.h>
+#include <libavutil/mem.h>
+
+#include "zfifo.h"
+
+/* A frame lent out: its span of the rings, and how many of its plane
+ * buffers are still referenced. */
+struct lend {
+    int64_t start;
+    int refs;
+};
+
+struct zfifo {
+    enum AVSampleFormat fmt;
+    AVChannelLayout layout;
+    int sample_rate;
+    int nb_planes;
+    int bps;                    /* bytes per sample in one plane */
+    size_t ring;                /* bytes of one plane's ring */
+    uint8_t *base;              /* nb_planes times the ring, mapped twice */
+    /* Positions in bytes of a plane since the start; the ring offset is
+     * the position modulo ring. */
+    int64_t rd, wr;
+    uint8_t *planes[AV_NUM_DATA_POINTERS];
+    struct lend lent[ZFIFO_MAX_LENT];
+    int lent_head, nb_lent;     /* oldest first */
+    int closing;                /* zfifo_free came before the last release */
+};
+
+static uint8_t *plane(const struct zfifo *zf, int p, int64_t pos)
+{
+    return zf->base + 2 * p * zf->ring + pos % zf->ring;
+}
+
+static void unmap(struct zfifo *zf)
+{
+    if (zf->base)
+        munmap(zf->base, 2 * zf->nb_planes * zf->ring);
+    zf->base = NULL;
+}
+
+/* Map nb_planes rings of the given size, each twice in a row. */
+static int map(struct zfifo *zf, size_t ring)
+{
+    const size_t total = 2 * zf->nb_planes * ring;
+    uint8_t *base;
+    int fd, p, error = 0;
+
+    if ((fd = memfd_create("zfifo", MFD_CLOEXEC)) < 0)
+        return AVERROR(errno);
+    if (ftruncate(fd, zf->nb_planes * ring) < 0) {
+        error = AVERROR(errno);
+        goto end;
+    }
+    /* Reserve the address range, then put the mappings into it. */
+    if ((base = mmap(NULL, total, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        error = AVERROR(errno);
+        goto end;
+    }
+    for (p = 0; p < 2 * zf->nb_planes; p++)
+        if (mmap(base + p * ring, ring, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                 fd, (p / 2) * ring) == MAP_FAILED) {
+            error = AVERROR(errno);
+            munmap(base, total);
+            goto end;
+        }
+    zf->base = base;
+    zf->ring = ring;
+
+end:
+    close(fd);
+    return error;
+}
+
+int zfifo_alloc(struct zfifo **zf, enum AVSampleFormat fmt, const AVChannelLayout *layout,
+                int sample_rate, int nb_samples)
+{
+    const size_t page = sysconf(_SC_PAGESIZE);
+    struct zfifo *z;
+    int error;
+
+    if (!(z = av_mallocz(sizeof(*z))))
+        return AVERROR(ENOMEM);
+    z->fmt         = fmt;
+    z->sample_rate = sample_rate;
+    z->nb_planes   = av_sample_fmt_is_planar(fmt) ? layout->nb_channels : 1;
+    z->bps         = av_get_bytes_per_sample(fmt) * (av_sample_fmt_is_planar(fmt) ? 1 : layout->nb_channels);
+    if (z->nb_planes > AV_NUM_DATA_POINTERS) {
+        error = AVERROR(EINVAL);
+        goto fail;
+    }
+    if ((error = av_channel_layout_copy(&z->layout, layout)) < 0 ||
+        (error = map(z, FFALIGN((size_t)nb_samples * z->bps, page))) < 0)
+        goto fail;
+    *zf = z;
+    return 0;
+
+fail:
+    fprintf(stderr, "Could not allocate zero-copy FIFO (error '%s')\n", av_err2str(error));
+    av_channel_layout_uninit(&z->layout);
+    av_free(z);
+    return error;
+}
+
+int zfifo_size(const struct zfifo *zf)
+{
+    return (zf->wr - zf->rd) / zf->bps;
+}
+
+/* Start of what may not be written over: the oldest span still lent. */
+static int64_t held(const struct zfifo *zf)
+{
+    return zf->nb_lent ? zf->lent[zf->lent_head].start : zf->rd;
+}
+
+int zfifo_space(struct zfifo *zf, int nb_samples, uint8_t ***planes)
+{
+    const size_t want = zf->wr - held(zf) + (size_t)nb_samples * zf->bps;
+    int p, error;
+
+    if (want > zf->ring) {
+        struct zfifo old = *zf;
+        size_t ring = zf->ring;
+
+        /* Lent frames point into the rings, so they can't move. */
+        if (zf->nb_lent) {
+            fprintf(stderr, "Zero-copy FIFO is full\n");
+            return AVERROR(ENOSPC);
+        }
+        while (ring < want)
+            ring *= 2;
+        if ((error = map(zf, ring)) < 0) {
+            fprintf(stderr, "Could not grow zero-copy FIFO (error '%s')\n", av_err2str(error));
+            return error;
+        }
+        for (p = 0; p < zf->nb_planes; p++)
+            memcpy(plane(zf, p, zf->rd), plane(&old, p, old.rd), zf->wr - zf->rd);
+        unmap(&old);
+    }
+    for (p = 0; p < zf->nb_planes; p++)
+        zf->planes[p] = plane(zf, p, zf->wr);
+    *planes = zf->planes;
+    return 0;
+}
+
+void zfifo_commit(struct zfifo *zf, int nb_samples)
+{
+    zf->wr += (int64_t)nb_samples * zf->bps;
+}
+
+void zfifo_drain(struct zfifo *zf, int nb_samples)
+{
+    zf->rd += (int64_t)FFMIN(nb_samples, zfifo_size(zf)) * zf->bps;
+}
+
+static void release(void *opaque, uint8_t *data)
+{
+    struct zfifo *zf = opaque;
+    int i;
+
+    /* Find the frame by where the plane starts in its ring; spans still
+     * lent don't overlap, so no two start at the same offset. */
+    for (i = 0; i < zf->nb_lent; i++) {
+        struct lend *l = &zf->lent[(zf->lent_head + i) % ZFIFO_MAX_LENT];
+        if (l->refs && (data - zf->base) % (2 * zf->ring) == l->start % zf->ring) {
+            l->refs--;
+            break;
+        }
+    }
+    /* Spans are freed for writing in order. */
+    while (zf->nb_lent && !zf->lent[zf->lent_head].refs) {
+        zf->lent_head = (zf->lent_head + 1) % ZFIFO_MAX_LENT;
+        zf->nb_lent--;
+    }
+    if (zf->closing && !zf->nb_lent) {
+        unmap(zf);
+        av_channel_layout_uninit(&zf->layout);
+        av_free(zf);
+    }
+}
+
+int zfifo_lend(struct zfifo *zf, AVFrame *frame, int nb_samples)
+{
+    const int size = nb_samples * zf->bps;
+    struct lend *l;
+    int p, error;
+
+    if (zf->nb_lent == ZFIFO_MAX_LENT || nb_samples > zfifo_size(zf)) {
+        fprintf(stderr, "Could not lend a frame from the zero-copy FIFO\n");
+        return AVERROR(EINVAL);
+    }
+    l = &zf->lent[(zf->lent_head + zf->nb_lent) % ZFIFO_MAX_LENT];
+    l->start = zf->rd;
+    l->refs  = 0;
+
+    frame->nb_samples  = nb_samples;
+    frame->format      = zf->fmt;
+    frame->sample_rate = zf->sample_rate;
+    if ((error = av_channel_layout_copy(&frame->ch_layout, &zf->layout)) < 0)
+        return error;
+    for (p = 0; p < zf->nb_planes; p++) {
+        frame->data[p] = plane(zf, p, zf->rd);
+        if (!(frame->buf[p] = av_buffer_create(frame->data[p], size, release, zf, AV_BUFFER_FLAG_READONLY))) {
+            av_frame_unref(frame);
+            return AVERROR(ENOMEM);
+        }
+        l->refs++;
+        /* Counted from the first reference on, so that release finds it. */
+        if (p == 0)
+            zf->nb_lent++;
+    }
+    frame->extended_data = frame->data;
+    frame->linesize[0]   = size;
+    zf->rd += size;
+    return 0;
+}
+
+void zfifo_free(struct zfifo **zf)
+{
+    if (!*zf)
+        return;
+    if ((*zf)->nb_lent)
+        (*zf)->closing = 1;
+    else {
+        unmap(*zf);
+        av_channel_layout_uninit(&(*zf)->layout);
+        av_free(*zf);
+    }
+    *zf = NULL;
+}
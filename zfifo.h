@@ -0,0 +1,83 @@
+/*
+ * zfifo.h: zero-copy sample FIFO for tmp30 (-Z).
+ *
+ * Takes the place of the AVAudioFifo between the resampler and the
+ * encoder. Each plane is a ring mapped twice in a row (a memfd behind two
+ * adjacent mappings), so any run of samples in it is contiguous in
+ * memory, also across the end of the ring. The resampler converts into
+ * the ring (zfifo_space, zfifo_commit), and the encoder gets frames whose
+ * data points into the ring and whose buffers are references to it
+ * (zfifo_lend), so samples are written once, by the resampler, and not
+ * copied again on the way to the encoder. Space lent to a frame is not
+ * written again until the frame is freed.
+ *
+ * The rings start on a page boundary; frames of the usual encoder sizes
+ * (1152, 1024, 960 samples of 2 or 4 byte samples) keep cache line
+ * alignment.
+ */
+
+#ifndef ZFIFO_H
+#define ZFIFO_H
+
+#include <stdint.h>
+
+#include <libavutil/channel_layout.h>
+#include <libavutil/frame.h>
+#include <libavutil/samplefmt.h>
+
+/* Frames that can be lent out at the same time */
+#define ZFIFO_MAX_LENT 16
+
+struct zfifo;
+
+/**
+ * Allocate a FIFO.
+ * @param[out] zf          FIFO
+ * @param      fmt         Sample format
+ * @param      layout      Channel layout, at most AV_NUM_DATA_POINTERS planes
+ * @param      sample_rate Sample rate of the frames lent out
+ * @param      nb_samples  Samples it holds to start with; it grows when
+ *                         nothing is lent out
+ * @return Error code (0 if successful)
+ */
+int zfifo_alloc(struct zfifo **zf, enum AVSampleFormat fmt, const AVChannelLayout *layout,
+                int sample_rate, int nb_samples);
+
+/**
+ * Number of samples in the FIFO.
+ */
+int zfifo_size(const struct zfifo *zf);
+
+/**
+ * Make room for nb_samples after the samples in the FIFO.
+ * @param[out] planes Where to write them, one pointer per plane
+ * @return Error code (0 if successful)
+ */
+int zfifo_space(struct zfifo *zf, int nb_samples, uint8_t ***planes);
+
+/**
+ * Add nb_samples written to the space from zfifo_space.
+ */
+void zfifo_commit(struct zfifo *zf, int nb_samples);
+
+/**
+ * Drop samples from the front of the FIFO.
+ */
+void zfifo_drain(struct zfifo *zf, int nb_samples);
+
+/**
+ * Take samples from the front of the FIFO as a frame that references
+ * them where they are.
+ * @param frame      Empty frame to fill in
+ * @param nb_samples Number of samples, at most zfifo_size
+ * @return Error code (0 if successful)
+ */
+int zfifo_lend(struct zfifo *zf, AVFrame *frame, int nb_samples);
+
+/**
+ * Free a FIFO. Its memory stays until the last frame lent from it is
+ * freed.
+ */
+void zfifo_free(struct zfifo **zf);
+
+#endif /* ZFIFO_H */